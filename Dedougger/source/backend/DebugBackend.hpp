@@ -0,0 +1,84 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "platform/platform.h"
+
+namespace dedougger {
+	typedef DWORD DBG_CONTINUE_STATUS;
+
+	struct ModuleEntry {
+		size_t		base = 0;
+		std::string path;
+		bool		isMainModule = false;
+	};
+
+	/**
+	 * DebugBackend - the OS facing half of the debugger.  Dedougger owns the event loop, breakpoint bookkeeping and
+	 *	callbacks; the backend is the only thing that talks to the OS debugging API.  Events are always reported as
+	 *	DEBUG_EVENTs (on Linux via the compat definitions in platform/linuxcompat.h) so callbacks are identical on
+	 *	every platform.
+	 *
+	 *	The backend is all-stop: while an event is being handled every thread in the target is stopped, and
+	 *	ContinueEvent resumes all of them.  This is what Windows does natively and what the state restorers rely on.
+	 *
+	 *	Methods:
+	 *		Spawn(execPath) - start a new process under the debugger.  It stays suspended until Start().
+	 *		Attach(pid) - attach to a running process
+	 *		Detach() - stop debugging the process
+	 *		Start() - let a spawned process begin executing
+	 *		WaitForEvent(debugEv, timeoutMs) - block until the next debug event.  Returns false on timeout.
+	 *		ContinueEvent(debugEv, continueStatus) - resume the target after handling debugEv.  DBG_EXCEPTION_NOT_HANDLED
+	 *			passes the exception (signal on Linux) on to the target.
+	 *		StepThread(debugEv, stepDebugEv) - resume the thread that raised debugEv for a single instruction and wait for
+	 *			its single step event.  The caller is responsible for setting/clearing the trap flag.
+	 *		BreakProcess() - force a breakpoint event in the target
+	 *		ReadMemory/WriteMemory(address, buffer, size, bytes) - target memory access.  Writes on Linux ignore page
+	 *			protections, writes on Windows honour them.
+	 *		ProtectMemory(address, size, newProtect, oldProtect) - change page protections, PAGE_* constants
+	 *		GetRegisters/SetRegisters(threadId, context) - read/write a thread's register file
+	 *		GetImageName(debugEv, buffer, size) - path of the module reported by a LOAD_DLL_DEBUG_EVENT
+	 *		EnumerateThreads(threadIds) - IDs of every thread currently in the target
+	 *		EnumerateModules(modules) - every image currently mapped in the target
+	 *		GetEntryPointAddress() - absolute address of the main module's entry point
+	 *		DuplicateThreadHandle(threadHandle, newHandle) - duplicate a thread handle for the target process
+	 */
+	class DebugBackend {
+	protected:
+		DWORD	processId		= 0;
+		HANDLE	processHandle	= INVALID_HANDLE_VALUE;
+	public:
+		virtual ~DebugBackend() {}
+
+		virtual void Spawn(const TCHAR* execPath) = 0;
+		virtual void Attach(DWORD pid) = 0;
+		virtual void Detach() = 0;
+		virtual void Start() = 0;
+
+		virtual bool WaitForEvent(DEBUG_EVENT* debugEv, DWORD timeoutMs) = 0;
+		virtual bool ContinueEvent(const DEBUG_EVENT* debugEv, DBG_CONTINUE_STATUS continueStatus) = 0;
+		virtual bool StepThread(const DEBUG_EVENT* debugEv, DEBUG_EVENT* stepDebugEv) = 0;
+		virtual bool BreakProcess() = 0;
+
+		virtual bool ReadMemory(size_t address, void* buffer, size_t size, SIZE_T* bytesRead) = 0;
+		virtual bool WriteMemory(size_t address, const void* buffer, size_t size, SIZE_T* bytesWritten) = 0;
+		virtual bool ProtectMemory(size_t address, size_t size, DWORD newProtect, DWORD* oldProtect) = 0;
+
+		virtual bool GetRegisters(DWORD threadId, CONTEXT* context) = 0;
+		virtual bool SetRegisters(DWORD threadId, const CONTEXT* context) = 0;
+
+		virtual bool GetImageName(const DEBUG_EVENT* debugEv, char* buffer, size_t size) = 0;
+		virtual bool EnumerateThreads(std::vector<DWORD>* threadIds) = 0;
+		virtual bool EnumerateModules(std::vector<ModuleEntry>* modules) = 0;
+		virtual size_t GetEntryPointAddress() = 0;
+		virtual bool DuplicateThreadHandle(HANDLE threadHandle, HANDLE* newHandle) = 0;
+
+		DWORD	ProcessId() const { return this->processId; }
+		HANDLE	ProcessHandle() const { return this->processHandle; }
+	};
+	typedef std::unique_ptr<DebugBackend> UP_DebugBackend;
+
+	/* Creates the backend for the platform we were compiled for.  Defined by the platform's backend translation unit. */
+	UP_DebugBackend CreateDebugBackend();
+}
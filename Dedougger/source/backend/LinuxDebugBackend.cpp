@@ -0,0 +1,1200 @@
+#ifdef __linux__
+#include <cpuid.h>
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <set>
+#include "backend/LinuxDebugBackend.hpp"
+#include "dexception.h"
+
+namespace dedougger {
+
+	namespace {
+		const size_t pageSize = 0x1000;
+
+		//
+		// Every backend registers itself here by pid so the Win32 compat functions (which only get a
+		// process handle) can find the tracer for the process.
+		//
+		std::map<pid_t, LinuxDebugBackend*> backendsByPid;
+
+		bool ListTasks(pid_t pid, std::vector<DWORD>* threadIds) {
+			char taskPath[64];
+			snprintf(taskPath, sizeof(taskPath), "/proc/%d/task", pid);
+			DIR* tasks = opendir(taskPath);
+			if (tasks == nullptr) {
+				return false;
+			}
+			struct dirent* entry;
+			while ((entry = readdir(tasks)) != nullptr) {
+				if (entry->d_name[0] != '.') {
+					threadIds->push_back((DWORD)atoi(entry->d_name));
+				}
+			}
+			closedir(tasks);
+			return true;
+		}
+
+		long DebugRegisterOffset(int index) {
+			return offsetof(struct user, u_debugreg) + index * sizeof(long);
+		}
+
+		bool HasContextFlag(DWORD contextFlags, DWORD flag) {
+			return (contextFlags & flag) == flag;
+		}
+
+		//
+		// Size of the XSAVE area for the features the OS enabled in XCR0, or 0 without XSAVE
+		//
+		size_t ExtendedStateSize() {
+			static size_t size = SIZE_MAX;
+			if (size == SIZE_MAX) {
+				unsigned int eax, ebx, ecx, edx;
+				size = 0;
+				if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_OSXSAVE) &&
+					__get_cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx)) {
+					size = ebx;
+				}
+			}
+			return size;
+		}
+	}
+
+	UP_DebugBackend CreateDebugBackend() {
+		return std::make_unique<LinuxDebugBackend>();
+	}
+
+	LinuxDebugBackend* LinuxDebugBackend::FromProcessHandle(HANDLE process) {
+		auto found = backendsByPid.find((pid_t)(intptr_t)process);
+		if (found == backendsByPid.end()) {
+			return nullptr;
+		}
+		return found->second;
+	}
+
+	LinuxDebugBackend* LinuxDebugBackend::FromThreadHandle(HANDLE thread) {
+		for (auto& backend : backendsByPid) {
+			if (backend.second->threads.count((pid_t)(intptr_t)thread)) {
+				return backend.second;
+			}
+		}
+		return nullptr;
+	}
+
+	LinuxDebugBackend::~LinuxDebugBackend() {
+		if (this->memFd != -1) {
+			close(this->memFd);
+		}
+		backendsByPid.erase((pid_t)this->processId);
+	}
+
+	void LinuxDebugBackend::Spawn(const TCHAR* execPath) {
+		int status;
+		pid_t child = fork();
+		if (child == 0) {
+			//
+			// The child stops with a SIGTRAP once exec succeeds, which is our equivalent of
+			// CREATE_SUSPENDED - nothing runs until the initial events have been handled.
+			//
+			ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+			execl(execPath, execPath, (char*)nullptr);
+			_exit(127);
+		}
+		if (child < 0) {
+			throw CreateProcessFailedException();
+		}
+		if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status)) {
+			throw CreateProcessFailedException();
+		}
+		ptrace(PTRACE_SETOPTIONS, child, nullptr, (void*)(PTRACE_O_TRACECLONE | PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+		this->processId = child;
+		this->processHandle = (HANDLE)(intptr_t)child;
+		this->AddThread(child);
+
+		char memPath[64];
+		snprintf(memPath, sizeof(memPath), "/proc/%d/mem", child);
+		this->memFd = open(memPath, O_RDWR);
+		if (this->memFd == -1) {
+			throw OpenProcessFailedException();
+		}
+		backendsByPid[child] = this;
+		this->QueueInitialEvents();
+	}
+
+	void LinuxDebugBackend::Attach(DWORD pid) {
+		this->processId = pid;
+		this->processHandle = (HANDLE)(intptr_t)pid;
+		//
+		// Threads can be created while we're attaching, so keep walking the task list until a pass
+		// doesn't turn up anything new.
+		//
+		bool attachedNew;
+		do {
+			std::vector<DWORD> taskIds;
+			attachedNew = false;
+			if (!ListTasks(pid, &taskIds)) {
+				throw OpenProcessFailedException();
+			}
+			for (DWORD taskId : taskIds) {
+				pid_t tid = (pid_t)taskId;
+				int status;
+				if (this->threads.find(tid) != this->threads.end()) {
+					continue;
+				}
+				if (ptrace(PTRACE_ATTACH, tid, nullptr, nullptr) == -1) {
+					if (tid == (pid_t)pid) {
+						throw DebugActiveProcessFailedException();
+					}
+					continue; // thread exited under us
+				}
+				this->AddThread(tid);
+				if (waitpid(tid, &status, __WALL) == tid && !(WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP)) {
+					TracedThread& thread = this->threads[tid];
+					thread.hasDeferredStatus = true;
+					thread.deferredStatus = status;
+					thread.stopRequested = true;
+				}
+				ptrace(PTRACE_SETOPTIONS, tid, nullptr, (void*)(PTRACE_O_TRACECLONE | PTRACE_O_TRACESYSGOOD));
+				attachedNew = true;
+			}
+		} while (attachedNew);
+
+		char memPath[64];
+		snprintf(memPath, sizeof(memPath), "/proc/%d/mem", (int)pid);
+		this->memFd = open(memPath, O_RDWR);
+		if (this->memFd == -1) {
+			throw OpenProcessFailedException();
+		}
+		backendsByPid[(pid_t)pid] = this;
+		this->QueueInitialEvents();
+	}
+
+	void LinuxDebugBackend::Detach() {
+		if (this->threads.empty()) {
+			return;
+		}
+		this->StopAllThreads(0);
+		for (auto& thread : this->threads) {
+			ptrace(PTRACE_DETACH, thread.first, nullptr, (void*)(intptr_t)thread.second.deliverSignal);
+		}
+		this->threads.clear();
+	}
+
+	void LinuxDebugBackend::Start() {
+		//
+		// Nothing to do - the spawned process is held in its exec stop until the initial events have
+		// been continued.
+		//
+	}
+
+	void LinuxDebugBackend::AddThread(pid_t tid) {
+		TracedThread thread;
+		this->threads[tid] = thread;
+	}
+
+	void LinuxDebugBackend::InitializeEvent(DEBUG_EVENT* debugEv, DWORD eventCode, pid_t tid) {
+		memset(debugEv, 0, sizeof(*debugEv));
+		debugEv->dwDebugEventCode	= eventCode;
+		debugEv->dwProcessId		= this->processId;
+		debugEv->dwThreadId			= (DWORD)tid;
+	}
+
+	/* Mirrors what Windows reports when a debugger starts or attaches: process creation, a thread creation
+	 * for every other thread, the loaded images and finally the initial breakpoint.
+	 */
+	void LinuxDebugBackend::QueueInitialEvents() {
+		DEBUG_EVENT debugEv;
+		pid_t mainThread = (pid_t)this->processId;
+		this->lastEventThreadId = mainThread;
+
+		this->InitializeEvent(&debugEv, CREATE_PROCESS_DEBUG_EVENT, mainThread);
+		debugEv.u.CreateProcessInfo.hProcess = this->processHandle;
+		debugEv.u.CreateProcessInfo.hThread = (HANDLE)(intptr_t)mainThread;
+		debugEv.u.CreateProcessInfo.lpStartAddress = (LPVOID)this->GetEntryPointAddress();
+		struct user_regs_struct regs;
+		if (ptrace(PTRACE_GETREGS, mainThread, nullptr, &regs) != -1) {
+			debugEv.u.CreateProcessInfo.lpThreadLocalBase = (LPVOID)regs.fs_base;
+		}
+		this->queuedEvents.push_back(debugEv);
+
+		for (auto& thread : this->threads) {
+			if (thread.first != mainThread) {
+				this->InitializeEvent(&debugEv, CREATE_THREAD_DEBUG_EVENT, thread.first);
+				debugEv.u.CreateThread.hThread = (HANDLE)(intptr_t)thread.first;
+				if (ptrace(PTRACE_GETREGS, thread.first, nullptr, &regs) != -1) {
+					debugEv.u.CreateThread.lpThreadLocalBase = (LPVOID)regs.fs_base;
+				}
+				this->queuedEvents.push_back(debugEv);
+			}
+		}
+
+		this->QueueModuleEvents();
+
+		ptrace(PTRACE_GETREGS, mainThread, nullptr, &regs);
+		this->InitializeEvent(&debugEv, EXCEPTION_DEBUG_EVENT, mainThread);
+		debugEv.u.Exception.dwFirstChance = 1;
+		debugEv.u.Exception.ExceptionRecord.ExceptionCode = EXCEPTION_BREAKPOINT;
+		debugEv.u.Exception.ExceptionRecord.ExceptionAddress = (PVOID)regs.rip;
+		this->queuedEvents.push_back(debugEv);
+	}
+
+	void LinuxDebugBackend::QueueModuleEvents() {
+		std::vector<ModuleEntry> current;
+		std::set<size_t> stillMapped;
+		DEBUG_EVENT debugEv;
+		if (!this->EnumerateModules(&current)) {
+			return;
+		}
+		for (auto& module : current) {
+			stillMapped.insert(module.base);
+			if (this->modules.find(module.base) == this->modules.end()) {
+				this->modules[module.base] = module.path;
+				this->InitializeEvent(&debugEv, LOAD_DLL_DEBUG_EVENT, this->lastEventThreadId);
+				debugEv.u.LoadDll.lpBaseOfDll = (LPVOID)module.base;
+				debugEv.u.LoadDll.lpImageName = (LPVOID)this->modules[module.base].c_str();
+				this->queuedEvents.push_back(debugEv);
+			}
+		}
+		for (auto module = this->modules.begin(); module != this->modules.end();) {
+			if (stillMapped.find(module->first) == stillMapped.end()) {
+				this->InitializeEvent(&debugEv, UNLOAD_DLL_DEBUG_EVENT, this->lastEventThreadId);
+				debugEv.u.UnloadDll.lpBaseOfDll = (LPVOID)module->first;
+				this->queuedEvents.push_back(debugEv);
+				module = this->modules.erase(module);
+			}
+			else {
+				module++;
+			}
+		}
+	}
+
+	bool LinuxDebugBackend::NextStatus(pid_t* tid, int* status, DWORD timeoutMs) {
+		//
+		// Statuses we picked up while stopping the world come first
+		//
+		for (auto& thread : this->threads) {
+			if (thread.second.hasDeferredStatus) {
+				thread.second.hasDeferredStatus = false;
+				*tid = thread.first;
+				*status = thread.second.deferredStatus;
+				return true;
+			}
+		}
+
+		int flags = __WALL;
+		DWORD waited = 0;
+		if (timeoutMs != INFINITE) {
+			flags |= WNOHANG;
+		}
+		while (true) {
+			pid_t result = waitpid(-1, status, flags);
+			if (result > 0) {
+				*tid = result;
+				return true;
+			}
+			if (result < 0 && errno != EINTR) {
+				return false;
+			}
+			if (result == 0) {
+				if (waited >= timeoutMs) {
+					return false;
+				}
+				usleep(1000);
+				waited++;
+			}
+		}
+	}
+
+	bool LinuxDebugBackend::TranslateStatus(pid_t tid, int status, DEBUG_EVENT* debugEv) {
+		auto found = this->threads.find(tid);
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			DWORD exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+			if (tid == (pid_t)this->processId) {
+				this->InitializeEvent(debugEv, EXIT_PROCESS_DEBUG_EVENT, tid);
+				debugEv->u.ExitProcess.dwExitCode = exitCode;
+				this->threads.clear();
+				return true;
+			}
+			if (found == this->threads.end()) {
+				return false;
+			}
+			this->threads.erase(found);
+			this->InitializeEvent(debugEv, EXIT_THREAD_DEBUG_EVENT, tid);
+			debugEv->u.ExitThread.dwExitCode = exitCode;
+			return true;
+		}
+
+		if (!WIFSTOPPED(status)) {
+			return false;
+		}
+
+		if (found == this->threads.end()) {
+			//
+			// A new thread's initial stop can arrive before its parent's clone event.  Track it now and
+			// keep it stopped, the clone event is what gets reported and only after that has been handled
+			// (and the thread possibly held) may it run.
+			//
+			this->AddThread(tid);
+			this->threads[tid].awaitingClone = true;
+			return false;
+		}
+
+		TracedThread& thread = found->second;
+		int signal = WSTOPSIG(status);
+		int ptraceEvent = status >> 16;
+		thread.running = false;
+
+		if (signal == (SIGTRAP | 0x80)) {
+			//
+			// Syscall stop, only seen while journaling.  Never an event.
+			//
+			this->RecordSyscallStop(tid, thread);
+			return false;
+		}
+
+		if (ptraceEvent == PTRACE_EVENT_CLONE) {
+			unsigned long newThreadId = 0;
+			ptrace(PTRACE_GETEVENTMSG, tid, nullptr, &newThreadId);
+			auto newThread = this->threads.find((pid_t)newThreadId);
+			if (newThread == this->threads.end()) {
+				int newStatus;
+				waitpid((pid_t)newThreadId, &newStatus, __WALL);
+				this->AddThread((pid_t)newThreadId);
+			}
+			else {
+				newThread->second.awaitingClone = false;
+			}
+			this->InitializeEvent(debugEv, CREATE_THREAD_DEBUG_EVENT, (pid_t)newThreadId);
+			debugEv->u.CreateThread.hThread = (HANDLE)(intptr_t)newThreadId;
+			//
+			// The new thread starts out returning from clone, on the stack and TLS its parent gave it
+			//
+			struct user_regs_struct newRegs;
+			if (ptrace(PTRACE_GETREGS, (pid_t)newThreadId, nullptr, &newRegs) != -1) {
+				debugEv->u.CreateThread.lpStartAddress = (LPVOID)newRegs.rip;
+				debugEv->u.CreateThread.lpThreadLocalBase = (LPVOID)newRegs.fs_base;
+			}
+			return true;
+		}
+		else if (ptraceEvent != 0) {
+			return false;
+		}
+
+		if (signal == SIGSTOP && thread.stopRequested) {
+			thread.stopRequested = false;
+			return false;
+		}
+
+		siginfo_t info = { 0 };
+		struct user_regs_struct regs;
+		ptrace(PTRACE_GETSIGINFO, tid, nullptr, &info);
+		ptrace(PTRACE_GETREGS, tid, nullptr, &regs);
+
+		this->InitializeEvent(debugEv, EXCEPTION_DEBUG_EVENT, tid);
+		EXCEPTION_RECORD& record = debugEv->u.Exception.ExceptionRecord;
+		debugEv->u.Exception.dwFirstChance = 1;
+		record.ExceptionAddress = (PVOID)regs.rip;
+
+		switch (signal) {
+		case SIGTRAP:
+			if (info.si_code == SI_KERNEL) {
+				//
+				// int3 - rip is already past the 0xCC, same as on Windows
+				//
+				record.ExceptionCode = EXCEPTION_BREAKPOINT;
+				record.ExceptionAddress = (PVOID)(regs.rip - 1);
+			}
+			else if (info.si_code == TRAP_TRACE || info.si_code == TRAP_HWBKPT || info.si_code == TRAP_BRKPT) {
+				//
+				// Hardware breakpoints come through as single step exceptions on Windows as well
+				//
+				record.ExceptionCode = EXCEPTION_SINGLE_STEP;
+			}
+			else {
+				//
+				// SIGTRAP sent with tgkill, i.e. BreakProcess()
+				//
+				record.ExceptionCode = EXCEPTION_BREAKPOINT;
+			}
+			break;
+		case SIGSEGV:
+			//
+			// The page fault error code isn't exposed through ptrace.  Protection faults are reported
+			// as write violations since write protection is the only restriction we ever apply.
+			//
+			record.ExceptionCode = EXCEPTION_ACCESS_VIOLATION;
+			record.NumberParameters = 2;
+			record.ExceptionInformation[0] = info.si_code == SEGV_ACCERR ? 1 : 0;
+			record.ExceptionInformation[1] = (ULONG_PTR)info.si_addr;
+			break;
+		case SIGBUS:
+			record.ExceptionCode = EXCEPTION_IN_PAGE_ERROR;
+			record.NumberParameters = 2;
+			record.ExceptionInformation[1] = (ULONG_PTR)info.si_addr;
+			break;
+		case SIGILL:
+			record.ExceptionCode = EXCEPTION_ILLEGAL_INSTRUCTION;
+			break;
+		case SIGFPE:
+			record.ExceptionCode = EXCEPTION_INT_DIVIDE_BY_ZERO;
+			break;
+		default:
+			record.ExceptionCode = LINUX_SIGNAL_EXCEPTION(signal);
+			break;
+		}
+		thread.lastSignal = signal;
+		return true;
+	}
+
+	/* Brings every running thread other than eventThread to a stop so the target is frozen while an
+	 * event is handled.
+	 */
+	void LinuxDebugBackend::StopAllThreads(pid_t eventThread) {
+		std::vector<pid_t> stopping;
+		for (auto& thread : this->threads) {
+			if (thread.first != eventThread && thread.second.running) {
+				syscall(SYS_tgkill, (pid_t)this->processId, thread.first, SIGSTOP);
+				thread.second.stopRequested = true;
+				stopping.push_back(thread.first);
+			}
+		}
+
+		for (pid_t tid : stopping) {
+			int status;
+			TracedThread& thread = this->threads[tid];
+			bool stopped = waitpid(tid, &status, __WALL) == tid;
+			//
+			// A syscall stop can beat our SIGSTOP.  Let the syscall through and keep waiting, so the journal
+			// has everything the thread did by the time the world is stopped.  The pending SIGSTOP cuts any
+			// blocking call short.
+			//
+			while (stopped && WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+				this->RecordSyscallStop(tid, thread);
+				ptrace(PTRACE_SYSCALL, tid, nullptr, nullptr);
+				stopped = waitpid(tid, &status, __WALL) == tid;
+			}
+			if (!stopped) {
+				continue;
+			}
+			thread.running = false;
+			if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP && (status >> 16) == 0) {
+				thread.stopRequested = false;
+				continue;
+			}
+			//
+			// The thread hit something real (or exited) before our SIGSTOP landed.  Hold on to it for
+			// the next WaitForEvent; the SIGSTOP is still queued and gets swallowed once it's resumed.
+			//
+			if (WIFEXITED(status) || WIFSIGNALED(status)) {
+				thread.stopRequested = false;
+			}
+			thread.hasDeferredStatus = true;
+			thread.deferredStatus = status;
+		}
+	}
+
+	bool LinuxDebugBackend::ResumeThread(pid_t tid, int signal) {
+		TracedThread& thread = this->threads[tid];
+		thread.running = true;
+		thread.deliverSignal = 0;
+		int request = this->journalLayout ? PTRACE_SYSCALL : PTRACE_CONT;
+		return ptrace((enum __ptrace_request)request, tid, nullptr, (void*)(intptr_t)signal) != -1;
+	}
+
+	/* Tracks the syscall a thread is stopped at the entry or exit of, and journals what it changed once it
+	 * has returned successfully
+	 */
+	void LinuxDebugBackend::RecordSyscallStop(pid_t tid, TracedThread& thread) {
+		struct __ptrace_syscall_info info;
+		memset(&info, 0, sizeof(info));
+		if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void*)sizeof(info), &info) <= 0) {
+			return;
+		}
+		if (info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+			thread.pendingSyscall = (long)info.entry.nr;
+			memcpy(thread.syscallArgs, info.entry.args, sizeof(thread.syscallArgs));
+			return;
+		}
+		long number = thread.pendingSyscall;
+		thread.pendingSyscall = -1;
+		if (info.op != PTRACE_SYSCALL_INFO_EXIT || !this->journalLayout || info.exit.is_error) {
+			return;
+		}
+
+		size_t result = (size_t)info.exit.rval;
+		const uint64_t* args = thread.syscallArgs;
+		switch (number) {
+		case SYS_mmap:
+			this->JournalRange(number, result, (size_t)args[1]);
+			break;
+		case SYS_munmap:
+		case SYS_mprotect:
+		case SYS_pkey_mprotect:
+			this->JournalRange(number, (size_t)args[0], (size_t)args[1]);
+			break;
+		case SYS_mremap:
+			this->JournalRange(number, (size_t)args[0], (size_t)args[1]);
+			this->JournalRange(number, result, (size_t)args[2]);
+			break;
+		case SYS_madvise:
+			//
+			// Not a layout change, but these drop the pages' contents without anybody writing to them
+			//
+			if (args[2] == MADV_DONTNEED || args[2] == MADV_FREE || args[2] == MADV_REMOVE) {
+				this->JournalRange(number, (size_t)args[0], (size_t)args[1]);
+			}
+			break;
+		case SYS_brk:
+			//
+			// brk returns the break it ended up with, which is the old one for brk(0) and refused moves
+			//
+			if (this->programBreak != 0 && result != this->programBreak) {
+				size_t low = std::min(result, this->programBreak);
+				this->JournalRange(number, low, std::max(result, this->programBreak) - low);
+			}
+			this->programBreak = result;
+			break;
+		}
+	}
+
+	void LinuxDebugBackend::JournalRange(long syscall, size_t address, size_t size) {
+		size_t first = address & ~(pageSize - 1);
+		size_t last = (address + size + pageSize - 1) & ~(pageSize - 1);
+		if (last > first) {
+			this->layoutJournal.push_back({ syscall, first, last - first });
+		}
+	}
+
+	void LinuxDebugBackend::SetLayoutJournaling(bool enable) {
+		if (enable && !this->journalLayout) {
+			long currentBreak = this->RemoteSyscall(SYS_brk, 0);
+			this->programBreak = currentBreak > 0 ? (size_t)currentBreak : 0;
+			this->layoutJournal.clear();
+		}
+		this->journalLayout = enable;
+	}
+
+	void LinuxDebugBackend::TakeLayoutJournal(std::vector<LayoutChange>* changes) {
+		changes->clear();
+		changes->swap(this->layoutJournal);
+	}
+
+	bool LinuxDebugBackend::MoveProgramBreak(size_t programBreak) {
+		long result = this->RemoteSyscall(SYS_brk, (long)programBreak);
+		if (result > 0) {
+			this->programBreak = (size_t)result;
+		}
+		return result == (long)programBreak;
+	}
+
+	void LinuxDebugBackend::ResumeAllThreads() {
+		for (auto& thread : this->threads) {
+			if (!thread.second.running && !thread.second.hasDeferredStatus && !thread.second.held && !thread.second.awaitingClone) {
+				this->ResumeThread(thread.first, thread.second.deliverSignal);
+			}
+		}
+	}
+
+	/* Returns a thread that is currently stopped, preferring the one that raised the last event */
+	pid_t LinuxDebugBackend::StoppedThread() {
+		auto found = this->threads.find(this->lastEventThreadId);
+		if (found != this->threads.end() && !found->second.running) {
+			return found->first;
+		}
+		for (auto& thread : this->threads) {
+			if (!thread.second.running && !thread.second.hasDeferredStatus && !thread.second.awaitingClone) {
+				return thread.first;
+			}
+		}
+		return 0;
+	}
+
+	bool LinuxDebugBackend::WaitForEvent(DEBUG_EVENT* debugEv, DWORD timeoutMs) {
+		this->layoutGeneration++;
+		if (!this->queuedEvents.empty()) {
+			*debugEv = this->queuedEvents.front();
+			this->queuedEvents.pop_front();
+			return true;
+		}
+
+		while (true) {
+			pid_t tid;
+			int status;
+			if (!this->NextStatus(&tid, &status, timeoutMs)) {
+				return false;
+			}
+			if (!this->TranslateStatus(tid, status, debugEv)) {
+				//
+				// Nothing to report (a consumed SIGSTOP, a syscall stop...), keep it going.  A new thread that
+				// stopped ahead of its clone event waits for it.
+				//
+				auto found = this->threads.find(tid);
+				if (found != this->threads.end() && !found->second.running && !found->second.hasDeferredStatus &&
+					!found->second.held && !found->second.awaitingClone) {
+					this->ResumeThread(tid, 0);
+				}
+				continue;
+			}
+
+			if (debugEv->dwDebugEventCode != EXIT_PROCESS_DEBUG_EVENT) {
+				this->StopAllThreads(tid);
+			}
+			this->lastEventThreadId = tid;
+
+			//
+			// Breakpoints are where new images show up (the entry point breakpoint in particular), so
+			// report any load/unload events ahead of the breakpoint itself like Windows would.
+			//
+			if (debugEv->dwDebugEventCode == EXCEPTION_DEBUG_EVENT &&
+				debugEv->u.Exception.ExceptionRecord.ExceptionCode == EXCEPTION_BREAKPOINT) {
+				DEBUG_EVENT breakpointEv = *debugEv;
+				this->QueueModuleEvents();
+				if (!this->queuedEvents.empty()) {
+					this->queuedEvents.push_back(breakpointEv);
+					*debugEv = this->queuedEvents.front();
+					this->queuedEvents.pop_front();
+				}
+			}
+			return true;
+		}
+	}
+
+	bool LinuxDebugBackend::ContinueEvent(const DEBUG_EVENT* debugEv, DBG_CONTINUE_STATUS continueStatus) {
+		auto found = this->threads.find((pid_t)debugEv->dwThreadId);
+		if (found != this->threads.end()) {
+			if (debugEv->dwDebugEventCode == EXCEPTION_DEBUG_EVENT && continueStatus == DBG_EXCEPTION_NOT_HANDLED) {
+				found->second.deliverSignal = found->second.lastSignal;
+			}
+			found->second.lastSignal = 0;
+		}
+		if (debugEv->dwDebugEventCode == EXIT_PROCESS_DEBUG_EVENT) {
+			return true;
+		}
+		//
+		// Queued events all belong to the stop we're currently in, so the target stays frozen until
+		// the last one has been handled.
+		//
+		if (!this->queuedEvents.empty()) {
+			return true;
+		}
+		this->ResumeAllThreads();
+		return true;
+	}
+
+	bool LinuxDebugBackend::StepThread(const DEBUG_EVENT* debugEv, DEBUG_EVENT* stepDebugEv) {
+		pid_t tid = (pid_t)debugEv->dwThreadId;
+		TracedThread& thread = this->threads[tid];
+		int status;
+
+		this->layoutGeneration++;
+		if (ptrace(PTRACE_SINGLESTEP, tid, nullptr, nullptr) == -1) {
+			return false;
+		}
+		while (true) {
+			if (waitpid(tid, &status, __WALL) != tid) {
+				return false;
+			}
+			if (!WIFSTOPPED(status)) {
+				thread.hasDeferredStatus = true;
+				thread.deferredStatus = status;
+				return false;
+			}
+			int signal = WSTOPSIG(status);
+			if (signal == SIGTRAP && (status >> 16) == 0) {
+				break;
+			}
+			//
+			// Something else arrived before the step completed.  Hand it to the target on the next
+			// resume and step again.
+			//
+			if (signal == SIGSTOP && thread.stopRequested) {
+				thread.stopRequested = false;
+			}
+			else {
+				thread.deliverSignal = signal;
+			}
+			ptrace(PTRACE_SINGLESTEP, tid, nullptr, nullptr);
+		}
+
+		struct user_regs_struct regs;
+		ptrace(PTRACE_GETREGS, tid, nullptr, &regs);
+		this->InitializeEvent(stepDebugEv, EXCEPTION_DEBUG_EVENT, tid);
+		stepDebugEv->u.Exception.dwFirstChance = 1;
+		stepDebugEv->u.Exception.ExceptionRecord.ExceptionCode = EXCEPTION_SINGLE_STEP;
+		stepDebugEv->u.Exception.ExceptionRecord.ExceptionAddress = (PVOID)regs.rip;
+		return true;
+	}
+
+	bool LinuxDebugBackend::BreakProcess() {
+		return syscall(SYS_tgkill, (pid_t)this->processId, (pid_t)this->processId, SIGTRAP) == 0;
+	}
+
+	bool LinuxDebugBackend::ReadMemory(size_t address, void* buffer, size_t size, SIZE_T* bytesRead) {
+		struct iovec local = { buffer, size };
+		struct iovec remote = { (void*)address, size };
+		ssize_t result = process_vm_readv((pid_t)this->processId, &local, 1, &remote, 1, 0);
+		if (result != (ssize_t)size) {
+			//
+			// process_vm_readv honours page protections, /proc/<pid>/mem doesn't.  Fall back for
+			// PROT_NONE and guard-style pages.
+			//
+			result = pread(this->memFd, buffer, size, (off_t)address);
+		}
+		if (bytesRead) {
+			*bytesRead = result > 0 ? (SIZE_T)result : 0;
+		}
+		return result == (ssize_t)size;
+	}
+
+	bool LinuxDebugBackend::WriteMemory(size_t address, const void* buffer, size_t size, SIZE_T* bytesWritten) {
+		ssize_t result = pwrite(this->memFd, buffer, size, (off_t)address);
+		if (bytesWritten) {
+			*bytesWritten = result > 0 ? (SIZE_T)result : 0;
+		}
+		return result == (ssize_t)size;
+	}
+
+	bool LinuxDebugBackend::QueryProtection(size_t address, DWORD* protect) {
+		std::vector<ProcessMapsEntry> entries;
+		if (!ReadProcessMaps((pid_t)this->processId, &entries)) {
+			return false;
+		}
+		for (auto& entry : entries) {
+			if (address >= entry.start && address < entry.end) {
+				*protect = ProtToPageProtection(entry.prot);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool LinuxDebugBackend::ProtectMemory(size_t address, size_t size, DWORD newProtect, DWORD* oldProtect) {
+		DWORD previousProtect = 0;
+		this->QueryProtection(address, &previousProtect);
+		if (oldProtect) {
+			*oldProtect = previousProtect;
+		}
+		size_t firstPage = address & ~(pageSize - 1);
+		size_t lastPage = (address + (size ? size : 1) + pageSize - 1) & ~(pageSize - 1);
+		int prot = PageProtectionToProt(newProtect);
+		long result = this->RemoteSyscall(SYS_mprotect, (long)firstPage, (long)(lastPage - firstPage), prot);
+		if (!(prot & PROT_EXEC) && this->syscallSite >= firstPage && this->syscallSite < lastPage) {
+			this->syscallSite = 0;
+		}
+		if (result < 0) {
+			errno = (int)-result;
+			return false;
+		}
+		return true;
+	}
+
+	/* Picks an executable address to plant RemoteSyscall's syscall instruction at.  Any executable mapping
+	 * will do; the bytes are put back once the syscall has run.
+	 */
+	size_t LinuxDebugBackend::SyscallSite() {
+		if (this->syscallSite != 0) {
+			return this->syscallSite;
+		}
+		std::vector<ProcessMapsEntry> entries;
+		if (ReadProcessMaps((pid_t)this->processId, &entries)) {
+			for (auto& entry : entries) {
+				if ((entry.prot & PROT_EXEC) && entry.path != "[vsyscall]" && entry.path != "[vdso]") {
+					this->syscallSite = entry.start;
+					break;
+				}
+			}
+		}
+		return this->syscallSite;
+	}
+
+	long LinuxDebugBackend::RemoteSyscall(long number, long arg0, long arg1, long arg2, long arg3, long arg4, long arg5) {
+		static const uint8_t syscallInstruction[2] = { 0x0f, 0x05 };
+		struct user_regs_struct savedRegs;
+		struct user_regs_struct regs;
+		uint8_t originalBytes[sizeof(syscallInstruction)];
+		SIZE_T bytes;
+		int status;
+		long result = -EFAULT;
+
+		this->layoutGeneration++;
+		pid_t tid = this->StoppedThread();
+		size_t site = this->SyscallSite();
+		if (tid == 0) {
+			return -ESRCH;
+		}
+		if (site == 0) {
+			return -EFAULT;
+		}
+		if (ptrace(PTRACE_GETREGS, tid, nullptr, &savedRegs) == -1) {
+			return -errno;
+		}
+		//
+		// Plant a syscall instruction at the site, point the thread's registers at it and step over
+		// it.  orig_rax = -1 keeps the kernel from treating this as a restart of whatever syscall the
+		// thread may have been interrupted in; the saved registers put that back afterwards.
+		//
+		if (!this->ReadMemory(site, originalBytes, sizeof(originalBytes), &bytes) ||
+			!this->WriteMemory(site, syscallInstruction, sizeof(syscallInstruction), &bytes)) {
+			return -EFAULT;
+		}
+		regs			= savedRegs;
+		regs.rax		= number;
+		regs.orig_rax	= -1;
+		regs.rdi		= arg0;
+		regs.rsi		= arg1;
+		regs.rdx		= arg2;
+		regs.r10		= arg3;
+		regs.r8			= arg4;
+		regs.r9			= arg5;
+		regs.rip		= site;
+		ptrace(PTRACE_SETREGS, tid, nullptr, &regs);
+		ptrace(PTRACE_SINGLESTEP, tid, nullptr, nullptr);
+		while (waitpid(tid, &status, __WALL) == tid && WIFSTOPPED(status)) {
+			TracedThread& thread = this->threads[tid];
+			int signal = WSTOPSIG(status);
+			if (signal == SIGTRAP) {
+				ptrace(PTRACE_GETREGS, tid, nullptr, &regs);
+				result = (long)regs.rax;
+				break;
+			}
+			if (signal == SIGSEGV || signal == SIGBUS || signal == SIGILL) {
+				//
+				// The site stopped being executable under us.  Pick another one next time.
+				//
+				this->syscallSite = 0;
+				break;
+			}
+			if (signal == SIGSTOP && thread.stopRequested) {
+				thread.stopRequested = false;
+			}
+			else {
+				thread.deliverSignal = signal;
+			}
+			ptrace(PTRACE_SINGLESTEP, tid, nullptr, nullptr);
+		}
+
+		this->WriteMemory(site, originalBytes, sizeof(originalBytes), &bytes);
+		ptrace(PTRACE_SETREGS, tid, nullptr, &savedRegs);
+		return result;
+	}
+
+	bool LinuxDebugBackend::HoldThread(pid_t tid) {
+		auto found = this->threads.find(tid);
+		if (found == this->threads.end() || found->second.running) {
+			return false;
+		}
+		found->second.held = true;
+		return true;
+	}
+
+	bool LinuxDebugBackend::ReleaseThread(pid_t tid) {
+		auto found = this->threads.find(tid);
+		if (found == this->threads.end()) {
+			return false;
+		}
+		found->second.held = false;
+		return true;
+	}
+
+	bool LinuxDebugBackend::KillThread(pid_t tid, int exitCode) {
+		static const uint8_t syscallInstruction[2] = { 0x0f, 0x05 };
+		struct user_regs_struct savedRegs;
+		struct user_regs_struct regs;
+		uint8_t originalBytes[sizeof(syscallInstruction)];
+		SIZE_T bytes;
+		int status;
+		bool exited = false;
+
+		auto found = this->threads.find(tid);
+		size_t site = this->SyscallSite();
+		if (found == this->threads.end() || found->second.running || site == 0 ||
+			ptrace(PTRACE_GETREGS, tid, nullptr, &savedRegs) == -1) {
+			return false;
+		}
+		//
+		// Same trick as RemoteSyscall, except the thread never comes back from this one
+		//
+		if (!this->ReadMemory(site, originalBytes, sizeof(originalBytes), &bytes) ||
+			!this->WriteMemory(site, syscallInstruction, sizeof(syscallInstruction), &bytes)) {
+			return false;
+		}
+		regs			= savedRegs;
+		regs.rax		= SYS_exit;
+		regs.orig_rax	= -1;
+		regs.rdi		= exitCode;
+		regs.rip		= site;
+		ptrace(PTRACE_SETREGS, tid, nullptr, &regs);
+		ptrace(PTRACE_SINGLESTEP, tid, nullptr, nullptr);
+		while (waitpid(tid, &status, __WALL) == tid) {
+			if (WIFEXITED(status) || WIFSIGNALED(status)) {
+				exited = true;
+				break;
+			}
+			int signal = WSTOPSIG(status);
+			if (signal == SIGTRAP || signal == SIGSEGV || signal == SIGBUS || signal == SIGILL) {
+				//
+				// It stepped past the syscall without exiting, or the site went away under us
+				//
+				this->syscallSite = 0;
+				break;
+			}
+			ptrace(PTRACE_SINGLESTEP, tid, nullptr, nullptr);
+		}
+		this->WriteMemory(site, originalBytes, sizeof(originalBytes), &bytes);
+		if (!exited) {
+			ptrace(PTRACE_SETREGS, tid, nullptr, &savedRegs);
+			return false;
+		}
+		this->threads.erase(found);
+		DEBUG_EVENT exitEv;
+		this->InitializeEvent(&exitEv, EXIT_THREAD_DEBUG_EVENT, tid);
+		exitEv.u.ExitThread.dwExitCode = (DWORD)exitCode;
+		this->queuedEvents.push_back(exitEv);
+		return true;
+	}
+
+	bool LinuxDebugBackend::ReadThreadContext(pid_t tid, CONTEXT* context) {
+		struct user_regs_struct regs;
+		DWORD contextFlags = context->ContextFlags;
+		if (ptrace(PTRACE_GETREGS, tid, nullptr, &regs) == -1) {
+			return false;
+		}
+		context->Rax	= regs.rax;
+		context->Rcx	= regs.rcx;
+		context->Rdx	= regs.rdx;
+		context->Rbx	= regs.rbx;
+		context->Rsp	= regs.rsp;
+		context->Rbp	= regs.rbp;
+		context->Rsi	= regs.rsi;
+		context->Rdi	= regs.rdi;
+		context->R8		= regs.r8;
+		context->R9		= regs.r9;
+		context->R10	= regs.r10;
+		context->R11	= regs.r11;
+		context->R12	= regs.r12;
+		context->R13	= regs.r13;
+		context->R14	= regs.r14;
+		context->R15	= regs.r15;
+		context->Rip	= regs.rip;
+		context->EFlags	= (DWORD)regs.eflags;
+		context->SegCs	= (WORD)regs.cs;
+		context->SegSs	= (WORD)regs.ss;
+		context->SegDs	= (WORD)regs.ds;
+		context->SegEs	= (WORD)regs.es;
+		context->SegFs	= (WORD)regs.fs;
+		context->SegGs	= (WORD)regs.gs;
+		context->FsBase	= regs.fs_base;
+		context->GsBase	= regs.gs_base;
+
+		if (HasContextFlag(contextFlags, CONTEXT_DEBUG_REGISTERS)) {
+			DWORD64* debugRegisters[] = { &context->Dr0, &context->Dr1, &context->Dr2, &context->Dr3, nullptr, nullptr, &context->Dr6, &context->Dr7 };
+			for (int i = 0; i < 8; i++) {
+				if (debugRegisters[i] == nullptr) {
+					continue;
+				}
+				errno = 0;
+				long value = ptrace(PTRACE_PEEKUSER, tid, (void*)DebugRegisterOffset(i), nullptr);
+				if (errno != 0) {
+					return false;
+				}
+				*debugRegisters[i] = (DWORD64)value;
+			}
+		}
+
+		if (HasContextFlag(contextFlags, CONTEXT_FLOATING_POINT)) {
+			struct user_fpregs_struct fpRegs;
+			static_assert(sizeof(fpRegs) == sizeof(context->FltSave), "FXSAVE layouts differ");
+			if (ptrace(PTRACE_GETFPREGS, tid, nullptr, &fpRegs) == -1) {
+				return false;
+			}
+			memcpy(&context->FltSave, &fpRegs, sizeof(fpRegs));
+			context->MxCsr = fpRegs.mxcsr;
+		}
+		return true;
+	}
+
+	bool LinuxDebugBackend::WriteThreadContext(pid_t tid, const CONTEXT* context) {
+		struct user_regs_struct regs;
+		DWORD contextFlags = context->ContextFlags;
+		//
+		// Start from the live registers so anything CONTEXT doesn't carry (orig_rax) survives
+		//
+		if (ptrace(PTRACE_GETREGS, tid, nullptr, &regs) == -1) {
+			return false;
+		}
+		regs.rax	= context->Rax;
+		regs.rcx	= context->Rcx;
+		regs.rdx	= context->Rdx;
+		regs.rbx	= context->Rbx;
+		regs.rsp	= context->Rsp;
+		regs.rbp	= context->Rbp;
+		regs.rsi	= context->Rsi;
+		regs.rdi	= context->Rdi;
+		regs.r8		= context->R8;
+		regs.r9		= context->R9;
+		regs.r10	= context->R10;
+		regs.r11	= context->R11;
+		regs.r12	= context->R12;
+		regs.r13	= context->R13;
+		regs.r14	= context->R14;
+		regs.r15	= context->R15;
+		regs.rip	= context->Rip;
+		regs.eflags	= context->EFlags;
+		if (HasContextFlag(contextFlags, CONTEXT_SEGMENTS)) {
+			regs.fs_base = context->FsBase;
+			regs.gs_base = context->GsBase;
+		}
+		if (ptrace(PTRACE_SETREGS, tid, nullptr, &regs) == -1) {
+			return false;
+		}
+
+		if (HasContextFlag(contextFlags, CONTEXT_DEBUG_REGISTERS)) {
+			//
+			// Every debug register write re-registers a perf breakpoint in the kernel, so only touch the
+			// ones that changed, and Dr7 last so it's validated against the new addresses.  Dr7 is always
+			// written: a cloned thread reports its parent's Dr7 but doesn't inherit the breakpoints.
+			//
+			const DWORD64 values[] = { context->Dr0, context->Dr1, context->Dr2, context->Dr3, 0, 0, context->Dr6, context->Dr7 };
+			const int writeOrder[] = { 0, 1, 2, 3, 6, 7 };
+			for (int i : writeOrder) {
+				errno = 0;
+				long current = ptrace(PTRACE_PEEKUSER, tid, (void*)DebugRegisterOffset(i), nullptr);
+				if (i != 7 && errno == 0 && (DWORD64)current == values[i]) {
+					continue;
+				}
+				if (ptrace(PTRACE_POKEUSER, tid, (void*)DebugRegisterOffset(i), (void*)values[i]) == -1) {
+					return false;
+				}
+			}
+		}
+
+		if (HasContextFlag(contextFlags, CONTEXT_FLOATING_POINT)) {
+			struct user_fpregs_struct fpRegs;
+			memcpy(&fpRegs, &context->FltSave, sizeof(fpRegs));
+			fpRegs.mxcsr = context->MxCsr;
+			if (ptrace(PTRACE_SETFPREGS, tid, nullptr, &fpRegs) == -1) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool LinuxDebugBackend::ReadExtendedState(pid_t tid, std::vector<uint8_t>* state) {
+		size_t size = ExtendedStateSize();
+		int noteType = NT_X86_XSTATE;
+		if (size == 0) {
+			size = sizeof(struct user_fpregs_struct);
+			noteType = NT_PRFPREG;
+		}
+		state->resize(size);
+		struct iovec iov = { state->data(), state->size() };
+		if (ptrace(PTRACE_GETREGSET, tid, (void*)(intptr_t)noteType, &iov) == -1) {
+			return false;
+		}
+		state->resize(iov.iov_len);
+		return true;
+	}
+
+	bool LinuxDebugBackend::WriteExtendedState(pid_t tid, const std::vector<uint8_t>& state) {
+		//
+		// Anything bigger than the FXSAVE area came from NT_X86_XSTATE
+		//
+		int noteType = state.size() > sizeof(struct user_fpregs_struct) ? NT_X86_XSTATE : NT_PRFPREG;
+		struct iovec iov = { (void*)state.data(), state.size() };
+		return ptrace(PTRACE_SETREGSET, tid, (void*)(intptr_t)noteType, &iov) != -1;
+	}
+
+	bool LinuxDebugBackend::GetRegisters(DWORD threadId, CONTEXT* context) {
+		return ReadThreadContext((pid_t)threadId, context);
+	}
+
+	bool LinuxDebugBackend::SetRegisters(DWORD threadId, const CONTEXT* context) {
+		return WriteThreadContext((pid_t)threadId, context);
+	}
+
+	bool LinuxDebugBackend::GetImageName(const DEBUG_EVENT* debugEv, char* buffer, size_t size) {
+		auto found = this->modules.find((size_t)debugEv->u.LoadDll.lpBaseOfDll);
+		if (found == this->modules.end() || found->second.size() >= size) {
+			return false;
+		}
+		memcpy(buffer, found->second.c_str(), found->second.size() + 1);
+		return true;
+	}
+
+	bool LinuxDebugBackend::EnumerateThreads(std::vector<DWORD>* threadIds) {
+		return ListTasks((pid_t)this->processId, threadIds);
+	}
+
+	bool LinuxDebugBackend::EnumerateModules(std::vector<ModuleEntry>* modules) {
+		std::vector<ProcessMapsEntry> entries;
+		std::set<std::string> seen;
+		char exeLink[64];
+		char exePath[PATH_MAX] = { 0 };
+		snprintf(exeLink, sizeof(exeLink), "/proc/%d/exe", (int)this->processId);
+		ssize_t exePathLength = readlink(exeLink, exePath, sizeof(exePath) - 1);
+		if (exePathLength > 0) {
+			exePath[exePathLength] = '\0';
+		}
+
+		if (!ReadProcessMaps((pid_t)this->processId, &entries)) {
+			return false;
+		}
+		//
+		// An image is the first file backed mapping of a path at offset zero (the one holding the ELF
+		// header).  Its start is the load base.
+		//
+		for (auto& entry : entries) {
+			if (entry.path.empty() || entry.path[0] != '/' || entry.offset != 0 || seen.count(entry.path)) {
+				continue;
+			}
+			seen.insert(entry.path);
+			ModuleEntry module;
+			module.base = entry.start;
+			module.path = entry.path;
+			module.isMainModule = entry.path == exePath;
+			modules->push_back(module);
+		}
+		return true;
+	}
+
+	size_t LinuxDebugBackend::GetEntryPointAddress() {
+		char auxvPath[64];
+		Elf64_auxv_t auxv;
+		size_t entryPoint = 0;
+		snprintf(auxvPath, sizeof(auxvPath), "/proc/%d/auxv", (int)this->processId);
+		int auxvFd = open(auxvPath, O_RDONLY);
+		if (auxvFd == -1) {
+			return 0;
+		}
+		while (read(auxvFd, &auxv, sizeof(auxv)) == sizeof(auxv) && auxv.a_type != AT_NULL) {
+			if (auxv.a_type == AT_ENTRY) {
+				entryPoint = (size_t)auxv.a_un.a_val;
+				break;
+			}
+		}
+		close(auxvFd);
+		return entryPoint;
+	}
+
+	bool LinuxDebugBackend::DuplicateThreadHandle(HANDLE threadHandle, HANDLE* newHandle) {
+		//
+		// Thread handles are just tids, there's nothing to duplicate
+		//
+		*newHandle = threadHandle;
+		return true;
+	}
+}
+#endif // __linux__
@@ -0,0 +1,154 @@
+#pragma once
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "backend/DebugBackend.hpp"
+
+namespace dedougger {
+	/**
+	 * LayoutChange - an address range a successful mmap/munmap/mremap/mprotect/brk/madvise of the target changed
+	 */
+	struct LayoutChange {
+		long	syscall;	// SYS_* number of the call
+		size_t	address;	// page aligned
+		size_t	size;		// bytes, a multiple of the page size
+	};
+
+	/**
+	 * LinuxDebugBackend - DebugBackend on top of ptrace/waitpid.
+	 *
+	 *	ptrace only ever stops the thread that hit something, so to give Dedougger the same all-stop view Windows
+	 *	has, every reported event is followed by SIGSTOPing the rest of the thread group; ContinueEvent resumes all
+	 *	of them.  Signals are translated into DEBUG_EVENT exceptions (SIGSEGV -> EXCEPTION_ACCESS_VIOLATION, int3 ->
+	 *	EXCEPTION_BREAKPOINT, hardware breakpoints/traps -> EXCEPTION_SINGLE_STEP), clone events into
+	 *	CREATE_THREAD_DEBUG_EVENTs and thread/process exits into the matching exit events.
+	 *
+	 *	There's no loader notification to hook, so LOAD_DLL/UNLOAD_DLL events are synthesized by diffing
+	 *	/proc/<pid>/maps whenever a breakpoint is hit (including the initial and entry point breakpoints, which is
+	 *	where every DT_NEEDED library shows up).
+	 *
+	 *	Memory is read with process_vm_readv and written through /proc/<pid>/mem, which ignores page protections.
+	 *	Anything that has to happen inside the target (mprotect for ProtectMemory) is done by hijacking a stopped
+	 *	thread to execute a single syscall instruction planted in an executable mapping - see RemoteSyscall.
+	 *
+	 *	With SetLayoutJournaling on, threads are resumed with PTRACE_SYSCALL instead of PTRACE_CONT.  Syscall stops
+	 *	are never reported as events; the ranges changed by the memory management calls that succeed are appended
+	 *	to a journal for the state restorer (TakeLayoutJournal), and the threads are sent on their way.  Every
+	 *	syscall the target makes then costs two extra stops, which is why it's off by default.  Syscalls we inject
+	 *	with RemoteSyscall are single stepped and never show up in the journal.
+	 */
+	class LinuxDebugBackend : public DebugBackend {
+		struct TracedThread {
+			bool	running				= false;	// resumed and hasn't reported a stop since
+			bool	stopRequested		= false;	// we sent a SIGSTOP that hasn't been consumed yet
+			bool	hasDeferredStatus	= false;	// reported a real stop while we were stopping it, replay it next wait
+			bool	held				= false;	// left stopped when the others are resumed, see HoldThread
+			bool	awaitingClone		= false;	// stopped before its parent's clone event was reported, left stopped until it is
+			int		deferredStatus		= 0;
+			int		lastSignal			= 0;		// signal that raised the current exception event
+			int		deliverSignal		= 0;		// signal to pass on to the thread when it's next resumed
+			long	pendingSyscall		= -1;		// syscall the thread entered and hasn't left yet
+			uint64_t syscallArgs[6]		= { 0 };
+		};
+
+		int									memFd = -1;
+		pid_t								lastEventThreadId = 0;
+		size_t								syscallSite = 0;	// where RemoteSyscall plants its syscall instruction
+		std::map<pid_t, TracedThread>		threads;
+		std::deque<DEBUG_EVENT>				queuedEvents;
+		std::map<size_t, std::string>		modules;	// base address -> path of every image we've reported
+		bool								journalLayout = false;
+		size_t								programBreak = 0;	// the target's break as of its last brk
+		std::vector<LayoutChange>			layoutJournal;
+		uint64_t							layoutGeneration = 0;	// see LayoutGeneration
+
+		bool	NextStatus(pid_t* tid, int* status, DWORD timeoutMs);
+		bool	TranslateStatus(pid_t tid, int status, DEBUG_EVENT* debugEv);
+		void	StopAllThreads(pid_t eventThread);
+		void	ResumeAllThreads();
+		bool	ResumeThread(pid_t tid, int signal);
+		void	AddThread(pid_t tid);
+		void	QueueInitialEvents();
+		void	QueueModuleEvents();
+		void	InitializeEvent(DEBUG_EVENT* debugEv, DWORD eventCode, pid_t tid);
+		pid_t	StoppedThread();
+		size_t	SyscallSite();
+		void	RecordSyscallStop(pid_t tid, TracedThread& thread);
+		void	JournalRange(long syscall, size_t address, size_t size);
+	public:
+		~LinuxDebugBackend();
+
+		void Spawn(const TCHAR* execPath) override;
+		void Attach(DWORD pid) override;
+		void Detach() override;
+		void Start() override;
+
+		bool WaitForEvent(DEBUG_EVENT* debugEv, DWORD timeoutMs) override;
+		bool ContinueEvent(const DEBUG_EVENT* debugEv, DBG_CONTINUE_STATUS continueStatus) override;
+		bool StepThread(const DEBUG_EVENT* debugEv, DEBUG_EVENT* stepDebugEv) override;
+		bool BreakProcess() override;
+
+		bool ReadMemory(size_t address, void* buffer, size_t size, SIZE_T* bytesRead) override;
+		bool WriteMemory(size_t address, const void* buffer, size_t size, SIZE_T* bytesWritten) override;
+		bool ProtectMemory(size_t address, size_t size, DWORD newProtect, DWORD* oldProtect) override;
+
+		bool GetRegisters(DWORD threadId, CONTEXT* context) override;
+		bool SetRegisters(DWORD threadId, const CONTEXT* context) override;
+
+		bool GetImageName(const DEBUG_EVENT* debugEv, char* buffer, size_t size) override;
+		bool EnumerateThreads(std::vector<DWORD>* threadIds) override;
+		bool EnumerateModules(std::vector<ModuleEntry>* modules) override;
+		size_t GetEntryPointAddress() override;
+		bool DuplicateThreadHandle(HANDLE threadHandle, HANDLE* newHandle) override;
+
+		/* Executes a single system call inside the target on a stopped thread and returns its raw result
+		 * (negative errno on failure).  The thread's registers and the bytes the syscall instruction was
+		 * planted over are restored afterwards.
+		 */
+		long RemoteSyscall(long number, long arg0 = 0, long arg1 = 0, long arg2 = 0, long arg3 = 0, long arg4 = 0, long arg5 = 0);
+		/* Looks up the protection of the mapping containing address in /proc/<pid>/maps */
+		bool QueryProtection(size_t address, DWORD* protect);
+		/* Starts or stops tracing the target's syscalls and journaling the layout changes they make.  The target
+		 * has to be stopped in a debug event.
+		 */
+		void SetLayoutJournaling(bool enable);
+		/* Changes whenever the target's address space may have changed: a wait for events (the target ran), a
+		 * single step or an injected syscall.  Lets /proc/<pid>/maps be parsed once for as long as it holds.
+		 */
+		uint64_t LayoutGeneration() { return this->layoutGeneration; }
+		/* Moves the layout changes recorded since the last call into changes, in the order they happened */
+		void TakeLayoutJournal(std::vector<LayoutChange>* changes);
+		/* The target's program break, as of its last brk while journaling or our own MoveProgramBreak */
+		size_t ProgramBreak() { return this->programBreak; }
+		/* Sets the target's program break with an injected brk.  Returns false if the kernel refused. */
+		bool MoveProgramBreak(size_t programBreak);
+
+		static bool ReadThreadContext(pid_t tid, CONTEXT* context);
+		static bool WriteThreadContext(pid_t tid, const CONTEXT* context);
+		/* Reads a thread's whole XSAVE area (x87, SSE, AVX, AVX-512 and whatever else XCR0 enables) with
+		 * PTRACE_GETREGSET, in the standard uncompacted layout.  CPUs without XSAVE only have the 512 byte
+		 * FXSAVE area.  state is resized to what the kernel returned.
+		 */
+		static bool ReadExtendedState(pid_t tid, std::vector<uint8_t>* state);
+		/* Loads an area ReadExtendedState returned back into a thread with a single PTRACE_SETREGSET */
+		static bool WriteExtendedState(pid_t tid, const std::vector<uint8_t>& state);
+		/* Keeps a stopped thread stopped when the rest are resumed, e.g. a new thread still at its clone stop,
+		 * until ReleaseThread.  Returns false if the thread isn't ours or isn't stopped.
+		 */
+		bool HoldThread(pid_t tid);
+		bool ReleaseThread(pid_t tid);
+		/* Makes a stopped thread exit with an injected exit syscall, the one way to end a single thread of a
+		 * process.  Its EXIT_THREAD_DEBUG_EVENT is queued behind the current event.
+		 */
+		bool KillThread(pid_t tid, int exitCode = 0);
+		/* Returns the backend debugging the process a compat process handle refers to, or nullptr */
+		static LinuxDebugBackend* FromProcessHandle(HANDLE process);
+		/* Returns the backend tracing the thread a compat thread handle refers to, or nullptr */
+		static LinuxDebugBackend* FromThreadHandle(HANDLE thread);
+	};
+}
+#endif // __linux__
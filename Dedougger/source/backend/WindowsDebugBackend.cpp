@@ -0,0 +1,213 @@
+#ifdef _WIN32
+#include <Windows.h>
+#include <processthreadsapi.h>
+#include <TlHelp32.h>
+#include <debugapi.h>
+#include "backend/WindowsDebugBackend.hpp"
+#include "targetstate/PEInfo.hpp"
+#include "dexception.h"
+
+namespace dedougger {
+
+	UP_DebugBackend CreateDebugBackend() {
+		return std::make_unique<WindowsDebugBackend>();
+	}
+
+	WindowsDebugBackend::~WindowsDebugBackend() {
+		if (this->processHandle != INVALID_HANDLE_VALUE && this->processHandle != NULL) {
+			CloseHandle(this->processHandle);
+		}
+	}
+
+	void WindowsDebugBackend::Spawn(const TCHAR* execPath) {
+		STARTUPINFO startupInfo = { 0 };
+		PROCESS_INFORMATION procInfo = { 0 };
+		bool success = CreateProcess(execPath, NULL, NULL, NULL, TRUE, DEBUG_PROCESS | CREATE_SUSPENDED, NULL, NULL, &startupInfo, &procInfo);
+		if (!success) {
+			throw CreateProcessFailedException();
+		}
+		this->processHandle = OpenProcess(PROCESS_ALL_ACCESS, false, procInfo.dwProcessId);
+		this->processId = procInfo.dwProcessId;
+		//
+		// The process hangs on the process start debug event so it won't *actually* start running
+		// until we resume the start thread in Start().
+		//
+		this->startThreadHandle = procInfo.hThread;
+	}
+
+	void WindowsDebugBackend::Attach(DWORD pid) {
+		this->processId = pid;
+		this->processHandle = OpenProcess(PROCESS_ALL_ACCESS, false, this->processId);
+		if (this->processHandle == INVALID_HANDLE_VALUE) {
+			throw OpenProcessFailedException();
+		}
+
+		bool success = DebugActiveProcess(this->processId);
+		if (!success) {
+			throw DebugActiveProcessFailedException();
+		}
+	}
+
+	void WindowsDebugBackend::Detach() {
+		DebugActiveProcessStop(this->processId);
+	}
+
+	void WindowsDebugBackend::Start() {
+		//
+		// If we started the process ourselves, we'll have a thread handle we'll have to resume to
+		// actually spin up the target process.
+		//
+		if (this->startThreadHandle != INVALID_HANDLE_VALUE) {
+			ResumeThread(this->startThreadHandle);
+		}
+	}
+
+	bool WindowsDebugBackend::WaitForEvent(DEBUG_EVENT* debugEv, DWORD timeoutMs) {
+		return WaitForDebugEvent(debugEv, timeoutMs);
+	}
+
+	bool WindowsDebugBackend::ContinueEvent(const DEBUG_EVENT* debugEv, DBG_CONTINUE_STATUS continueStatus) {
+		//
+		// Windows hands us handles with some events that we're expected to close.  Callbacks have
+		// already run at this point, so anyone who wanted to keep one has duplicated it.
+		//
+		switch (debugEv->dwDebugEventCode) {
+		case CREATE_THREAD_DEBUG_EVENT:
+			CloseHandle(debugEv->u.CreateThread.hThread);
+			break;
+		case LOAD_DLL_DEBUG_EVENT:
+			if (debugEv->u.LoadDll.hFile != NULL) {
+				CloseHandle(debugEv->u.LoadDll.hFile);
+			}
+			break;
+		}
+		return ContinueDebugEvent(debugEv->dwProcessId, debugEv->dwThreadId, continueStatus);
+	}
+
+	bool WindowsDebugBackend::StepThread(const DEBUG_EVENT* debugEv, DEBUG_EVENT* stepDebugEv) {
+		ContinueDebugEvent(debugEv->dwProcessId, debugEv->dwThreadId, DBG_CONTINUE);
+		return WaitForDebugEvent(stepDebugEv, INFINITE);
+	}
+
+	bool WindowsDebugBackend::BreakProcess() {
+		return DebugBreakProcess(this->processHandle);
+	}
+
+	bool WindowsDebugBackend::ReadMemory(size_t address, void* buffer, size_t size, SIZE_T* bytesRead) {
+		return ReadProcessMemory(this->processHandle, (LPCVOID)address, buffer, size, bytesRead);
+	}
+
+	bool WindowsDebugBackend::WriteMemory(size_t address, const void* buffer, size_t size, SIZE_T* bytesWritten) {
+		return WriteProcessMemory(this->processHandle, (LPVOID)address, buffer, size, bytesWritten);
+	}
+
+	bool WindowsDebugBackend::ProtectMemory(size_t address, size_t size, DWORD newProtect, DWORD* oldProtect) {
+		return VirtualProtectEx(this->processHandle, (LPVOID)address, size, newProtect, oldProtect);
+	}
+
+	bool WindowsDebugBackend::GetRegisters(DWORD threadId, CONTEXT* context) {
+		HANDLE threadHandle = OpenThread(THREAD_GET_CONTEXT, false, threadId);
+		if (threadHandle == NULL) {
+			return false;
+		}
+		bool result = GetThreadContext(threadHandle, context);
+		CloseHandle(threadHandle);
+		return result;
+	}
+
+	bool WindowsDebugBackend::SetRegisters(DWORD threadId, const CONTEXT* context) {
+		HANDLE threadHandle = OpenThread(THREAD_SET_CONTEXT, false, threadId);
+		if (threadHandle == NULL) {
+			return false;
+		}
+		bool result = SetThreadContext(threadHandle, context);
+		CloseHandle(threadHandle);
+		return result;
+	}
+
+	bool WindowsDebugBackend::GetImageName(const DEBUG_EVENT* debugEv, char* buffer, size_t size) {
+		HANDLE imageHandle = debugEv->u.LoadDll.hFile;
+		if (imageHandle == NULL) {
+			return false;
+		}
+		DWORD charsWritten = GetFinalPathNameByHandleA(imageHandle, buffer, (DWORD)size, FILE_NAME_NORMALIZED);
+		return charsWritten > 0 && charsWritten < size;
+	}
+
+	bool WindowsDebugBackend::EnumerateThreads(std::vector<DWORD>* threadIds) {
+		HANDLE h = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, this->processId);
+		//
+		// Walk all threads on the system and add threads belonging to the target
+		// process to the list
+		//
+		if (h == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		THREADENTRY32 thread_entry = { 0 };
+		thread_entry.dwSize = sizeof(thread_entry);
+		if (Thread32First(h, &thread_entry)) {
+			do {
+				if (thread_entry.th32OwnerProcessID == this->processId) {
+					threadIds->push_back(thread_entry.th32ThreadID);
+				}
+			} while (Thread32Next(h, &thread_entry));
+		}
+		CloseHandle(h);
+		return true;
+	}
+
+	bool WindowsDebugBackend::EnumerateModules(std::vector<ModuleEntry>* modules) {
+		//
+		// This will fail with partial copy if the process hasn't gotten through startup yet
+		//
+		char exePathMb[MAX_PATH];
+		HANDLE h = INVALID_HANDLE_VALUE;
+		do {
+			h = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, this->processId);
+		} while (h == INVALID_HANDLE_VALUE && GetLastError() == ERROR_BAD_LENGTH);
+
+		if (h == INVALID_HANDLE_VALUE) {
+			printf("Failed to create snapshot for module search %x\n", GetLastError());
+			return false;
+		}
+
+		MODULEENTRY32 moduleEntry;
+		moduleEntry.dwSize = sizeof(moduleEntry);
+		if (Module32First(h, &moduleEntry)) {
+			do {
+				size_t len = wcslen(moduleEntry.szExePath);
+				if (len > 4) {
+					SIZE_T numCharsConverted;
+					wcstombs_s(&numCharsConverted, exePathMb, moduleEntry.szExePath, sizeof(exePathMb));
+					ModuleEntry entry;
+					entry.base = (size_t)moduleEntry.modBaseAddr;
+					entry.path = exePathMb;
+					entry.isMainModule = !wcscmp(moduleEntry.szExePath + (len - 4), L".exe");
+					modules->push_back(entry);
+				}
+			} while (Module32Next(h, &moduleEntry));
+		}
+		else {
+			printf("Failed to find any modules in target process %x\n", GetLastError());
+		}
+		CloseHandle(h);
+		return true;
+	}
+
+	size_t WindowsDebugBackend::GetEntryPointAddress() {
+		std::vector<ModuleEntry> modules;
+		this->EnumerateModules(&modules);
+		for (auto& module : modules) {
+			if (module.isMainModule) {
+				PEInfoEx peInfo(module.base, this->processHandle);
+				return module.base + peInfo.GetEntryPointOffset();
+			}
+		}
+		return 0;
+	}
+
+	bool WindowsDebugBackend::DuplicateThreadHandle(HANDLE threadHandle, HANDLE* newHandle) {
+		return DuplicateHandle(this->processHandle, threadHandle, this->processHandle, newHandle, THREAD_ALL_ACCESS, false, NULL);
+	}
+}
+#endif // _WIN32
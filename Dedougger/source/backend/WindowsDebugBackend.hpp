@@ -0,0 +1,38 @@
+#pragma once
+#ifdef _WIN32
+#include "backend/DebugBackend.hpp"
+
+namespace dedougger {
+	/**
+	 * WindowsDebugBackend - DebugBackend on top of the Win32 debugging API (WaitForDebugEvent/ContinueDebugEvent).
+	 */
+	class WindowsDebugBackend : public DebugBackend {
+		HANDLE startThreadHandle = INVALID_HANDLE_VALUE;
+	public:
+		~WindowsDebugBackend();
+
+		void Spawn(const TCHAR* execPath) override;
+		void Attach(DWORD pid) override;
+		void Detach() override;
+		void Start() override;
+
+		bool WaitForEvent(DEBUG_EVENT* debugEv, DWORD timeoutMs) override;
+		bool ContinueEvent(const DEBUG_EVENT* debugEv, DBG_CONTINUE_STATUS continueStatus) override;
+		bool StepThread(const DEBUG_EVENT* debugEv, DEBUG_EVENT* stepDebugEv) override;
+		bool BreakProcess() override;
+
+		bool ReadMemory(size_t address, void* buffer, size_t size, SIZE_T* bytesRead) override;
+		bool WriteMemory(size_t address, const void* buffer, size_t size, SIZE_T* bytesWritten) override;
+		bool ProtectMemory(size_t address, size_t size, DWORD newProtect, DWORD* oldProtect) override;
+
+		bool GetRegisters(DWORD threadId, CONTEXT* context) override;
+		bool SetRegisters(DWORD threadId, const CONTEXT* context) override;
+
+		bool GetImageName(const DEBUG_EVENT* debugEv, char* buffer, size_t size) override;
+		bool EnumerateThreads(std::vector<DWORD>* threadIds) override;
+		bool EnumerateModules(std::vector<ModuleEntry>* modules) override;
+		size_t GetEntryPointAddress() override;
+		bool DuplicateThreadHandle(HANDLE threadHandle, HANDLE* newHandle) override;
+	};
+}
+#endif // _WIN32
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <Windows.h>
+#include "platform/platform.h"
 
 namespace dedougger {
 	class DeferredSWBP {
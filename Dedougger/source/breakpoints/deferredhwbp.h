@@ -1,5 +1,5 @@
 #pragma once
-#include <Windows.h>
+#include "platform/platform.h"
 #include "HwbpDescriptor.h"
 
 namespace dedougger {
@@ -1,11 +1,12 @@
 #pragma once
-#include "breakpoints\deferredhwbp.h"
-#include "breakpoints\DeferredSWBP.h"
-#include "breakpoints\HwbpDescriptor.h"
-#include "breakpoints\swbp.hpp"
-#include "targetstate\peinfo.hpp"
-#include "targetstate\ThreadState.hpp"
-#include "targetstate\moduleinfo.hpp"
+#include "backend/DebugBackend.hpp"
+#include "breakpoints/deferredhwbp.h"
+#include "breakpoints/DeferredSWBP.h"
+#include "breakpoints/HwbpDescriptor.h"
+#include "breakpoints/swbp.hpp"
+#include "targetstate/ThreadRegistry.hpp"
+#include "targetstate/ThreadState.hpp"
+#include "targetstate/moduleinfo.hpp"
 
 #include <array>
 #include <assert.h>
@@ -13,11 +14,14 @@
 #include <memory>
 #include <vector>
 
-#include <Windows.h>
+#include "platform/platform.h"
+#ifdef _WIN32
+#include "targetstate/PEInfo.hpp"
 #include <processthreadsapi.h>
 #include <DbgHelp.h>
-#include <stdio.h>
 #include <tchar.h>
+#endif
+#include <stdio.h>
 
 namespace dedougger {
 	class ModuleNotFoundException : public std::exception {};
@@ -42,8 +46,7 @@ namespace dedougger {
 		BP_HANDLE = 0, // tells the debugger to 'handle' the breakpoint, i.e. replace the instruction, single step, etc.
 		BP_DONT_HANDLE // tells the debugger not to handle the breakpoint, just continue execution
 	};
-		
-	typedef DWORD DBG_CONTINUE_STATUS;
+
 	typedef CALLBACKRESULT (*EventCallback)(const DEBUGEVENTCALLBACKID eventId, ThreadState* threadState, const DEBUG_EVENT *debugEv, DBG_CONTINUE_STATUS* dwContinueStatus, void *callbackObject);
 	typedef void (*DeferredBpResolvedCallback)(const char* moduleName, size_t offset, size_t resolvedAddress, void *callbackObject);
 
@@ -83,7 +86,7 @@ namespace dedougger {
 	 *		BreakProcess() - triggers a breakpoint event in the target process
 	 *		GetCallStack(thread, threadState) - returns a vector of STACKFRAMEs representing the call stack of the given
 	 *			thread.  This should only be called when the process is in a broken state, i.e. from one of the event
-	 *			callbacks.
+	 *			callbacks.  Windows only.
 	 *		ClearHWBP(index) - remove a hardware breakpoint
 	 *		ClearSWBP(address) - remove a software breakpoint
 	 *		SetSWBP(address, replacePageProtection, replaceInstOnBPHit) - set a software breakpoint.  replacePageProtection, 
@@ -100,10 +103,17 @@ namespace dedougger {
 	 *			breakpoint will be deferred.
 	 *		GetMainModuleBase() - get the base address of the main module
 	 *		GetModuleByName(moduleName) - get the base address of a module by its executable name
+	 *		GetModules() - every loaded module, by base address
 	 *		RegisterEventCallback(eventId, callback, callbackObject) - registers an event callback.  The callback will be called
 	 *			when the eventId event (such as THREAD_CREATE, etc.) is triggered in the debugger.
 	 *		ProcessId() - gets the debugged process ID
 	 *		DuplicateThreadHandle(threadHandle, newHandle) - duplicates a thread handle for a thread in the debugged process
+	 *		Backend() - the DebugBackend talking to the OS on our behalf
+	 *		Threads() - the threads of the target, kept up to date from the thread create and exit events.  See
+	 *			ThreadRegistry.
+	 *
+	 *	All OS interaction goes through a DebugBackend (Win32 debugging API on Windows, ptrace on Linux), so the same
+	 *	callbacks fire with the same DEBUG_EVENTs on both.
 	 *
 	 */
 
@@ -111,7 +121,7 @@ namespace dedougger {
 		DWORD	processId;
 		bool	firstBreakpointHit;		
 		HANDLE	processHandle;
-		HANDLE	startThreadHandle;		
+		UP_DebugBackend backend;
 		//
 		// Breakpoints
 		//
@@ -126,7 +136,7 @@ namespace dedougger {
 		//
 		std::map<std::string, ModuleInfo>	modulesByName;
 		std::map<size_t, ModuleInfo>		modulesByAddress;
-		std::map<DWORD, DWORD>				threads;
+		ThreadRegistry						threads;
 		ModuleInfo							mainModule;
 		
 		// Array of callbacks that will be called on triggering of each debug event		
@@ -146,7 +156,9 @@ namespace dedougger {
 		~Dedougger();
 		void BeginDebugging();
 		bool BreakProcess();
+#ifdef _WIN32
 		std::vector<STACKFRAME64> GetCallStack(HANDLE thread, ThreadState *threadState);
+#endif
 
 		void ClearHWBP(int bpIndex);
 		int ClearHWBPByAddress(size_t address);
@@ -160,13 +172,16 @@ namespace dedougger {
 
 		void* GetMainModuleBase();
 		void* GetModuleByName(wchar_t* module_name);
+		const std::map<size_t, ModuleInfo>& GetModules() const { return this->modulesByAddress; }
 		EventCallbackObjectPair RegisterEventCallback(DEBUGEVENTCALLBACKID eventId, EventCallback callback, void *callbackObject);
 		ResolvedCallbackObjectPair RegisterBreakpointResolvedCallback(DeferredBpResolvedCallback callback, void* object);
 
 		DWORD ProcessId() { return this->processId; }
 		bool DuplicateThreadHandle(HANDLE threadHandle, HANDLE* newHandle) {
-			return DuplicateHandle(this->processHandle, threadHandle, this->processHandle, newHandle, THREAD_ALL_ACCESS, false, NULL); 
+			return this->backend->DuplicateThreadHandle(threadHandle, newHandle);
 		}
+		DebugBackend* Backend() { return this->backend.get(); }
+		ThreadRegistry& Threads() { return this->threads; }
 
 
 	private:
@@ -176,7 +191,9 @@ namespace dedougger {
 		void  WriteBreakpointsToThread(ThreadState *threadState);
 		void  MapDll(ModuleInfo newDll);
 		const ModuleInfo *ResolveModule(std::string moduleName) const;
+#ifdef _WIN32
 		SP_ExportedFunction ResolveFunction(const std::string &moduleName, const std::string &functionName) const;
+#endif
 		DWORD ResumeFromBreakpoint(const DEBUG_EVENT *debugEv, ThreadState* threadState, bool replaceBreakpoint = true);
 		//
 		// Internal Debug event handlers
@@ -16,5 +16,17 @@ namespace dedougger {
 	class DebugActiveProcessFailedException :public std::exception {};
 	class OpenProcessFailedException :public std::exception {};
 	class SetThreadContextFailedException :public std::exception {};
+	class CreateProcessFailedException :public std::exception {};
+	class UnsupportedPageDifferentialTypeException :public std::exception {};
+	class SoftDirtyTrackingFailedException :public std::exception {};
+	class UserfaultfdFailedException :public std::exception {};
+	class LayoutJournalFailedException :public std::exception {};
+	class ProcMemoryMapFailedException :public std::exception {};
+	class UnsupportedMMapGenerationTypeException :public std::exception {};
+	class SnapshotArenaExhaustedException :public std::exception {};
+	class SnapshotFileInvalidException :public std::exception {};
+	class SnapshotFileWriteFailedException :public std::exception {};
+	class ResurrectThreadFailedException :public std::exception {};
+	class SnapshotThreadMismatchException :public std::exception {};
 
 }
\ No newline at end of file
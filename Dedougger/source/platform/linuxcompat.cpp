@@ -0,0 +1,386 @@
+#ifdef __linux__
+#include <algorithm>
+#include <map>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "platform/linuxcompat.h"
+#include "backend/LinuxDebugBackend.hpp"
+
+using dedougger::LinuxDebugBackend;
+
+namespace {
+	//
+	// Top of the x86-64 user address space (47-bit).  VirtualQueryEx reports everything past the last
+	// mapping up to here as free and fails beyond it, which is what ends a VirtualQuery walk.
+	//
+	const size_t userSpaceEnd = 0x7ffffffff000;
+
+	bool IsSpecialMapping(const std::string& path) {
+		//
+		// [vvar] and friends are readable by the process itself but not through /proc/<pid>/mem or
+		// process_vm_readv, so as far as a debugger is concerned they're inaccessible.
+		//
+		return path == "[vvar]" || path == "[vvar_vclock]" || path == "[vsyscall]";
+	}
+
+	//
+	// A VirtualQueryEx walk asks for one region at a time, and the layout can't change in between unless the
+	// target ran or we injected a syscall into it.  The maps of every debugged process are kept parsed along
+	// with the backend's layout generation they were read in, so a walk parses /proc/<pid>/maps once.
+	//
+	struct ParsedProcessMaps {
+		uint64_t						generation;
+		std::vector<ProcessMapsEntry>	entries;
+	};
+	std::map<pid_t, ParsedProcessMaps> parsedMaps;
+
+	const std::vector<ProcessMapsEntry>* GetProcessMaps(pid_t pid, std::vector<ProcessMapsEntry>* uncached) {
+		LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle((HANDLE)(intptr_t)pid);
+		if (backend == nullptr) {
+			//
+			// Nothing tells us when a process we don't debug changes, so it's read every time
+			//
+			parsedMaps.erase(pid);
+			return ReadProcessMaps(pid, uncached) ? uncached : nullptr;
+		}
+		auto found = parsedMaps.find(pid);
+		if (found != parsedMaps.end() && found->second.generation == backend->LayoutGeneration()) {
+			return &found->second.entries;
+		}
+		ParsedProcessMaps& parsed = parsedMaps[pid];
+		parsed.entries.clear();
+		if (!ReadProcessMaps(pid, &parsed.entries)) {
+			parsedMaps.erase(pid);
+			return nullptr;
+		}
+		parsed.generation = backend->LayoutGeneration();
+		return &parsed.entries;
+	}
+}
+
+HANDLE OpenProcess(DWORD desiredAccess, BOOL inheritHandle, DWORD processId) {
+	return (HANDLE)(intptr_t)processId;
+}
+
+HANDLE OpenThread(DWORD desiredAccess, BOOL inheritHandle, DWORD threadId) {
+	return (HANDLE)(intptr_t)threadId;
+}
+
+BOOL CloseHandle(HANDLE handle) {
+	return TRUE;
+}
+
+DWORD GetLastError() {
+	return (DWORD)errno;
+}
+
+BOOL ReadProcessMemory(HANDLE process, LPCVOID baseAddress, LPVOID buffer, SIZE_T size, SIZE_T* bytesRead) {
+	LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle(process);
+	if (backend) {
+		return backend->ReadMemory((size_t)baseAddress, buffer, size, bytesRead);
+	}
+	struct iovec local = { buffer, size };
+	struct iovec remote = { (void*)baseAddress, size };
+	ssize_t result = process_vm_readv((pid_t)(intptr_t)process, &local, 1, &remote, 1, 0);
+	if (bytesRead) {
+		*bytesRead = result > 0 ? (SIZE_T)result : 0;
+	}
+	return result == (ssize_t)size;
+}
+
+BOOL WriteProcessMemory(HANDLE process, LPVOID baseAddress, LPCVOID buffer, SIZE_T size, SIZE_T* bytesWritten) {
+	LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle(process);
+	if (backend) {
+		return backend->WriteMemory((size_t)baseAddress, buffer, size, bytesWritten);
+	}
+	char memPath[64];
+	snprintf(memPath, sizeof(memPath), "/proc/%d/mem", (int)(intptr_t)process);
+	int memFd = open(memPath, O_RDWR);
+	if (memFd == -1) {
+		return FALSE;
+	}
+	ssize_t result = pwrite(memFd, buffer, size, (off_t)baseAddress);
+	close(memFd);
+	if (bytesWritten) {
+		*bytesWritten = result > 0 ? (SIZE_T)result : 0;
+	}
+	return result == (ssize_t)size;
+}
+
+BOOL VirtualProtectEx(HANDLE process, LPVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect) {
+	LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle(process);
+	if (backend == nullptr) {
+		//
+		// mprotect has to run inside the target, which needs a tracer
+		//
+		errno = ESRCH;
+		return FALSE;
+	}
+	return backend->ProtectMemory((size_t)address, size, newProtect, oldProtect);
+}
+
+LPVOID VirtualAllocEx(HANDLE process, LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect) {
+	LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle(process);
+	if (backend == nullptr) {
+		errno = ESRCH;
+		return nullptr;
+	}
+	//
+	// Reserved-only memory is PROT_NONE, the same way glibc reserves address space.  A requested
+	// address has to be honoured exactly like it is on Windows, so don't let mmap treat it as a hint
+	// or clobber whatever is already there.
+	//
+	int prot = (allocationType & MEM_COMMIT) ? PageProtectionToProt(protect) : PROT_NONE;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | (address ? MAP_FIXED_NOREPLACE : 0);
+	long result = backend->RemoteSyscall(SYS_mmap, (long)address, (long)size, prot, flags, -1, 0);
+	if (result < 0 && result > -4096) {
+		errno = (int)-result;
+		return nullptr;
+	}
+	if (address && (LPVOID)result != address) {
+		backend->RemoteSyscall(SYS_munmap, result, (long)size);
+		errno = EEXIST;
+		return nullptr;
+	}
+	return (LPVOID)result;
+}
+
+BOOL VirtualFreeEx(HANDLE process, LPVOID address, SIZE_T size, DWORD freeType) {
+	LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle(process);
+	if (backend == nullptr) {
+		errno = ESRCH;
+		return FALSE;
+	}
+	if (size == 0) {
+		//
+		// MEM_RELEASE with no size frees the whole allocation, which here is the rest of the mapping
+		//
+		MEMORY_BASIC_INFORMATION memInfo;
+		if (!VirtualQueryEx(process, address, &memInfo, sizeof(memInfo)) || memInfo.State == MEM_FREE) {
+			errno = EINVAL;
+			return FALSE;
+		}
+		size = memInfo.RegionSize;
+	}
+	long result;
+	if (freeType & MEM_DECOMMIT) {
+		result = backend->RemoteSyscall(SYS_mmap, (long)address, (long)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	}
+	else {
+		result = backend->RemoteSyscall(SYS_munmap, (long)address, (long)size);
+	}
+	if (result < 0 && result > -4096) {
+		errno = (int)-result;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+SIZE_T VirtualQueryEx(HANDLE process, LPCVOID address, PMEMORY_BASIC_INFORMATION buffer, SIZE_T length) {
+	std::vector<ProcessMapsEntry> uncached;
+	size_t page = (size_t)address & ~(size_t)0xFFF;
+	if (length < sizeof(MEMORY_BASIC_INFORMATION) || page >= userSpaceEnd) {
+		errno = EINVAL;
+		return 0;
+	}
+	const std::vector<ProcessMapsEntry>* entries = GetProcessMaps((pid_t)(intptr_t)process, &uncached);
+	if (entries == nullptr) {
+		return 0;
+	}
+
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->BaseAddress		= (PVOID)page;
+	buffer->RegionSize		= userSpaceEnd - page;
+	buffer->State			= MEM_FREE;
+	buffer->Protect			= PAGE_NOACCESS;
+	//
+	// The first mapping that ends past the page either holds it or starts the gap the page is in
+	//
+	auto entry = std::upper_bound(entries->begin(), entries->end(), page,
+		[](size_t address, const ProcessMapsEntry& entry) { return address < entry.end; });
+	if (entry == entries->end() || entry->start >= userSpaceEnd) {
+		return sizeof(*buffer);
+	}
+	if (entry->start > page) {
+		//
+		// Gap between mappings
+		//
+		buffer->RegionSize = entry->start - page;
+		return sizeof(*buffer);
+	}
+	MapsEntryToMemoryInfo(*entry, buffer);
+	buffer->BaseAddress			= (PVOID)page;
+	buffer->RegionSize			= entry->end - page;
+	return sizeof(*buffer);
+}
+
+void MapsEntryToMemoryInfo(const ProcessMapsEntry& entry, PMEMORY_BASIC_INFORMATION buffer) {
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->BaseAddress			= (PVOID)entry.start;
+	buffer->AllocationBase		= (PVOID)entry.start;
+	buffer->RegionSize			= entry.end - entry.start;
+	buffer->Protect				= IsSpecialMapping(entry.path) ? PAGE_NOACCESS : ProtToPageProtection(entry.prot);
+	buffer->AllocationProtect	= buffer->Protect;
+	//
+	// PROT_NONE mappings are how Linux reserves address space (thread stack guards, malloc arena
+	// reservations), so they're reported the way Windows reports reserved memory.
+	//
+	buffer->State				= entry.prot == PROT_NONE ? MEM_RESERVE : MEM_COMMIT;
+	if (entry.shared) {
+		buffer->Type = MEM_MAPPED;
+	}
+	else if (!entry.path.empty() && entry.path[0] == '/') {
+		buffer->Type = MEM_IMAGE;
+	}
+	else {
+		buffer->Type = MEM_PRIVATE;
+	}
+}
+
+BOOL GetThreadContext(HANDLE thread, CONTEXT* context) {
+	return LinuxDebugBackend::ReadThreadContext((pid_t)(intptr_t)thread, context);
+}
+
+BOOL SetThreadContext(HANDLE thread, const CONTEXT* context) {
+	return LinuxDebugBackend::WriteThreadContext((pid_t)(intptr_t)thread, context);
+}
+
+BOOL QueryThreadCycleTime(HANDLE thread, ULONG64* cycleTime) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/schedstat", (int)(intptr_t)thread);
+	FILE* file = fopen(path, "r");
+	if (file == nullptr) {
+		return FALSE;
+	}
+	unsigned long long runTime = 0;
+	int fields = fscanf(file, "%llu", &runTime);
+	fclose(file);
+	if (fields != 1) {
+		return FALSE;
+	}
+	*cycleTime = runTime;
+	return TRUE;
+}
+
+HANDLE GetCurrentProcess() {
+	return (HANDLE)(intptr_t)getpid();
+}
+
+BOOL DuplicateHandle(HANDLE sourceProcess, HANDLE sourceHandle, HANDLE targetProcess, PHANDLE targetHandle,
+	DWORD desiredAccess, BOOL inheritHandle, DWORD options) {
+	*targetHandle = sourceHandle;
+	return TRUE;
+}
+
+DWORD GetThreadId(HANDLE thread) {
+	return (DWORD)(intptr_t)thread;
+}
+
+DWORD SuspendThread(HANDLE thread) {
+	LinuxDebugBackend* backend = LinuxDebugBackend::FromThreadHandle(thread);
+	if (backend == nullptr || !backend->HoldThread((pid_t)(intptr_t)thread)) {
+		return (DWORD)-1;
+	}
+	return 0;
+}
+
+DWORD ResumeThread(HANDLE thread) {
+	LinuxDebugBackend* backend = LinuxDebugBackend::FromThreadHandle(thread);
+	if (backend == nullptr || !backend->ReleaseThread((pid_t)(intptr_t)thread)) {
+		return (DWORD)-1;
+	}
+	return 1;
+}
+
+BOOL TerminateThread(HANDLE thread, DWORD exitCode) {
+	LinuxDebugBackend* backend = LinuxDebugBackend::FromThreadHandle(thread);
+	return backend != nullptr && backend->KillThread((pid_t)(intptr_t)thread, (int)exitCode);
+}
+
+BOOL GetExitCodeThread(HANDLE thread, PDWORD exitCode) {
+	//
+	// The backend reaps a thread's exit before anyone could ask, so all that's left to tell is whether it's gone
+	//
+	*exitCode = LinuxDebugBackend::FromThreadHandle(thread) != nullptr ? STILL_ACTIVE : 0;
+	return TRUE;
+}
+
+int PageProtectionToProt(DWORD protect) {
+	switch (protect & 0xFF) {
+	case PAGE_NOACCESS:
+		return PROT_NONE;
+	case PAGE_READONLY:
+		return PROT_READ;
+	case PAGE_READWRITE:
+	case PAGE_WRITECOPY:
+		return PROT_READ | PROT_WRITE;
+	case PAGE_EXECUTE:
+		return PROT_EXEC;
+	case PAGE_EXECUTE_READ:
+		return PROT_READ | PROT_EXEC;
+	case PAGE_EXECUTE_READWRITE:
+	case PAGE_EXECUTE_WRITECOPY:
+		return PROT_READ | PROT_WRITE | PROT_EXEC;
+	}
+	return PROT_NONE;
+}
+
+DWORD ProtToPageProtection(int prot) {
+	bool read = prot & PROT_READ;
+	bool write = prot & PROT_WRITE;
+	if (prot & PROT_EXEC) {
+		if (write) {
+			return PAGE_EXECUTE_READWRITE;
+		}
+		return read ? PAGE_EXECUTE_READ : PAGE_EXECUTE;
+	}
+	if (write) {
+		return PAGE_READWRITE;
+	}
+	return read ? PAGE_READONLY : PAGE_NOACCESS;
+}
+
+uint64_t GetTickCount64() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+bool ReadProcessMaps(pid_t pid, std::vector<ProcessMapsEntry>* entries) {
+	char mapsPath[64];
+	char line[PATH_MAX + 128];
+	snprintf(mapsPath, sizeof(mapsPath), "/proc/%d/maps", pid);
+	FILE* maps = fopen(mapsPath, "r");
+	if (maps == nullptr) {
+		return false;
+	}
+	while (fgets(line, sizeof(line), maps)) {
+		ProcessMapsEntry entry;
+		char perms[8] = { 0 };
+		int pathStart = 0;
+		unsigned long long start, end, offset;
+		if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perms, &offset, &pathStart) < 4) {
+			continue;
+		}
+		entry.start		= (size_t)start;
+		entry.end		= (size_t)end;
+		entry.offset	= (size_t)offset;
+		entry.prot		= (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) | (perms[2] == 'x' ? PROT_EXEC : 0);
+		entry.shared	= perms[3] == 's';
+		if (pathStart > 0) {
+			entry.path = line + pathStart;
+			while (!entry.path.empty() && (entry.path.back() == '\n' || entry.path.back() == ' ')) {
+				entry.path.pop_back();
+			}
+		}
+		entries->push_back(entry);
+	}
+	fclose(maps);
+	return true;
+}
+#endif // __linux__
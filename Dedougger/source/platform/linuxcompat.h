@@ -0,0 +1,433 @@
+#pragma once
+//
+// Linux compatibility layer.  The debugger core, the breakpoint code and the callbacks handed to
+// fuzzers all speak Win32 (DEBUG_EVENT, CONTEXT, HANDLE, PAGE_* protections).  Rather than fork every
+// one of those signatures we define the subset of the Win32 types we use here, with the same field
+// names and values, and have the ptrace backend translate into them.
+//
+// Handles on Linux are not kernel objects: a process handle is the pid and a thread handle is the
+// tid, both cast to HANDLE.  CloseHandle on them is a no-op.
+//
+#ifndef _WIN32
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <wchar.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) && !defined(_AMD64_)
+#define _AMD64_
+#endif
+
+//
+// Scalar types
+//
+typedef uint8_t		BYTE;
+typedef uint16_t	WORD;
+typedef uint32_t	DWORD;
+typedef uint64_t	DWORD64;
+typedef int32_t		LONG;
+typedef uint32_t	ULONG;
+typedef int64_t		LONG64;
+typedef uint64_t	ULONG64;
+typedef uintptr_t	ULONG_PTR;
+typedef size_t		SIZE_T;
+typedef int			BOOL;
+typedef char		TCHAR;
+typedef char		CHAR;
+typedef wchar_t		WCHAR;
+typedef void*		HANDLE;
+typedef void*		PVOID;
+typedef void*		LPVOID;
+typedef const void*	LPCVOID;
+typedef DWORD*		PDWORD;
+typedef SIZE_T*		PSIZE_T;
+typedef HANDLE*		PHANDLE;
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#define INVALID_HANDLE_VALUE	((HANDLE)(intptr_t)-1)
+#define MAX_PATH				260
+#define INFINITE				0xFFFFFFFF
+#define _T(x)					x
+#define TEXT(x)					x
+#define _Out_opt_
+#define _In_
+
+#define ERROR_SUCCESS			0
+
+//
+// Access rights.  Accepted and ignored - ptrace access is all or nothing.
+//
+#define PROCESS_ALL_ACCESS		0x1FFFFF
+#define THREAD_ALL_ACCESS		0x1FFFFF
+#define THREAD_TERMINATE		0x0001
+#define THREAD_SUSPEND_RESUME	0x0002
+#define THREAD_GET_CONTEXT		0x0008
+#define THREAD_SET_CONTEXT		0x0010
+#define THREAD_QUERY_INFORMATION	0x0040
+#define THREAD_QUERY_LIMITED_INFORMATION	0x0800
+#define DUPLICATE_SAME_ACCESS	0x0002
+
+#define STILL_ACTIVE			259
+
+//
+// Page protections.  Values match winnt.h so code that switches on them works unchanged.
+//
+#define PAGE_NOACCESS			0x01
+#define PAGE_READONLY			0x02
+#define PAGE_READWRITE			0x04
+#define PAGE_WRITECOPY			0x08
+#define PAGE_EXECUTE			0x10
+#define PAGE_EXECUTE_READ		0x20
+#define PAGE_EXECUTE_READWRITE	0x40
+#define PAGE_EXECUTE_WRITECOPY	0x80
+#define PAGE_GUARD				0x100
+#define PAGE_NOCACHE			0x200
+#define PAGE_WRITECOMBINE		0x400
+
+//
+// Memory states and types reported by VirtualQueryEx
+//
+#define MEM_COMMIT				0x00001000
+#define MEM_RESERVE				0x00002000
+#define MEM_DECOMMIT			0x00004000
+#define MEM_RELEASE				0x00008000
+#define MEM_FREE				0x00010000
+#define MEM_PRIVATE				0x00020000
+#define MEM_MAPPED				0x00040000
+#define MEM_IMAGE				0x01000000
+
+//
+// Debug event codes
+//
+#define EXCEPTION_DEBUG_EVENT		1
+#define CREATE_THREAD_DEBUG_EVENT	2
+#define CREATE_PROCESS_DEBUG_EVENT	3
+#define EXIT_THREAD_DEBUG_EVENT		4
+#define EXIT_PROCESS_DEBUG_EVENT	5
+#define LOAD_DLL_DEBUG_EVENT		6
+#define UNLOAD_DLL_DEBUG_EVENT		7
+#define OUTPUT_DEBUG_STRING_EVENT	8
+#define RIP_EVENT					9
+
+//
+// Exception codes.  Signals that have no Win32 equivalent are reported as
+// LINUX_SIGNAL_EXCEPTION(signo) so they still pass through the default
+// first-chance handling and get delivered to the target.
+//
+#define EXCEPTION_ACCESS_VIOLATION		0xC0000005
+#define EXCEPTION_IN_PAGE_ERROR			0xC0000006
+#define EXCEPTION_ILLEGAL_INSTRUCTION	0xC000001D
+#define EXCEPTION_INT_DIVIDE_BY_ZERO	0xC0000094
+#define EXCEPTION_BREAKPOINT			0x80000003
+#define EXCEPTION_SINGLE_STEP			0x80000004
+#define LINUX_SIGNAL_EXCEPTION(signo)	(0xE0000000 | (DWORD)(signo))
+#define EXCEPTION_MAXIMUM_PARAMETERS	15
+
+//
+// Continue statuses
+//
+#define DBG_EXCEPTION_HANDLED		0x00010001
+#define DBG_CONTINUE				0x00010002
+#define DBG_EXCEPTION_NOT_HANDLED	0x80010001
+
+struct EXCEPTION_RECORD {
+	DWORD				ExceptionCode;
+	DWORD				ExceptionFlags;
+	EXCEPTION_RECORD*	ExceptionRecord;
+	PVOID				ExceptionAddress;
+	DWORD				NumberParameters;
+	ULONG_PTR			ExceptionInformation[EXCEPTION_MAXIMUM_PARAMETERS];
+};
+
+struct EXCEPTION_DEBUG_INFO {
+	EXCEPTION_RECORD	ExceptionRecord;
+	DWORD				dwFirstChance;
+};
+
+struct CREATE_THREAD_DEBUG_INFO {
+	HANDLE	hThread;
+	LPVOID	lpThreadLocalBase;
+	LPVOID	lpStartAddress;
+};
+
+struct CREATE_PROCESS_DEBUG_INFO {
+	HANDLE	hFile;
+	HANDLE	hProcess;
+	HANDLE	hThread;
+	LPVOID	lpBaseOfImage;
+	DWORD	dwDebugInfoFileOffset;
+	DWORD	nDebugInfoSize;
+	LPVOID	lpThreadLocalBase;
+	LPVOID	lpStartAddress;
+	LPVOID	lpImageName;
+	WORD	fUnicode;
+};
+
+struct EXIT_THREAD_DEBUG_INFO {
+	DWORD dwExitCode;
+};
+
+struct EXIT_PROCESS_DEBUG_INFO {
+	DWORD dwExitCode;
+};
+
+//
+// lpImageName is debugger-local on Linux (it points at the backend's copy of the
+// path, not into the target) - use DebugBackend::GetImageName to read it.
+//
+struct LOAD_DLL_DEBUG_INFO {
+	HANDLE	hFile;
+	LPVOID	lpBaseOfDll;
+	DWORD	dwDebugInfoFileOffset;
+	DWORD	nDebugInfoSize;
+	LPVOID	lpImageName;
+	WORD	fUnicode;
+};
+
+struct UNLOAD_DLL_DEBUG_INFO {
+	LPVOID lpBaseOfDll;
+};
+
+struct OUTPUT_DEBUG_STRING_INFO {
+	char*	lpDebugStringData;
+	WORD	fUnicode;
+	WORD	nDebugStringLength;
+};
+
+struct RIP_INFO {
+	DWORD dwError;
+	DWORD dwType;
+};
+
+struct DEBUG_EVENT {
+	DWORD dwDebugEventCode;
+	DWORD dwProcessId;
+	DWORD dwThreadId;
+	union {
+		EXCEPTION_DEBUG_INFO		Exception;
+		CREATE_THREAD_DEBUG_INFO	CreateThread;
+		CREATE_PROCESS_DEBUG_INFO	CreateProcessInfo;
+		EXIT_THREAD_DEBUG_INFO		ExitThread;
+		EXIT_PROCESS_DEBUG_INFO		ExitProcess;
+		LOAD_DLL_DEBUG_INFO			LoadDll;
+		UNLOAD_DLL_DEBUG_INFO		UnloadDll;
+		OUTPUT_DEBUG_STRING_INFO	DebugString;
+		RIP_INFO					RipInfo;
+	} u;
+};
+
+//
+// Thread context.  Field names and flag values follow the AMD64 CONTEXT so CONTEXTREGISTER
+// offsets and every GetRegisterValue/SetRegisterValue call work as-is.  FltSave has the FXSAVE
+// layout, which is also what PTRACE_GETFPREGS returns.
+//
+#define CONTEXT_AMD64				0x00100000
+#define CONTEXT_CONTROL				(CONTEXT_AMD64 | 0x01)
+#define CONTEXT_INTEGER				(CONTEXT_AMD64 | 0x02)
+#define CONTEXT_SEGMENTS			(CONTEXT_AMD64 | 0x04)
+#define CONTEXT_FLOATING_POINT		(CONTEXT_AMD64 | 0x08)
+#define CONTEXT_DEBUG_REGISTERS		(CONTEXT_AMD64 | 0x10)
+#define CONTEXT_FULL				(CONTEXT_CONTROL | CONTEXT_INTEGER | CONTEXT_FLOATING_POINT)
+#define CONTEXT_ALL					(CONTEXT_CONTROL | CONTEXT_INTEGER | CONTEXT_SEGMENTS | CONTEXT_FLOATING_POINT | CONTEXT_DEBUG_REGISTERS)
+
+struct M128A {
+	ULONG64	Low;
+	LONG64	High;
+};
+
+struct XMM_SAVE_AREA32 {
+	WORD	ControlWord;
+	WORD	StatusWord;
+	BYTE	TagWord;
+	BYTE	Reserved1;
+	WORD	ErrorOpcode;
+	DWORD	ErrorOffset;
+	WORD	ErrorSelector;
+	WORD	Reserved2;
+	DWORD	DataOffset;
+	WORD	DataSelector;
+	WORD	Reserved3;
+	DWORD	MxCsr;
+	DWORD	MxCsr_Mask;
+	M128A	FloatRegisters[8];
+	M128A	XmmRegisters[16];
+	BYTE	Reserved4[96];
+};
+static_assert(sizeof(XMM_SAVE_AREA32) == 512, "XMM_SAVE_AREA32 must match the FXSAVE layout");
+
+struct CONTEXT {
+	DWORD64 P1Home;
+	DWORD64 P2Home;
+	DWORD64 P3Home;
+	DWORD64 P4Home;
+	DWORD64 P5Home;
+	DWORD64 P6Home;
+
+	DWORD	ContextFlags;
+	DWORD	MxCsr;
+
+	WORD	SegCs;
+	WORD	SegDs;
+	WORD	SegEs;
+	WORD	SegFs;
+	WORD	SegGs;
+	WORD	SegSs;
+	DWORD	EFlags;
+
+	DWORD64 Dr0;
+	DWORD64 Dr1;
+	DWORD64 Dr2;
+	DWORD64 Dr3;
+	DWORD64 Dr6;
+	DWORD64 Dr7;
+
+	DWORD64 Rax;
+	DWORD64 Rcx;
+	DWORD64 Rdx;
+	DWORD64 Rbx;
+	DWORD64 Rsp;
+	DWORD64 Rbp;
+	DWORD64 Rsi;
+	DWORD64 Rdi;
+	DWORD64 R8;
+	DWORD64 R9;
+	DWORD64 R10;
+	DWORD64 R11;
+	DWORD64 R12;
+	DWORD64 R13;
+	DWORD64 R14;
+	DWORD64 R15;
+
+	DWORD64 Rip;
+
+	XMM_SAVE_AREA32 FltSave;
+
+	//
+	// Linux only - the segment bases live outside the selectors here
+	//
+	DWORD64 FsBase;
+	DWORD64 GsBase;
+
+	DWORD64 DebugControl;
+	DWORD64 LastBranchToRip;
+	DWORD64 LastBranchFromRip;
+	DWORD64 LastExceptionToRip;
+	DWORD64 LastExceptionFromRip;
+};
+typedef CONTEXT* PCONTEXT;
+
+//
+// XSAVE state components, numbered as in XCR0 and LocateXStateFeature
+//
+#define XSTATE_LEGACY_FLOATING_POINT	0
+#define XSTATE_LEGACY_SSE				1
+#define XSTATE_AVX						2
+#define XSTATE_AVX512_KMASK				5
+#define XSTATE_AVX512_ZMM_H				6
+#define XSTATE_AVX512_ZMM				7
+
+struct MEMORY_BASIC_INFORMATION {
+	PVOID	BaseAddress;
+	PVOID	AllocationBase;
+	DWORD	AllocationProtect;
+	WORD	PartitionId;
+	SIZE_T	RegionSize;
+	DWORD	State;
+	DWORD	Protect;
+	DWORD	Type;
+};
+typedef MEMORY_BASIC_INFORMATION* PMEMORY_BASIC_INFORMATION;
+
+//
+// String helpers
+//
+#define _stricmp	strcasecmp
+#define _strcmpi	strcasecmp
+#define _strnicmp	strncasecmp
+#define _wcsicmp	wcscasecmp
+#define _tcsdup		strdup
+#define _tcscmp		strcmp
+
+template <size_t N>
+inline int strncpy_s(char (&dest)[N], const char* src, size_t count) {
+	size_t len = strnlen(src, count < N - 1 ? count : N - 1);
+	memcpy(dest, src, len);
+	dest[len] = '\0';
+	return 0;
+}
+
+//
+// Win32 process/thread/memory functions, implemented in linuxcompat.cpp on top of ptrace and
+// /proc/<pid>/mem.  Anything that has to run code in the target (VirtualProtectEx, VirtualAllocEx,
+// VirtualFreeEx) goes through the
+// LinuxDebugBackend that is tracing the process, so it must be called while the target is stopped
+// in a debug event - which is the only place the fuzzer calls it from anyway.
+//
+HANDLE	OpenProcess(DWORD desiredAccess, BOOL inheritHandle, DWORD processId);
+HANDLE	OpenThread(DWORD desiredAccess, BOOL inheritHandle, DWORD threadId);
+BOOL	CloseHandle(HANDLE handle);
+DWORD	GetLastError();
+BOOL	ReadProcessMemory(HANDLE process, LPCVOID baseAddress, LPVOID buffer, SIZE_T size, SIZE_T* bytesRead);
+BOOL	WriteProcessMemory(HANDLE process, LPVOID baseAddress, LPCVOID buffer, SIZE_T size, SIZE_T* bytesWritten);
+BOOL	VirtualProtectEx(HANDLE process, LPVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect);
+LPVOID	VirtualAllocEx(HANDLE process, LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect);
+BOOL	VirtualFreeEx(HANDLE process, LPVOID address, SIZE_T size, DWORD freeType);
+SIZE_T	VirtualQueryEx(HANDLE process, LPCVOID address, PMEMORY_BASIC_INFORMATION buffer, SIZE_T length);
+BOOL	GetThreadContext(HANDLE thread, CONTEXT* context);
+BOOL	SetThreadContext(HANDLE thread, const CONTEXT* context);
+/* Time the thread has spent on a CPU, from /proc/<tid>/schedstat.  It's in nanoseconds rather than cycles,
+ * which doesn't matter for the only thing it's good for: telling whether a thread ran in between two calls.
+ */
+BOOL	QueryThreadCycleTime(HANDLE thread, ULONG64* cycleTime);
+/* A thread handle is its tid, so GetThreadId is the identity and DuplicateHandle hands back the same value.
+ * SuspendThread/ResumeThread keep a stopped thread stopped across ContinueDebugEvent and let it go again -
+ * they only work on a thread the backend has stopped, which is any thread while the target is in a debug
+ * event.  TerminateThread makes the thread exit through an injected exit syscall.
+ */
+HANDLE	GetCurrentProcess();
+BOOL	DuplicateHandle(HANDLE sourceProcess, HANDLE sourceHandle, HANDLE targetProcess, PHANDLE targetHandle,
+	DWORD desiredAccess, BOOL inheritHandle, DWORD options);
+DWORD	GetThreadId(HANDLE thread);
+DWORD	SuspendThread(HANDLE thread);
+DWORD	ResumeThread(HANDLE thread);
+BOOL	TerminateThread(HANDLE thread, DWORD exitCode);
+BOOL	GetExitCodeThread(HANDLE thread, PDWORD exitCode);
+
+//
+// Protection conversion helpers used by the compat layer and the backend
+//
+int		PageProtectionToProt(DWORD protect);
+DWORD	ProtToPageProtection(int prot);
+
+uint64_t	GetTickCount64();
+
+//
+// One line of /proc/<pid>/maps.  This is the Linux counterpart of a VirtualQueryEx region and what
+// the backend and VirtualQueryEx are built on.
+//
+struct ProcessMapsEntry {
+	size_t		start;
+	size_t		end;
+	int			prot;		// PROT_* bits
+	bool		shared;		// 's' in the permissions column, otherwise a private/copy-on-write mapping
+	size_t		offset;
+	std::string	path;		// backing file, [heap]/[stack]/[vdso] etc. or empty for anonymous memory
+};
+
+bool	ReadProcessMaps(pid_t pid, std::vector<ProcessMapsEntry>* entries);
+/* Describes a whole maps entry the way VirtualQueryEx would */
+void	MapsEntryToMemoryInfo(const ProcessMapsEntry& entry, PMEMORY_BASIC_INFORMATION buffer);
+
+#endif // !_WIN32
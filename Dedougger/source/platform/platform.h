@@ -0,0 +1,11 @@
+#pragma once
+//
+// Single point of inclusion for the OS headers.  The debugger core is written against the Win32
+// types (DEBUG_EVENT, CONTEXT, HANDLE etc.), so on Windows this is just Windows.h and on Linux it
+// pulls in the small compatibility layer that defines those types on top of ptrace.
+//
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include "platform/linuxcompat.h"
+#endif
@@ -0,0 +1,340 @@
+#include "RegisterFile.hpp"
+#include <string.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+#ifdef __linux__
+#include <cpuid.h>
+#include "backend/LinuxDebugBackend.hpp"
+#endif
+
+namespace dedougger {
+
+	namespace {
+		const uint64_t FINGERPRINT_SEED = 0xcbf29ce484222325;
+		const uint64_t FINGERPRINT_PRIME = 0x100000001b3;
+
+		//
+		// FNV-1a over eight bytes at a time, which is plenty for telling register states apart
+		//
+		uint64_t HashBytes(uint64_t hash, const void* data, size_t size) {
+			const uint8_t* bytes = (const uint8_t*)data;
+			for (; size >= sizeof(uint64_t); bytes += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+				uint64_t word;
+				memcpy(&word, bytes, sizeof(word));
+				hash = (hash ^ word) * FINGERPRINT_PRIME;
+			}
+			for (; size > 0; bytes++, size--) {
+				hash = (hash ^ *bytes) * FINGERPRINT_PRIME;
+			}
+			return hash;
+		}
+
+		//
+		// The standard (non-compacted) XSAVE layout: the FXSAVE image, the header with XSTATE_BV, then every
+		// component at the offset CPUID leaf 0xD gives for it
+		//
+		const size_t XSAVE_LEGACY_SIZE = 512;
+		const size_t XSAVE_HEADER_SIZE = 64;
+
+		/* Finds where an XSAVE component above SSE lives in the standard layout
+			Returns:
+				false if the CPU doesn't have the component
+		 */
+		bool LocateComponent(DWORD feature, size_t* offset, size_t* size) {
+			unsigned int eax, ebx, ecx, edx;
+#ifdef _WIN32
+			int registers[4];
+			__cpuidex(registers, 0xD, (int)feature);
+			eax = (unsigned int)registers[0];
+			ebx = (unsigned int)registers[1];
+#else
+			if (!__get_cpuid_count(0xD, feature, &eax, &ebx, &ecx, &edx)) {
+				return false;
+			}
+#endif
+			*size = eax;
+			*offset = ebx;
+			return eax != 0;
+		}
+	}
+
+	/* Hashes MxCsr through the end of FltSave - the segment, flags, debug, integer and control registers and the
+		legacy x87/SSE state, but not ContextFlags - and then the XSAVE components above SSE
+	 */
+	void RegisterFile::UpdateFingerprint() {
+		const CONTEXT* context = this->GetContext();
+		const uint8_t* start = (const uint8_t*)&context->MxCsr;
+		const uint8_t* end = (const uint8_t*)&context->FltSave + sizeof(context->FltSave);
+		uint64_t hash = HashBytes(FINGERPRINT_SEED, start, end - start);
+#ifdef _WIN32
+		DWORD64 features = 0;
+		if ((context->ContextFlags & CONTEXT_XSTATE) == CONTEXT_XSTATE && GetXStateFeaturesMask((PCONTEXT)context, &features)) {
+			hash = HashBytes(hash, &features, sizeof(features));
+			for (DWORD feature = XSTATE_AVX; feature < 64; feature++) {
+				DWORD length = 0;
+				const void* state = (features >> feature) & 1 ? LocateXStateFeature((PCONTEXT)context, feature, &length) : nullptr;
+				if (state != nullptr) {
+					hash = HashBytes(hash, state, length);
+				}
+			}
+		}
+#else
+		hash = HashBytes(hash, &context->FsBase, sizeof(context->FsBase));
+		hash = HashBytes(hash, &context->GsBase, sizeof(context->GsBase));
+		if (this->extendedState.size() > sizeof(context->FltSave)) {
+			hash = HashBytes(hash, this->extendedState.data() + sizeof(context->FltSave),
+				this->extendedState.size() - sizeof(context->FltSave));
+		}
+#endif
+		this->fingerprint = hash;
+	}
+
+#ifdef _WIN32
+	RegisterFile::RegisterFile() {
+		this->Initialize();
+	}
+
+	RegisterFile::RegisterFile(const RegisterFile& other) {
+		this->Initialize();
+		CopyContext(this->Context(), other.Context()->ContextFlags, (PCONTEXT)other.Context());
+		this->fingerprint = other.fingerprint;
+	}
+
+	RegisterFile& RegisterFile::operator=(const RegisterFile& other) {
+		if (this != &other) {
+			CopyContext(this->Context(), other.Context()->ContextFlags, (PCONTEXT)other.Context());
+			this->fingerprint = other.fingerprint;
+		}
+		return *this;
+	}
+
+	/* Lays out a context with room for every XSAVE feature the OS has enabled.  The CONTEXT and its XSAVE
+		area have alignment requirements of their own, which is why copies can't just copy the buffer.
+	 */
+	void RegisterFile::Initialize() {
+		DWORD64 features = GetEnabledXStateFeatures();
+		DWORD flags = CONTEXT_ALL;
+		if (features & ~XSTATE_MASK_LEGACY) {
+			flags |= CONTEXT_XSTATE;
+		}
+		DWORD length = 0;
+		InitializeContext(nullptr, flags, nullptr, &length);
+		this->buffer.resize(length);
+		CONTEXT* context = nullptr;
+		if (!InitializeContext(this->buffer.data(), flags, &context, &length)) {
+			//
+			// Fall back to a plain context, which still has the legacy FXSAVE area
+			//
+			this->buffer.assign(sizeof(CONTEXT) + 16, 0);
+			this->contextOffset = (16 - (size_t)this->buffer.data() % 16) % 16;
+			this->Context()->ContextFlags = CONTEXT_ALL;
+			return;
+		}
+		this->contextOffset = (uint8_t*)context - this->buffer.data();
+		if (flags & CONTEXT_XSTATE) {
+			SetXStateFeaturesMask(context, features & ~XSTATE_MASK_LEGACY);
+		}
+	}
+
+	bool RegisterFile::Capture(HANDLE thread) {
+		if (!GetThreadContext(thread, this->Context())) {
+			return false;
+		}
+		this->UpdateFingerprint();
+		return true;
+	}
+
+	bool RegisterFile::Restore(HANDLE thread) const {
+		return SetThreadContext(thread, this->Context()) != 0;
+	}
+
+	const CONTEXT* RegisterFile::GetContext() const {
+		return this->Context();
+	}
+
+	void RegisterFile::SetContext(const CONTEXT* context) {
+		CopyContext(this->Context(), context->ContextFlags & CONTEXT_ALL, (PCONTEXT)context);
+		this->UpdateFingerprint();
+	}
+
+	const void* RegisterFile::LocateFeature(DWORD feature, DWORD* length) const {
+		return LocateXStateFeature((PCONTEXT)this->Context(), feature, length);
+	}
+
+	/* Lays the context's FltSave and XSTATE components out as one XSAVE area in the standard layout, which is
+		what a snapshot file stores whatever OS wrote it
+	 */
+	void RegisterFile::GetExtendedState(std::vector<uint8_t>* state) const {
+		const CONTEXT* context = this->Context();
+		DWORD64 features = XSTATE_MASK_LEGACY;
+		state->assign(XSAVE_LEGACY_SIZE + XSAVE_HEADER_SIZE, 0);
+		memcpy(state->data(), &context->FltSave, XSAVE_LEGACY_SIZE);
+		if ((context->ContextFlags & CONTEXT_XSTATE) == CONTEXT_XSTATE && GetXStateFeaturesMask((PCONTEXT)context, &features)) {
+			features |= XSTATE_MASK_LEGACY;
+		}
+		for (DWORD feature = XSTATE_AVX; feature < 64; feature++) {
+			size_t offset = 0;
+			size_t size = 0;
+			DWORD length = 0;
+			const void* component = (features >> feature) & 1 ? LocateXStateFeature((PCONTEXT)context, feature, &length) : nullptr;
+			if (component == nullptr || !LocateComponent(feature, &offset, &size)) {
+				features &= ~(1ULL << feature);
+				continue;
+			}
+			state->resize(std::max(state->size(), offset + length), 0);
+			memcpy(state->data() + offset, component, length);
+		}
+		memcpy(state->data() + XSAVE_LEGACY_SIZE, &features, sizeof(features));
+	}
+
+	/* Takes the floating point and vector registers from an XSAVE area in the standard layout.  Components the
+		OS hasn't enabled for the context are dropped.
+		Returns:
+			false if the area is too small to hold the header
+	 */
+	bool RegisterFile::SetExtendedState(const void* state, size_t size) {
+		const uint8_t* area = (const uint8_t*)state;
+		CONTEXT* context = this->Context();
+		if (size < XSAVE_LEGACY_SIZE + XSAVE_HEADER_SIZE) {
+			return false;
+		}
+		memcpy(&context->FltSave, area, XSAVE_LEGACY_SIZE);
+		context->MxCsr = context->FltSave.MxCsr;
+		uint64_t features = 0;
+		memcpy(&features, area + XSAVE_LEGACY_SIZE, sizeof(features));
+		if ((context->ContextFlags & CONTEXT_XSTATE) == CONTEXT_XSTATE) {
+			features &= GetEnabledXStateFeatures() & ~XSTATE_MASK_LEGACY;
+			SetXStateFeaturesMask(context, features);
+			for (DWORD feature = XSTATE_AVX; feature < 64; feature++) {
+				size_t offset = 0;
+				size_t length = 0;
+				DWORD context_length = 0;
+				void* component = (features >> feature) & 1 ? LocateXStateFeature(context, feature, &context_length) : nullptr;
+				if (component != nullptr && LocateComponent(feature, &offset, &length) && offset + length <= size) {
+					memcpy(component, area + offset, std::min((size_t)context_length, length));
+				}
+			}
+		}
+		this->UpdateFingerprint();
+		return true;
+	}
+#else
+	RegisterFile::RegisterFile() {
+		memset(&this->context, 0, sizeof(this->context));
+		this->context.ContextFlags = CONTEXT_ALL;
+	}
+
+	RegisterFile::RegisterFile(const RegisterFile& other) = default;
+	RegisterFile& RegisterFile::operator=(const RegisterFile& other) = default;
+
+	bool RegisterFile::Capture(HANDLE thread) {
+		pid_t tid = (pid_t)(intptr_t)thread;
+		//
+		// The legacy region of the XSAVE area is an FXSAVE image, so the floating point registers come
+		// from there instead of a separate PTRACE_GETFPREGS
+		//
+		this->context.ContextFlags = (CONTEXT_ALL & ~CONTEXT_FLOATING_POINT) | CONTEXT_AMD64;
+		if (!LinuxDebugBackend::ReadThreadContext(tid, &this->context) ||
+			!LinuxDebugBackend::ReadExtendedState(tid, &this->extendedState)) {
+			this->context.ContextFlags = CONTEXT_ALL;
+			return false;
+		}
+		this->context.ContextFlags = CONTEXT_ALL;
+		memcpy(&this->context.FltSave, this->extendedState.data(), sizeof(this->context.FltSave));
+		this->context.MxCsr = this->context.FltSave.MxCsr;
+		this->UpdateFingerprint();
+		return true;
+	}
+
+	bool RegisterFile::Restore(HANDLE thread) const {
+		pid_t tid = (pid_t)(intptr_t)thread;
+		if (this->extendedState.empty()) {
+			return LinuxDebugBackend::WriteThreadContext(tid, &this->context);
+		}
+		CONTEXT general = this->context;
+		general.ContextFlags = (CONTEXT_ALL & ~CONTEXT_FLOATING_POINT) | CONTEXT_AMD64;
+		return LinuxDebugBackend::WriteThreadContext(tid, &general) &&
+			LinuxDebugBackend::WriteExtendedState(tid, this->extendedState);
+	}
+
+	const CONTEXT* RegisterFile::GetContext() const {
+		return &this->context;
+	}
+
+	void RegisterFile::SetContext(const CONTEXT* context) {
+		const size_t legacySize = sizeof(this->context.FltSave);
+		this->context = *context;
+		this->context.ContextFlags = CONTEXT_ALL;
+		this->context.FltSave.MxCsr = this->context.MxCsr;
+		if (this->extendedState.size() >= legacySize) {
+			memcpy(this->extendedState.data(), &this->context.FltSave, legacySize);
+		}
+		//
+		// Components whose XSTATE_BV bit is clear are loaded in their initial state, whatever the area
+		// holds, so mark x87 and SSE as in use for the new values to take
+		//
+		if (this->extendedState.size() >= legacySize + sizeof(uint64_t)) {
+			uint64_t xstateBv;
+			memcpy(&xstateBv, this->extendedState.data() + legacySize, sizeof(xstateBv));
+			xstateBv |= (1 << XSTATE_LEGACY_FLOATING_POINT) | (1 << XSTATE_LEGACY_SSE);
+			memcpy(this->extendedState.data() + legacySize, &xstateBv, sizeof(xstateBv));
+		}
+		this->UpdateFingerprint();
+	}
+
+	const void* RegisterFile::LocateFeature(DWORD feature, DWORD* length) const {
+		size_t offset = 0;
+		size_t size = sizeof(this->context.FltSave);
+		if (feature > XSTATE_LEGACY_SSE && !LocateComponent(feature, &offset, &size)) {
+			return nullptr;
+		}
+		if (offset + size > this->extendedState.size()) {
+			return nullptr;
+		}
+		if (length != nullptr) {
+			*length = (DWORD)size;
+		}
+		return this->extendedState.data() + offset;
+	}
+
+	void RegisterFile::GetExtendedState(std::vector<uint8_t>* state) const {
+		*state = this->extendedState;
+	}
+
+	/* Takes the floating point and vector registers from an XSAVE area in the standard layout.  PTRACE_SETREGSET
+		only takes an area of the size this CPU uses, so one written elsewhere is cut down or padded to the size
+		Capture found, and the components that didn't fit are left in their initial state.
+		Returns:
+			false if the area is too small to hold the header
+	 */
+	bool RegisterFile::SetExtendedState(const void* state, size_t size) {
+		if (size < XSAVE_LEGACY_SIZE + XSAVE_HEADER_SIZE) {
+			return false;
+		}
+		if (this->extendedState.empty()) {
+			this->extendedState.assign((const uint8_t*)state, (const uint8_t*)state + size);
+		}
+		else {
+			size = std::min(size, this->extendedState.size());
+			std::fill(std::copy((const uint8_t*)state, (const uint8_t*)state + size, this->extendedState.begin()),
+				this->extendedState.end(), 0);
+			uint64_t features = 0;
+			memcpy(&features, this->extendedState.data() + XSAVE_LEGACY_SIZE, sizeof(features));
+			for (DWORD feature = XSTATE_AVX; feature < 64; feature++) {
+				size_t offset = 0;
+				size_t length = 0;
+				if (((features >> feature) & 1) && (!LocateComponent(feature, &offset, &length) || offset + length > size)) {
+					features &= ~(1ULL << feature);
+				}
+			}
+			memcpy(this->extendedState.data() + XSAVE_LEGACY_SIZE, &features, sizeof(features));
+		}
+		memcpy(&this->context.FltSave, this->extendedState.data(), sizeof(this->context.FltSave));
+		this->context.MxCsr = this->context.FltSave.MxCsr;
+		this->UpdateFingerprint();
+		return true;
+	}
+#endif
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "platform/platform.h"
+
+namespace dedougger {
+	/**
+	 * RegisterFile - a snapshot of everything a thread keeps in registers: the general, segment and debug
+	 *	registers of a CONTEXT_ALL context plus the whole XSAVE area, so x87, SSE, AVX and AVX-512 state (where
+	 *	the CPU has it) survive a restore too.
+	 *
+	 *	On Windows the context is built with InitializeContext and CONTEXT_XSTATE for every feature
+	 *	GetEnabledXStateFeatures reports, so one Get/SetThreadContext moves all of it.  On Linux the XSAVE area
+	 *	comes from PTRACE_GETREGSET(NT_X86_XSTATE) next to the general registers, and its legacy region doubles
+	 *	as the context's FltSave.  Either way Capture and Restore are a single call per thread.
+	 *
+	 *	Methods:
+	 *		Capture(thread) - reads the thread's registers.  Returns false if the thread couldn't be read.
+	 *		Restore(thread) - writes them back, to the same thread or another one
+	 *		GetContext() - the captured context; its floating point fields match the XSAVE area
+	 *		SetContext(context) - replaces the general and floating point registers, e.g. with a context read
+	 *			from a snapshot file.  Vector state above XMM is kept.
+	 *		GetExtendedState(state)/SetExtendedState(state, size) - the floating point and vector registers as one
+	 *			XSAVE area in the standard (non-compacted) layout, the same on either OS.  Empty if nothing was
+	 *			captured.
+	 *		LocateFeature(feature, length) - the captured state of an XSAVE component (XSTATE_AVX etc.), or
+	 *			nullptr if it wasn't captured
+	 *		GetFingerprint() - a hash of every register the thread can change, updated by Capture and SetContext.
+	 *			Register files with the same fingerprint put a thread in the same state.
+	 */
+	class RegisterFile {
+#ifdef _WIN32
+		std::vector<uint8_t>	buffer;				// InitializeContext's buffer, holds the CONTEXT and its XSAVE area
+		size_t					contextOffset = 0;	// where InitializeContext aligned the CONTEXT in buffer
+
+		CONTEXT* Context() { return (CONTEXT*)(this->buffer.data() + this->contextOffset); }
+		const CONTEXT* Context() const { return (const CONTEXT*)(this->buffer.data() + this->contextOffset); }
+		void Initialize();
+#else
+		CONTEXT					context;
+		std::vector<uint8_t>	extendedState;		// XSAVE area in the standard layout, empty until captured
+#endif
+		uint64_t				fingerprint = 0;
+
+		void UpdateFingerprint();
+	public:
+		RegisterFile();
+		RegisterFile(const RegisterFile& other);
+		RegisterFile& operator=(const RegisterFile& other);
+
+		bool Capture(HANDLE thread);
+		bool Restore(HANDLE thread) const;
+		const CONTEXT* GetContext() const;
+		void SetContext(const CONTEXT* context);
+		const void* LocateFeature(DWORD feature, DWORD* length) const;
+		void GetExtendedState(std::vector<uint8_t>* state) const;
+		bool SetExtendedState(const void* state, size_t size);
+		uint64_t GetFingerprint() const { return this->fingerprint; }
+	};
+}
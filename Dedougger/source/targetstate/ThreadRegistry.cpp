@@ -0,0 +1,96 @@
+#include "ThreadRegistry.hpp"
+#include <stdio.h>
+#include "backend/DebugBackend.hpp"
+
+namespace dedougger {
+	ThreadRegistry::~ThreadRegistry() {
+		this->Clear();
+	}
+
+	/* Finds a thread's entry, creating it with a fresh handle if there's none
+	 */
+	RegisteredThread& ThreadRegistry::Insert(DWORD threadId) {
+		auto found = this->threads.find(threadId);
+		if (found == this->threads.end()) {
+			RegisteredThread thread = { 0 };
+			thread.threadId = threadId;
+			thread.handle = OpenThread(THREAD_ALL_ACCESS, false, threadId);
+			if (thread.handle == NULL) {
+				printf("Couldn't open registered thread %x\n", threadId);
+			}
+			found = this->threads.emplace(threadId, thread).first;
+		}
+		return found->second;
+	}
+
+	/* Registers a thread.  A thread that's already registered keeps its handle and only has its creation
+	 * details updated, since Seed can get to a thread before its creation event does.
+		Args:
+			threadId - the new thread
+			startAddress - lpStartAddress of its creation event
+			localBase - lpThreadLocalBase of its creation event
+		Returns:
+			The thread's entry
+	 */
+	const RegisteredThread& ThreadRegistry::Add(DWORD threadId, size_t startAddress, size_t localBase) {
+		RegisteredThread& thread = this->Insert(threadId);
+		thread.startAddress = startAddress;
+		thread.localBase = localBase;
+		return thread;
+	}
+
+	void ThreadRegistry::Remove(DWORD threadId) {
+		auto found = this->threads.find(threadId);
+		if (found == this->threads.end()) {
+			return;
+		}
+		if (found->second.handle != NULL) {
+			CloseHandle(found->second.handle);
+		}
+		this->threads.erase(found);
+	}
+
+	void ThreadRegistry::Clear() {
+		for (auto& thread : this->threads) {
+			if (thread.second.handle != NULL) {
+				CloseHandle(thread.second.handle);
+			}
+		}
+		this->threads.clear();
+	}
+
+	/* Registers every thread the backend enumerates that isn't registered yet.  Creation events make this
+	 * unnecessary, it's only for a registry that started late.
+		Args:
+			backend - the backend debugging the process
+		Returns:
+			Number of threads added
+	 */
+	size_t ThreadRegistry::Seed(DebugBackend* backend) {
+		std::vector<DWORD> threadIds;
+		size_t added = 0;
+		if (!backend->EnumerateThreads(&threadIds)) {
+			return 0;
+		}
+		for (DWORD threadId : threadIds) {
+			if (this->threads.find(threadId) != this->threads.end()) {
+				continue;
+			}
+			this->Insert(threadId);
+			added++;
+		}
+		return added;
+	}
+
+	const RegisteredThread* ThreadRegistry::Find(DWORD threadId) const {
+		auto found = this->threads.find(threadId);
+		return found == this->threads.end() ? nullptr : &found->second;
+	}
+
+	void ThreadRegistry::GetThreadIds(std::vector<DWORD>* threadIds) const {
+		threadIds->reserve(threadIds->size() + this->threads.size());
+		for (auto& thread : this->threads) {
+			threadIds->push_back(thread.first);
+		}
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include "platform/platform.h"
+
+namespace dedougger {
+	class DebugBackend;
+
+	struct RegisteredThread {
+		DWORD	threadId;
+		HANDLE	handle;			// opened by the registry, valid for as long as the thread is registered
+		size_t	startAddress;	// where the thread started, from its creation event
+		size_t	localBase;		// TEB on Windows, fs base on Linux
+	};
+
+	/**
+	 * ThreadRegistry - the threads of the debugged process, kept up to date from thread create and exit debug
+	 *	events (PTRACE_O_TRACECLONE on Linux) instead of asking the OS every time.  Listing them costs as much as
+	 *	the target has threads, where a Toolhelp snapshot walks every thread on the machine.
+	 *
+	 *	The Dedougger owns it and feeds it; anything else that needs the target's threads - ThreadRestorerEx, the
+	 *	StateFuzzer - reads it through Dedougger::Threads().  Each thread comes with a handle the registry opened
+	 *	for it, so users don't have to open their own for every access.
+	 *
+	 *	Methods:
+	 *		Add(threadId, startAddress, localBase) - registers a thread from its creation event
+	 *		Remove(threadId) - forgets a thread that exited and closes its handle
+	 *		Clear() - forgets every thread, when the process exits
+	 *		Seed(backend) - registers the threads the backend enumerates that we missed the creation of.  Their
+	 *			start address and local base are unknown (0).
+	 *		Find(threadId) - the thread's entry, or nullptr if it isn't registered
+	 *		GetThreadIds(threadIds) - appends the IDs of the registered threads, in ID order
+	 *		Count() - number of registered threads
+	 *		begin()/end() - iterate the threads by ID
+	 */
+	class ThreadRegistry {
+		std::map<DWORD, RegisteredThread> threads;
+
+		RegisteredThread& Insert(DWORD threadId);
+	public:
+		typedef std::map<DWORD, RegisteredThread>::const_iterator const_iterator;
+
+		ThreadRegistry() {}
+		~ThreadRegistry();
+		ThreadRegistry(const ThreadRegistry&) = delete;
+		ThreadRegistry& operator=(const ThreadRegistry&) = delete;
+
+		const RegisteredThread& Add(DWORD threadId, size_t startAddress, size_t localBase);
+		void Remove(DWORD threadId);
+		void Clear();
+		size_t Seed(DebugBackend* backend);
+		const RegisteredThread* Find(DWORD threadId) const;
+		void GetThreadIds(std::vector<DWORD>* threadIds) const;
+		size_t Count() const { return this->threads.size(); }
+		const_iterator begin() const { return this->threads.begin(); }
+		const_iterator end() const { return this->threads.end(); }
+	};
+}
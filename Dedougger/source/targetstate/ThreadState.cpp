@@ -7,14 +7,17 @@ The caller must take care to know the actual size of the register they're reques
 */
 
 void ThreadState::PullThreadContext() {
-	if (this->threadHandle == INVALID_HANDLE_VALUE) {
+	if (this->threadHandle == INVALID_HANDLE_VALUE || this->threadHandle == NULL) {
+		//
+		// Only a handle we opened is ours to close, ones we were given belong to the caller (e.g. the ThreadRegistry)
+		//
 		this->threadHandle = OpenThread(THREAD_ALL_ACCESS, false, this->threadId);
+		this->ownThreadHandle = this->threadHandle != NULL;
 	}
 	int result = GetThreadContext(this->threadHandle, &this->threadContext);
 	if (!result) {
 		throw(GetThreadContextFailureException());
 	}
-	this->ownThreadHandle = true;
 	this->contextRead = true;
 }
 
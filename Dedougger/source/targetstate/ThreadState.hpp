@@ -1,7 +1,7 @@
 #pragma once
 #include <exception>
 #include <stdint.h>
-#include <Windows.h>
+#include "platform/platform.h"
 #include "breakpoints/HwbpDescriptor.h"
 
 
@@ -68,7 +68,7 @@ enum CONTEXTREGISTER {
 	LASTEXCEPTIONFROMRIP = offsetof(CONTEXT, LastExceptionFromRip),
 	
 	//
-	// Floating point registers left out for now TODO
+	// Floating point and vector registers left out, RegisterFile snapshots them along with the rest
 	//
 
 #endif // _AMD64_
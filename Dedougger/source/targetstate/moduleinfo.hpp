@@ -1,6 +1,16 @@
 #pragma once
+#include <memory>
 #include <string>
-#include "targetstate\peinfo.hpp"
+#include "platform/platform.h"
+#ifdef _WIN32
+#include "targetstate/PEInfo.hpp"
+#else
+//
+// PE parsing only applies to Windows images
+//
+class PEInfoEx;
+typedef std::shared_ptr<PEInfoEx> SP_PEInfoEx;
+#endif
 namespace dedougger {
 	class ModuleInfo {
 		std::string path;
@@ -13,18 +23,22 @@ namespace dedougger {
 		}
 
 		ModuleInfo(size_t baseAddress, std::string filePath, HANDLE processHandle) {
-			size_t pathIndex = filePath.find_first_of("\\\\?\\");
-			if (pathIndex != std::string::npos) {
-				this->path = filePath.substr(pathIndex + 4);
+			//
+			// Strip the \\?\ prefix GetFinalPathNameByHandle puts on Windows paths
+			//
+			if (filePath.compare(0, 4, "\\\\?\\") == 0) {
+				this->path = filePath.substr(4);
 			}
 			else {
-				this->path = filePath.substr(pathIndex);
+				this->path = filePath;
 			}
 			this->base = baseAddress;
 
-			size_t moduleNameIndex = this->path.find_last_of('\\') + 1;
+			size_t moduleNameIndex = this->path.find_last_of("\\/") + 1;
 			this->name = this->path.substr(moduleNameIndex);
+#ifdef _WIN32
 			this->module = std::make_shared<PEInfoEx>(this->base, processHandle);
+#endif
 		}
 
 		ModuleInfo(ModuleInfo& other) {
@@ -50,6 +64,7 @@ namespace dedougger {
 		}
 
 		const std::string GetModuleName() const { return this->name; }
+		const std::string GetModulePath() const { return this->path; }
 		const size_t GetModuleBaseAddress() const { return this->base; };
 		const SP_PEInfoEx GetPEInfo() const { return this->module; }
 	};
@@ -0,0 +1,16 @@
+#pragma once
+#include <stddef.h>
+
+namespace dedougger {
+	/**
+	 * Micro-benchmarks for the state restoration hot paths.  They run in-process against synthetic data,
+	 * print their results and return 0 on success, so the harness can run them from the command line.
+	 *
+	 *	benchmark_page_index(page_count, lookups) - PageIndex lookups per second against std::map with
+	 *		page_count tracked pages, and the time to insert a 64 MB region below them page by page and as a run
+	 *	benchmark_parallel_restore(max_workers, megabytes) - restore throughput of a RestoreWorkerPool with 1 to
+	 *		max_workers threads, for picking PageRestorerEx::set_restore_workers
+	 */
+	int benchmark_page_index(size_t page_count, size_t lookups);
+	int benchmark_parallel_restore(size_t max_workers, size_t megabytes);
+}
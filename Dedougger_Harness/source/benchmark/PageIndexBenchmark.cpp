@@ -0,0 +1,126 @@
+#include "Benchmark.hpp"
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <map>
+#include <random>
+#include <vector>
+#include "pagerestorer/PageIndex.hpp"
+
+namespace dedougger {
+
+	/* Measures how many fault lookups per second PageIndex and the std::map it replaced manage, and how long
+	 * saving a new region below every tracked page takes inserting page by page and as one run
+		Args:
+			page_count - number of tracked pages, spread over regions of 1 to 256 pages with gaps between
+			lookups - number of lookups timed per container
+		Returns:
+			0, or 1 if the two containers disagree on an answer or the two ways of inserting on the index
+	 */
+	int benchmark_page_index(size_t page_count, size_t lookups) {
+		std::mt19937_64 random(0x5EED);
+		PageRegion region = { 0 };
+		std::vector<PageBackupEx> backups;
+		std::vector<LPVOID> probes;
+		PageIndex index;
+		std::map<LPVOID, PageBackupEx*> map;
+
+		//
+		// Lay the pages out the way a process looks: runs of pages with holes between them
+		//
+		backups.reserve(page_count);
+		size_t address = 0x10000000;
+		while (backups.size() < page_count) {
+			size_t run = 1 + random() % 256;
+			for (size_t i = 0; i < run && backups.size() < page_count; i++) {
+				backups.emplace_back((PVOID)address, &region, nullptr, false);
+				address += PageBackupEx::BACKUP_PAGE_SIZE;
+			}
+			address += PageBackupEx::BACKUP_PAGE_SIZE * (1 + random() % 64);
+		}
+		index.reserve(page_count);
+		for (PageBackupEx& backup : backups) {
+			index.insert(backup.get_page_address(), &backup);
+			map[backup.get_page_address()] = &backup;
+		}
+
+		//
+		// Fault addresses land anywhere in a page, and one in eight misses every tracked page
+		//
+		probes.reserve(lookups);
+		for (size_t i = 0; i < lookups; i++) {
+			if (random() % 8 == 0) {
+				probes.push_back((LPVOID)(random() % (address + 0x100000)));
+			}
+			else {
+				size_t page = (size_t)backups[random() % page_count].get_page_address();
+				probes.push_back((LPVOID)(page + random() % PageBackupEx::BACKUP_PAGE_SIZE));
+			}
+		}
+
+		uintptr_t index_checksum = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (LPVOID probe : probes) {
+			index_checksum += (uintptr_t)index.find(probe);
+		}
+		double index_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		//
+		// What touch_address used to do: the last page starting at or below the address, if it covers it
+		//
+		uintptr_t map_checksum = 0;
+		start = std::chrono::steady_clock::now();
+		for (LPVOID probe : probes) {
+			auto found = map.upper_bound(probe);
+			if (found == map.begin()) {
+				continue;
+			}
+			found--;
+			if (found->second->get_page_last_byte() > probe) {
+				map_checksum += (uintptr_t)found->second;
+			}
+		}
+		double map_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		printf("page index benchmark: %zu pages, %zu lookups\n", page_count, lookups);
+		printf("  PageIndex:  %12.0f lookups/sec\n", lookups / index_seconds);
+		printf("  std::map:   %12.0f lookups/sec\n", lookups / map_seconds);
+		if (index_checksum != map_checksum) {
+			printf("  lookup results differ!\n");
+			return 1;
+		}
+
+		//
+		// A 64 MB mmap landing below everything, the way push_state saves a top-down allocation
+		//
+		const size_t region_pages = 0x4000;
+		std::vector<PageBackupEx> region_backups;
+		std::vector<PageBackupEx*> run;
+		region_backups.reserve(region_pages);
+		for (size_t i = 0; i < region_pages; i++) {
+			region_backups.emplace_back((PVOID)(0x10000 + i * PageBackupEx::BACKUP_PAGE_SIZE), &region, nullptr, false);
+			run.push_back(&region_backups.back());
+		}
+		PageIndex by_page = index;
+		start = std::chrono::steady_clock::now();
+		for (PageBackupEx* page : run) {
+			by_page.insert(page->get_page_address(), page);
+		}
+		double by_page_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		PageIndex by_run = index;
+		start = std::chrono::steady_clock::now();
+		by_run.insert_run(run[0]->get_page_address(), run.data(), run.size());
+		double by_run_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		printf("  %zu page region inserted below the rest:\n", region_pages);
+		printf("  insert:     %12.3f ms\n", by_page_seconds * 1000);
+		printf("  insert_run: %12.3f ms\n", by_run_seconds * 1000);
+		for (size_t i = 0; i < by_run.size(); i++) {
+			if (by_run.page_at(i) != by_page.page_at(i) || by_run.address_at(i) != by_page.address_at(i)) {
+				printf("  inserted indexes differ!\n");
+				return 1;
+			}
+		}
+		return 0;
+	}
+}
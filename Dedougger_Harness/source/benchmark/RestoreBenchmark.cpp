@@ -0,0 +1,99 @@
+#include "Benchmark.hpp"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+#include "pagerestorer/PageBackupEx.h"
+#include "pagerestorer/RestoreWorkerPool.hpp"
+
+namespace dedougger {
+
+	/* Measures restore throughput with 1 to max_workers threads writing, to pick a worker count for a target
+		Args:
+			max_workers - the largest worker count timed
+			megabytes - size of the restored memory.  Pages are written to a buffer in our own process, in runs
+				of 1 to 16 pages with gaps between them like the dirty pages of a real restore.
+		Returns:
+			0, or 1 if a restore left the wrong contents behind
+	 */
+	int benchmark_parallel_restore(size_t max_workers, size_t megabytes) {
+		const size_t page_size = PageBackupEx::BACKUP_PAGE_SIZE;
+		const int rounds = 20;
+		size_t page_count = (megabytes << 20) / page_size;
+		std::mt19937_64 random(0x5EED);
+		PageRegion region = { 0 };
+#ifdef _WIN32
+		HANDLE process = OpenProcess(PROCESS_ALL_ACCESS, false, GetCurrentProcessId());
+#else
+		HANDLE process = OpenProcess(PROCESS_ALL_ACCESS, false, (DWORD)getpid());
+#endif
+
+		//
+		// Lay out the restored pages first, the target buffer has to cover the gaps as well
+		//
+		std::vector<size_t> offsets;
+		size_t target_size = 0;
+		while (offsets.size() < page_count) {
+			size_t run = 1 + random() % 16;
+			for (size_t i = 0; i < run && offsets.size() < page_count; i++) {
+				offsets.push_back(target_size);
+				target_size += page_size;
+			}
+			target_size += page_size * (1 + random() % 16);
+		}
+
+		std::vector<BYTE> saved(page_count * page_size + page_size);
+		std::vector<BYTE> target(target_size + page_size);
+		BYTE* saved_pages = (BYTE*)(((size_t)saved.data() + page_size - 1) & ~(page_size - 1));
+		BYTE* target_pages = (BYTE*)(((size_t)target.data() + page_size - 1) & ~(page_size - 1));
+		for (size_t i = 0; i < page_count * page_size; i++) {
+			saved_pages[i] = (BYTE)random();
+		}
+
+		std::vector<PageBackupEx> backups;
+		backups.reserve(page_count);
+		for (size_t i = 0; i < page_count; i++) {
+			backups.emplace_back((PVOID)(target_pages + offsets[i]), &region, saved_pages + i * page_size, false);
+		}
+		std::vector<PageBackupEx*> dirty_pages;
+		for (PageBackupEx& backup : backups) {
+			dirty_pages.push_back(&backup);
+		}
+
+		printf("Restoring %zu pages (%zu MB) in %zu runs per worker count\n", page_count, megabytes, (size_t)rounds);
+		double single_rate = 0;
+		for (size_t worker_count = 1; worker_count <= max_workers; worker_count++) {
+			RestoreWorkerPool pool(worker_count);
+			std::chrono::steady_clock::duration elapsed(0);
+			for (int round = 0; round < rounds; round++) {
+				memset(target_pages, 0xCC, target_size);
+				for (PageBackupEx* page : dirty_pages) {
+					page->set_dirty();
+				}
+				auto start = std::chrono::steady_clock::now();
+				pool.restore(process, dirty_pages);
+				elapsed += std::chrono::steady_clock::now() - start;
+			}
+			for (PageBackupEx& backup : backups) {
+				if (memcmp(backup.get_page_address(), backup.get_backup(), page_size) != 0) {
+					printf("Page %p wasn't restored with %zu workers\n", backup.get_page_address(), worker_count);
+					return 1;
+				}
+			}
+
+			double seconds = std::chrono::duration<double>(elapsed).count();
+			double rate = (double)megabytes * rounds / seconds;
+			if (worker_count == 1) {
+				single_rate = rate;
+			}
+			printf("%2zu workers: %8.1f MB/s  %5.2fx  %llu write calls\n", worker_count, rate, rate / single_rate,
+				(unsigned long long)pool.get_write_calls());
+		}
+		return 0;
+	}
+}
@@ -6,6 +6,8 @@ namespace dedougger {
 	//
 	void StateFuzzer::CommonInit() {
 		this->stateSaved = false;
+		this->pageRestorer->set_metrics(&this->metrics);
+		this->threadRestorer->set_metrics(&this->metrics);
 		this->dedougger->RegisterEventCallback(DEBUGEVENTCALLBACKID::THREAD_CREATE_EVENT_CALLBACK, ThreadCreateCallbackStatic, (void*)this);
 		this->dedougger->RegisterEventCallback(DEBUGEVENTCALLBACKID::EXIT_THREAD_EVENT_CALLBACK, ExitThreadCallbackStatic, (void*)this);
 		this->dedougger->RegisterEventCallback(DEBUGEVENTCALLBACKID::BREAKPOINT_CALLBACK, BreakpointCallbackStatic, (void*)this);
@@ -57,7 +59,7 @@ namespace dedougger {
 	}
 
 	CALLBACKRESULT StateFuzzer::ExitThreadCallback(const DEBUGEVENTCALLBACKID eventId, ThreadState * threadState, const DEBUG_EVENT * debugEv, DBG_CONTINUE_STATUS * dwContinueStatus)	{
-		this->threadRestorer->remove_thread_from_kill(threadState->GetThreadId());
+		this->threadRestorer->thread_exited(threadState->GetThreadId());
 		return CALLBACKRESULT::BP_HANDLE;
 	}
 
@@ -68,7 +70,39 @@ namespace dedougger {
 		size_t address = (size_t)debugEv->u.Exception.ExceptionRecord.ExceptionAddress;
 		if (address == this->stateSavePoint && !this->stateSaved) {
 			int hwbpIndex = this->dedougger->ClearHWBPByAddress(address);
-			this->SaveState();
+			if (this->snapshotFilePath.empty()) {
+				this->SaveState();
+			}
+			else {
+				//
+				// A snapshot from an earlier run gets us the same state without having to save it again.  One that
+				// can't be loaded leaves the target untouched, so the state is saved and written out in its place.
+				//
+				bool loaded = false;
+				try {
+					this->LoadSnapshotFile(this->snapshotFilePath.c_str());
+					loaded = true;
+				}
+				catch (const SnapshotFileInvalidException&) {
+					printf("No usable snapshot in %s\n", this->snapshotFilePath.c_str());
+				}
+				catch (const SnapshotThreadMismatchException&) {
+					printf("The threads in %s don't match the target's\n", this->snapshotFilePath.c_str());
+				}
+				catch (const VirtualAllocFailedException&) {
+					printf("The regions in %s can't be mapped in the target\n", this->snapshotFilePath.c_str());
+				}
+				catch (const VirtualProtectFailedException&) {
+					printf("The regions in %s can't be mapped in the target\n", this->snapshotFilePath.c_str());
+				}
+				catch (const SnapshotArenaExhaustedException&) {
+					printf("The pages in %s don't fit in the snapshot arena\n", this->snapshotFilePath.c_str());
+				}
+				if (!loaded) {
+					this->SaveState();
+					this->SaveSnapshotFile(this->snapshotFilePath.c_str());
+				}
+			}
 		}
 		else {
 			if (this->stateResetPoints.find(address) != this->stateResetPoints.end()) {
@@ -127,14 +161,29 @@ namespace dedougger {
 		SaveStateResults results;
 		results.pagesSaved = this->pageRestorer->save_state();
 		results.threadsSaved = this->threadRestorer->save_state();
+		printf("%llu pages stored, %llu more deduplicated or zero\n",
+			(unsigned long long)this->pageRestorer->get_unique_pages(),
+			(unsigned long long)this->pageRestorer->get_deduplicated_pages());
 		this->stateSaved = true;
 		return results;
 	}
 
 	RestoreStateResults StateFuzzer::RestoreState() {
+		static std::vector<std::pair<size_t, size_t>> lostStacks;
 		RestoreStateResults results;
+		this->metrics.begin_restore();
+		//
+		// Saved threads that exited are resurrected on their old stacks, which have to be back first
+		//
+		lostStacks.clear();
+		this->threadRestorer->get_lost_stacks(&lostStacks);
+		for (auto& stack : lostStacks) {
+			this->pageRestorer->restore_range(stack.first, stack.second);
+		}
 		results.pagesRestored = this->pageRestorer->restore_state();
 		results.threadsRestored = this->threadRestorer->restore_state();
+		results.threadsKilled = this->threadRestorer->get_last_killed();
+		this->metrics.end_restore();
 		this->restoreCount++;
 		if (tickStart == 0) {
 			tickStart = GetTickCount64();
@@ -144,10 +193,51 @@ namespace dedougger {
 			uint64_t elapsedTicks = currentTick - this->tickStart;
 			float elapsedSeconds = (float)elapsedTicks / 1000.0;
 			printf("%f cases per second\n", (float)this->restoreCount / elapsedSeconds);
+			printf("%llu pages scanned, %llu pages compared, %llu pages restored, %llu write faults\n",
+				(unsigned long long)this->pageRestorer->get_pages_scanned(),
+				(unsigned long long)this->pageRestorer->get_pages_compared(),
+				(unsigned long long)this->pageRestorer->get_pages_restored(),
+				(unsigned long long)this->pageRestorer->get_write_faults());
+			printf("%llu hot pages, %llu hot page restores without a fault\n",
+				(unsigned long long)this->pageRestorer->get_hot_pages(),
+				(unsigned long long)this->pageRestorer->get_hot_page_restores());
+			printf("%f write calls per restore\n",
+				(float)this->pageRestorer->get_write_calls() / (float)this->pageRestorer->get_restore_count());
+			printf("%llu thread restores skipped, the thread still had the saved registers\n",
+				(unsigned long long)this->threadRestorer->get_threads_skipped());
+			printf("%llu threads created by iterations killed, %llu of them frozen at creation\n",
+				(unsigned long long)this->threadRestorer->get_threads_killed(),
+				(unsigned long long)this->threadRestorer->get_threads_frozen());
+			printf("%llu threads resurrected after exiting\n",
+				(unsigned long long)this->threadRestorer->get_threads_resurrected());
+			const LatencyHistogram& restoreTimes = this->metrics.get_histogram(RestoreMetrics::RESTORE_TOTAL);
+			printf("restore p50 %lluus, p99 %lluus, max %lluus\n",
+				(unsigned long long)restoreTimes.percentile(50) / 1000,
+				(unsigned long long)restoreTimes.percentile(99) / 1000,
+				(unsigned long long)restoreTimes.get_max() / 1000);
 		}
 		return results;
 	}
 
+	SaveStateResults StateFuzzer::PushState() {
+		SaveStateResults results;
+		results.pagesSaved = this->pageRestorer->push_state();
+		results.threadsSaved = this->threadRestorer->push_state();
+		return results;
+	}
+
+	void StateFuzzer::PopState() {
+		this->pageRestorer->pop_state();
+		this->threadRestorer->pop_state();
+	}
+
+	RestoreStateResults StateFuzzer::RestoreToLevel(size_t level) {
+		while (this->pageRestorer->get_level() > level) {
+			this->PopState();
+		}
+		return this->RestoreState();
+	}
+
 	void StateFuzzer::SetStateSavePointDeferred(const char* moduleName, size_t offset)	{
 		this->stateSavePointDeferred = DeferredPoint(moduleName, offset);
 		//this->dedougger->SetHWBPInModule(moduleName, offset, BPCONDITION::EXECUTION, BPLEN::ONE);
@@ -159,6 +249,57 @@ namespace dedougger {
 		this->dedougger->SetHWBPInModule(moduleName, offset, BPCONDITION::EXECUTION, BPLEN::ONE);
 	}
 
+	void StateFuzzer::SetPageDifferentialType(PageDifferentialType type) {
+		this->pageRestorer->set_page_differential_type(type);
+	}
+
+	void StateFuzzer::SetRestoreWorkers(size_t count, size_t threshold) {
+		this->pageRestorer->set_restore_workers(count, threshold);
+	}
+
+	void StateFuzzer::SetSnapshotScope(const SnapshotScope& scope) {
+		this->pageRestorer->set_scope(scope);
+	}
+
+	void StateFuzzer::SaveSnapshotFile(const char* path) {
+		SnapshotFileWriter writer;
+		this->pageRestorer->write_snapshot(&writer);
+		this->threadRestorer->write_snapshot(&writer);
+		const std::map<size_t, ModuleInfo>& modules = this->dedougger->GetModules();
+		for (auto it = modules.begin(); it != modules.end(); it++) {
+			writer.add_module(it->first, it->second.GetModulePath());
+		}
+		writer.write(path);
+	}
+
+	SaveStateResults StateFuzzer::LoadSnapshotFile(const char* path) {
+		SaveStateResults results;
+		SP_SnapshotFile file = std::make_shared<SnapshotFile>(path);
+		const std::map<size_t, ModuleInfo>& modules = this->dedougger->GetModules();
+		for (size_t i = 0; i < file->get_header()->module_count; i++) {
+			const SnapshotFileModule* module = file->get_module(i);
+			if (modules.find((size_t)module->base) == modules.end()) {
+				printf("Snapshot module %s isn't loaded at %llx, the snapshot may not fit this target\n",
+					module->path, (unsigned long long)module->base);
+			}
+		}
+		//
+		// The threads are matched before anything is written into the target and only get their registers once
+		// the pages are in, so a snapshot that doesn't fit leaves the target as it was
+		//
+		this->threadRestorer->stage_snapshot(file);
+		try {
+			results.pagesSaved = this->pageRestorer->load_snapshot(file);
+		}
+		catch (...) {
+			this->threadRestorer->discard_snapshot();
+			throw;
+		}
+		results.threadsSaved = this->threadRestorer->load_snapshot();
+		this->stateSaved = true;
+		return results;
+	}
+
 	void StateFuzzer::BeginDebugging() {
 		this->dedougger->BeginDebugging();
 	}
@@ -1,8 +1,9 @@
 #pragma once
 #include "dedougger.hpp"
-#include "pagerestorer\PageRestorerEx.h"
-#include "threadrestorer\ThreadRestorerEx.hpp"
+#include "pagerestorer/PageRestorerEx.h"
+#include "threadrestorer/ThreadRestorerEx.hpp"
 
+#include <string>
 #include <vector>
 
 namespace dedougger {
@@ -15,6 +16,7 @@ namespace dedougger {
 	struct RestoreStateResults {
 		uint16_t pagesRestored;
 		uint16_t threadsRestored;
+		uint16_t threadsKilled;		// threads the iteration created, killed by the restore
 	};
 	
 	struct DeferredPoint {
@@ -40,6 +42,33 @@ namespace dedougger {
 	 *		SaveState() - saves the state of all memory pages and threads
 	 *		RestoreState() - restores the state of all memory pages and threads.  Keep in mind handles and other things
 	 *			are not tracked and not restored.
+	 *		PushState() - saves a nested state on top of the current one (e.g. after login, then after joining a lobby)
+	 *			holding only what changed since.  RestoreState() goes back to the deepest state.
+	 *		PopState() - drops the deepest state, the next RestoreState() goes back to the one below it
+	 *		RestoreToLevel(level) - drops every state above level and restores it.  Level 0 is SaveState()'s.
+	 *		SaveSnapshotFile(path) - writes the saved state, threads and module list out to a snapshot file
+	 *		LoadSnapshotFile(path) - takes a snapshot file as the saved state instead of SaveState().  The target has
+	 *			to be the same program with the same layout (ASLR off); the module list is checked against it.  A
+	 *			snapshot that doesn't fit throws and leaves the target and the saved state untouched.
+	 *		SetSnapshotFile(path) - when the save point is hit, load the file if it exists, otherwise save the state
+	 *			and write it out for the next run
+	 *		SetPageDifferentialType(type) - picks how written pages are detected, must be called before the state is
+	 *			saved.  Useful to compare MEMORY_WATCH against READ_ONLY_PAGES and the Linux-only SOFT_DIRTY and
+	 *			USERFAULTFD_WP modes.
+	 *		SetRestoreWorkers(count, threshold) - writes restores of at least threshold dirty pages with count threads.
+	 *			Run Dedougger_Harness --benchmark-parallel-restore to see what count pays off on a machine.
+	 *		SetMetricsFile(path, interval) - appends the restore metrics (time per phase with p50/p99/max, pages and bytes
+	 *			restored) to path as a line of JSON every interval restores
+	 *		GetMetrics() - the restore metrics, see RestoreMetrics
+	 *		SetSkipUnchangedThreads(skip) - whether restores leave alone the threads that still have their saved
+	 *			registers, on by default.  See ThreadRestorerEx.
+	 *		SetNewThreadPolicy(policy) - NEW_THREADS_FREEZE suspends the threads an iteration creates as soon as they're
+	 *			created, so they sit out the rest of it before the restore kills them.  NEW_THREADS_RUN (the default)
+	 *			lets them run until then.
+	 *		SetVerification(interval, samplePages) - every interval restores, checks samplePages restored pages (0 for
+	 *			all) against their snapshot and reports the ones that drifted, see PageRestorerEx::set_verification
+	 *		SetSnapshotScope(scope) - snapshots only part of the target's memory, e.g. writable private memory and the
+	 *			main module's .data, leaving code and file mappings alone.  Must be called before the state is saved.
 	 *		BeginDebugging() - starts debugging the target process.  This method does not return - the debugger will 
 	 *			communicate with the object through event callbacks for various exceptions.
 	 *	Members: - all protected, not intended for use but available to child classes just in case
@@ -62,6 +91,8 @@ namespace dedougger {
 		uint64_t			tickStart = 0;
 		std::set<size_t>	stateResetPoints;
 		std::vector<DeferredPoint> stateResetPointsDeferred;
+		std::string			snapshotFilePath;
+		RestoreMetrics		metrics;
 
 
 		void CommonInit();
@@ -86,7 +117,7 @@ namespace dedougger {
 		StateFuzzer(DWORD pid) {
 			this->dedougger			= std::make_unique<Dedougger>(pid);
 			this->pageRestorer		= std::make_unique<PageRestorerEx>(pid);
-			this->threadRestorer	= std::make_unique<ThreadRestorerEx>(pid);
+			this->threadRestorer	= std::make_unique<ThreadRestorerEx>(pid, &this->dedougger->Threads());
 			this->CommonInit();
 		}
 
@@ -98,14 +129,28 @@ namespace dedougger {
 			this->dedougger = std::make_unique<Dedougger>(execPath);
 			DWORD pid = this->dedougger->ProcessId();
 			this->pageRestorer = std::make_unique<PageRestorerEx>(pid);
-			this->threadRestorer = std::make_unique<ThreadRestorerEx>(pid);
+			this->threadRestorer = std::make_unique<ThreadRestorerEx>(pid, &this->dedougger->Threads());
 			this->CommonInit();
 		}
 
 		SaveStateResults SaveState();
 		RestoreStateResults RestoreState();		
+		SaveStateResults PushState();
+		void PopState();
+		RestoreStateResults RestoreToLevel(size_t level);
 		void SetStateSavePointDeferred(const char* moduleName, size_t offset);
 		void AddStateResetPointDeferred(const char* moduleName, size_t offset);
+		void SetPageDifferentialType(PageDifferentialType type);
+		void SetRestoreWorkers(size_t count, size_t threshold);
+		void SetSnapshotScope(const SnapshotScope& scope);
+		void SetVerification(uint32_t interval, size_t samplePages) { this->pageRestorer->set_verification(interval, samplePages); }
+		void SetMetricsFile(const char* path, uint64_t interval) { this->metrics.set_dump_file(path, interval); }
+		void SetSkipUnchangedThreads(bool skip) { this->threadRestorer->set_skip_unchanged(skip); }
+		void SetNewThreadPolicy(NewThreadPolicy policy) { this->threadRestorer->set_new_thread_policy(policy); }
+		const RestoreMetrics& GetMetrics() { return this->metrics; }
+		void SaveSnapshotFile(const char* path);
+		SaveStateResults LoadSnapshotFile(const char* path);
+		void SetSnapshotFile(const char* path) { this->snapshotFilePath = path; }
 		void BeginDebugging();
 
 	};
@@ -1,82 +1,101 @@
 #include "PageBackupEx.h"
+#include <string.h>
+#include "PageStore.hpp"
+#include "PageCompare.hpp"
 
 
 namespace dedougger {
 
-	PageBackupEx::PageBackupEx(PVOID remote_page, HANDLE process, bool trackPageChanges) {
+	PageBackupEx::PageBackupEx(PVOID remote_page, PageRegion* region, PVOID storage, bool trackPageChanges) {
 		this->page_address = remote_page;
-		this->trackPageChanges = trackPageChanges;		
+		this->region = region;
+		this->data = storage;
 		this->dirty = false;
 		this->trackPageChanges = trackPageChanges;		
-		this->original_protect = 0;
+		this->hot = false;
+		this->dirty_streak = 0;
+		this->last_dirty_restore = 0;
+		this->hot_since = 0;
+		this->hash_valid = false;
+		this->backup_hash = 0;
 	}
 
-	int PageBackupEx::backup(HANDLE process) {
-		SIZE_T bytesRead = 0;
-		BOOL success = 1;
-		DWORD page_guard = 0;
-		DWORD old_protect = 0;
-		DWORD old_protect2;
-		MEMORY_BASIC_INFORMATION page_info;
-		VirtualQueryEx(process, this->page_address, &page_info, sizeof(page_info));
-		return this->backup(process, &page_info);
+	uint64_t PageBackupEx::get_backup_hash() {
+		if (!this->hash_valid) {
+			this->backup_hash = hash_page(this->data);
+			this->hash_valid = true;
+		}
+		return this->backup_hash;
 	}
 
-	int PageBackupEx::backup(HANDLE process, PMEMORY_BASIC_INFORMATION memInfo)	{
+	/* Notes that the page was restored because it was dirty
+		Args:
+			restore - number of the restore
+		Returns:
+			How many restores in a row the page has been dirty for
+	 */
+	uint16_t PageBackupEx::record_dirty_restore(uint32_t restore) {
+		if (this->dirty_streak > 0 && restore - this->last_dirty_restore == 1) {
+			if (this->dirty_streak < UINT16_MAX) {
+				this->dirty_streak++;
+			}
+		}
+		else {
+			this->dirty_streak = 1;
+		}
+		this->last_dirty_restore = restore;
+		return this->dirty_streak;
+	}
 
+	/* Reads the page out of the target on its own, into storage the page has to itself.  Backing up a
+	 * whole region is cheaper done by reading the region once and handing each page its part, which is how
+	 * PageRestorerEx does it (interning the parts in a PageStore).
+	 */
+	int PageBackupEx::backup(HANDLE process) {
 		SIZE_T bytesRead = 0;
 		BOOL success = 1;
 		DWORD page_guard = 0;
 		DWORD old_protect = 0;
 		DWORD old_protect2;
-		this->page_info = *memInfo;
-		this->original_protect = this->page_info.Protect;
-		
+		MEMORY_BASIC_INFORMATION& page_info = this->region->info;
+
 		//
 		// If the page isn't committed, we can't back it up.
 		//
-		if (this->page_info.State != MEM_COMMIT) {
+		if (page_info.State != MEM_COMMIT) {
 			printf("Attempt to backup non-committed page\n");
 			return 0;
 		}
-		else if (this->page_info.Protect == PAGE_NOACCESS) {
-			printf("Attempt to backup no access page %p\n", this->page_info.BaseAddress);
+		else if (page_info.Protect == PAGE_NOACCESS) {
+			printf("Attempt to backup no access page %p\n", this->page_address);
 			return 0;
 		}
 
-
-		//
-		// If a backup already exists, free it.
-		//
-		if (this->data != nullptr) {
-			free(this->data);
-		}
-		this->data = malloc(this->page_info.RegionSize);
-
 		//
 		// If the page is page guarded, we can't read it.  So we'll have to clear the page guard protection, 
 		// read the page, and then restore the page guard.
 		//
-		page_guard = this->page_info.Protect & PAGE_GUARD;
-		if (page_guard || this->page_info.Protect == PAGE_NOACCESS) {
-			success = VirtualProtectEx(process, this->page_address, this->page_info.RegionSize, PAGE_READONLY & ~page_guard, &old_protect);
+		page_guard = page_info.Protect & PAGE_GUARD;
+		if (page_guard) {
+			success = VirtualProtectEx(process, this->page_address, BACKUP_PAGE_SIZE, PAGE_READONLY, &old_protect);
 			if (!success) {
 				throw VirtualProtectFailedException();
 			}
 		}
 
 		success = ReadProcessMemory(process,
-			this->page_info.BaseAddress,
+			this->page_address,
 			this->data,
-			this->page_info.RegionSize,
+			BACKUP_PAGE_SIZE,
 			&bytesRead);
+		this->hash_valid = false;
 
-		if (success == false || bytesRead != this->page_info.RegionSize) {
+		if (success == false || bytesRead != BACKUP_PAGE_SIZE) {
 			throw ReadProcessMemoryFailedException();
 		}
 
-		if (page_guard || this->page_info.Protect == PAGE_NOACCESS) {
-			success = VirtualProtectEx(process, this->page_address, this->page_info.RegionSize, old_protect, &old_protect2);
+		if (page_guard) {
+			success = VirtualProtectEx(process, this->page_address, BACKUP_PAGE_SIZE, old_protect, &old_protect2);
 			if (!success) {
 				throw VirtualProtectFailedException();
 			}
@@ -94,90 +113,79 @@ namespace dedougger {
 		return 0;
 	}
 
-int PageBackupEx::ProtectPage(HANDLE process) {
-	DWORD oldProtectNoPG;
-	MEMORY_BASIC_INFORMATION freshInfo;
-	SIZE_T bytesWritten = 0;
-	DWORD oldProtect = 0;
-	DWORD oldOldProtect = 0;
-	DWORD newProtect = 0;
-	DWORD page_guard;
-	int error = 0;
-	int result = 0;
-	LPVOID allocResult;
-	bool doRestore = true;
-
-	result = VirtualQueryEx(process, this->page_address, &freshInfo, sizeof(freshInfo));
-	//
-	// We don't want to do the whole region, just this page.
-	//
-	freshInfo.RegionSize = this->page_info.RegionSize;
-	if (!result) {
-		throw VirtualQueryFailedException();
+	/* Takes the page's contents from a copy already read out of the target.  Write-protecting the page is
+	 * left to the caller, which can do the whole region at once.
+		Args:
+			contents - BACKUP_PAGE_SIZE bytes of page contents
+	 */
+	void PageBackupEx::backup_contents(const void* contents) {
+		memcpy(this->data, contents, BACKUP_PAGE_SIZE);
+		this->hash_valid = false;
 	}
 
-	oldProtect = freshInfo.Protect;
-	oldProtectNoPG = oldProtect & (~PAGE_GUARD);
-	page_guard = oldProtect & PAGE_GUARD;
+	/* Works out the protection that lets a page be read and executed like before but faults on writes
+		Args:
+			protect - the page's normal protection
+		Returns:
+			The protection to watch the page with, which is protect itself if it can't be written anyway
+	 */
+	DWORD PageBackupEx::get_watch_protection(DWORD protect) {
+		DWORD newProtect = 0;
+		DWORD protectNoPG = protect & (~PAGE_GUARD);
+		DWORD page_guard = protect & PAGE_GUARD;
 
-	switch (oldProtectNoPG) {
-	case (PAGE_EXECUTE_READ):
-	case (PAGE_EXECUTE_READWRITE):
-		newProtect = PAGE_EXECUTE_READ;
-		break;
-	case (PAGE_READONLY):
-	case (PAGE_READWRITE):
-		newProtect = PAGE_READONLY;
-		break;
-	case (PAGE_EXECUTE):
-		newProtect = oldProtect;
-		break;
-	case (PAGE_WRITECOPY):
-		doRestore = false;
-		newProtect = PAGE_WRITECOPY;
-		break;
-	default:
-		printf("Unknown protection constant 0x%x", oldProtect);
-		throw new UnknownProtectionException();
-		break;
+		switch (protectNoPG) {
+		case (PAGE_EXECUTE_READ):
+		case (PAGE_EXECUTE_READWRITE):
+			newProtect = PAGE_EXECUTE_READ;
+			break;
+		case (PAGE_READONLY):
+		case (PAGE_READWRITE):
+			newProtect = PAGE_READONLY;
+			break;
+		case (PAGE_EXECUTE):
+			newProtect = protectNoPG;
+			break;
+		case (PAGE_WRITECOPY):
+			newProtect = PAGE_WRITECOPY;
+			break;
+		default:
+			printf("Unknown protection constant 0x%x", protect);
+			throw UnknownProtectionException();
+			break;
+		}
+
+		return newProtect | page_guard;
 	}
 
-	newProtect |= page_guard;
-	if (this->page_info.Type == MEM_MAPPED) {
+	/* Write-protects part of a region
+		Args:
+			process - handle of the target
+			region - the region the range lies in
+			address - page aligned start of the range
+			size - size of the range in bytes
+		Returns:
+			false if the protection couldn't be changed, in which case writes to the range go unnoticed
+	 */
+	bool PageBackupEx::protect_range(HANDLE process, PageRegion* region, PVOID address, SIZE_T size) {
+		DWORD oldProtect = region->info.Protect;
+		DWORD oldOldProtect = 0;
+		DWORD newProtect = get_watch_protection(oldProtect);
+
 		//
-		// VirtualProtect can fail on mapped views of files.
-		// Due to this, we unmap the file and fill the space it
-		// held with a copy of the data the view contained.
+		// VirtualProtect can fail on mapped views of files.  PageRestorerEx replaces
+		// them with private copies when it saves them, so a view only gets here if
+		// that's turned off or the view couldn't be read; the caller falls back to
+		// restoring or comparing the page.
 		//
-		//this->dirty = true;
-		/*
-		SIZE_T backup_size = freshInfo.RegionSize;
-		BYTE* backup = (BYTE*)malloc(backup_size);
-		SIZE_T bytesWritten = 0;
-		result = ReadProcessMemory(process, freshInfo.BaseAddress, backup, backup_size, &bytesWritten);
-		if (!result || bytesWritten != backup_size) {
-			throw std::exception();
-		}
-
-		bool unmapResult = UnmapViewOfFile2(process, freshInfo.BaseAddress, NULL);
-		if (!unmapResult) {
-			throw std::exception();
-		}
-		LPVOID allocResult = VirtualAllocEx(process, freshInfo.BaseAddress, freshInfo.RegionSize, MEM_COMMIT, newProtect);
-		if (allocResult == nullptr) {
-			throw std::exception();
+		if (newProtect == oldProtect) {
+			return true;
 		}
-		result = WriteProcessMemory(process, allocResult, backup, backup_size, &bytesWritten);
-		if (!result || bytesWritten != backup_size) {
-			throw std::exception();
-		}
-		free(backup);
-		*/
+		return VirtualProtectEx(process, address, size, newProtect, &oldOldProtect) != 0;
 	}
 
-	if (newProtect != oldProtect) {
-		result = VirtualProtectEx(process, freshInfo.BaseAddress, freshInfo.RegionSize - 1, newProtect, &oldOldProtect);
-		if (!result) {
+	int PageBackupEx::ProtectPage(HANDLE process) {
+		if (!protect_range(process, this->region, this->page_address, BACKUP_PAGE_SIZE)) {
 			//
 			// In testing, there has been one and only one region in the 
 			// target process that isn't mapped to a view of a file that
@@ -187,41 +195,7 @@ int PageBackupEx::ProtectPage(HANDLE process) {
 			// previous state on restore.
 			// 				
 			this->dirty = true;
-		}
-	}
-
-	return result;
-	}
-
-	int PageBackupEx::resize(HANDLE process) {
-		MEMORY_BASIC_INFORMATION freshInfo;
-		int result;
-		PVOID allocResult;
-		DWORD new_state;
-		result = VirtualQueryEx(process, this->page_address, &freshInfo, sizeof(freshInfo));
-		if (!result) {
-			throw VirtualQueryFailedException();
-		}
-		// If the size of the page has changed, we need to re-allocate it
-		if (freshInfo.RegionSize != this->page_info.RegionSize) {
-			// Untested, test when reached			
-			result = VirtualFreeEx(process, freshInfo.BaseAddress, 0, MEM_RELEASE);
-			if (!result) {
-				throw VirtualFreeFailedException();
-			}
-			if (this->page_info.State == MEM_COMMIT) {
-				new_state = MEM_COMMIT | MEM_RESERVE;
-			} else {
-				new_state = this->page_info.State;
-}
-			allocResult = VirtualAllocEx(process,
-				this->page_address,
-				this->page_info.RegionSize,
-				new_state,
-				this->page_info.Protect);
-			if (!allocResult) {
-				throw VirtualAllocFailedException();
-			}
+			return 0;
 		}
 		return 1;
 	}
@@ -230,29 +204,56 @@ int PageBackupEx::ProtectPage(HANDLE process) {
 		SIZE_T bytesWritten = 0;
 		bool result;
 		if (this->dirty) {
-			//this->resize(process);
 			this->dirty = false;
-			// need to resize first
 			result = WriteProcessMemory(process,
 				this->page_address,
 				this->data,
-				this->page_info.RegionSize,
+				BACKUP_PAGE_SIZE,
 				&bytesWritten);
-			this->ProtectPage(process);
-			if (!result || bytesWritten != this->page_info.RegionSize) {
+			if (this->trackPageChanges) {
+				this->ProtectPage(process);
+			}
+			if (!result || bytesWritten != BACKUP_PAGE_SIZE) {
 				throw WriteProcessMemoryFailedException();
 			}
 		}
 		return bytesWritten > 0;		
 	}
 
+	/* Queues the write restoring a dirty page instead of doing it.  Once the batch is flushed, rearm() puts
+	 * the change tracking back in place.
+		Args:
+			batch - the batch to add the write to
+		Returns:
+			true if the page was dirty and a write was queued
+	 */
+	bool PageBackupEx::queue_restore(PageWriteBatch* batch) {
+		if (!this->dirty) {
+			return false;
+		}
+		this->dirty = false;
+		if (this->data == PageStore::zero_page()) {
+			batch->add_zero((size_t)this->page_address, BACKUP_PAGE_SIZE);
+		}
+		else {
+			batch->add((size_t)this->page_address, this->data, BACKUP_PAGE_SIZE);
+		}
+		return true;
+	}
+
+	void PageBackupEx::rearm(HANDLE process) {
+		if (this->trackPageChanges) {
+			this->ProtectPage(process);
+		}
+	}
+
 	void PageBackupEx::mark_dirty(HANDLE process) {
 		DWORD old_protect = 0;
 		this->dirty = true;
 		bool result = VirtualProtectEx(process, 
-			this->page_info.BaseAddress, 
-			this->page_info.RegionSize, 
-			this->original_protect, 
+			this->page_address, 
+			BACKUP_PAGE_SIZE, 
+			this->region->info.Protect, 
 			&old_protect);
 		if (!result) {
 			throw VirtualProtectFailedException();
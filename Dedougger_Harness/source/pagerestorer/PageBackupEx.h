@@ -1,28 +1,85 @@
 #pragma once
 
-#include <Windows.h>
+#include "platform/platform.h"
 #include <stdio.h>
 #include "dexception.h"
+#include "PageWriteBatch.hpp"
 
 namespace dedougger {
+	/**
+	 * PageRegion - a committed region as it looked when it was backed up.  Everything that holds for the
+	 *	region as a whole (base, size, protection, type) is kept here once and shared by the PageBackupEx of
+	 *	each of its pages.  Regions we can't read (no access) are recorded without any pages.
+	 */
+	struct PageRegion {
+		MEMORY_BASIC_INFORMATION info;
+		bool track_changes;	// pages are write-protected by us, rather than by userfaultfd or not at all
+		bool compare_contents;	// nothing catches writes, pages are compared against their backup on restore
+	};
+
+	/**
+	 * PageBackupEx - the saved contents of one 4 KiB page.
+	 *
+	 *	This is a fixed-size descriptor; the page's bytes live in a PageStore, shared with every page that
+	 *	has the same contents, or in storage handed out by a SnapshotArena.
+	 *	Dirtiness, restoring and write-protection all work on the single page, so a write to one page of a
+	 *	large region only costs that page.  Pages of a region are backed up and first protected region-wide
+	 *	by PageRestorerEx; protect_range() is shared so runs of pages can be re-armed with one call.
+	 *
+	 *	Methods:
+	 *		backup(process)/backup_contents(contents) - saves the page, either read from the target or from a copy of it
+	 *		restore(process) - writes the page back if it's dirty and re-arms the write watch
+	 *		queue_restore(batch)/rearm(process) - the same split in two, for batched restores
+	 *		mark_dirty(process) - records a write and gives the page its original protection back
+	 *		get_backup()/set_backup(storage) - the contents restore() writes back, swapped by nested snapshots.
+	 *			Pointing it at PageStore::zero_page() makes restores write zeroes without copying.
+	 *		protect_range(process, region, address, size) - write-protects part of a region
+	 *		record_dirty_restore(restore)/is_hot()/set_hot(restore)/set_cold() - how often the page gets written,
+	 *			for PageRestorerEx's hot page policy
+	 *		get_backup_hash() - hash_page of the backup, kept until the backup changes
+	 */
 	class PageBackupEx {
-		MEMORY_BASIC_INFORMATION page_info;
-		PVOID page_address;		
+		PageRegion* region;
+		PVOID page_address;
 		PVOID data;
 		bool dirty;
 		bool trackPageChanges;
-		DWORD original_protect;
+		bool hot;
+		uint16_t dirty_streak;			// consecutive restores the page was dirty in
+		uint32_t last_dirty_restore;
+		uint32_t hot_since;
+		bool hash_valid;
+		uint64_t backup_hash;			// hash_page of the backup, worked out when restore verification asks
 		int ProtectPage(HANDLE process);
-		int resize(HANDLE process);
 	public:
-		PageBackupEx(PVOID remote_page, HANDLE process, bool trackPageChanges = true);
+		static const SIZE_T BACKUP_PAGE_SIZE = 0x1000;
+
+		PageBackupEx(PVOID remote_page, PageRegion* region, PVOID storage, bool trackPageChanges = true);
 		int restore(HANDLE process);
+		bool queue_restore(PageWriteBatch* batch);
+		void rearm(HANDLE process);
 		int backup(HANDLE process);
-		int backup(HANDLE process, PMEMORY_BASIC_INFORMATION memInfo);
+		void backup_contents(const void* contents);
 		void mark_dirty(HANDLE process);
+		void set_dirty() { this->dirty = true; }
+		void set_clean() { this->dirty = false; }
 		bool is_dirty() { return this->dirty; }
+		bool is_tracking_changes() { return this->trackPageChanges; }
+		void set_tracking_changes(bool track) { this->trackPageChanges = track; }
+		PageRegion* get_region() { return this->region; }
 		PVOID get_page_address() { return this->page_address; }
-		SIZE_T get_page_size() { return this->page_info.RegionSize; }
-		PVOID get_page_last_byte() { return (PVOID)((SIZE_T)this->page_address + this->page_info.RegionSize); }
+		PVOID get_backup() { return this->data; }
+		void set_backup(PVOID storage) { this->data = storage; this->hash_valid = false; }
+		uint64_t get_backup_hash();
+		SIZE_T get_page_size() { return BACKUP_PAGE_SIZE; }
+		PVOID get_page_last_byte() { return (PVOID)((SIZE_T)this->page_address + BACKUP_PAGE_SIZE); }
+		uint16_t record_dirty_restore(uint32_t restore);
+		bool is_hot() { return this->hot; }
+		void set_hot(uint32_t restore) { this->hot = true; this->hot_since = restore; }
+		void set_cold() { this->hot = false; this->dirty_streak = 0; }
+		uint32_t get_hot_since() { return this->hot_since; }
+
+		static DWORD get_watch_protection(DWORD protect);
+		static bool protect_range(HANDLE process, PageRegion* region, PVOID address, SIZE_T size);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,251 @@
+#include "PageCompare.hpp"
+#include <stdint.h>
+#include "PageBackupEx.h"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PAGE_COMPARE_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+//
+// MSVC emits any intrinsic it's asked for, GCC and clang want the functions using them marked
+//
+#if defined(PAGE_COMPARE_X86) && !defined(_MSC_VER)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define TARGET_AVX2
+#define TARGET_SSE2
+#endif
+
+namespace dedougger {
+
+	const size_t COMPARE_BLOCK_SIZE = 256;
+	const size_t HASH_STRIPE_WORDS = 8;
+	const size_t HASH_STRIPES = PageBackupEx::BACKUP_PAGE_SIZE / (HASH_STRIPE_WORDS * sizeof(uint64_t));
+	const uint64_t HASH_PRIME_1 = 0x9E3779B185EBCA87ull;
+	const uint64_t HASH_PRIME_2 = 0xC2B2AE3D27D4EB4Full;
+	const uint64_t HASH_PRIME_3 = 0x165667B19E3779F9ull;
+	alignas(32) static const uint64_t hash_initial[HASH_STRIPE_WORDS] = {
+		0xC2B2AE3Dull, HASH_PRIME_1, HASH_PRIME_2, HASH_PRIME_3,
+		0x85EBCA77C2B2AE63ull, 0x85EBCA77ull, 0x27D4EB2F165667C5ull, 0x9E3779B1ull
+	};
+	//
+	// Stripe s is keyed with hash_secret[s] to hash_secret[s + 7], filled in before the first hash
+	//
+	alignas(32) static uint64_t hash_secret[HASH_STRIPES + HASH_STRIPE_WORDS];
+
+	static void init_hash_secret() {
+		uint64_t state = HASH_PRIME_1;
+		for (size_t i = 0; i < HASH_STRIPES + HASH_STRIPE_WORDS; i++) {
+			//
+			// splitmix64
+			//
+			state += 0x9E3779B97F4A7C15ull;
+			uint64_t z = state;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			hash_secret[i] = z ^ (z >> 31);
+		}
+	}
+
+	static uint64_t hash_finish(const uint64_t* lanes) {
+		uint64_t h = PageBackupEx::BACKUP_PAGE_SIZE * HASH_PRIME_1;
+		for (size_t lane = 0; lane < HASH_STRIPE_WORDS; lane++) {
+			h ^= lanes[lane] * HASH_PRIME_2;
+			h = ((h << 31) | (h >> 33)) * HASH_PRIME_1;
+		}
+		h ^= h >> 33;
+		h *= HASH_PRIME_2;
+		h ^= h >> 29;
+		h *= HASH_PRIME_3;
+		h ^= h >> 32;
+		return h;
+	}
+
+	/* Each lane takes in the product of the low and high halves of its keyed word, and its neighbour's word
+	 * unkeyed, so no input bits are lost to the multiply
+	 */
+	static uint64_t hash_page_scalar(const void* page) {
+		const uint64_t* words = (const uint64_t*)page;
+		uint64_t lanes[HASH_STRIPE_WORDS];
+		for (size_t lane = 0; lane < HASH_STRIPE_WORDS; lane++) {
+			lanes[lane] = hash_initial[lane];
+		}
+		for (size_t stripe = 0; stripe < HASH_STRIPES; stripe++) {
+			for (size_t lane = 0; lane < HASH_STRIPE_WORDS; lane++) {
+				uint64_t word = words[stripe * HASH_STRIPE_WORDS + lane];
+				uint64_t keyed = word ^ hash_secret[stripe + lane];
+				lanes[lane ^ 1] += word;
+				lanes[lane] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+			}
+		}
+		return hash_finish(lanes);
+	}
+
+	static bool pages_equal_scalar(const void* a, const void* b) {
+		const uint64_t* left = (const uint64_t*)a;
+		const uint64_t* right = (const uint64_t*)b;
+		for (size_t block = 0; block < PageBackupEx::BACKUP_PAGE_SIZE / sizeof(uint64_t); block += COMPARE_BLOCK_SIZE / sizeof(uint64_t)) {
+			uint64_t difference = 0;
+			for (size_t i = block; i < block + COMPARE_BLOCK_SIZE / sizeof(uint64_t); i++) {
+				difference |= left[i] ^ right[i];
+			}
+			if (difference != 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+#ifdef PAGE_COMPARE_X86
+	TARGET_SSE2 static bool pages_equal_sse2(const void* a, const void* b) {
+		const __m128i* left = (const __m128i*)a;
+		const __m128i* right = (const __m128i*)b;
+		const __m128i zero = _mm_setzero_si128();
+		for (size_t block = 0; block < PageBackupEx::BACKUP_PAGE_SIZE / sizeof(__m128i); block += COMPARE_BLOCK_SIZE / sizeof(__m128i)) {
+			__m128i difference = zero;
+			for (size_t i = block; i < block + COMPARE_BLOCK_SIZE / sizeof(__m128i); i++) {
+				difference = _mm_or_si128(difference, _mm_xor_si128(_mm_loadu_si128(left + i), _mm_loadu_si128(right + i)));
+			}
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(difference, zero)) != 0xFFFF) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	TARGET_SSE2 static uint64_t hash_page_sse2(const void* page) {
+		const __m128i* words = (const __m128i*)page;
+		const size_t vectors = HASH_STRIPE_WORDS * sizeof(uint64_t) / sizeof(__m128i);
+		alignas(16) uint64_t lanes[HASH_STRIPE_WORDS];
+		__m128i accumulators[vectors];
+		for (size_t i = 0; i < vectors; i++) {
+			accumulators[i] = _mm_load_si128((const __m128i*)hash_initial + i);
+		}
+		for (size_t stripe = 0; stripe < HASH_STRIPES; stripe++) {
+			for (size_t i = 0; i < vectors; i++) {
+				__m128i word = _mm_loadu_si128(words + stripe * vectors + i);
+				__m128i keyed = _mm_xor_si128(word, _mm_loadu_si128((const __m128i*)(hash_secret + stripe) + i));
+				__m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+				__m128i swapped = _mm_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+				accumulators[i] = _mm_add_epi64(accumulators[i], _mm_add_epi64(product, swapped));
+			}
+		}
+		for (size_t i = 0; i < vectors; i++) {
+			_mm_store_si128((__m128i*)lanes + i, accumulators[i]);
+		}
+		return hash_finish(lanes);
+	}
+
+	TARGET_AVX2 static uint64_t hash_page_avx2(const void* page) {
+		const __m256i* words = (const __m256i*)page;
+		const size_t vectors = HASH_STRIPE_WORDS * sizeof(uint64_t) / sizeof(__m256i);
+		alignas(32) uint64_t lanes[HASH_STRIPE_WORDS];
+		__m256i accumulators[vectors];
+		for (size_t i = 0; i < vectors; i++) {
+			accumulators[i] = _mm256_load_si256((const __m256i*)hash_initial + i);
+		}
+		for (size_t stripe = 0; stripe < HASH_STRIPES; stripe++) {
+			for (size_t i = 0; i < vectors; i++) {
+				__m256i word = _mm256_loadu_si256(words + stripe * vectors + i);
+				__m256i keyed = _mm256_xor_si256(word, _mm256_loadu_si256((const __m256i*)(hash_secret + stripe) + i));
+				__m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+				__m256i swapped = _mm256_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+				accumulators[i] = _mm256_add_epi64(accumulators[i], _mm256_add_epi64(product, swapped));
+			}
+		}
+		for (size_t i = 0; i < vectors; i++) {
+			_mm256_store_si256((__m256i*)lanes + i, accumulators[i]);
+		}
+		return hash_finish(lanes);
+	}
+
+	TARGET_AVX2 static bool pages_equal_avx2(const void* a, const void* b) {
+		const __m256i* left = (const __m256i*)a;
+		const __m256i* right = (const __m256i*)b;
+		for (size_t block = 0; block < PageBackupEx::BACKUP_PAGE_SIZE / sizeof(__m256i); block += COMPARE_BLOCK_SIZE / sizeof(__m256i)) {
+			__m256i difference = _mm256_setzero_si256();
+			for (size_t i = block; i < block + COMPARE_BLOCK_SIZE / sizeof(__m256i); i++) {
+				difference = _mm256_or_si256(difference, _mm256_xor_si256(_mm256_loadu_si256(left + i), _mm256_loadu_si256(right + i)));
+			}
+			if (!_mm256_testz_si256(difference, difference)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static bool cpu_has_sse2() {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		return (info[3] & (1 << 26)) != 0;
+#else
+		return __builtin_cpu_supports("sse2");
+#endif
+	}
+
+	static bool cpu_has_avx2() {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return false;
+		}
+		//
+		// The CPU having AVX isn't enough, the OS has to save the YMM registers (OSXSAVE + XCR0)
+		//
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) {
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+#endif
+
+	typedef bool(*PageCompareKernel)(const void*, const void*);
+	typedef uint64_t(*PageHashKernel)(const void*);
+
+	struct PageCompareChoice {
+		PageCompareKernel	kernel;
+		PageHashKernel		hash;
+		const char*			name;
+	};
+
+	static PageCompareChoice choose_kernel() {
+		init_hash_secret();
+#ifdef PAGE_COMPARE_X86
+		if (cpu_has_avx2()) {
+			return { pages_equal_avx2, hash_page_avx2, "avx2" };
+		}
+		if (cpu_has_sse2()) {
+			return { pages_equal_sse2, hash_page_sse2, "sse2" };
+		}
+#endif
+		return { pages_equal_scalar, hash_page_scalar, "scalar" };
+	}
+
+	static const PageCompareChoice& get_choice() {
+		static const PageCompareChoice choice = choose_kernel();
+		return choice;
+	}
+
+	bool pages_equal(const void* a, const void* b) {
+		return get_choice().kernel(a, b);
+	}
+
+	uint64_t hash_page(const void* page) {
+		return get_choice().hash(page);
+	}
+
+	const char* get_page_compare_kernel() {
+		return get_choice().name;
+	}
+}
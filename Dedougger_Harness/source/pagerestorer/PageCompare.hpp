@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+#include "platform/platform.h"
+
+namespace dedougger {
+	/**
+	 * Page comparison for READ_ONLY_PAGES differential restores - tells whether a page still matches its backup.
+	 *
+	 *	There's an AVX2, an SSE2 and a plain 64 bit kernel.  The fastest one the CPU (and OS, for the AVX
+	 *	state) supports is picked on first use; x86 CPUs without SSE2 and other architectures get the scalar
+	 *	one.  The kernels only say whether the pages are equal, and bail out at the first 256 byte block that
+	 *	isn't.
+	 *
+	 *	hash_page is for checking a page against a backup without reading the backup (restore verification).
+	 *	It's built like XXH3's long-input loop: eight 64 bit lanes, each 64 byte stripe mixed with a per-stripe
+	 *	key by a 32x32->64 multiply, which maps onto SSE2/AVX2 without 64 bit multiplies.  All the kernels
+	 *	compute the same hash.
+	 *
+	 *	Functions:
+	 *		pages_equal(a, b) - compares two BACKUP_PAGE_SIZE byte pages
+	 *		hash_page(page) - 64 bit hash of a BACKUP_PAGE_SIZE byte page
+	 *		get_page_compare_kernel() - name of the kernel pages_equal and hash_page use, for logging
+	 */
+	bool pages_equal(const void* a, const void* b);
+	uint64_t hash_page(const void* page);
+	const char* get_page_compare_kernel();
+}
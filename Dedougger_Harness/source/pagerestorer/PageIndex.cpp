@@ -0,0 +1,52 @@
+#include "PageIndex.hpp"
+#include <algorithm>
+
+namespace dedougger {
+
+	/* Adds a run of adjacent pages.  No tracked page can lie inside the run, so the pages above it move up once
+	 * to make room for all of it.
+		Args:
+			base - page aligned address of the first page
+			run - the pages' backups, in address order
+			count - number of pages
+	 */
+	void PageIndex::insert_run(LPVOID base, PageBackupEx* const* run, size_t count) {
+		size_t number = page_number(base);
+		size_t position = this->page_numbers.size();
+		if (count == 0) {
+			return;
+		}
+		if (!this->page_numbers.empty() && this->page_numbers.back() >= number) {
+			position = this->lower_bound(base);
+		}
+		this->page_numbers.insert(this->page_numbers.begin() + position, count, 0);
+		for (size_t i = 0; i < count; i++) {
+			this->page_numbers[position + i] = number + i;
+		}
+		this->pages.insert(this->pages.begin() + position, run, run + count);
+	}
+
+	/* Looks up the page an address lies in
+		Args:
+			address - any address, it doesn't have to be page aligned
+		Returns:
+			The page's backup, or nullptr if the page isn't in the index
+	 */
+	PageBackupEx* PageIndex::find(LPCVOID address) {
+		size_t position = this->lower_bound(address);
+		if (position == this->page_numbers.size() || this->page_numbers[position] != page_number(address)) {
+			return nullptr;
+		}
+		return this->pages[position];
+	}
+
+	size_t PageIndex::lower_bound(LPCVOID address) {
+		auto found = std::lower_bound(this->page_numbers.begin(), this->page_numbers.end(), page_number(address));
+		return found - this->page_numbers.begin();
+	}
+
+	void PageIndex::reserve(size_t count) {
+		this->page_numbers.reserve(count);
+		this->pages.reserve(count);
+	}
+}
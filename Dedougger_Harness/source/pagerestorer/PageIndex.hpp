@@ -0,0 +1,57 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "platform/platform.h"
+#include "PageBackupEx.h"
+
+namespace dedougger {
+	/**
+	 * PageIndex - maps target page addresses to their PageBackupEx.
+	 *
+	 *	Page numbers are kept sorted in one flat array with the descriptors in a parallel one, so a lookup is
+	 *	a binary search over densely packed 8 byte keys instead of a pointer chase through tree nodes, and
+	 *	walking a range of pages is a linear scan.  Snapshots are built in address order, so inserting is
+	 *	nearly always an append.  Regions saved later (push_state, top-down mmaps) can land below pages already
+	 *	tracked, which is what insert_run is for: the whole region goes in with one move of the pages above it
+	 *	instead of one per page.
+	 *
+	 *	Methods:
+	 *		insert(address, page) - adds a page, address has to be page aligned and not already present
+	 *		insert_run(base, pages, count) - adds count pages at base, base + page size and so on, none of which
+	 *			may be present
+	 *		find(address) - the page containing address, or nullptr
+	 *		lower_bound(address) - position of the first page at or above address
+	 *		size()/page_at(position)/address_at(position) - positional access in address order
+	 *		reserve(count) - makes room for count pages up front
+	 *		remove_if(predicate) - drops every page the predicate returns true for
+	 */
+	class PageIndex {
+		std::vector<size_t>			page_numbers;
+		std::vector<PageBackupEx*>	pages;
+
+		static size_t page_number(LPCVOID address) { return (size_t)address / PageBackupEx::BACKUP_PAGE_SIZE; }
+	public:
+		void insert(LPVOID address, PageBackupEx* page) { this->insert_run(address, &page, 1); }
+		void insert_run(LPVOID base, PageBackupEx* const* run, size_t count);
+		PageBackupEx* find(LPCVOID address);
+		size_t lower_bound(LPCVOID address);
+		size_t size() { return this->pages.size(); }
+		PageBackupEx* page_at(size_t position) { return this->pages[position]; }
+		LPVOID address_at(size_t position) { return (LPVOID)(this->page_numbers[position] * PageBackupEx::BACKUP_PAGE_SIZE); }
+		void reserve(size_t count);
+
+		template <class Predicate>
+		void remove_if(Predicate predicate) {
+			size_t kept = 0;
+			for (size_t i = 0; i < this->pages.size(); i++) {
+				if (!predicate(this->pages[i])) {
+					this->page_numbers[kept] = this->page_numbers[i];
+					this->pages[kept] = this->pages[i];
+					kept++;
+				}
+			}
+			this->page_numbers.resize(kept);
+			this->pages.resize(kept);
+		}
+	};
+}
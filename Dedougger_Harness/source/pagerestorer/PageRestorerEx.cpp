@@ -1,14 +1,130 @@
 #include "PageRestorerEx.h"
+#include <algorithm>
 #include <vector>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include "dexception.h"
+#include "PageCompare.hpp"
 
 namespace dedougger {
+
+	const size_t pageSize = 0x1000;
+	//
+	// Divergent pages printed per verification, the rest are only counted
+	//
+	const size_t MAX_REPORTED_DIVERGENCES = 8;
+	//
+	// Shortest run of zero pages discarded instead of written.  An injected madvise costs about as much as
+	// writing 16 to 32 pages.
+	//
+	const size_t ZERO_DISCARD_MIN_PAGES = 32;
+
+	/* The protection private memory gets in place of a mapped view's.  Copy-on-write only exists for views. */
+	static DWORD private_protection(DWORD protect) {
+		DWORD modifiers = protect & (PAGE_GUARD | PAGE_NOCACHE | PAGE_WRITECOMBINE);
+		switch (protect & ~modifiers) {
+		case PAGE_WRITECOPY:
+			return PAGE_READWRITE | modifiers;
+		case PAGE_EXECUTE_WRITECOPY:
+			return PAGE_EXECUTE_READWRITE | modifiers;
+		default:
+			return protect;
+		}
+	}
+
+#ifdef __linux__
+	//
+	// Bit 55 of a pagemap entry is the page's soft-dirty bit
+	//
+	const uint64_t PAGEMAP_SOFT_DIRTY = 1ull << 55;
+
+	/* Checks whether the kernel maintains soft-dirty bits.  Without CONFIG_MEM_SOFT_DIRTY clear_refs still
+	 * accepts "4" and pagemap just never reports anything dirty, so the only way to tell is to dirty one of
+	 * our own pages and look.
+	 */
+	static bool soft_dirty_supported() {
+		static int supported = -1;
+		if (supported != -1) {
+			return supported;
+		}
+		supported = 0;
+		int clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+		int pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+		void* probe = mmap(nullptr, pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (clear_refs_fd != -1 && pagemap_fd != -1 && probe != MAP_FAILED) {
+			uint64_t entry = 0;
+			*(volatile char*)probe = 1;
+			if (write(clear_refs_fd, "4", 1) == 1) {
+				*(volatile char*)probe = 2;
+				if (pread(pagemap_fd, &entry, sizeof(entry), ((size_t)probe / pageSize) * sizeof(entry)) == sizeof(entry)) {
+					supported = (entry & PAGEMAP_SOFT_DIRTY) != 0;
+				}
+			}
+		}
+		if (probe != MAP_FAILED) {
+			munmap(probe, pageSize);
+		}
+		if (clear_refs_fd != -1) {
+			close(clear_refs_fd);
+		}
+		if (pagemap_fd != -1) {
+			close(pagemap_fd);
+		}
+		return supported;
+	}
+#endif
 	
 	PageRestorerEx::PageRestorerEx(DWORD processId) {
 		this->free_unknown_pages	= true;
+		this->privatize_mapped		= true;
+		this->mappings_privatized	= 0;
 		this->processId				= processId;
+		this->pages_scanned			= 0;
+		this->pages_restored		= 0;
+		this->pages_compared		= 0;
+		this->pages_not_resident	= 0;
+		this->pages_discarded		= 0;
+		this->write_faults			= 0;
+		this->restore_count			= 0;
+		this->hot_page_streak		= 8;
+		this->hot_page_period		= 1024;
+		this->hot_pages				= 0;
+		this->hot_page_restores		= 0;
+		this->parallel_restore_threshold = 0;
+		this->metrics				= nullptr;
+		this->verify_interval		= 0;
+		this->verify_sample_pages	= 0;
+		this->verify_cursor			= 0;
+		this->pages_verified		= 0;
+		this->divergent_pages		= 0;
+		this->layout_ranges_restored = 0;
+#ifdef _WIN32
 		this->mmgType				= MMapGenerationType::WORKING_SET;
 		this->pdType				= PageDifferentialType::MEMORY_WATCH;
+#else
+		//
+		// There's no working set API on Linux, but /proc tells us what's mapped and what's resident.  Soft-dirty
+		// tracking is cheaper than taking a fault through the debugger for every first write.
+		//
+		this->mmgType				= MMapGenerationType::PROC_PAGEMAP;
+		this->pdType				= PageDifferentialType::SOFT_DIRTY;
+		this->pagemap_fd			= -1;
+		this->clear_refs_fd			= -1;
+		this->layout_journal		= false;
+		this->program_break			= 0;
+		if (!soft_dirty_supported()) {
+			//
+			// Note write-protecting pages on Linux also makes the kernel's own writes to them fail,
+			// most visibly glibc's rseq area, so targets need GLIBC_TUNABLES=glibc.pthread.rseq=0.
+			//
+			printf("Kernel doesn't track soft-dirty pages (CONFIG_MEM_SOFT_DIRTY), falling back to memory watch\n");
+			this->pdType			= PageDifferentialType::MEMORY_WATCH;
+		}
+#endif
 		this->process_handle		= OpenProcess(PROCESS_ALL_ACCESS, false, processId);
 
 		if (this->process_handle == INVALID_HANDLE_VALUE) {
@@ -16,28 +132,109 @@ namespace dedougger {
 		}
 	}
 
-	int PageRestorerEx::save_state() {
-		
-		PSAPI_WORKING_SET_INFORMATION singleSetInfo;
-		PSAPI_WORKING_SET_INFORMATION* completeSetInfo;
-		bool queryResult = QueryWorkingSet(this->process_handle, &singleSetInfo, sizeof(singleSetInfo));
-		assert(!queryResult && ERROR_BAD_LENGTH == GetLastError());
-		uint64_t numEntries = singleSetInfo.NumberOfEntries;
-		size_t completeSetSize = sizeof(PSAPI_WORKING_SET_INFORMATION) * numEntries;
-		completeSetInfo = (PSAPI_WORKING_SET_INFORMATION*)malloc(completeSetSize);
-		queryResult = QueryWorkingSet(this->process_handle, &completeSetInfo, completeSetSize);
-
-		assert(InitializeProcessForWsWatch(this->process_handle));
+	PageRestorerEx::~PageRestorerEx() {
+#ifdef __linux__
+		if (this->pagemap_fd != -1) {
+			close(this->pagemap_fd);
+		}
+		if (this->clear_refs_fd != -1) {
+			close(this->clear_refs_fd);
+		}
+#endif
+	}
 
+	void PageRestorerEx::set_page_differential_type(PageDifferentialType type) {
 		//
-		// We don't really care about the performance of save state - it's only called once, 
-		// whereas restore state will be called hundreds of thousands of times.  So, even
-		// though this class's API looks like it has functionality to use working set to 
-		// save state, it is unused (for now).
+		// Soft-dirty bits and userfaultfd only exist on Linux
 		//
-		return this->save_state_working_set();		
+#ifdef __linux__
+		bool supported = type == PageDifferentialType::MEMORY_WATCH ||
+			type == PageDifferentialType::READ_ONLY_PAGES ||
+			type == PageDifferentialType::USERFAULTFD_WP ||
+			(type == PageDifferentialType::SOFT_DIRTY && soft_dirty_supported());
+#else
+		bool supported = type == PageDifferentialType::MEMORY_WATCH ||
+			type == PageDifferentialType::READ_ONLY_PAGES;
+#endif
+		if (type == PageDifferentialType::READ_ONLY_PAGES) {
+			printf("Comparing pages with the %s kernel\n", get_page_compare_kernel());
+		}
+		if (!supported) {
+			throw UnsupportedPageDifferentialTypeException();
+		}
+		this->pdType = type;
 	}
 
+	void PageRestorerEx::set_mmap_generation_type(MMapGenerationType type) {
+#ifdef __linux__
+		bool supported = type == MMapGenerationType::VIRTUAL_QUERY || type == MMapGenerationType::PROC_PAGEMAP;
+#else
+		bool supported = type == MMapGenerationType::VIRTUAL_QUERY || type == MMapGenerationType::WORKING_SET;
+#endif
+		if (!supported) {
+			throw UnsupportedMMapGenerationTypeException();
+		}
+		this->mmgType = type;
+	}
+
+	int PageRestorerEx::save_state() {
+		int pages_saved = 0;
+		this->scope.resolve_modules(this->process_handle);
+#ifdef __linux__
+		if (this->pdType == PageDifferentialType::USERFAULTFD_WP && !this->uffd_tracker) {
+			this->uffd_tracker = std::make_unique<UffdWriteTracker>(this->processId);
+		}
+		if (this->layout_journal) {
+			this->start_layout_journal();
+		}
+		else {
+			this->program_break = this->query_program_break();
+			this->reserved_regions.clear();
+		}
+#endif
+		if (this->mmgType == MMapGenerationType::VIRTUAL_QUERY) {
+			pages_saved = this->save_state_virtual_query();
+		}
+#ifdef __linux__
+		else if (this->mmgType == MMapGenerationType::PROC_PAGEMAP) {
+			pages_saved = this->save_state_proc_maps();
+		}
+#endif
+#ifdef _WIN32
+		else {
+			PSAPI_WORKING_SET_INFORMATION singleSetInfo;
+			PSAPI_WORKING_SET_INFORMATION* completeSetInfo;
+			bool queryResult = QueryWorkingSet(this->process_handle, &singleSetInfo, sizeof(singleSetInfo));
+			assert(!queryResult && ERROR_BAD_LENGTH == GetLastError());
+			uint64_t numEntries = singleSetInfo.NumberOfEntries;
+			size_t completeSetSize = sizeof(PSAPI_WORKING_SET_INFORMATION) * numEntries;
+			completeSetInfo = (PSAPI_WORKING_SET_INFORMATION*)malloc(completeSetSize);
+			queryResult = QueryWorkingSet(this->process_handle, &completeSetInfo, completeSetSize);
+
+			assert(InitializeProcessForWsWatch(this->process_handle));
+
+			//
+			// We don't really care about the performance of save state - it's only called once, 
+			// whereas restore state will be called hundreds of thousands of times.  So, even
+			// though this class's API looks like it has functionality to use working set to 
+			// save state, it is unused (for now).
+			//
+			pages_saved = this->save_state_working_set();
+		}
+#endif
+
+#ifdef __linux__
+		if (this->pdType == PageDifferentialType::SOFT_DIRTY) {
+			//
+			// Everything written from here on is what the iteration did
+			//
+			this->clear_soft_dirty();
+		}
+#endif
+		return pages_saved;
+	}
+
+#ifdef _WIN32
 	int PageRestorerEx::save_page(const PSAPI_WORKING_SET_BLOCK *block_info) {
 		MEMORY_BASIC_INFORMATION mem_info = set_block_to_mem_info(block_info);
 #ifdef _DEBUG
@@ -49,32 +246,216 @@ namespace dedougger {
 			assert(mem_info.Protect == mem_info_test.Protect);
 		
 #endif
-		int pagesSaved = this->save_page(&mem_info);
+		//
+		// The working set only tells us about single pages, so each one gets its own region record
+		//
+		int pagesSaved = this->save_mapping(&mem_info);
 		return pagesSaved;
 	}
+#endif
 
-	int PageRestorerEx::save_page(PMEMORY_BASIC_INFORMATION mem_info) {
-		PageBackupEx* page = nullptr;
-		
-		auto found = this->pages.find(mem_info->BaseAddress);
-		if (found != this->pages.end())
-		{
+	/* Backs up every page of a committed region
+		Args:
+			mem_info - the region as VirtualQueryEx describes it
+			resident - optional, one flag per page of the region.  Pages without the flag aren't read and are
+				saved as zero pages, which only holds for private anonymous memory.
+		Returns:
+			The number of pages backed up
+	 */
+	int PageRestorerEx::save_region(PMEMORY_BASIC_INFORMATION mem_info, const uint8_t* resident) {
+		//
+		// We're using a static vector here to avoid the allocs/frees on every region.
+		//
+		static std::vector<BYTE> contents;
+		PageRegion* region = nullptr;
+		SIZE_T bytes_read = 0;
+		DWORD page_guard = 0;
+		DWORD old_protect = 0;
+		DWORD old_protect2 = 0;
+
+		auto found = this->regions.find(mem_info->BaseAddress);
+		if (found != this->regions.end()) {
 			//
-			// If the page is already tracked, use the existing page.
+			// If the region is already tracked, use the existing record.
 			//
-			 page = this->pages.at(mem_info->BaseAddress);
+			region = found->second;
 		} else {
+			region = new PageRegion();
+			this->regions[mem_info->BaseAddress] = region;
+		}
+		region->info = *mem_info;
+
+		//
+		// If the region isn't committed or can't be read, we can't back it up.  It's still
+		// recorded so restore doesn't take it for something the iteration allocated.
+		//
+		if (mem_info->State != MEM_COMMIT) {
+			printf("Attempt to backup non-committed page\n");
+			return 0;
+		}
+		else if (mem_info->Protect == PAGE_NOACCESS) {
+			printf("Attempt to backup no access page %p\n", mem_info->BaseAddress);
+			return 0;
+		}
+
+		if (found == this->regions.end()) {
+			this->start_tracking(region);
+		}
+
+		//
+		// Read the region in one go, or one go per run of resident pages.  If it's page guarded, we can't
+		// read it, so we'll have to clear the page guard protection, read it, and then restore the page guard.
+		//
+		SIZE_T page_count = mem_info->RegionSize / pageSize;
+		contents.resize(mem_info->RegionSize);
+		page_guard = mem_info->Protect & PAGE_GUARD;
+		if (page_guard) {
+			if (!VirtualProtectEx(this->process_handle, mem_info->BaseAddress, mem_info->RegionSize, PAGE_READONLY, &old_protect)) {
+				throw VirtualProtectFailedException();
+			}
+		}
+		SIZE_T run_start = 0;
+		while (run_start < page_count) {
+			if (resident != nullptr && !resident[run_start]) {
+				run_start++;
+				continue;
+			}
+			SIZE_T run_end = resident == nullptr ? page_count : run_start + 1;
+			while (run_end < page_count && resident[run_end]) {
+				run_end++;
+			}
+			SIZE_T run_size = (run_end - run_start) * pageSize;
+			bool success = ReadProcessMemory(this->process_handle,
+				(BYTE*)mem_info->BaseAddress + run_start * pageSize,
+				contents.data() + run_start * pageSize,
+				run_size,
+				&bytes_read);
+			if (!success || bytes_read != run_size) {
+				throw ReadProcessMemoryFailedException();
+			}
+			run_start = run_end;
+		}
+		if (page_guard) {
+			if (!VirtualProtectEx(this->process_handle, mem_info->BaseAddress, mem_info->RegionSize, old_protect, &old_protect2)) {
+				throw VirtualProtectFailedException();
+			}
+		}
+
+		int pages_saved = 0;
+		std::vector<PageBackupEx*> region_pages;
+		std::vector<PageBackupEx*> new_pages;
+		bool already_compared = found != this->regions.end() && region->compare_contents;
+		size_t run_start_page = 0;
+		for (SIZE_T offset = 0; offset < mem_info->RegionSize; offset += pageSize) {
+			LPVOID address = (BYTE*)mem_info->BaseAddress + offset;
+			const void* page_contents = contents.data() + offset;
+			if (resident != nullptr && !resident[offset / pageSize]) {
+				page_contents = PageStore::zero_page();
+				this->pages_not_resident++;
+			}
+			PVOID storage = this->page_store.intern(page_contents);
+			PageBackupEx* page = this->pages.find(address);
+			if (page == nullptr) {
+				page = this->arena.add_page(address, region, region->track_changes, storage);
+				new_pages.push_back(page);
+			}
+			else {
+				//
+				// The pages added since the last tracked one go into the index as one run
+				//
+				if (run_start_page < new_pages.size()) {
+					this->pages.insert_run(new_pages[run_start_page]->get_page_address(), new_pages.data() + run_start_page,
+						new_pages.size() - run_start_page);
+					run_start_page = new_pages.size();
+				}
+				this->page_store.release(page->get_backup());
+				page->set_backup(storage);
+			}
+			region_pages.push_back(page);
+			pages_saved++;
+		}
+		if (run_start_page < new_pages.size()) {
+			this->pages.insert_run(new_pages[run_start_page]->get_page_address(), new_pages.data() + run_start_page,
+				new_pages.size() - run_start_page);
+		}
+
+		//
+		// If we're to track changes to pages, write-protect the whole region at once.
+		// WARNING: write-protected changes will cause calls to WriteProcessMemory
+		// to fail on the page, which may break things that rely on this.
+		//
+		if (region->track_changes &&
+			!PageBackupEx::protect_range(this->process_handle, region, mem_info->BaseAddress, mem_info->RegionSize)) {
 			//
-			// If the page isn't already in the map, create a new PageBackupEx,
-			// add it to the map, and use it for the backup.
-			// 
-			page = new PageBackupEx(mem_info->BaseAddress, this->process_handle);
-			this->pages[mem_info->BaseAddress] = page;
+			// Nothing will tell us about writes to the region, so compare it on every restore instead
+			//
+			region->track_changes = false;
+			region->compare_contents = true;
+			for (PageBackupEx* page : region_pages) {
+				page->set_tracking_changes(false);
+			}
 		}
-		int result = page->backup(this->process_handle, mem_info);
-		return result;
+		//
+		// A region that was compared already only brings the pages it grew by, one that just started being
+		// compared (new, or it lost its write protection) brings all of them
+		//
+		if (region->compare_contents) {
+			std::vector<PageBackupEx*>& uncompared = already_compared ? new_pages : region_pages;
+			this->compared_pages.insert(this->compared_pages.end(), uncompared.begin(), uncompared.end());
+		}
+		return pages_saved;
+	}
+
+	/* Decides how writes to a newly saved region are detected.  Regions that end up tracking changes
+	 * themselves are write-protected by the caller once their pages are backed up.
+		Args:
+			region - the region, with its info filled in
+	 */
+	void PageRestorerEx::start_tracking(PageRegion* region) {
+		region->track_changes = this->pdType == PageDifferentialType::MEMORY_WATCH;
+		region->compare_contents = this->pdType == PageDifferentialType::READ_ONLY_PAGES;
+#ifdef __linux__
+		if (this->pdType == PageDifferentialType::USERFAULTFD_WP) {
+			//
+			// Only anonymous memory can be write-protected through userfaultfd, everything else is
+			// watched with page protections like MEMORY_WATCH does.
+			//
+			bool writable = (region->info.Protect & (PAGE_READWRITE | PAGE_EXECUTE_READWRITE)) != 0;
+			region->track_changes = !(writable && region->info.Type == MEM_PRIVATE &&
+				this->uffd_tracker->track_range((size_t)region->info.BaseAddress, region->info.RegionSize));
+		}
+#endif
+	}
+
+	/* Finds the tracked region an address lies in
+		Returns:
+			The region, or nullptr if the address isn't in one
+	 */
+	PageRegion* PageRestorerEx::find_region(LPVOID address) {
+		auto found = this->regions.upper_bound(address);
+		if (found == this->regions.begin()) {
+			return nullptr;
+		}
+		found--;
+		PageRegion* region = found->second;
+		if ((BYTE*)address >= (BYTE*)region->info.BaseAddress + region->info.RegionSize) {
+			return nullptr;
+		}
+		return region;
+	}
+
+	/* Checks whether any tracked region overlaps a mapping */
+	bool PageRestorerEx::overlaps_region(PMEMORY_BASIC_INFORMATION mem_info) {
+		auto found = this->regions.lower_bound((BYTE*)mem_info->BaseAddress + mem_info->RegionSize);
+		if (found == this->regions.begin()) {
+			return false;
+		}
+		found--;
+		PageRegion* region = found->second;
+		return (BYTE*)region->info.BaseAddress + region->info.RegionSize > (BYTE*)mem_info->BaseAddress;
 	}
 
+#ifdef _WIN32
 	int PageRestorerEx::save_state_working_set() {
 		SIZE_T bytes_returned = 0;
 		PVOID current_page = nullptr;
@@ -121,6 +502,7 @@ namespace dedougger {
 
 		return pages_saved;
 	}
+#endif
 
 	int PageRestorerEx::save_state_virtual_query() {
 		//
@@ -140,14 +522,18 @@ namespace dedougger {
 					// If and only if the page is committed, save a snapshot of it.
 					// Non committed pages are ignored.  
 					//
-					this->save_page(&mem_info);
-					pages_saved++;
+					pages_saved += this->save_mapping(&mem_info);
 					//
 					// Re-do the VirtualQuery call in case some pages got coalesced 
 					// after our VirtualProtect
 					//
 					bytes_returned = VirtualQueryEx(this->process_handle, current_page, &mem_info, sizeof(mem_info));
 				}
+#ifdef __linux__
+				else if (mem_info.State == MEM_RESERVE) {
+					this->record_reserved_region(&mem_info, nullptr);
+				}
+#endif
 				current_page = (BYTE*)current_page + mem_info.RegionSize;
 			}
 		} while (bytes_returned > 0);
@@ -156,61 +542,201 @@ namespace dedougger {
 	}
 
 	int PageRestorerEx::restore_state_virtual_query()	{
-		SIZE_T bytes_returned = 0;
-		MEMORY_BASIC_INFORMATION mem_info = { 0 };
-		PVOID current_page = nullptr;
 		//
 		// We're using a static vector here to avoid the allocs/frees on every state restoration.
 		// I know I know, premature optimziation and all that.
 		//
 		static std::vector<PageBackupEx*> tracked_pages;
+		static std::vector<MEMORY_BASIC_INFORMATION> mappings;
 		tracked_pages.clear();
 
 		int pages_restored = 0;
-		int pages_killed = 0;
+#ifdef __linux__
+		if (this->layout_journal) {
+			//
+			// undo_layout_changes has already dealt with whatever the iteration mapped, only the pages are left
+			//
+			this->collect_dirty_pages(tracked_pages);
+			return this->restore_pages(tracked_pages);
+		}
+#endif
 		//
 		// Enumerate all pages.  If it's a page we track, restore it.
 		// If it's not a page we track, free it since it was likely 
 		// allocated during the fuzz iteration.
 		//
+		this->read_mappings(&mappings);
+		if (this->restore_layout(mappings)) {
+			this->read_mappings(&mappings);
+		}
+		for (MEMORY_BASIC_INFORMATION& mem_info : mappings) {
+			if (mem_info.State == MEM_COMMIT) {
+				this->collect_mapping_pages(&mem_info, tracked_pages);
+			}
+		}
 
-		do {
-			bytes_returned = VirtualQueryEx(this->process_handle, current_page, &mem_info, sizeof(mem_info));
-			if (bytes_returned > 0) {
-				current_page = mem_info.BaseAddress;
-				if (mem_info.State == MEM_COMMIT) {
-					//
-					// If and only if the page is committed do we restore it OR free it
-					// if it isn't tracked.
-					//
-					try {
-						tracked_pages.push_back(this->pages.at(mem_info.BaseAddress));
+		this->pages_scanned += tracked_pages.size();
+		pages_restored = this->restore_pages(tracked_pages);
 
-					}
-					catch (std::out_of_range e) {
-						// If it's not a page we're tracking, kill it
-						//printf("Freeing page\n");
-						bool success = VirtualFreeEx(this->process_handle, mem_info.BaseAddress, 0, MEM_RELEASE);
-						pages_killed++;
-						if (!success) {
-							int error = GetLastError();
-							int boo = 0;
+		return pages_restored;
+	}
 
-						}
-					}
-				}
-				current_page = (BYTE*)current_page + mem_info.RegionSize;
+	/* Backs up the parts of a committed mapping that are in scope.  With PROC_PAGEMAP only the pages
+	 * pagemap says are resident are read if it's private anonymous memory; anything else (files, shared
+	 * memory) reads back its backing store, so it's read whole.
+		Args:
+			mem_info - the mapping as VirtualQueryEx describes it
+			level - optional, the nested snapshot the mapping's regions are new at
+		Returns:
+			The number of pages backed up
+	 */
+	int PageRestorerEx::save_mapping(PMEMORY_BASIC_INFORMATION mem_info, SnapshotLevel* level) {
+		static std::vector<MEMORY_BASIC_INFORMATION> pieces;
+		int pages_saved = 0;
+		if (this->scope.is_restricted()) {
+			this->scope.select(mem_info, &pieces);
+		}
+		else {
+			pieces.assign(1, *mem_info);
+		}
+		if (!pieces.empty() && mem_info->Type == MEM_MAPPED && this->privatize_mapped && this->privatize_mapping(mem_info)) {
+			for (MEMORY_BASIC_INFORMATION& piece : pieces) {
+				piece.Type = mem_info->Type;
+				piece.Protect = mem_info->Protect;
 			}
-		} while (bytes_returned > 0);
+		}
+		for (MEMORY_BASIC_INFORMATION& piece : pieces) {
+			const uint8_t* resident_pages = nullptr;
+#ifdef __linux__
+			static std::vector<uint8_t> resident;
+			if (this->mmgType == MMapGenerationType::PROC_PAGEMAP && piece.Type == MEM_PRIVATE && piece.Protect != PAGE_NOACCESS) {
+				this->get_proc_map()->read_resident((size_t)piece.BaseAddress, piece.RegionSize / pageSize, &resident);
+				resident_pages = resident.data();
+			}
+#endif
+			pages_saved += this->save_region(&piece, resident_pages);
+			if (level != nullptr) {
+				level->new_regions.push_back(this->regions.at(piece.BaseAddress));
+			}
+		}
+		return pages_saved;
+	}
 
-		for (int i = tracked_pages.size() - 1; i >= 0; i--) {
-			tracked_pages[i]->restore(this->process_handle);
-			pages_restored++;
+	/* Replaces a mapped view of a file or shared memory with private memory holding the same contents.
+	 * Protection changes can fail on mapped views, so their pages couldn't be write watched, and restoring
+	 * them would write through to the file and whoever else maps it.  Once private they're tracked like any
+	 * other memory.
+		Args:
+			mem_info - the mapping.  If it's replaced its Type becomes MEM_PRIVATE and its Protect the private
+				equivalent of the view's.
+		Returns:
+			false if the view couldn't be read, in which case it's left mapped
+	 */
+	bool PageRestorerEx::privatize_mapping(PMEMORY_BASIC_INFORMATION mem_info) {
+		static std::vector<BYTE> contents;
+		SIZE_T bytes_transferred = 0;
+#ifdef _WIN32
+		//
+		// A view can only be unmapped whole, so every region of it is copied and gets its protection back
+		//
+		static std::vector<MEMORY_BASIC_INFORMATION> view_regions;
+		BYTE* view_base = (BYTE*)mem_info->AllocationBase;
+		BYTE* view_end = view_base;
+		MEMORY_BASIC_INFORMATION view_region;
+		view_regions.clear();
+		while (VirtualQueryEx(this->process_handle, view_end, &view_region, sizeof(view_region)) &&
+			view_region.AllocationBase == view_base && view_region.State != MEM_FREE) {
+			view_regions.push_back(view_region);
+			view_end += view_region.RegionSize;
+		}
+		contents.assign(view_end - view_base, 0);
+		for (const MEMORY_BASIC_INFORMATION& region : view_regions) {
+			if (region.State != MEM_COMMIT || (region.Protect & (PAGE_GUARD | PAGE_NOACCESS))) {
+				continue;
+			}
+			if (!ReadProcessMemory(this->process_handle, region.BaseAddress, contents.data() + ((BYTE*)region.BaseAddress - view_base),
+				region.RegionSize, &bytes_transferred) || bytes_transferred != region.RegionSize) {
+				printf("Couldn't read the mapped view at %p, it's left mapped\n", view_base);
+				return false;
+			}
+		}
+		if (!UnmapViewOfFile2(this->process_handle, view_base, 0)) {
+			printf("Couldn't unmap the view at %p, it's left mapped\n", view_base);
+			return false;
+		}
+		//
+		// The view is gone, from here on there's no going back
+		//
+		if (VirtualAllocEx(this->process_handle, view_base, view_end - view_base, MEM_RESERVE, PAGE_NOACCESS) == nullptr) {
+			throw VirtualAllocFailedException();
+		}
+		for (const MEMORY_BASIC_INFORMATION& region : view_regions) {
+			if (region.State != MEM_COMMIT) {
+				continue;
+			}
+			DWORD oldProtect = 0;
+			if (VirtualAllocEx(this->process_handle, region.BaseAddress, region.RegionSize, MEM_COMMIT, PAGE_READWRITE) == nullptr) {
+				throw VirtualAllocFailedException();
+			}
+			if (!WriteProcessMemory(this->process_handle, region.BaseAddress, contents.data() + ((BYTE*)region.BaseAddress - view_base),
+				region.RegionSize, &bytes_transferred)) {
+				throw WriteProcessMemoryFailedException();
+			}
+			if (!VirtualProtectEx(this->process_handle, region.BaseAddress, region.RegionSize, private_protection(region.Protect), &oldProtect)) {
+				throw VirtualProtectFailedException();
+			}
+		}
+#else
+		//
+		// mmap with MAP_FIXED swaps the view for anonymous memory in one go.  /proc/<pid>/mem writes through
+		// any protection, so the copy can go straight in.
+		//
+		contents.resize(mem_info->RegionSize);
+		if (!ReadProcessMemory(this->process_handle, mem_info->BaseAddress, contents.data(), mem_info->RegionSize, &bytes_transferred) ||
+			bytes_transferred != mem_info->RegionSize) {
+			//
+			// Pages of a file mapping past the end of the file can't be read
+			//
+			printf("Couldn't read the mapped view at %p, it's left mapped\n", mem_info->BaseAddress);
+			return false;
 		}
+		long result = this->get_backend()->RemoteSyscall(SYS_mmap, (long)mem_info->BaseAddress, (long)mem_info->RegionSize,
+			PageProtectionToProt(mem_info->Protect), MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		if (result != (long)mem_info->BaseAddress) {
+			printf("Couldn't replace the mapped view at %p, it's left mapped\n", mem_info->BaseAddress);
+			return false;
+		}
+		if (!WriteProcessMemory(this->process_handle, mem_info->BaseAddress, contents.data(), mem_info->RegionSize, &bytes_transferred)) {
+			throw WriteProcessMemoryFailedException();
+		}
+#endif
+		mem_info->Type = MEM_PRIVATE;
+		mem_info->Protect = private_protection(mem_info->Protect);
+		this->mappings_privatized++;
+		return true;
+	}
 
-		return pages_restored;
+	/* Adds the saved pages of a committed mapping to tracked_pages.  restore_layout has already freed the
+	 * mappings and parts of them the snapshot doesn't know.
+		Args:
+			mem_info - the mapping as VirtualQueryEx describes it
+			tracked_pages - receives the saved pages in the mapping
+	 */
+	void PageRestorerEx::collect_mapping_pages(PMEMORY_BASIC_INFORMATION mem_info, std::vector<PageBackupEx*>& tracked_pages) {
+		//
+		// Write watching splits our regions up page by page, and the snapshot scope can cut them out of
+		// the middle of a mapping, so what matters is whether the mapping overlaps one we saved.
+		//
+		if (this->overlaps_region(mem_info)) {
+			size_t page = this->pages.lower_bound(mem_info->BaseAddress);
+			LPVOID region_end = (BYTE*)mem_info->BaseAddress + mem_info->RegionSize;
+			for (; page < this->pages.size() && this->pages.address_at(page) < region_end; page++) {
+				tracked_pages.push_back(this->pages.page_at(page));
+			}
+		}
 	}
 
+#ifdef _WIN32
 	int PageRestorerEx::restore_state_working_set()	{
 		SIZE_T bytes_returned = 0;
 		PVOID current_page = nullptr;
@@ -244,16 +770,19 @@ namespace dedougger {
 			assert(qwsResult);
 		}
 
+		this->pages_scanned += workingSetPages->NumberOfEntries;
 		for (int i = 0; i < workingSetPages->NumberOfEntries; i++) {
 			PSAPI_WORKING_SET_BLOCK &page = workingSetPages->WorkingSetInfo[i];
 			current_page = (PVOID)(page.VirtualPage << 12);
-			auto tracked_candidate = this->pages.find(current_page);
-			if (tracked_candidate != this->pages.end()) {
-				tracked_pages.push_back(tracked_candidate->second);
+			PageBackupEx* tracked_candidate = this->pages.find(current_page);
+			MEMORY_BASIC_INFORMATION page_info = set_block_to_mem_info(&page);
+			if (tracked_candidate != nullptr) {
+				tracked_pages.push_back(tracked_candidate);
 			}
-			else {
+			else if (this->scope.contains(&page_info)) {
 				// If it's not a page we're tracking, kill it
 				//printf("Freeing page\n");
+				RestoreMetrics::PhaseTimer timer(this->metrics, RestoreMetrics::UNTRACKED_FREE);
 				bool success = VirtualFreeEx(this->process_handle, current_page, 0, MEM_RELEASE);
 				pages_killed++;
 				if (!success) {
@@ -263,85 +792,1622 @@ namespace dedougger {
 			}
 		}
 
-		
-		for (int i = tracked_pages.size() - 1; i >= 0; i--) {
-			auto tracked_page = tracked_pages[i];
-			if (tracked_page->is_dirty()) {
-				tracked_page->restore(this->process_handle);
-				pages_restored++;
-			}
-		}
+		pages_restored = this->restore_pages(tracked_pages);
 
 		return pages_restored;
 	}	
+#endif
 
-	int PageRestorerEx::restore_state() {
-		if (false) {
-			return this->restore_state_virtual_query();
+#ifdef __linux__
+	/* Resets the soft-dirty bit of every page in the target, so the next pagemap read only reports pages
+	 * written after this call.
+	 */
+	void PageRestorerEx::clear_soft_dirty() {
+		if (this->clear_refs_fd == -1) {
+			char clear_refs_path[64];
+			snprintf(clear_refs_path, sizeof(clear_refs_path), "/proc/%u/clear_refs", this->processId);
+			this->clear_refs_fd = open(clear_refs_path, O_WRONLY);
+			if (this->clear_refs_fd == -1) {
+				throw SoftDirtyTrackingFailedException();
+			}
 		}
-		else {
-			return this->restore_state_working_set();
+		//
+		// "4" clears only the soft-dirty bits, leaving the referenced/accessed bits alone
+		//
+		if (write(this->clear_refs_fd, "4", 1) != 1) {
+			throw SoftDirtyTrackingFailedException();
 		}
 	}
 
-	bool PageRestorerEx::touch_address(LPVOID address) {
-		auto potential_block = this->pages.upper_bound(address);
-		if (potential_block == this->pages.end()) {
-			return false;
+	/* Marks every tracked page the kernel reports written dirty
+		Args:
+			dirty_pages - receives the dirty pages, in address order
+	 */
+	void PageRestorerEx::collect_soft_dirty_pages(std::vector<PageBackupEx*>& dirty_pages) {
+		static std::vector<uint64_t> pagemap_entries;
+		dirty_pages.clear();
+
+		if (this->pagemap_fd == -1) {
+			char pagemap_path[64];
+			snprintf(pagemap_path, sizeof(pagemap_path), "/proc/%u/pagemap", this->processId);
+			this->pagemap_fd = open(pagemap_path, O_RDONLY);
+			if (this->pagemap_fd == -1) {
+				throw SoftDirtyTrackingFailedException();
+			}
 		}
-		potential_block--;
-		bool touched = false;
-		if (potential_block != this->pages.end()) {
-			PVOID lastByte = potential_block->second->get_page_last_byte();
-			if ( lastByte > address) {
-				potential_block->second->mark_dirty(this->process_handle);
-				touched = true;
+
+		//
+		// Walk the arena in runs of consecutive addresses, one pagemap read per run
+		//
+		PageBackupEx* pages = this->arena.begin();
+		size_t page_total = this->arena.size();
+		for (size_t first = 0; first < page_total;) {
+			size_t last = first + 1;
+			while (last < page_total && pages[last].get_page_address() == pages[last - 1].get_page_last_byte()) {
+				last++;
 			}
-			else {
+			size_t page_count = last - first;
+			size_t first_page = (size_t)pages[first].get_page_address() / pageSize;
+			pagemap_entries.resize(page_count);
+			ssize_t bytes_read = pread(this->pagemap_fd,
+				pagemap_entries.data(),
+				page_count * sizeof(uint64_t),
+				first_page * sizeof(uint64_t));
+			if (bytes_read != (ssize_t)(page_count * sizeof(uint64_t))) {
+				throw SoftDirtyTrackingFailedException();
+			}
+			this->pages_scanned += page_count;
+
+			for (size_t i = 0; i < page_count; i++) {
 				//
-				// Page isn't in our map.  Do nothing.
+				// restore_layout marks the pages of the regions it mapped again dirty itself
 				//
+				if ((pagemap_entries[i] & PAGEMAP_SOFT_DIRTY) || pages[first + i].is_dirty()) {
+					pages[first + i].set_dirty();
+					dirty_pages.push_back(&pages[first + i]);
+				}
 			}
+			first = last;
 		}
-		else {
-			//
-			// Page isn't in our map.  Do nothing.
-			//
-		}
-		return touched;
 	}
 
+	/* Restores every tracked page the kernel reports written
+		Returns:
+			The number of pages restored
+	 */
+	int PageRestorerEx::restore_state_soft_dirty() {
+		static std::vector<PageBackupEx*> dirty_pages;
+		int pages_restored = 0;
 
+		this->restore_unjournaled_layout();
+		this->collect_soft_dirty_pages(dirty_pages);
+		pages_restored = this->restore_pages(dirty_pages);
 
-	MEMORY_BASIC_INFORMATION set_block_to_mem_info(const PSAPI_WORKING_SET_BLOCK *block) {
-		MEMORY_BASIC_INFORMATION result;
-		DWORD protection = set_block_protection_to_mem_info_protection(block->Protection);
-		result.AllocationBase = (PVOID)(block->VirtualPage << 12);
-		result.AllocationProtect = protection;
-		result.BaseAddress = (PVOID)(block->VirtualPage << 12);
-		result.PartitionId = 0;
-		result.Protect = protection;
-		// The working set includes only physically available and allocated memory, thus it must
-		// be committed.
-		result.RegionSize = 4096; // all will be typical pages right?
-		result.State = MEM_COMMIT;
-		result.Type = 0; // TODO: Do we need to resolve this?
-		
-		return result;
+		//
+		// Our own writes just set the bits on everything we restored
+		//
+		this->clear_soft_dirty();
+		return pages_restored;
 	}
 
-	DWORD set_block_protection_to_mem_info_protection(ULONG_PTR protection) {
+	/* Marks every tracked page the fault thread or touch_address saw a write to dirty
+		Args:
+			dirty_pages - receives the dirty pages
+	 */
+	void PageRestorerEx::collect_userfaultfd_pages(std::vector<PageBackupEx*>& dirty_pages) {
+		static std::vector<size_t> fault_pages;
+		dirty_pages.clear();
+
+		this->uffd_tracker->take_dirty_pages(&fault_pages);
+		for (size_t fault_page : fault_pages) {
+			PageBackupEx* page = this->pages.find((LPVOID)fault_page);
+			if (page != nullptr) {
+				page->set_dirty();
+			}
+		}
+
 		//
-		// The memory set block protection is made up of flags, unlike the 
-		// MEMORY_BASIC_INFORMATION protection constants.  e.g. executable and
-		// read/write is Execute | ReadWrite in the memory set protection, where
-		// that doesn't work in the normal MEMORY_BASIC_INFORMATION constant.
+		// Pages that fell back to write watching were marked dirty through touch_address
 		//
-		DWORD result = 0;
-		DWORD base_protection = protection & 7;
-		
-		if (protection & 8) {
-			result |= PAGE_NOCACHE;
+		this->pages_scanned += this->arena.size();
+		for (PageBackupEx& page : this->arena) {
+			if (page.is_dirty()) {
+				dirty_pages.push_back(&page);
+			}
+		}
+	}
+
+	/* Restores every tracked page the fault thread or touch_address saw a write to
+		Returns:
+			The number of pages restored
+	 */
+	int PageRestorerEx::restore_state_userfaultfd() {
+		static std::vector<PageBackupEx*> restore_list;
+		int pages_restored = 0;
+
+		this->restore_unjournaled_layout();
+		this->collect_userfaultfd_pages(restore_list);
+		pages_restored = this->restore_pages(restore_list);
+		return pages_restored;
+	}
+
+	/* The dirty page modes only see the pages they track, so without the journal nothing would free what the
+	 * iteration allocated or map back a region it freed before its pages are written.  Walks the mappings the
+	 * way the enumerating restores do.
+	 */
+	void PageRestorerEx::restore_unjournaled_layout() {
+		static std::vector<MEMORY_BASIC_INFORMATION> mappings;
+		if (this->layout_journal) {
+			return;
+		}
+		this->read_mappings(&mappings);
+		this->restore_layout(mappings);
+	}
+
+	ProcMemoryMap* PageRestorerEx::get_proc_map() {
+		if (!this->proc_map) {
+			this->proc_map = std::make_unique<ProcMemoryMap>(this->processId);
+		}
+		return this->proc_map.get();
+	}
+
+	/* Backs up every committed mapping from one read of /proc/<pid>/maps
+		Returns:
+			The number of pages backed up, resident or not
+	 */
+	int PageRestorerEx::save_state_proc_maps() {
+		static std::vector<MEMORY_BASIC_INFORMATION> mappings;
+		int pages_saved = 0;
+		this->get_proc_map()->read_regions(&mappings);
+		for (MEMORY_BASIC_INFORMATION& mem_info : mappings) {
+			if (mem_info.State == MEM_COMMIT) {
+				pages_saved += this->save_mapping(&mem_info);
+			}
+			else if (mem_info.State == MEM_RESERVE) {
+				this->record_reserved_region(&mem_info, nullptr);
+			}
+		}
+		return pages_saved;
+	}
+
+	/* restore_state_virtual_query with the mappings taken from one read of /proc/<pid>/maps
+		Returns:
+			The number of pages restored
+	 */
+	int PageRestorerEx::restore_state_proc_maps() {
+		static std::vector<PageBackupEx*> tracked_pages;
+		static std::vector<MEMORY_BASIC_INFORMATION> mappings;
+		tracked_pages.clear();
+		if (this->layout_journal) {
+			this->collect_dirty_pages(tracked_pages);
+			return this->restore_pages(tracked_pages);
+		}
+
+		this->get_proc_map()->read_regions(&mappings);
+		if (this->restore_layout(mappings)) {
+			this->get_proc_map()->read_regions(&mappings);
+		}
+		for (MEMORY_BASIC_INFORMATION& mem_info : mappings) {
+			if (mem_info.State == MEM_COMMIT) {
+				this->collect_mapping_pages(&mem_info, tracked_pages);
+			}
+		}
+		this->pages_scanned += tracked_pages.size();
+		return this->restore_pages(tracked_pages);
+	}
+
+	/* Puts the runs of zero pages of private anonymous memory back with madvise(MADV_DONTNEED) inside the target
+	 * instead of writing them: the kernel drops the pages and the next access faults in a fresh zero page.
+	 * Injecting the syscall takes a few ptrace round trips, so runs shorter than ZERO_DISCARD_MIN_PAGES are
+	 * cheaper written.  File-backed and shared mappings are always written, DONTNEED would bring their file's
+	 * contents back or not zero them at all, and so is userfaultfd tracked memory, whose write protection
+	 * doesn't survive the pages being dropped on kernels without UFFD_FEATURE_WP_UNPOPULATED.
+		Args:
+			dirty_pages - the pages to restore, in address order
+			written_pages - receives the ones that still have to be written
+	 */
+	void PageRestorerEx::discard_zero_runs(const std::vector<PageBackupEx*>& dirty_pages, std::vector<PageBackupEx*>& written_pages) {
+		LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle(this->process_handle);
+		written_pages.clear();
+		for (size_t first = 0; first < dirty_pages.size();) {
+			size_t last = first + 1;
+			PageBackupEx* page = dirty_pages[first];
+			bool discardable = backend != nullptr && !this->uffd_tracker && page->get_backup() == PageStore::zero_page() &&
+				page->get_region()->info.Type == MEM_PRIVATE;
+			if (discardable) {
+				while (last < dirty_pages.size() && dirty_pages[last]->get_backup() == PageStore::zero_page() &&
+					dirty_pages[last]->get_region() == page->get_region() &&
+					dirty_pages[last]->get_page_address() == dirty_pages[last - 1]->get_page_last_byte()) {
+					last++;
+				}
+				discardable = last - first >= ZERO_DISCARD_MIN_PAGES &&
+					backend->RemoteSyscall(SYS_madvise, (long)page->get_page_address(), (long)((last - first) * pageSize), MADV_DONTNEED) == 0;
+			}
+			for (size_t i = first; i < last; i++) {
+				if (discardable) {
+					dirty_pages[i]->set_clean();
+				}
+				else {
+					written_pages.push_back(dirty_pages[i]);
+				}
+			}
+			if (discardable) {
+				this->pages_discarded += last - first;
+			}
+			first = last;
+		}
+	}
+
+	/* Asks the target where its program break is, so restores that find the heap changed can put it back
+		Returns:
+			The break, or 0 if it can't be found out
+	 */
+	size_t PageRestorerEx::query_program_break() {
+		LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle(this->process_handle);
+		if (backend == nullptr) {
+			return 0;
+		}
+		long result = backend->RemoteSyscall(SYS_brk, 0);
+		return result > 0 ? (size_t)result : 0;
+	}
+
+	LinuxDebugBackend* PageRestorerEx::get_backend() {
+		LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle(this->process_handle);
+		if (backend == nullptr) {
+			throw LayoutJournalFailedException();
+		}
+		return backend;
+	}
+
+	/* Undo the layout changes the debug backend journals on restore, instead of walking the address space
+		Args:
+			enable - true to use the journal.  Has to be set before save_state() or load_snapshot().
+	 */
+	void PageRestorerEx::set_layout_journal(bool enable) {
+		this->layout_journal = enable;
+		if (!enable) {
+			LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle(this->process_handle);
+			if (backend != nullptr) {
+				backend->SetLayoutJournaling(false);
+			}
+			this->layout_changes.clear();
+		}
+	}
+
+	/* Starts the backend's journal and takes the current layout as the one restores go back to */
+	void PageRestorerEx::start_layout_journal() {
+		LinuxDebugBackend* backend = this->get_backend();
+		backend->SetLayoutJournaling(true);
+		backend->TakeLayoutJournal(&this->layout_changes);
+		this->layout_changes.clear();
+		this->reserved_regions.clear();
+		this->program_break = backend->ProgramBreak();
+	}
+
+	/* Remembers address space the snapshot has reserved, so restores put reservations back instead of
+	 * unmapping them
+		Args:
+			mem_info - the reservation as VirtualQueryEx describes it
+			level - the snapshot level it was first seen at, nullptr for save_state()
+	 */
+	void PageRestorerEx::record_reserved_region(PMEMORY_BASIC_INFORMATION mem_info, SnapshotLevel* level) {
+		this->reserved_regions[mem_info->BaseAddress] = mem_info->RegionSize;
+		if (level != nullptr) {
+			level->new_reserved.push_back(mem_info->BaseAddress);
+		}
+	}
+
+	bool PageRestorerEx::find_reserved_region(size_t address, size_t* end) {
+		auto found = this->reserved_regions.upper_bound((LPVOID)address);
+		if (found == this->reserved_regions.begin()) {
+			return false;
+		}
+		found--;
+		*end = (size_t)found->first + found->second;
+		return address < *end;
+	}
+
+	/* Puts every range the target changed the layout of since the current snapshot back the way the
+	 * snapshot has it.  Saved pages in those ranges are marked dirty, so the restore rewrites them.
+	 */
+	void PageRestorerEx::undo_layout_changes() {
+		static std::vector<LayoutChange> journaled;
+		LinuxDebugBackend* backend = this->get_backend();
+		backend->TakeLayoutJournal(&journaled);
+		this->layout_changes.insert(this->layout_changes.end(), journaled.begin(), journaled.end());
+
+		//
+		// The kernel keeps its own idea of where the break is, so the heap has to be moved back with brk
+		// rather than unmapped, or the target's next brk works from the wrong end of it
+		//
+		size_t saved_break = this->levels.empty() ? this->program_break : this->levels.back().program_break;
+		if (saved_break != 0 && backend->ProgramBreak() != saved_break && !backend->MoveProgramBreak(saved_break)) {
+			throw VirtualAllocFailedException();
+		}
+		if (this->layout_changes.empty()) {
+			return;
+		}
+
+		//
+		// One pass over every distinct range, however many calls touched it
+		//
+		std::sort(this->layout_changes.begin(), this->layout_changes.end(), [](const LayoutChange& a, const LayoutChange& b) {
+			return a.address < b.address;
+		});
+		size_t start = this->layout_changes[0].address;
+		size_t end = start + this->layout_changes[0].size;
+		for (size_t i = 1; i < this->layout_changes.size(); i++) {
+			LayoutChange& change = this->layout_changes[i];
+			if (change.address > end) {
+				this->restore_range_layout(start, end);
+				start = change.address;
+			}
+			end = std::max(end, change.address + change.size);
+		}
+		this->restore_range_layout(start, end);
+		this->layout_changes.clear();
+	}
+
+	/* Puts one changed range back the way the current snapshot has it
+		Args:
+			start/end - page aligned bounds of the range
+	 */
+	void PageRestorerEx::restore_range_layout(size_t start, size_t end) {
+		size_t address = start;
+		while (address < end) {
+			MEMORY_BASIC_INFORMATION mem_info = { 0 };
+			DWORD old_protect = 0;
+			if (VirtualQueryEx(this->process_handle, (LPCVOID)address, &mem_info, sizeof(mem_info)) == 0) {
+				break;
+			}
+			size_t mapping_end = std::min(end, (size_t)mem_info.BaseAddress + mem_info.RegionSize);
+			//
+			// A mapping can cover saved regions, reservations and memory the snapshot never had
+			//
+			while (address < mapping_end) {
+				size_t part_end = mapping_end;
+				size_t reserved_end = 0;
+				PageRegion* region = this->find_region((LPVOID)address);
+				if (region != nullptr && region->info.State == MEM_COMMIT) {
+					part_end = std::min(part_end, (size_t)region->info.BaseAddress + region->info.RegionSize);
+					this->restore_region_layout(region, &mem_info, address, part_end);
+				}
+				else if (region != nullptr || this->find_reserved_region(address, &reserved_end)) {
+					if (region != nullptr) {
+						reserved_end = (size_t)region->info.BaseAddress + region->info.RegionSize;
+					}
+					part_end = std::min(part_end, reserved_end);
+					if (mem_info.State == MEM_FREE) {
+						if (VirtualAllocEx(this->process_handle, (LPVOID)address, part_end - address, MEM_RESERVE, PAGE_NOACCESS) != (LPVOID)address) {
+							throw VirtualAllocFailedException();
+						}
+					}
+					else if (mem_info.State == MEM_COMMIT &&
+						!VirtualProtectEx(this->process_handle, (LPVOID)address, part_end - address, PAGE_NOACCESS, &old_protect)) {
+						throw VirtualProtectFailedException();
+					}
+				}
+				else {
+					//
+					// Nothing the snapshot knows about, up to wherever the next thing it does know starts
+					//
+					auto next_region = this->regions.upper_bound((LPVOID)address);
+					if (next_region != this->regions.end()) {
+						part_end = std::min(part_end, (size_t)next_region->first);
+					}
+					auto next_reserved = this->reserved_regions.upper_bound((LPVOID)address);
+					if (next_reserved != this->reserved_regions.end()) {
+						part_end = std::min(part_end, (size_t)next_reserved->first);
+					}
+					MEMORY_BASIC_INFORMATION part_info = mem_info;
+					part_info.BaseAddress = (PVOID)address;
+					part_info.RegionSize = part_end - address;
+					if (mem_info.State != MEM_FREE && this->scope.contains(&part_info) &&
+						!VirtualFreeEx(this->process_handle, (LPVOID)address, part_end - address, MEM_RELEASE)) {
+						throw VirtualFreeFailedException();
+					}
+				}
+				address = part_end;
+			}
+		}
+		this->layout_ranges_restored++;
+	}
+
+#endif
+
+	/* Maps and protects part of a saved region the way it was saved, and marks its pages dirty
+		Args:
+			region - the saved region
+			mem_info - what the target has at start right now
+			start/end - page aligned part of the region to put back
+	 */
+	void PageRestorerEx::restore_region_layout(PageRegion* region, PMEMORY_BASIC_INFORMATION mem_info, size_t start, size_t end) {
+		SIZE_T size = end - start;
+		DWORD old_protect = 0;
+		DWORD allocation_type = MEM_RESERVE | MEM_COMMIT;
+#ifdef _WIN32
+		bool mapped = mem_info->State == MEM_COMMIT;
+		if (mem_info->State == MEM_RESERVE) {
+			allocation_type = MEM_COMMIT;
+		}
+#else
+		//
+		// Reserved memory is a PROT_NONE mapping, which reprotecting commits
+		//
+		bool mapped = mem_info->State != MEM_FREE;
+#endif
+		if (mapped && mem_info->Type != region->info.Type) {
+			//
+			// Something else was mapped over the region, a file maybe.  Our pages don't belong in it.
+			//
+			if (!this->release_range(mem_info, start, end)) {
+				throw VirtualFreeFailedException();
+			}
+#ifdef _WIN32
+			MEMORY_BASIC_INFORMATION released = { 0 };
+			if (VirtualQueryEx(this->process_handle, (LPCVOID)start, &released, sizeof(released)) && released.State == MEM_RESERVE) {
+				allocation_type = MEM_COMMIT;
+			}
+#endif
+			mapped = false;
+		}
+		if (!mapped) {
+			if (VirtualAllocEx(this->process_handle, (LPVOID)start, size, allocation_type, region->info.Protect) != (LPVOID)start) {
+				throw VirtualAllocFailedException();
+			}
+		}
+		else if (mem_info->Protect != region->info.Protect &&
+			!VirtualProtectEx(this->process_handle, (LPVOID)start, size, region->info.Protect, &old_protect)) {
+			throw VirtualProtectFailedException();
+		}
+#ifdef __linux__
+		if (this->uffd_tracker && !region->track_changes && !region->compare_contents) {
+			//
+			// userfaultfd registrations belong to the mapping, one that's been replaced has lost ours
+			//
+			this->uffd_tracker->track_range(start, size);
+		}
+#endif
+		for (size_t i = this->pages.lower_bound((LPVOID)start); i < this->pages.size() && this->pages.address_at(i) < (LPVOID)end; i++) {
+			this->pages.page_at(i)->set_dirty();
+		}
+	}
+
+	/* Frees part of a mapping the snapshot doesn't have there
+		Args:
+			mem_info - the mapping
+			start/end - page aligned part of it to free
+		Returns:
+			false if it couldn't be freed
+	 */
+	bool PageRestorerEx::release_range(PMEMORY_BASIC_INFORMATION mem_info, size_t start, size_t end) {
+#ifdef _WIN32
+		if (mem_info->Type == MEM_MAPPED) {
+			return UnmapViewOfFile2(this->process_handle, mem_info->AllocationBase, 0) != 0;
+		}
+		//
+		// Only whole allocations can be released.  Part of one goes back to being reserved, which is also how
+		// a stack the iteration grew gets its guard page back where it was.
+		//
+		MEMORY_BASIC_INFORMATION next = { 0 };
+		bool whole_allocation = (size_t)mem_info->AllocationBase == start &&
+			(!VirtualQueryEx(this->process_handle, (LPCVOID)end, &next, sizeof(next)) || next.AllocationBase != mem_info->AllocationBase);
+		if (whole_allocation) {
+			return VirtualFreeEx(this->process_handle, (LPVOID)start, 0, MEM_RELEASE) != 0;
+		}
+		return VirtualFreeEx(this->process_handle, (LPVOID)start, end - start, MEM_DECOMMIT) != 0;
+#else
+		return VirtualFreeEx(this->process_handle, (LPVOID)start, end - start, MEM_RELEASE) != 0;
+#endif
+	}
+
+	/* Checks whether the target still has a saved region mapped the way it was saved.  Write watching
+	 * leaves pages with their watch protection or, once written, their own.
+	 */
+	static bool layout_matches(PageRegion* region, const MEMORY_BASIC_INFORMATION* mem_info) {
+		if (mem_info->State != MEM_COMMIT || mem_info->Type != region->info.Type) {
+			return false;
+		}
+		return mem_info->Protect == region->info.Protect ||
+			(region->track_changes && mem_info->Protect == PageBackupEx::get_watch_protection(region->info.Protect));
+	}
+
+	/* Checks part of a write watched region for pages that are writable without having been written.  The
+	 * iteration mapped fresh memory over them with the protection they were saved with.
+		Args:
+			region - the saved region
+			mem_info - what the target has there
+			start/end - page aligned part of the region to check
+	 */
+	bool PageRestorerEx::lost_write_watch(PageRegion* region, const MEMORY_BASIC_INFORMATION* mem_info, size_t start, size_t end) {
+		if (!region->track_changes || mem_info->State != MEM_COMMIT || mem_info->Protect != region->info.Protect ||
+			mem_info->Protect == PageBackupEx::get_watch_protection(region->info.Protect)) {
+			return false;
+		}
+		for (size_t i = this->pages.lower_bound((LPVOID)start); i < this->pages.size() && this->pages.address_at(i) < (LPVOID)end; i++) {
+			PageBackupEx* page = this->pages.page_at(i);
+			if (!page->is_dirty() && !page->is_hot()) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/* Maps the saved regions in a range again where the target doesn't have them the way they were saved,
+	 * e.g. the stack of a thread that exited, and marks their pages dirty so the next restore_state() writes
+	 * them.  Address space walk restores do this for all memory by themselves; the write watch ones only
+	 * look at pages that are still there.
+		Args:
+			start/end - the range, rounded out to pages
+		Returns:
+			Number of parts put back
+	 */
+	int PageRestorerEx::restore_range(size_t start, size_t end) {
+		int parts_restored = 0;
+		start &= ~(PageBackupEx::BACKUP_PAGE_SIZE - 1);
+		end = (end + PageBackupEx::BACKUP_PAGE_SIZE - 1) & ~(PageBackupEx::BACKUP_PAGE_SIZE - 1);
+		MEMORY_BASIC_INFORMATION mem_info = { 0 };
+#ifdef _WIN32
+		//
+		// Reserve the whole range first if it's gone, so the saved regions come back as one allocation the
+		// way a stack's committed part sits at the top of its reservation
+		//
+		if (VirtualQueryEx(this->process_handle, (LPCVOID)start, &mem_info, sizeof(mem_info)) && mem_info.State == MEM_FREE &&
+			(size_t)mem_info.BaseAddress + mem_info.RegionSize >= end) {
+			VirtualAllocEx(this->process_handle, (LPVOID)start, end - start, MEM_RESERVE, PAGE_NOACCESS);
+		}
+#endif
+		auto it = this->regions.upper_bound((LPVOID)start);
+		if (it != this->regions.begin()) {
+			it--;
+		}
+		for (; it != this->regions.end() && (size_t)it->first < end; it++) {
+			PageRegion* region = it->second;
+			size_t address = std::max(start, (size_t)region->info.BaseAddress);
+			size_t region_end = std::min(end, (size_t)region->info.BaseAddress + region->info.RegionSize);
+			if (region->info.State != MEM_COMMIT) {
+				continue;
+			}
+			while (address < region_end) {
+				if (VirtualQueryEx(this->process_handle, (LPCVOID)address, &mem_info, sizeof(mem_info)) == 0) {
+					throw VirtualQueryFailedException();
+				}
+				size_t part_end = std::min(region_end, (size_t)mem_info.BaseAddress + mem_info.RegionSize);
+				if (!layout_matches(region, &mem_info)) {
+					this->restore_region_layout(region, &mem_info, address, part_end);
+					parts_restored++;
+				}
+				address = part_end;
+			}
+		}
+		this->layout_ranges_restored += parts_restored;
+		return parts_restored;
+	}
+
+	/* Compares the target's mappings with the saved regions
+		Args:
+			mappings - the target's mappings in address order, free ones optional
+			unknown - receives the committed parts in scope that no saved region covers
+			changed - receives the parts of saved regions the target doesn't have mapped the way they were
+				saved, in address order: freed, decommitted, mapped over or reprotected.  Write watched pages
+				that lost their watch count as mapped over.
+	 */
+	void PageRestorerEx::find_layout_changes(const std::vector<MEMORY_BASIC_INFORMATION>& mappings,
+		std::vector<LayoutFix>& unknown, std::vector<LayoutFix>& changed) {
+		unknown.clear();
+		changed.clear();
+		for (const MEMORY_BASIC_INFORMATION& mem_info : mappings) {
+			if (mem_info.State != MEM_COMMIT) {
+				continue;
+			}
+			size_t address = (size_t)mem_info.BaseAddress;
+			size_t mapping_end = address + mem_info.RegionSize;
+			while (address < mapping_end) {
+				PageRegion* region = this->find_region((LPVOID)address);
+				if (region != nullptr) {
+					address = std::min(mapping_end, (size_t)region->info.BaseAddress + region->info.RegionSize);
+					continue;
+				}
+				//
+				// Nothing saved here up to wherever the next saved region starts: allocated by the iteration,
+				// or a region it grew or merged with its neighbour
+				//
+				size_t part_end = mapping_end;
+				bool reserved = false;
+				auto next_region = this->regions.upper_bound((LPVOID)address);
+				if (next_region != this->regions.end()) {
+					part_end = std::min(part_end, (size_t)next_region->first);
+				}
+#ifdef __linux__
+				//
+				// Address space the snapshot had reserved goes back to being reserved instead
+				//
+				size_t reserved_end = 0;
+				reserved = this->find_reserved_region(address, &reserved_end);
+				if (reserved) {
+					part_end = std::min(part_end, reserved_end);
+				}
+				else {
+					auto next_reserved = this->reserved_regions.upper_bound((LPVOID)address);
+					if (next_reserved != this->reserved_regions.end()) {
+						part_end = std::min(part_end, (size_t)next_reserved->first);
+					}
+				}
+#endif
+				MEMORY_BASIC_INFORMATION part = mem_info;
+				part.BaseAddress = (PVOID)address;
+				part.RegionSize = part_end - address;
+				if (this->scope.contains(&part)) {
+					unknown.push_back({ nullptr, mem_info, address, part_end, reserved });
+				}
+				address = part_end;
+			}
+		}
+
+		size_t mapping = 0;
+		for (auto& entry : this->regions) {
+			PageRegion* region = entry.second;
+			if (region->info.State != MEM_COMMIT) {
+				continue;
+			}
+			size_t address = (size_t)region->info.BaseAddress;
+			size_t region_end = address + region->info.RegionSize;
+			while (address < region_end) {
+				while (mapping < mappings.size() &&
+					(size_t)mappings[mapping].BaseAddress + mappings[mapping].RegionSize <= address) {
+					mapping++;
+				}
+				MEMORY_BASIC_INFORMATION current = { 0 };
+				size_t part_end = region_end;
+				if (mapping < mappings.size() && (size_t)mappings[mapping].BaseAddress <= address) {
+					current = mappings[mapping];
+					part_end = std::min(part_end, (size_t)current.BaseAddress + current.RegionSize);
+				}
+				else {
+					//
+					// A gap between mappings, the region was unmapped
+					//
+					current.BaseAddress = (PVOID)address;
+					current.State = MEM_FREE;
+					if (mapping < mappings.size()) {
+						part_end = std::min(part_end, (size_t)mappings[mapping].BaseAddress);
+					}
+				}
+				if (!layout_matches(region, &current) || this->lost_write_watch(region, &current, address, part_end)) {
+					changed.push_back({ region, current, address, part_end, false });
+				}
+				address = part_end;
+			}
+		}
+	}
+
+	/* Puts the saved regions back where and how they were saved and frees whatever the iteration mapped
+	 * around them, before the pages are restored.  Regions the iteration freed, shrank, split, merged into
+	 * something else or reprotected are mapped again at their own addresses and their pages marked dirty;
+	 * memory it allocated or grew a region by goes.
+		Args:
+			mappings - the target's mappings in address order, free ones optional
+		Returns:
+			true if the layout had changed, in which case mappings no longer describes the target
+	 */
+	bool PageRestorerEx::restore_layout(std::vector<MEMORY_BASIC_INFORMATION>& mappings) {
+		static std::vector<LayoutFix> unknown;
+		static std::vector<LayoutFix> changed;
+		this->find_layout_changes(mappings, unknown, changed);
+		if (unknown.empty() && changed.empty()) {
+			return false;
+		}
+		RestoreMetrics::PhaseTimer timer(this->metrics, RestoreMetrics::UNTRACKED_FREE);
+#ifdef __linux__
+		//
+		// The heap can only be put back with brk, the kernel keeps its own idea of where the break is.  Moving
+		// it maps or unmaps the difference itself, so look again afterwards.
+		//
+		size_t saved_break = this->levels.empty() ? this->program_break : this->levels.back().program_break;
+		if (saved_break != 0) {
+			LinuxDebugBackend* backend = this->get_backend();
+			if ((size_t)backend->RemoteSyscall(SYS_brk, 0) != saved_break) {
+				if (!backend->MoveProgramBreak(saved_break)) {
+					throw VirtualAllocFailedException();
+				}
+				this->read_mappings(&mappings);
+				this->find_layout_changes(mappings, unknown, changed);
+			}
+		}
+#endif
+		for (LayoutFix& fix : unknown) {
+			DWORD old_protect = 0;
+			if (fix.reserved) {
+				VirtualProtectEx(this->process_handle, (LPVOID)fix.start, fix.end - fix.start, PAGE_NOACCESS, &old_protect);
+			}
+			else {
+				this->release_range(&fix.current, fix.start, fix.end);
+			}
+		}
+		//
+		// Adjacent parts that are put back the same way take one call between them
+		//
+		auto same_fix = [](const LayoutFix& a, const LayoutFix& b) {
+			return a.end == b.start &&
+				a.region->info.Type == b.region->info.Type &&
+				a.region->info.Protect == b.region->info.Protect &&
+				a.region->track_changes == b.region->track_changes &&
+				a.region->compare_contents == b.region->compare_contents &&
+				a.current.State == b.current.State &&
+				a.current.Type == b.current.Type &&
+				a.current.Protect == b.current.Protect;
+		};
+		for (size_t first = 0; first < changed.size();) {
+			size_t last = first + 1;
+			while (last < changed.size() && same_fix(changed[last - 1], changed[last])) {
+				last++;
+			}
+			this->restore_region_layout(changed[first].region, &changed[first].current, changed[first].start, changed[last - 1].end);
+			this->layout_ranges_restored++;
+			first = last;
+		}
+		return true;
+	}
+
+	/* Lists the target's mappings in address order the way the memory map type enumerates them
+		Args:
+			mappings - receives the mappings, its previous contents are discarded
+	 */
+	void PageRestorerEx::read_mappings(std::vector<MEMORY_BASIC_INFORMATION>* mappings) {
+		SIZE_T bytes_returned = 0;
+		MEMORY_BASIC_INFORMATION mem_info = { 0 };
+		PVOID current_page = nullptr;
+#ifdef __linux__
+		if (this->mmgType == MMapGenerationType::PROC_PAGEMAP) {
+			this->get_proc_map()->read_regions(mappings);
+			return;
+		}
+#endif
+		mappings->clear();
+		do {
+			bytes_returned = VirtualQueryEx(this->process_handle, current_page, &mem_info, sizeof(mem_info));
+			if (bytes_returned > 0) {
+				mappings->push_back(mem_info);
+				current_page = (BYTE*)mem_info.BaseAddress + mem_info.RegionSize;
+			}
+		} while (bytes_returned > 0);
+	}
+
+	/* Finds where the run of adjacent pages of one region that starts at first ends
+		Returns:
+			The index one past the last page of the run
+	 */
+	static size_t page_run_end(const std::vector<PageBackupEx*>& pages, size_t first) {
+		size_t last = first + 1;
+		while (last < pages.size() &&
+			pages[last]->get_region() == pages[first]->get_region() &&
+			pages[last]->get_page_address() == pages[last - 1]->get_page_last_byte()) {
+			last++;
+		}
+		return last;
+	}
+
+	/* Writes the dirty pages in the list back in one batch and re-arms whatever tracks changes to them
+		Args:
+			tracked_pages - candidate pages, clean ones are dropped from the list
+		Returns:
+			The number of pages restored
+	 */
+	int PageRestorerEx::restore_pages(std::vector<PageBackupEx*>& tracked_pages) {
+		size_t restored = 0;
+		for (PageBackupEx* page : tracked_pages) {
+			if (page->is_dirty()) {
+				tracked_pages[restored++] = page;
+			}
+		}
+		tracked_pages.resize(restored);
+		this->pages_restored += restored;
+		std::sort(tracked_pages.begin(), tracked_pages.end(), [](PageBackupEx* a, PageBackupEx* b) {
+			return a->get_page_address() < b->get_page_address();
+		});
+		if (this->metrics != nullptr) {
+			this->metrics->add_pages(restored, restored * pageSize);
+		}
+
+		RestoreMetrics::PhaseTimer write_timer(this->metrics, RestoreMetrics::PAGE_WRITE);
+#ifdef __linux__
+		//
+		// Pages of a userfaultfd region that weren't written are still write-protected, and our writes
+		// into one of those would either fail or wait on our own fault thread.
+		//
+		if (this->uffd_tracker) {
+			for (size_t first = 0; first < tracked_pages.size();) {
+				size_t last = page_run_end(tracked_pages, first);
+				if (!tracked_pages[first]->is_tracking_changes()) {
+					this->uffd_tracker->unprotect_range((size_t)tracked_pages[first]->get_page_address(),
+						(last - first) * pageSize);
+				}
+				first = last;
+			}
+		}
+#endif
+		static std::vector<PageBackupEx*> written_pages;
+#ifdef __linux__
+		this->discard_zero_runs(tracked_pages, written_pages);
+#else
+		written_pages = tracked_pages;
+#endif
+		if (this->restore_workers && written_pages.size() >= this->parallel_restore_threshold) {
+			this->restore_workers->restore(this->process_handle, written_pages);
+		}
+		else {
+			for (PageBackupEx* page : written_pages) {
+				page->queue_restore(&this->write_batch);
+			}
+			this->write_batch.flush(this->process_handle);
+		}
+		RestoreMetrics::PhaseTimer reprotect_timer(this->metrics, RestoreMetrics::REPROTECT);
+		this->apply_hot_page_policy(tracked_pages);
+		this->rearm_pages(tracked_pages);
+		return (int)restored;
+	}
+
+	/* Updates how often each restored page gets written and takes the pages that are hot out of the list,
+	 * leaving them writable and dirty so the next restore writes them back without waiting for a fault
+		Args:
+			restored_pages - the restored pages, in address order.  Only the ones to re-arm are left.
+	 */
+	void PageRestorerEx::apply_hot_page_policy(std::vector<PageBackupEx*>& restored_pages) {
+		bool fault_based = this->pdType == PageDifferentialType::MEMORY_WATCH ||
+			this->pdType == PageDifferentialType::USERFAULTFD_WP;
+		if (this->hot_page_streak == 0 || !fault_based) {
+			return;
+		}
+		uint32_t restore = (uint32_t)this->restore_count;
+		size_t kept = 0;
+		for (PageBackupEx* page : restored_pages) {
+			if (page->get_region()->compare_contents) {
+				restored_pages[kept++] = page;
+				continue;
+			}
+			if (page->is_hot()) {
+				this->hot_page_restores++;
+				if (restore - page->get_hot_since() < this->hot_page_period) {
+					page->set_dirty();
+					continue;
+				}
+				//
+				// Protect it again and see whether it's still written to
+				//
+				page->set_cold();
+				this->hot_pages--;
+			}
+			else if (page->record_dirty_restore(restore) >= this->hot_page_streak) {
+				page->set_hot(restore);
+				page->set_dirty();
+				this->hot_pages++;
+				continue;
+			}
+			restored_pages[kept++] = page;
+		}
+		restored_pages.resize(kept);
+	}
+
+	/* Tunes when a page counts as hot
+		Args:
+			streak - restores in a row a page has to be dirty in to be left writable, 0 turns the policy off
+			period - restores a hot page stays writable before it's protected again to check it's still hot
+	 */
+	void PageRestorerEx::set_hot_page_policy(uint32_t streak, uint32_t period) {
+		this->hot_page_streak = streak;
+		this->hot_page_period = period;
+	}
+
+	/* Sets up writing restores back with several threads
+		Args:
+			worker_count - threads writing pages, including the one restoring.  0 or 1 writes from the
+				restoring thread alone, as by default.
+			threshold - dirty pages a restore needs before it's split between workers, smaller restores
+				aren't worth waking them for
+	 */
+	void PageRestorerEx::set_restore_workers(size_t worker_count, size_t threshold) {
+		this->parallel_restore_threshold = threshold;
+		if (worker_count <= 1) {
+			this->restore_workers.reset();
+		}
+		else if (!this->restore_workers || this->restore_workers->get_worker_count() != worker_count) {
+			this->restore_workers = std::make_unique<RestoreWorkerPool>(worker_count);
+		}
+	}
+
+	uint64_t PageRestorerEx::get_write_calls() {
+		uint64_t write_calls = this->write_batch.get_write_calls();
+		if (this->restore_workers) {
+			write_calls += this->restore_workers->get_write_calls();
+		}
+		return write_calls;
+	}
+
+	bool PageRestorerEx::is_hot_page(LPCVOID address) {
+		PageBackupEx* page = this->pages.find(address);
+		return page != nullptr && page->is_hot();
+	}
+
+	/* Puts change tracking back on restored pages, one call per run of adjacent pages
+		Args:
+			restored_pages - the restored pages, in address order
+	 */
+	void PageRestorerEx::rearm_pages(std::vector<PageBackupEx*>& restored_pages) {
+		for (size_t first = 0; first < restored_pages.size();) {
+			size_t last = page_run_end(restored_pages, first);
+			PageBackupEx* page = restored_pages[first];
+			SIZE_T run_size = (last - first) * pageSize;
+			if (page->is_tracking_changes()) {
+				if (!PageBackupEx::protect_range(this->process_handle, page->get_region(), page->get_page_address(), run_size)) {
+					//
+					// See PageBackupEx::ProtectPage - pages we can't protect are restored every time.
+					//
+					for (size_t i = first; i < last; i++) {
+						restored_pages[i]->set_dirty();
+					}
+				}
+			}
+#ifdef __linux__
+			else if (this->uffd_tracker) {
+				this->uffd_tracker->protect_range((size_t)page->get_page_address(), run_size);
+			}
+#endif
+			first = last;
+		}
+	}
+
+	/* Gathers the pages written since the last save, push or restore and marks them dirty
+		Args:
+			dirty_pages - receives the dirty pages
+	 */
+	void PageRestorerEx::collect_dirty_pages(std::vector<PageBackupEx*>& dirty_pages) {
+#ifdef __linux__
+		if (this->pdType == PageDifferentialType::SOFT_DIRTY) {
+			this->collect_soft_dirty_pages(dirty_pages);
+			return;
+		}
+		if (this->pdType == PageDifferentialType::USERFAULTFD_WP) {
+			this->collect_userfaultfd_pages(dirty_pages);
+			return;
+		}
+#endif
+		dirty_pages.clear();
+		this->pages_scanned += this->arena.size();
+		for (PageBackupEx& page : this->arena) {
+			if (page.is_dirty()) {
+				dirty_pages.push_back(&page);
+			}
+		}
+	}
+
+	/* Reads back the pages nothing tracks writes to and marks the ones that no longer match their backup
+	 * dirty.  Each run of adjacent pages is read with one call.  Pages that can't be read are marked dirty
+	 * too, so they're restored rather than assumed unchanged.
+	 */
+	void PageRestorerEx::compare_pages() {
+		static std::vector<BYTE> contents;
+		for (size_t first = 0; first < this->compared_pages.size();) {
+			size_t last = page_run_end(this->compared_pages, first);
+			PageBackupEx* page = this->compared_pages[first];
+			SIZE_T run_size = (last - first) * pageSize;
+			SIZE_T bytes_read = 0;
+			size_t pages_read = 0;
+			contents.resize(run_size);
+			//
+			// Reading a guard page would trip the guard, those are restored blindly like before
+			//
+			if (!(page->get_region()->info.Protect & PAGE_GUARD)) {
+				if (!ReadProcessMemory(this->process_handle, page->get_page_address(), contents.data(), run_size, &bytes_read)) {
+					bytes_read = std::min(bytes_read, run_size);
+				}
+				pages_read = bytes_read / pageSize;
+			}
+			for (size_t i = first; i < last; i++) {
+				PageBackupEx* compared = this->compared_pages[i];
+				if (i - first >= pages_read) {
+					compared->set_dirty();
+				}
+				else if (!compared->is_dirty() && !pages_equal(contents.data() + (i - first) * pageSize, compared->get_backup())) {
+					compared->set_dirty();
+				}
+			}
+			this->pages_compared += pages_read;
+			first = last;
+		}
+	}
+
+	/* Backs up the committed regions that aren't part of any snapshot yet
+		Args:
+			level - the snapshot level the regions are recorded in
+	 */
+	void PageRestorerEx::save_new_regions(SnapshotLevel* level) {
+		SIZE_T bytes_returned = 0;
+		MEMORY_BASIC_INFORMATION mem_info = { 0 };
+		PVOID current_page = nullptr;
+#ifdef __linux__
+		if (this->mmgType == MMapGenerationType::PROC_PAGEMAP) {
+			static std::vector<MEMORY_BASIC_INFORMATION> mappings;
+			this->get_proc_map()->read_regions(&mappings);
+			for (MEMORY_BASIC_INFORMATION& mapping : mappings) {
+				if (this->overlaps_region(&mapping)) {
+					continue;
+				}
+				size_t reserved_end = 0;
+				if (mapping.State == MEM_COMMIT) {
+					this->save_mapping(&mapping, level);
+				}
+				else if (mapping.State == MEM_RESERVE &&
+					!this->find_reserved_region((size_t)mapping.BaseAddress, &reserved_end)) {
+					this->record_reserved_region(&mapping, level);
+				}
+			}
+			return;
+		}
+#endif
+		do {
+			bytes_returned = VirtualQueryEx(this->process_handle, current_page, &mem_info, sizeof(mem_info));
+			if (bytes_returned > 0) {
+				current_page = mem_info.BaseAddress;
+				if (mem_info.State == MEM_COMMIT && !this->overlaps_region(&mem_info)) {
+					this->save_mapping(&mem_info, level);
+					bytes_returned = VirtualQueryEx(this->process_handle, current_page, &mem_info, sizeof(mem_info));
+				}
+#ifdef __linux__
+				else if (mem_info.State == MEM_RESERVE && this->find_region(mem_info.BaseAddress) == nullptr) {
+					size_t reserved_end = 0;
+					if (!this->find_reserved_region((size_t)mem_info.BaseAddress, &reserved_end)) {
+						this->record_reserved_region(&mem_info, level);
+					}
+				}
+#endif
+				current_page = (BYTE*)current_page + mem_info.RegionSize;
+			}
+		} while (bytes_returned > 0);
+	}
+
+	/* Saves a child snapshot on top of the current one.  Only what changed since the current snapshot is
+	 * stored: a copy of every page written since and the regions allocated since.
+		Returns:
+			The number of pages the child snapshot holds a copy of
+	 */
+	int PageRestorerEx::push_state() {
+		static std::vector<PageBackupEx*> dirty_pages;
+		SnapshotLevel level;
+		SIZE_T bytes_read = 0;
+		level.arena_mark = this->arena.get_mark();
+
+		this->compare_pages();
+		this->collect_dirty_pages(dirty_pages);
+		std::sort(dirty_pages.begin(), dirty_pages.end(), [](PageBackupEx* a, PageBackupEx* b) {
+			return a->get_page_address() < b->get_page_address();
+		});
+
+		//
+		// Copy the pages' current contents into the arena, one read per run of adjacent pages, and make
+		// the copies what restore writes back from now on.
+		//
+		for (size_t first = 0; first < dirty_pages.size();) {
+			size_t last = page_run_end(dirty_pages, first);
+			SIZE_T run_size = (last - first) * pageSize;
+			BYTE* storage = this->arena.allocate_storage(last - first);
+			bool success = ReadProcessMemory(this->process_handle,
+				dirty_pages[first]->get_page_address(),
+				storage,
+				run_size,
+				&bytes_read);
+			if (!success || bytes_read != run_size) {
+				throw ReadProcessMemoryFailedException();
+			}
+			for (size_t i = first; i < last; i++) {
+				PageBackupEx* page = dirty_pages[i];
+				level.deltas.push_back({ page, page->get_backup() });
+				page->set_backup(storage + (i - first) * pageSize);
+				page->set_clean();
+				if (page->is_hot()) {
+					//
+					// It's re-armed with the rest, so it has to earn being hot again at this level
+					//
+					page->set_cold();
+					this->hot_pages--;
+				}
+			}
+			first = last;
+		}
+		this->rearm_pages(dirty_pages);
+#ifdef __linux__
+		if (this->pdType == PageDifferentialType::SOFT_DIRTY) {
+			this->clear_soft_dirty();
+		}
+#endif
+
+		//
+		// Whatever was allocated since belongs to the child.  The working set only shows pages that are
+		// resident, so this is only done when we see the whole address space.
+		//
+		if (this->mmgType == MMapGenerationType::VIRTUAL_QUERY || this->mmgType == MMapGenerationType::PROC_PAGEMAP) {
+			this->save_new_regions(&level);
+		}
+#ifdef __linux__
+		//
+		// The layout changes made so far are what separates the child from its parent.  Popping the child
+		// hands them back to be undone.
+		//
+		if (this->layout_journal) {
+			LinuxDebugBackend* backend = this->get_backend();
+			static std::vector<LayoutChange> journaled;
+			backend->TakeLayoutJournal(&journaled);
+			level.layout_changes.swap(this->layout_changes);
+			level.layout_changes.insert(level.layout_changes.end(), journaled.begin(), journaled.end());
+			level.program_break = backend->ProgramBreak();
+		}
+		else {
+			level.program_break = this->query_program_break();
+		}
+#endif
+
+		this->levels.push_back(level);
+		return (int)level.deltas.size();
+	}
+
+	/* Drops the deepest snapshot.  The pages the snapshot had its own copy of are marked dirty so the next
+	 * restore_state() puts the parent's contents back, and the regions allocated at its level are freed.
+		Returns:
+			false if there's no snapshot above the one save_state() took
+	 */
+	bool PageRestorerEx::pop_state() {
+		if (this->levels.empty()) {
+			return false;
+		}
+		SnapshotLevel& level = this->levels.back();
+#ifdef __linux__
+		this->layout_changes.insert(this->layout_changes.end(), level.layout_changes.begin(), level.layout_changes.end());
+		for (LPVOID reserved : level.new_reserved) {
+			this->reserved_regions.erase(reserved);
+		}
+#endif
+		for (PageDelta& delta : level.deltas) {
+			delta.page->set_backup(delta.parent_backup);
+			delta.page->set_dirty();
+		}
+		if (!level.new_regions.empty()) {
+			for (PageRegion* region : level.new_regions) {
+				//
+				// Not every restore walks the address space looking for allocations to free, so do it here
+				//
+				VirtualFreeEx(this->process_handle, region->info.BaseAddress, 0, MEM_RELEASE);
+				this->regions.erase(region->info.BaseAddress);
+				delete region;
+			}
+			//
+			// The level's pages are exactly the ones the arena handed out after its mark
+			//
+			PageBackupEx* first_dropped = this->arena.begin() + level.arena_mark.page_count;
+			this->pages.remove_if([first_dropped](PageBackupEx* page) { return page >= first_dropped; });
+			this->compared_pages.erase(std::remove_if(this->compared_pages.begin(), this->compared_pages.end(),
+				[first_dropped](PageBackupEx* page) { return page >= first_dropped; }), this->compared_pages.end());
+			for (PageBackupEx* page = first_dropped; page < this->arena.end(); page++) {
+				this->page_store.release(page->get_backup());
+				if (page->is_hot()) {
+					this->hot_pages--;
+				}
+			}
+		}
+		this->arena.release_to(level.arena_mark);
+		this->levels.pop_back();
+		return true;
+	}
+
+	/* Pops snapshots until level is the deepest one and restores it
+		Args:
+			level - 0 for the snapshot save_state() took, 1 for the first push_state() and so on
+		Returns:
+			The number of pages restored
+	 */
+	int PageRestorerEx::restore_to_level(size_t level) {
+		while (this->levels.size() > level) {
+			this->pop_state();
+		}
+		return this->restore_state();
+	}
+
+	/* Adds the regions and the pages of the snapshot restore_state() currently goes back to to a snapshot file
+		Args:
+			writer - the file being put together
+		Returns:
+			The number of pages added
+	 */
+	int PageRestorerEx::write_snapshot(SnapshotFileWriter* writer) {
+		std::map<PageRegion*, size_t> region_indexes;
+		for (auto it = this->regions.begin(); it != this->regions.end(); it++) {
+			region_indexes[it->second] = writer->add_region(&it->second->info);
+		}
+		for (size_t i = 0; i < this->pages.size(); i++) {
+			PageBackupEx* page = this->pages.page_at(i);
+			writer->add_page(page->get_page_address(), region_indexes.at(page->get_region()), page->get_backup());
+		}
+		return (int)this->pages.size();
+	}
+
+	/* Takes a snapshot file as the saved state instead of calling save_state(), and puts it into the target.
+	 * The target has to be the same program started the same way (ASLR off) so the address space lines up:
+	 * recorded regions that are missing get allocated at their old address, committed regions the file
+	 * doesn't know are freed, and then every page is written from the mapped file in one batch.  The page
+	 * backups keep pointing into the mapping, so nothing is copied into the arena.
+	 *
+	 * The regions and pages are staged first.  If a region can't be put back or the arena runs out, what was
+	 * allocated or reprotected in the target is undone and the restorer is left empty, so the caller can still
+	 * fall back to save_state().
+		Args:
+			file - the mapped snapshot, kept alive for as long as the restorer uses it
+		Returns:
+			The number of pages loaded
+	 */
+	int PageRestorerEx::load_snapshot(SP_SnapshotFile file) {
+		static std::vector<PageBackupEx*> loaded_pages;
+		const SnapshotFileHeader* header = file->get_header();
+		std::vector<PageRegion*> file_regions;
+		std::vector<PageBackupEx*> compared;
+		std::vector<PageRegion*> allocated;	// regions we had to allocate in the target
+		std::vector<std::pair<PageRegion*, DWORD>> reprotected;	// and the ones we changed the protection of
+		assert(this->regions.empty());
+		this->scope.resolve_modules(this->process_handle);
+#ifdef __linux__
+		if (this->pdType == PageDifferentialType::USERFAULTFD_WP && !this->uffd_tracker) {
+			this->uffd_tracker = std::make_unique<UffdWriteTracker>(this->processId);
+		}
+#endif
+
+		SnapshotArena::Mark mark = this->arena.get_mark();
+		loaded_pages.clear();
+		try {
+			for (size_t i = 0; i < header->region_count; i++) {
+				const SnapshotFileRegion* saved = file->get_region(i);
+				PageRegion* region = new PageRegion();
+				region->info.BaseAddress		= (PVOID)saved->base;
+				region->info.RegionSize			= (SIZE_T)saved->size;
+				region->info.AllocationBase		= (PVOID)saved->allocation_base;
+				region->info.AllocationProtect	= saved->allocation_protect;
+				region->info.Protect			= saved->protect;
+				region->info.State				= saved->state;
+				region->info.Type				= saved->type;
+				region->track_changes			= false;
+				region->compare_contents		= false;
+				file_regions.push_back(region);
+				if (region->info.State != MEM_COMMIT) {
+					continue;
+				}
+
+				//
+				// Put the region back the way it was recorded if the target doesn't have it like that
+				//
+				MEMORY_BASIC_INFORMATION mem_info = { 0 };
+				DWORD old_protect = 0;
+				VirtualQueryEx(this->process_handle, region->info.BaseAddress, &mem_info, sizeof(mem_info));
+				if (mem_info.State == MEM_FREE) {
+					if (VirtualAllocEx(this->process_handle, region->info.BaseAddress, region->info.RegionSize,
+						MEM_RESERVE | MEM_COMMIT, region->info.Protect) != region->info.BaseAddress) {
+						throw VirtualAllocFailedException();
+					}
+					allocated.push_back(region);
+				}
+#ifdef _WIN32
+				else if (mem_info.State == MEM_RESERVE) {
+					if (VirtualAllocEx(this->process_handle, region->info.BaseAddress, region->info.RegionSize,
+						MEM_COMMIT, region->info.Protect) != region->info.BaseAddress) {
+						throw VirtualAllocFailedException();
+					}
+				}
+#endif
+				else if (mem_info.Protect != region->info.Protect) {
+					if (!VirtualProtectEx(this->process_handle, region->info.BaseAddress, region->info.RegionSize,
+						region->info.Protect, &old_protect)) {
+						throw VirtualProtectFailedException();
+					}
+					reprotected.push_back(std::make_pair(region, old_protect));
+				}
+			}
+
+			//
+			// Every page starts out dirty, so restoring them all writes the file's contents into the target
+			// and arms change tracking behind them.  Zero pages are restored without reading the file at all.
+			//
+			for (size_t i = 0; i < header->page_count; i++) {
+				const SnapshotFilePage* saved = file->get_page(i);
+				PageRegion* region = file_regions[saved->region];
+				const void* contents = file->get_page_contents(i);
+				PVOID storage = PageStore::is_zero(contents) ? this->page_store.intern(contents) : (PVOID)contents;
+				PageBackupEx* page = this->arena.add_page((PVOID)saved->address, region, region->track_changes, storage);
+				page->set_dirty();
+				loaded_pages.push_back(page);
+			}
+		}
+		catch (...) {
+			for (auto& change : reprotected) {
+				DWORD old_protect = 0;
+				VirtualProtectEx(this->process_handle, change.first->info.BaseAddress, change.first->info.RegionSize,
+					change.second, &old_protect);
+			}
+			for (PageRegion* region : allocated) {
+				VirtualFreeEx(this->process_handle, region->info.BaseAddress, 0, MEM_RELEASE);
+			}
+			this->arena.release_to(mark);
+			loaded_pages.clear();
+			for (PageRegion* region : file_regions) {
+				delete region;
+			}
+			throw;
+		}
+
+		//
+		// Nothing below fails short of the target going away, so the staged regions and pages become the
+		// saved state
+		//
+		this->snapshot_file = file;
+		for (PageRegion* region : file_regions) {
+			this->regions[region->info.BaseAddress] = region;
+			if (region->info.State == MEM_COMMIT && region->info.Protect != PAGE_NOACCESS) {
+				this->start_tracking(region);
+			}
+		}
+		this->pages.reserve(header->page_count);
+		for (PageBackupEx* page : loaded_pages) {
+			page->set_tracking_changes(page->get_region()->track_changes);
+			this->pages.insert(page->get_page_address(), page);
+			if (page->get_region()->compare_contents) {
+				this->compared_pages.push_back(page);
+			}
+		}
+
+		//
+		// Whatever the target has committed that the snapshot doesn't know about goes, the same way
+		// restore_state_virtual_query gets rid of allocations made during an iteration
+		//
+		SIZE_T bytes_returned = 0;
+		MEMORY_BASIC_INFORMATION mem_info = { 0 };
+		PVOID current_page = nullptr;
+		do {
+			bytes_returned = VirtualQueryEx(this->process_handle, current_page, &mem_info, sizeof(mem_info));
+			if (bytes_returned > 0) {
+				current_page = mem_info.BaseAddress;
+				if (mem_info.State == MEM_COMMIT && !this->overlaps_region(&mem_info) && this->scope.contains(&mem_info)) {
+					VirtualFreeEx(this->process_handle, mem_info.BaseAddress, 0, MEM_RELEASE);
+				}
+				current_page = (BYTE*)current_page + mem_info.RegionSize;
+			}
+		} while (bytes_returned > 0);
+
+		int pages_loaded = this->restore_pages(loaded_pages);
+
+#ifdef __linux__
+		if (this->pdType == PageDifferentialType::SOFT_DIRTY) {
+			this->clear_soft_dirty();
+		}
+		if (this->layout_journal) {
+			this->start_layout_journal();
+		}
+		else {
+			this->program_break = this->query_program_break();
+		}
+#endif
+		return pages_loaded;
+	}
+
+	uint64_t PageRestorerEx::get_write_faults() {
+#ifdef __linux__
+		if (this->uffd_tracker) {
+			return this->write_faults + this->uffd_tracker->get_fault_count();
+		}
+#endif
+		return this->write_faults;
+	}
+
+	int PageRestorerEx::restore_state() {
+		//
+		// Whatever the phases below don't claim for themselves is spent finding the pages to restore
+		//
+		RestoreMetrics::PhaseTimer timer(this->metrics, RestoreMetrics::PAGE_ENUMERATION);
+		this->restore_count++;
+#ifdef __linux__
+		if (this->layout_journal) {
+			RestoreMetrics::PhaseTimer layout_timer(this->metrics, RestoreMetrics::UNTRACKED_FREE);
+			this->undo_layout_changes();
+		}
+#endif
+		this->compare_pages();
+		int pages_restored = this->restore_state_by_type();
+		if (this->verify_interval != 0 && this->restore_count % this->verify_interval == 0) {
+			this->verify_pages();
+		}
+		return pages_restored;
+	}
+
+	/* Restores the dirty pages the way the differential and memory map types find them */
+	int PageRestorerEx::restore_state_by_type() {
+#ifdef __linux__
+		if (this->pdType == PageDifferentialType::SOFT_DIRTY) {
+			return this->restore_state_soft_dirty();
+		}
+		if (this->pdType == PageDifferentialType::USERFAULTFD_WP) {
+			return this->restore_state_userfaultfd();
+		}
+#endif
+		if (this->mmgType == MMapGenerationType::VIRTUAL_QUERY) {
+			return this->restore_state_virtual_query();
+		}
+#ifdef __linux__
+		if (this->mmgType == MMapGenerationType::PROC_PAGEMAP) {
+			return this->restore_state_proc_maps();
+		}
+#endif
+#ifdef _WIN32
+		return this->restore_state_working_set();
+#else
+		return 0;
+#endif
+	}
+
+	/* Reads back a window of the tracked pages after a restore and checks them against the hashes of their
+	 * backups.  The window moves on each time, so with a sample of n pages every page is checked once every
+	 * pages / n verifications.  Pages that don't match are reported and marked dirty so the next restore
+	 * writes them back.
+	 */
+	void PageRestorerEx::verify_pages() {
+		static std::vector<BYTE> contents;
+		RestoreMetrics::PhaseTimer timer(this->metrics, RestoreMetrics::VERIFY);
+		size_t total = this->pages.size();
+		if (total == 0) {
+			return;
+		}
+		size_t count = this->verify_sample_pages == 0 ? total : std::min(this->verify_sample_pages, total);
+		size_t start = this->verify_cursor % total;
+		size_t divergent = 0;
+		SIZE_T bytes_read = 0;
+
+		for (size_t checked = 0; checked < count;) {
+			size_t first = (start + checked) % total;
+			if (this->pages.page_at(first)->get_region()->info.Protect & PAGE_GUARD) {
+				//
+				// Reading would trip the guard
+				//
+				checked++;
+				continue;
+			}
+			//
+			// One read per run of adjacent pages, stopping at the end of the index since the window wraps
+			//
+			size_t last = first + 1;
+			while (last < total && checked + (last - first) < count &&
+				(BYTE*)this->pages.address_at(last) == (BYTE*)this->pages.address_at(last - 1) + pageSize &&
+				!(this->pages.page_at(last)->get_region()->info.Protect & PAGE_GUARD)) {
+				last++;
+			}
+			SIZE_T run_size = (last - first) * pageSize;
+			contents.resize(run_size);
+			bool readable = ReadProcessMemory(this->process_handle, this->pages.address_at(first), contents.data(), run_size, &bytes_read) &&
+				bytes_read == run_size;
+			for (size_t i = first; i < last; i++) {
+				PageBackupEx* page = this->pages.page_at(i);
+				if (readable && hash_page(contents.data() + (i - first) * pageSize) == page->get_backup_hash()) {
+					continue;
+				}
+				if (divergent < MAX_REPORTED_DIVERGENCES) {
+					printf("Restore %llu: page %p in %s %s\n",
+						(unsigned long long)this->restore_count,
+						page->get_page_address(),
+						this->describe_address(page->get_page_address()).c_str(),
+						readable ? "doesn't match the snapshot" : "can't be read");
+				}
+				page->set_dirty();
+				divergent++;
+			}
+			this->pages_verified += last - first;
+			checked += last - first;
+		}
+		this->verify_cursor = (start + count) % total;
+		if (divergent != 0) {
+			printf("Restore %llu: %zu of %zu verified pages diverged from the snapshot\n",
+				(unsigned long long)this->restore_count, divergent, count);
+			this->divergent_pages += divergent;
+		}
+	}
+
+	/* Names what an address in the target belongs to, for reports
+		Returns:
+			The path of the module or file mapped there, or what kind of memory it is
+	 */
+	std::string PageRestorerEx::describe_address(LPVOID address) {
+#ifdef _WIN32
+		char path[MAX_PATH];
+		if (GetMappedFileNameA(this->process_handle, address, path, sizeof(path))) {
+			return path;
+		}
+#else
+		std::vector<ProcessMapsEntry> maps;
+		if (ReadProcessMaps((pid_t)this->processId, &maps)) {
+			for (const ProcessMapsEntry& entry : maps) {
+				if ((size_t)address >= entry.start && (size_t)address < entry.end && !entry.path.empty()) {
+					return entry.path;
+				}
+			}
+		}
+#endif
+		PageRegion* region = this->find_region(address);
+		if (region != nullptr && region->info.Type == MEM_MAPPED) {
+			return "shared memory";
+		}
+		return "private memory";
+	}
+
+	/* Re-reads tracked pages after restores and checks them against their backups, to catch state drift.
+		Args:
+			interval - verify after every interval-th restore, 0 turns verification off
+			sample_pages - pages checked each time, 0 for all of them
+	 */
+	void PageRestorerEx::set_verification(uint32_t interval, size_t sample_pages) {
+		this->verify_interval = interval;
+		this->verify_sample_pages = sample_pages;
+	}
+
+	bool PageRestorerEx::touch_address(LPVOID address) {
+		if (this->pdType == PageDifferentialType::SOFT_DIRTY) {
+			//
+			// Nothing is write-protected, so any fault is the target's own
+			//
+			return false;
+		}
+		//
+		// Backups are page sized, so the page the address lies in is the only candidate
+		//
+		PageBackupEx* potential_block = this->pages.find(address);
+		bool touched = false;
+		//
+		// Pages we didn't protect ourselves can't have faulted because of us
+		//
+		if (potential_block != nullptr && potential_block->is_tracking_changes()) {
+			potential_block->mark_dirty(this->process_handle);
+			this->write_faults++;
+			touched = true;
+		}
+		else {
+			//
+			// Page isn't in our map.  Do nothing.
+			//
+		}
+		return touched;
+	}
+
+
+
+#ifdef _WIN32
+	MEMORY_BASIC_INFORMATION set_block_to_mem_info(const PSAPI_WORKING_SET_BLOCK *block) {
+		MEMORY_BASIC_INFORMATION result;
+		DWORD protection = set_block_protection_to_mem_info_protection(block->Protection);
+		result.AllocationBase = (PVOID)(block->VirtualPage << 12);
+		result.AllocationProtect = protection;
+		result.BaseAddress = (PVOID)(block->VirtualPage << 12);
+		result.PartitionId = 0;
+		result.Protect = protection;
+		// The working set includes only physically available and allocated memory, thus it must
+		// be committed.
+		result.RegionSize = 4096; // all will be typical pages right?
+		result.State = MEM_COMMIT;
+		result.Type = 0; // TODO: Do we need to resolve this?
+		
+		return result;
+	}
+
+	DWORD set_block_protection_to_mem_info_protection(ULONG_PTR protection) {
+		//
+		// The memory set block protection is made up of flags, unlike the 
+		// MEMORY_BASIC_INFORMATION protection constants.  e.g. executable and
+		// read/write is Execute | ReadWrite in the memory set protection, where
+		// that doesn't work in the normal MEMORY_BASIC_INFORMATION constant.
+		//
+		DWORD result = 0;
+		DWORD base_protection = protection & 7;
+		
+		if (protection & 8) {
+			result |= PAGE_NOCACHE;
 		}
 		
 		if (protection & 16) {
@@ -375,4 +2441,5 @@ namespace dedougger {
 		return result;
 	}
 
+#endif
 }
\ No newline at end of file
@@ -1,51 +1,296 @@
 #pragma once
 
-#include <Windows.h>
+#include "platform/platform.h"
 #include <assert.h>
+#include <stdint.h>
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
+#ifdef _WIN32
 #include <Psapi.h>
+#endif
 #include "PageBackupEx.h"
+#include "SnapshotArena.hpp"
+#include "PageStore.hpp"
+#include "PageIndex.hpp"
+#include "SnapshotFile.hpp"
+#include "RestoreWorkerPool.hpp"
+#include "SnapshotScope.hpp"
+#include "RestoreMetrics.hpp"
+#ifdef __linux__
+#include "UffdWriteTracker.hpp"
+#include "ProcMemoryMap.hpp"
+#include "backend/LinuxDebugBackend.hpp"
+#endif
 
 namespace dedougger {
 
 	enum class PageDifferentialType : char {
 		MEMORY_WATCH,
-		READ_ONLY_PAGES
+		READ_ONLY_PAGES,	// nothing is protected, pages are read back and compared with their backup on restore
+		SOFT_DIRTY,		// Linux only - pages are left writable and the kernel's soft-dirty bits say what changed
+		USERFAULTFD_WP	// Linux only - first writes are caught with userfaultfd write-protection, no debugger involved
 	};
 
 	enum class MMapGenerationType : char {
 		VIRTUAL_QUERY,
-		WORKING_SET 
+		WORKING_SET,
+		PROC_PAGEMAP	// Linux only - mappings from one read of /proc/<pid>/maps, only resident pages are read
 	};
 	
+#ifdef _WIN32
 	MEMORY_BASIC_INFORMATION set_block_to_mem_info(const PSAPI_WORKING_SET_BLOCK*);
 	DWORD set_block_protection_to_mem_info_protection(ULONG_PTR protection);
+#endif
 
+	/**
+	 * PageRestorerEx - saves the committed memory of a target process and restores what changed since.
+	 *
+	 *	save_state() walks the address space, as picked by the MMapGenerationType, and backs up every committed
+	 *	page in scope.  VIRTUAL_QUERY asks one VirtualQueryEx per region; on Linux PROC_PAGEMAP, the default,
+	 *	takes every mapping from one read of /proc/<pid>/maps and saves non-resident private anonymous pages as
+	 *	zero pages without reading them (see ProcMemoryMap).  Mapped views (MEM_MAPPED) are replaced with
+	 *	private memory holding the same contents, so restores never write through to a file or another process,
+	 *	unless set_privatize_mapped(false).
+	 *
+	 *	restore_state() rewrites only the pages written since, found according to the PageDifferentialType:
+	 *		MEMORY_WATCH - pages are write-protected and the fuzzer reports each first write through
+	 *			touch_address(), which marks the page dirty and makes it writable again
+	 *		READ_ONLY_PAGES - nothing is protected; saved regions are read back in bulk and compared with their
+	 *			backups (see PageCompare).  Regions MEMORY_WATCH can't protect are compared the same way.
+	 *		SOFT_DIRTY - the kernel's soft-dirty bits, cleared through /proc/<pid>/clear_refs and read back from
+	 *			/proc/<pid>/pagemap, so the target takes no faults
+	 *		USERFAULTFD_WP - anonymous memory is write-protected through a userfaultfd whose faults a fuzzer-side
+	 *			thread resolves (see UffdWriteTracker), falling back to MEMORY_WATCH for mappings it can't
+	 *			protect.  save_state() throws UserfaultfdFailedException if the target isn't allowed a kernel
+	 *			mode userfaultfd.
+	 *	In the fault based modes a page dirty for hot_page_streak restores in a row is left writable and restored
+	 *	unconditionally, and protected again after hot_page_period restores.  Dirty pages are sorted, coalesced
+	 *	into runs and written with vectored calls (see PageWriteBatch); long runs of zero pages in private
+	 *	anonymous memory are discarded with MADV_DONTNEED instead.
+	 *
+	 *	Before the pages, a restore puts the layout back (see restore_layout): memory the iteration allocated is
+	 *	freed, and saved regions it freed, shrank, remapped or reprotected are mapped again and restored whole.
+	 *	That normally costs a pass over the mappings.  With the Linux layout journal the backend records the
+	 *	ranges the target's mmap/munmap/mremap/mprotect/brk/madvise calls changed, and only those are looked at.
+	 *
+	 *	Page descriptors live in a SnapshotArena with the region each came from recorded once in a PageRegion,
+	 *	and the saved contents in a PageStore that keeps one copy of identical pages and none of zero pages.
+	 *	Nested snapshots keep their copies in the arena.
+	 *
+	 *	Methods:
+	 *		save_state() - backs up every committed page
+	 *		restore_state() - restores the pages written since the last save/restore
+	 *		touch_address(address) - MEMORY_WATCH write fault notification
+	 *		set_page_differential_type(type) - picks the dirty tracking strategy, call before save_state()
+	 *		set_mmap_generation_type(type) - picks how the address space is enumerated, call before save_state()
+	 *		set_scope(scope)/get_scope() - limits the snapshot to part of the target's memory (see SnapshotScope).
+	 *			Call before save_state() or load_snapshot().
+	 *		set_privatize_mapped(val) - whether mapped views are replaced with private memory on save, on by default
+	 *		set_hot_page_policy(streak, period) - tunes the hot page policy, a streak of 0 turns it off
+	 *		set_layout_journal(enable) - Linux only, undo the iteration's layout changes from the backend's journal
+	 *			instead of walking the address space.  Call before save_state().
+	 *		set_restore_workers(count, threshold) - splits restores of at least threshold dirty pages between
+	 *			count threads, each writing its share of the sorted list (see RestoreWorkerPool).  Off by default.
+	 *		set_metrics(metrics) - times the phases of each restore and counts the pages written into metrics
+	 *			(see RestoreMetrics), nullptr to stop
+	 *		set_verification(interval, sample_pages) - every interval restores, reads sample_pages tracked pages back
+	 *			and checks them against a hash of their backup (see hash_page).  Pages that drifted are reported
+	 *			with their module and restored again next time.  Off by default.
+	 *		push_state() - saves a child snapshot on top of the current one, holding only the pages written and
+	 *			the regions allocated since.  restore_state() then goes back to the child.
+	 *		pop_state() - drops the deepest snapshot and frees what was allocated at its level
+	 *		restore_to_level(level) - pops down to level (0 is the save_state() snapshot) and restores it
+	 *		get_level() - depth of the snapshot restore_state() currently goes back to
+	 *		restore_range(start, end) - maps the saved regions in a range again where the iteration freed or remapped
+	 *			them, for memory the thread restorer needs back before restoring, like an exited thread's stack
+	 *		write_snapshot(writer) - adds the saved regions and pages to a snapshot file
+	 *		load_snapshot(file) - takes a mapped snapshot file as the saved state instead of save_state() and writes
+	 *			it into the target.  If it throws, the target and the restorer are left as they were.
+	 *		get_restore_workers()/get_hot_pages()/is_hot_page(address) - current settings and state
+	 *		get_snapshot_footprint()/get_unique_pages()/get_deduplicated_pages() - memory committed to hold the
+	 *			snapshot, pages the PageStore holds a copy of, and pages that share a copy or cost nothing
+	 *		get_restore_count()/get_write_calls()/get_pages_scanned()/get_pages_restored()/get_pages_compared()/
+	 *		get_pages_discarded()/get_pages_not_resident()/get_pages_verified()/get_divergent_pages()/
+	 *		get_write_faults()/get_hot_page_restores()/get_mappings_privatized()/get_layout_ranges_restored() -
+	 *			running totals of what restores and saves have done
+	 */
 	class PageRestorerEx {	
 	protected:
-		std::map<LPVOID, PageBackupEx*> pages;
+		//
+		// A page a nested snapshot has its own copy of, and the copy its parent had
+		//
+		struct PageDelta {
+			PageBackupEx*	page;
+			PVOID			parent_backup;
+		};
+
+		//
+		// Part of the address space whose layout a restore puts back, and what the target has there
+		//
+		struct LayoutFix {
+			PageRegion*					region;		// the saved region, null for memory the snapshot doesn't have
+			MEMORY_BASIC_INFORMATION	current;
+			size_t						start;
+			size_t						end;
+			bool						reserved;	// address space the snapshot has reserved
+		};
+
+		struct SnapshotLevel {
+			std::vector<PageDelta>		deltas;
+			std::vector<PageRegion*>	new_regions;	// regions first saved at this level
+			SnapshotArena::Mark			arena_mark;		// arena fill level before the level was pushed
+#ifdef __linux__
+			std::vector<LayoutChange>	layout_changes;	// journaled between the parent and this level
+			std::vector<LPVOID>			new_reserved;	// reservations first seen at this level
+			size_t						program_break;
+#endif
+		};
+
+		std::map<LPVOID, PageRegion*> regions;
+		PageIndex pages;
+		SnapshotArena arena;
+		PageStore page_store;
+		std::vector<SnapshotLevel> levels;
+		SP_SnapshotFile snapshot_file;	// the loaded snapshot, page backups may point into it
 		HANDLE process_handle;
 		DWORD processId;
 		bool free_unknown_pages;
+		bool privatize_mapped;
+		uint64_t mappings_privatized;
 		PageDifferentialType pdType;
 		MMapGenerationType mmgType;
+		uint64_t pages_scanned;
+		uint64_t pages_restored;
+		uint64_t pages_compared;
+		uint64_t pages_not_resident;
+		uint64_t pages_discarded;
+		std::vector<PageBackupEx*> compared_pages;	// pages of regions with compare_contents set
+		uint64_t write_faults;
+		uint64_t restore_count;
+		uint32_t hot_page_streak;
+		uint32_t hot_page_period;
+		uint64_t hot_pages;
+		uint64_t hot_page_restores;
+		PageWriteBatch write_batch;
+		UP_RestoreWorkerPool restore_workers;	// null unless restores are written in parallel
+		size_t parallel_restore_threshold;
+		SnapshotScope scope;
+		RestoreMetrics* metrics;	// null unless restores are timed
+		uint32_t verify_interval;
+		size_t verify_sample_pages;
+		size_t verify_cursor;		// where in the page index the next verification starts
+		uint64_t pages_verified;
+		uint64_t divergent_pages;
+		uint64_t layout_ranges_restored;
+#ifdef __linux__
+		int pagemap_fd;
+		int clear_refs_fd;
+		UP_UffdWriteTracker uffd_tracker;
+		UP_ProcMemoryMap proc_map;
+		bool layout_journal;
+		size_t program_break;						// the target's break when save_state() ran
+		std::vector<LayoutChange> layout_changes;	// journaled since the current snapshot and not undone yet
+		std::map<LPVOID, SIZE_T> reserved_regions;	// address space the snapshot has reserved but not committed
+
+		void clear_soft_dirty();
+		void collect_soft_dirty_pages(std::vector<PageBackupEx*>& dirty_pages);
+		void collect_userfaultfd_pages(std::vector<PageBackupEx*>& dirty_pages);
+		int restore_state_soft_dirty();
+		int restore_state_userfaultfd();
+		void restore_unjournaled_layout();
+		ProcMemoryMap* get_proc_map();
+		int save_state_proc_maps();
+		int restore_state_proc_maps();
+		LinuxDebugBackend* get_backend();
+		void start_layout_journal();
+		void record_reserved_region(PMEMORY_BASIC_INFORMATION mem_info, SnapshotLevel* level);
+		bool find_reserved_region(size_t address, size_t* end);
+		void undo_layout_changes();
+		void restore_range_layout(size_t start, size_t end);
+		size_t query_program_break();
+		void discard_zero_runs(const std::vector<PageBackupEx*>& dirty_pages, std::vector<PageBackupEx*>& written_pages);
+#endif
+		void restore_region_layout(PageRegion* region, PMEMORY_BASIC_INFORMATION mem_info, size_t start, size_t end);
+		bool release_range(PMEMORY_BASIC_INFORMATION mem_info, size_t start, size_t end);
+		bool lost_write_watch(PageRegion* region, const MEMORY_BASIC_INFORMATION* mem_info, size_t start, size_t end);
+		void find_layout_changes(const std::vector<MEMORY_BASIC_INFORMATION>& mappings,
+			std::vector<LayoutFix>& unknown, std::vector<LayoutFix>& changed);
+		bool restore_layout(std::vector<MEMORY_BASIC_INFORMATION>& mappings);
+		void read_mappings(std::vector<MEMORY_BASIC_INFORMATION>* mappings);
 
+		void collect_dirty_pages(std::vector<PageBackupEx*>& dirty_pages);
+		void compare_pages();
+		void save_new_regions(SnapshotLevel* level);
+		int restore_pages(std::vector<PageBackupEx*>& tracked_pages);
+		void rearm_pages(std::vector<PageBackupEx*>& restored_pages);
+		void apply_hot_page_policy(std::vector<PageBackupEx*>& restored_pages);
 		int restore_page(LPVOID page);
 		int save_page(LPVOID page);
-		int save_page(const PSAPI_WORKING_SET_BLOCK*);
-		int save_page(PMEMORY_BASIC_INFORMATION);
-		int save_state_working_set();
+		int save_region(PMEMORY_BASIC_INFORMATION, const uint8_t* resident = nullptr);
+		int save_mapping(PMEMORY_BASIC_INFORMATION mem_info, SnapshotLevel* level = nullptr);
+		bool privatize_mapping(PMEMORY_BASIC_INFORMATION mem_info);
+		void collect_mapping_pages(PMEMORY_BASIC_INFORMATION mem_info, std::vector<PageBackupEx*>& tracked_pages);
+		bool overlaps_region(PMEMORY_BASIC_INFORMATION mem_info);
+		PageRegion* find_region(LPVOID address);
+		void start_tracking(PageRegion* region);
 		int save_state_virtual_query();
 		int restore_state_virtual_query();
+		int restore_state_by_type();
+		void verify_pages();
+		std::string describe_address(LPVOID address);
+#ifdef _WIN32
+		int save_page(const PSAPI_WORKING_SET_BLOCK*);
+		int save_state_working_set();
 		int restore_state_working_set();
+#endif
 	public:
 		PageRestorerEx(DWORD processId);
+		~PageRestorerEx();
 		int restore_state();
 		int save_state();
 		bool touch_address(LPVOID address);
 		void set_free_unknown_pages(bool val) { this->free_unknown_pages = val; }
+		void set_privatize_mapped(bool val) { this->privatize_mapped = val; }
+		uint64_t get_mappings_privatized() { return this->mappings_privatized; }
+		void set_page_differential_type(PageDifferentialType type);
+		void set_mmap_generation_type(MMapGenerationType type);
+		void set_scope(const SnapshotScope& scope) { this->scope = scope; }
+		void set_metrics(RestoreMetrics* metrics) { this->metrics = metrics; }
+		void set_verification(uint32_t interval, size_t sample_pages);
+		uint64_t get_pages_verified() { return this->pages_verified; }
+		uint64_t get_divergent_pages() { return this->divergent_pages; }
+		const SnapshotScope& get_scope() { return this->scope; }
 		HANDLE get_process_handle() { return this->process_handle; }		
+		uint64_t get_pages_scanned() { return this->pages_scanned; }
+		uint64_t get_pages_restored() { return this->pages_restored; }
+		uint64_t get_pages_compared() { return this->pages_compared; }
+		uint64_t get_pages_not_resident() { return this->pages_not_resident; }
+		uint64_t get_pages_discarded() { return this->pages_discarded; }
+		uint64_t get_write_faults();
+		uint64_t get_restore_count() { return this->restore_count; }
+		uint64_t get_write_calls();
+		void set_restore_workers(size_t worker_count, size_t threshold);
+		size_t get_restore_workers() { return this->restore_workers ? this->restore_workers->get_worker_count() : 1; }
+		void set_hot_page_policy(uint32_t streak, uint32_t period);
+		uint64_t get_hot_pages() { return this->hot_pages; }
+		uint64_t get_hot_page_restores() { return this->hot_page_restores; }
+		bool is_hot_page(LPCVOID address);
+		SIZE_T get_snapshot_footprint() { return this->arena.get_footprint() + this->page_store.get_footprint(); }
+		uint64_t get_unique_pages() { return this->page_store.get_unique_pages(); }
+		uint64_t get_deduplicated_pages() { return this->page_store.get_references() - this->page_store.get_unique_pages(); }
+		int push_state();
+		bool pop_state();
+		int restore_to_level(size_t level);
+		size_t get_level() { return this->levels.size(); }
+		int restore_range(size_t start, size_t end);
+#ifdef __linux__
+		void set_layout_journal(bool enable);
+#endif
+		uint64_t get_layout_ranges_restored() { return this->layout_ranges_restored; }
+		int write_snapshot(SnapshotFileWriter* writer);
+		int load_snapshot(SP_SnapshotFile file);
 	};
 	typedef std::unique_ptr<PageRestorerEx> UP_PageRestorerEx;
 	typedef std::shared_ptr<PageRestorerEx> SP_PageRestorerEx;
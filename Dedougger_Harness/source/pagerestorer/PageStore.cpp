@@ -0,0 +1,178 @@
+#include "PageStore.hpp"
+#include <string.h>
+
+namespace dedougger {
+
+	PageStore::PageStore(SIZE_T max_bytes) {
+		SnapshotArena::reserve(&this->storage, max_bytes);
+	}
+
+	PageStore::~PageStore() {
+		SnapshotArena::release(&this->storage);
+	}
+
+	/* Gets the shared copy of a page's contents
+		Args:
+			contents - BACKUP_PAGE_SIZE bytes to store
+		Returns:
+			Storage holding the contents, which must not be written to, or zero_page() if they're all zero
+	 */
+	PVOID PageStore::intern(const void* contents) {
+		this->references++;
+		if (contents == zero_page() || is_zero(contents)) {
+			return zero_page();
+		}
+		uint64_t contents_hash = hash(contents);
+		if (!this->table.empty()) {
+			size_t mask = this->table.size() - 1;
+			for (size_t i = contents_hash & mask; this->table[i] != EMPTY; i = (i + 1) & mask) {
+				uint32_t entry = this->table[i];
+				if (entry == DELETED || this->slots[entry - 1].hash != contents_hash) {
+					continue;
+				}
+				BYTE* candidate = this->slot_storage(entry - 1);
+				if (memcmp(candidate, contents, PageBackupEx::BACKUP_PAGE_SIZE) == 0) {
+					this->slots[entry - 1].references++;
+					return candidate;
+				}
+			}
+		}
+
+		uint32_t slot = this->allocate_slot();
+		BYTE* storage = this->slot_storage(slot);
+		memcpy(storage, contents, PageBackupEx::BACKUP_PAGE_SIZE);
+		this->slots[slot] = { contents_hash, 1 };
+		this->insert_entry(slot);
+		this->unique_pages++;
+		return storage;
+	}
+
+	/* Drops a reference to storage handed out by intern(), freeing it with the last one
+		Args:
+			storage - the storage
+		Returns:
+			false if the storage didn't come from this store (nested snapshot or snapshot file storage)
+	 */
+	bool PageStore::release(const void* storage) {
+		if (storage == zero_page()) {
+			this->references--;
+			return true;
+		}
+		const BYTE* bytes = (const BYTE*)storage;
+		if (bytes < this->storage.base || bytes >= this->storage.base + this->storage.used) {
+			return false;
+		}
+		uint32_t slot = (uint32_t)((bytes - this->storage.base) / PageBackupEx::BACKUP_PAGE_SIZE);
+		if (this->slots[slot].references == 0) {
+			return false;
+		}
+		this->references--;
+		if (--this->slots[slot].references > 0) {
+			return true;
+		}
+		this->erase_entry(slot);
+		this->unique_pages--;
+		this->free_slots.push_back(slot);
+		return true;
+	}
+
+	PVOID PageStore::zero_page() {
+		alignas(PageBackupEx::BACKUP_PAGE_SIZE) static const BYTE zeroes[PageBackupEx::BACKUP_PAGE_SIZE] = { 0 };
+		return (PVOID)zeroes;
+	}
+
+	bool PageStore::is_zero(const void* contents) {
+		const uint64_t* words = (const uint64_t*)contents;
+		uint64_t bits = 0;
+		for (size_t i = 0; i < PageBackupEx::BACKUP_PAGE_SIZE / sizeof(uint64_t); i++) {
+			bits |= words[i];
+		}
+		return bits == 0;
+	}
+
+	uint32_t PageStore::allocate_slot() {
+		if (this->free_slots.empty()) {
+			//
+			// Commit the next chunk of the mapping and hand it out front to back
+			//
+			uint32_t first = (uint32_t)this->slots.size();
+			SnapshotArena::allocate(&this->storage, CHUNK_PAGES * PageBackupEx::BACKUP_PAGE_SIZE);
+			this->slots.resize(first + CHUNK_PAGES, { 0, 0 });
+			for (uint32_t i = CHUNK_PAGES; i > 0; i--) {
+				this->free_slots.push_back(first + i - 1);
+			}
+		}
+		uint32_t slot = this->free_slots.back();
+		this->free_slots.pop_back();
+		return slot;
+	}
+
+	/* Adds a slot to the hash table under the hash in its Slot, growing the table past half full
+	 */
+	void PageStore::insert_entry(uint32_t slot) {
+		if ((this->table_used + 1) * 2 > this->table.size()) {
+			this->grow_table();
+		}
+		size_t mask = this->table.size() - 1;
+		size_t i = this->slots[slot].hash & mask;
+		while (this->table[i] != EMPTY && this->table[i] != DELETED) {
+			i = (i + 1) & mask;
+		}
+		if (this->table[i] == EMPTY) {
+			this->table_used++;
+		}
+		this->table[i] = slot + 1;
+	}
+
+	/* Takes a slot out of the hash table, leaving a DELETED marker so later entries of its probe run stay
+	 * reachable
+	 */
+	void PageStore::erase_entry(uint32_t slot) {
+		size_t mask = this->table.size() - 1;
+		for (size_t i = this->slots[slot].hash & mask; this->table[i] != EMPTY; i = (i + 1) & mask) {
+			if (this->table[i] == slot + 1) {
+				this->table[i] = DELETED;
+				return;
+			}
+		}
+	}
+
+	/* Rebuilds the table at four times the live entries (and at least 1024), which also drops the DELETED
+	 * markers
+	 */
+	void PageStore::grow_table() {
+		size_t size = 1024;
+		while (size < this->unique_pages * 4) {
+			size *= 2;
+		}
+		std::vector<uint32_t> old_table;
+		old_table.swap(this->table);
+		this->table.assign(size, uint32_t(EMPTY));
+		this->table_used = 0;
+		size_t mask = size - 1;
+		for (uint32_t entry : old_table) {
+			if (entry == EMPTY || entry == DELETED) {
+				continue;
+			}
+			size_t i = this->slots[entry - 1].hash & mask;
+			while (this->table[i] != EMPTY) {
+				i = (i + 1) & mask;
+			}
+			this->table[i] = entry;
+			this->table_used++;
+		}
+	}
+
+	/* 64 bit multiply-rotate hash over the page's words.  Only used to find candidates, equality is
+	 * always checked on the contents.
+	 */
+	uint64_t PageStore::hash(const void* contents) {
+		const uint64_t* words = (const uint64_t*)contents;
+		uint64_t h = 0x9E3779B97F4A7C15ull;
+		for (size_t i = 0; i < PageBackupEx::BACKUP_PAGE_SIZE / sizeof(uint64_t); i++) {
+			h = (h ^ words[i]) * 0xBF58476D1CE4E5B9ull;
+			h ^= h >> 31;
+		}
+		return h;
+	}
+}
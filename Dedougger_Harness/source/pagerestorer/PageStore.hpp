@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "platform/platform.h"
+#include "dexception.h"
+#include "PageBackupEx.h"
+#include "SnapshotArena.hpp"
+
+namespace dedougger {
+	/**
+	 * PageStore - content-addressed storage for backed up pages.
+	 *
+	 *	Identical pages are only stored once: a page is hashed when it's interned and shares the copy of any
+	 *	page with the same contents, which is reference counted and freed with its last user.  All-zero pages
+	 *	aren't stored at all, they all point at one static zero page that restores recognise and write
+	 *	without copying (see PageWriteBatch::add_zero).  The stored pages are immutable, so a page that's
+	 *	backed up again gets a new reference instead of being overwritten.
+	 *
+	 *	Storage is one reserved SnapshotArena::Mapping of page sized slots, committed a chunk at a time, and
+	 *	freed slots are reused before a new one is committed.  A slot's hash and reference count sit in a dense
+	 *	array indexed by slot number, and slots are found by hash through an open addressing table of slot
+	 *	numbers, so interning and releasing a page doesn't allocate anything per page.
+	 *
+	 *	Methods:
+	 *		intern(contents) - the shared copy of a page's contents, stored if it's new
+	 *		release(storage) - drops a reference, false if the storage isn't the store's
+	 *		zero_page()/is_zero(contents) - the shared zero page and the test for it
+	 *		get_unique_pages() - pages actually stored
+	 *		get_references() - pages handed out, zero pages included, so references - unique is what was saved
+	 *		get_footprint() - bytes committed for page contents
+	 */
+	class PageStore {
+		struct Slot {
+			uint64_t	hash;
+			uint32_t	references;		// 0 for a free slot
+		};
+
+		static const uint32_t EMPTY = 0;			// table entries are slot number + 1
+		static const uint32_t DELETED = 0xFFFFFFFF;
+
+		SnapshotArena::Mapping	storage;
+		std::vector<Slot>		slots;			// indexed by slot number, one per slot ever handed out
+		std::vector<uint32_t>	table;			// open addressing by hash, a power of two in size
+		size_t					table_used = 0;	// entries that aren't EMPTY, DELETED included
+		std::vector<uint32_t>	free_slots;
+		size_t					unique_pages = 0;
+		uint64_t				references = 0;
+
+		uint32_t allocate_slot();
+		BYTE* slot_storage(uint32_t slot) { return this->storage.base + (SIZE_T)slot * PageBackupEx::BACKUP_PAGE_SIZE; }
+		void insert_entry(uint32_t slot);
+		void erase_entry(uint32_t slot);
+		void grow_table();
+		static uint64_t hash(const void* contents);
+	public:
+		static const size_t CHUNK_PAGES = 64;
+
+		PageStore(SIZE_T max_bytes = SnapshotArena::DEFAULT_RESERVE);
+		~PageStore();
+		PageStore(const PageStore&) = delete;
+		PageStore& operator=(const PageStore&) = delete;
+
+		PVOID intern(const void* contents);
+		bool release(const void* storage);
+		static PVOID zero_page();
+		static bool is_zero(const void* contents);
+		size_t get_unique_pages() { return this->unique_pages; }
+		uint64_t get_references() { return this->references; }
+		SIZE_T get_footprint() { return this->storage.committed; }
+	};
+}
@@ -0,0 +1,166 @@
+#include "PageWriteBatch.hpp"
+#include <algorithm>
+#include <string.h>
+#ifdef __linux__
+#include <limits.h>
+#endif
+
+namespace dedougger {
+
+	alignas(0x1000) static const BYTE zero_block[PageWriteBatch::ZERO_BLOCK_SIZE] = { 0 };
+
+	/* Writes everything queued since the last flush into the target
+		Args:
+			process - handle of the target process
+	 */
+	void PageWriteBatch::flush(HANDLE process) {
+		std::sort(this->writes.begin(), this->writes.end());
+#ifdef __linux__
+		//
+		// Every write takes one local iovec, so that's the limit that decides how much fits in one call
+		//
+		for (size_t first = 0; first < this->writes.size(); first += IOV_MAX) {
+			this->write_vectored(process, first, std::min(this->writes.size(), first + IOV_MAX));
+		}
+#else
+		size_t run_start = 0;
+		while (run_start < this->writes.size()) {
+			size_t run_end = run_start + 1;
+			size_t run_size = this->writes[run_start].size;
+			while (run_end < this->writes.size() &&
+				this->writes[run_end].address == this->writes[run_end - 1].address + this->writes[run_end - 1].size) {
+				run_size += this->writes[run_end].size;
+				run_end++;
+			}
+			if (run_end - run_start == 1) {
+				this->write_single(process, this->writes[run_start], 0);
+			}
+			else {
+				//
+				// WriteProcessMemory wants one contiguous source buffer
+				//
+				SIZE_T bytes_written = 0;
+				this->staging.resize(run_size);
+				BYTE* cursor = this->staging.data();
+				for (size_t i = run_start; i < run_end; i++) {
+					if (this->writes[i].data == nullptr) {
+						memset(cursor, 0, this->writes[i].size);
+					}
+					else {
+						memcpy(cursor, this->writes[i].data, this->writes[i].size);
+					}
+					cursor += this->writes[i].size;
+				}
+				bool result = WriteProcessMemory(process,
+					(LPVOID)this->writes[run_start].address,
+					this->staging.data(),
+					run_size,
+					&bytes_written);
+				this->write_calls++;
+				if (!result || bytes_written != run_size) {
+					throw WriteProcessMemoryFailedException();
+				}
+			}
+			run_start = run_end;
+		}
+#endif
+		this->writes.clear();
+	}
+
+#ifdef __linux__
+	/* Moves past the first bytes of an iovec array, trimming the iovec they end in
+		Args:
+			iov - the iovecs
+			next - index of the first iovec not entirely consumed, updated
+			bytes - how many bytes to skip from there
+	 */
+	static void advance_iov(std::vector<struct iovec>& iov, size_t* next, size_t bytes) {
+		while (bytes > 0) {
+			struct iovec& current = iov[*next];
+			if (bytes < current.iov_len) {
+				current.iov_base = (BYTE*)current.iov_base + bytes;
+				current.iov_len -= bytes;
+				return;
+			}
+			bytes -= current.iov_len;
+			(*next)++;
+		}
+	}
+
+	void PageWriteBatch::write_vectored(HANDLE process, size_t first, size_t last) {
+		size_t total_size = 0;
+		this->local_iov.clear();
+		this->remote_iov.clear();
+		for (size_t i = first; i < last; i++) {
+			PageWrite& write = this->writes[i];
+			if (write.data != nullptr) {
+				this->local_iov.push_back({ (void*)write.data, write.size });
+			}
+			else if (!this->local_iov.empty() && this->local_iov.back().iov_base == zero_block &&
+				this->local_iov.back().iov_len + write.size <= ZERO_BLOCK_SIZE) {
+				//
+				// Local iovecs are consumed in order no matter where the bytes land, so a run of zero
+				// writes can all come out of the same block
+				//
+				this->local_iov.back().iov_len += write.size;
+			}
+			else {
+				this->local_iov.push_back({ (void*)zero_block, write.size });
+			}
+			if (!this->remote_iov.empty() &&
+				(size_t)this->remote_iov.back().iov_base + this->remote_iov.back().iov_len == write.address) {
+				this->remote_iov.back().iov_len += write.size;
+			}
+			else {
+				this->remote_iov.push_back({ (void*)write.address, write.size });
+			}
+			total_size += write.size;
+		}
+
+		//
+		// process_vm_writev stops at the first page it isn't allowed to write.  Push the write it stopped in
+		// through WriteProcessMemory, a pwrite to /proc/<pid>/mem which ignores protections, and carry on
+		// vectored right after it with the iovecs picked up where the kernel left them.
+		//
+		size_t local_next = 0;
+		size_t remote_next = 0;
+		size_t next_write = first;
+		while (total_size > 0) {
+			ssize_t result = process_vm_writev((pid_t)(intptr_t)process,
+				this->local_iov.data() + local_next, this->local_iov.size() - local_next,
+				this->remote_iov.data() + remote_next, this->remote_iov.size() - remote_next, 0);
+			this->write_calls++;
+			if (result == (ssize_t)total_size) {
+				return;
+			}
+
+			size_t bytes_done = result > 0 ? (size_t)result : 0;
+			size_t consumed = 0;
+			while (consumed + this->writes[next_write].size <= bytes_done) {
+				consumed += this->writes[next_write].size;
+				next_write++;
+			}
+			this->write_single(process, this->writes[next_write], bytes_done - consumed);
+			consumed += this->writes[next_write].size;
+			next_write++;
+			total_size -= consumed;
+			advance_iov(this->local_iov, &local_next, consumed);
+			advance_iov(this->remote_iov, &remote_next, consumed);
+		}
+	}
+#endif
+
+	void PageWriteBatch::write_single(HANDLE process, const PageWrite& write, size_t offset) {
+		SIZE_T bytes_written = 0;
+		const BYTE* data = write.data != nullptr ? (const BYTE*)write.data : zero_block;
+		bool result = WriteProcessMemory(process,
+			(LPVOID)(write.address + offset),
+			data + offset,
+			write.size - offset,
+			&bytes_written);
+		this->write_calls++;
+		if (!result || bytes_written != write.size - offset) {
+			throw WriteProcessMemoryFailedException();
+		}
+	}
+}
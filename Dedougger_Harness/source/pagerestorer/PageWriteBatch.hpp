@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "platform/platform.h"
+#include "dexception.h"
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+namespace dedougger {
+	/**
+	 * PageWriteBatch - collects the page writes of one restore and issues them with as few calls as possible.
+	 *
+	 *	Writes are sorted by target address and runs of adjacent writes are coalesced.  On Linux every run
+	 *	becomes one remote iovec and a single process_vm_writev covers up to IOV_MAX runs; anything it refuses
+	 *	(read-only or otherwise protected pages, since process_vm_writev honours protections) is retried
+	 *	through WriteProcessMemory.  Elsewhere each run is written with one WriteProcessMemory, staging
+	 *	multi-page runs through a contiguous buffer.
+	 *
+	 *	The buffers handed to add() have to stay valid until flush() returns.  Writes of zeroes (add_zero) need
+	 *	no buffer: they're all sourced from one shared block of zeroes, so consecutive zero pages take a single
+	 *	local iovec and no copying, instead of one per page.  Long runs of zero pages in private anonymous memory
+	 *	never get here on Linux; PageRestorerEx drops them with MADV_DONTNEED instead.
+	 *
+	 *	Methods:
+	 *		add(address, data, size) - queues a write of size bytes from data to address in the target
+	 *		add_zero(address, size) - queues a write of size zero bytes to address in the target, size is at most
+	 *			ZERO_BLOCK_SIZE
+	 *		flush(process) - performs and forgets all queued writes
+	 *		get_write_calls() - running total of write calls made into the target
+	 */
+	class PageWriteBatch {
+		struct PageWrite {
+			size_t		address;
+			const void*	data;		// nullptr for zeroes
+			size_t		size;
+			bool operator<(const PageWrite& other) const { return this->address < other.address; }
+		};
+
+		std::vector<PageWrite>	writes;
+		uint64_t				write_calls = 0;
+#ifdef __linux__
+		std::vector<struct iovec> local_iov;
+		std::vector<struct iovec> remote_iov;
+
+		void write_vectored(HANDLE process, size_t first, size_t last);
+#else
+		std::vector<BYTE>		staging;
+#endif
+		void write_single(HANDLE process, const PageWrite& write, size_t offset);
+	public:
+		static const size_t ZERO_BLOCK_SIZE = 0x10000;
+
+		void add(size_t address, const void* data, size_t size) { this->writes.push_back({ address, data, size }); }
+		void add_zero(size_t address, size_t size) { this->writes.push_back({ address, nullptr, size }); }
+		void flush(HANDLE process);
+		size_t size() { return this->writes.size(); }
+		uint64_t get_write_calls() { return this->write_calls; }
+	};
+}
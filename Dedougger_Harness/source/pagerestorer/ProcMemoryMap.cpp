@@ -0,0 +1,85 @@
+#ifdef __linux__
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include "ProcMemoryMap.hpp"
+
+namespace dedougger {
+
+	namespace {
+		const size_t pageSize = 0x1000;
+		//
+		// Where VirtualQueryEx stops walking, [vsyscall] lies above it
+		//
+		const size_t userSpaceEnd = 0x7ffffffff000;
+		//
+		// Bits 63 and 62 of a pagemap entry say the page is present in memory or in swap
+		//
+		const uint64_t PAGEMAP_PRESENT = 1ull << 63;
+		const uint64_t PAGEMAP_SWAPPED = 1ull << 62;
+		//
+		// Entries read per pread, 2 MiB of address space
+		//
+		const size_t PAGEMAP_BATCH = 512;
+	}
+
+	ProcMemoryMap::ProcMemoryMap(DWORD processId) {
+		char path[64];
+		this->processId = processId;
+		snprintf(path, sizeof(path), "/proc/%u/pagemap", processId);
+		this->pagemap_fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (this->pagemap_fd == -1) {
+			throw ProcMemoryMapFailedException();
+		}
+	}
+
+	ProcMemoryMap::~ProcMemoryMap() {
+		close(this->pagemap_fd);
+	}
+
+	/* Reads the target's mappings with a single pass over /proc/<pid>/maps
+		Args:
+			regions - receives one entry per mapping, in address order.  Its previous contents are discarded.
+	 */
+	void ProcMemoryMap::read_regions(std::vector<MEMORY_BASIC_INFORMATION>* regions) {
+		static std::vector<ProcessMapsEntry> maps;
+		regions->clear();
+		maps.clear();
+		if (!ReadProcessMaps((pid_t)this->processId, &maps)) {
+			throw ProcMemoryMapFailedException();
+		}
+		for (const ProcessMapsEntry& entry : maps) {
+			if (entry.start >= userSpaceEnd) {
+				continue;
+			}
+			MEMORY_BASIC_INFORMATION mem_info;
+			MapsEntryToMemoryInfo(entry, &mem_info);
+			regions->push_back(mem_info);
+		}
+	}
+
+	/* Finds out which pages of a range are backed by memory or swap
+		Args:
+			address - page aligned start of the range
+			page_count - number of pages in the range
+			resident - receives one flag per page, non-zero if the page is resident.  Its previous contents
+				are discarded.
+	 */
+	void ProcMemoryMap::read_resident(size_t address, size_t page_count, std::vector<uint8_t>* resident) {
+		resident->resize(page_count);
+		this->entries.resize(PAGEMAP_BATCH);
+		for (size_t first = 0; first < page_count; first += PAGEMAP_BATCH) {
+			size_t count = std::min(PAGEMAP_BATCH, page_count - first);
+			off_t offset = (off_t)((address / pageSize + first) * sizeof(uint64_t));
+			ssize_t bytes_read = pread(this->pagemap_fd, this->entries.data(), count * sizeof(uint64_t), offset);
+			if (bytes_read != (ssize_t)(count * sizeof(uint64_t))) {
+				throw ProcMemoryMapFailedException();
+			}
+			for (size_t i = 0; i < count; i++) {
+				(*resident)[first + i] = (this->entries[i] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) != 0;
+			}
+		}
+	}
+}
+#endif // __linux__
@@ -0,0 +1,40 @@
+#pragma once
+#ifdef __linux__
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "platform/platform.h"
+#include "dexception.h"
+
+namespace dedougger {
+	/**
+	 * ProcMemoryMap - the target's mappings and resident pages, read straight from /proc.
+	 *
+	 *	Walking the address space with VirtualQueryEx parses /proc/<pid>/maps again for every region it
+	 *	returns.  read_regions parses it once and hands back the whole table, each mapping described the way
+	 *	VirtualQueryEx would.  read_resident asks /proc/<pid>/pagemap which pages of a range are present in
+	 *	memory or swapped out; pages of private anonymous memory that are neither were never touched and read
+	 *	back as zeroes, so a save doesn't have to read them.
+	 *
+	 *	Methods:
+	 *		read_regions(regions) - every user space mapping of the target, in address order
+	 *		read_resident(address, page_count, resident) - one flag per page, set if the page is present or
+	 *			swapped out
+	 */
+	class ProcMemoryMap {
+		DWORD					processId;
+		int						pagemap_fd;
+		std::vector<uint64_t>	entries;		// raw pagemap entries of the last read_resident
+	public:
+		ProcMemoryMap(DWORD processId);
+		~ProcMemoryMap();
+		ProcMemoryMap(const ProcMemoryMap&) = delete;
+		ProcMemoryMap& operator=(const ProcMemoryMap&) = delete;
+
+		void read_regions(std::vector<MEMORY_BASIC_INFORMATION>* regions);
+		void read_resident(size_t address, size_t page_count, std::vector<uint8_t>* resident);
+	};
+
+	typedef std::unique_ptr<ProcMemoryMap> UP_ProcMemoryMap;
+}
+#endif // __linux__
@@ -0,0 +1,141 @@
+#include "RestoreMetrics.hpp"
+#include <stdio.h>
+
+namespace dedougger {
+
+	/* Buckets below SUB_BUCKETS hold one value each.  Above that every power of two is split into
+	 * SUB_BUCKETS buckets of equal width.
+	 */
+	int LatencyHistogram::bucket_of(uint64_t value) {
+		if (value < SUB_BUCKETS) {
+			return (int)value;
+		}
+		int msb = 63;
+		while (!(value >> msb)) {
+			msb--;
+		}
+		int shift = msb - SUB_BUCKET_BITS;
+		return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+	}
+
+	uint64_t LatencyHistogram::bucket_limit(int bucket) {
+		if (bucket < SUB_BUCKETS) {
+			return (uint64_t)bucket;
+		}
+		int shift = bucket / SUB_BUCKETS - 1;
+		uint64_t sub_bucket = (uint64_t)(bucket % SUB_BUCKETS) + SUB_BUCKETS;
+		return ((sub_bucket + 1) << shift) - 1;
+	}
+
+	void LatencyHistogram::record(uint64_t nanoseconds) {
+		this->counts[bucket_of(nanoseconds)]++;
+		this->count++;
+		this->sum += nanoseconds;
+		if (nanoseconds > this->max) {
+			this->max = nanoseconds;
+		}
+	}
+
+	uint64_t LatencyHistogram::percentile(double p) const {
+		if (this->count == 0) {
+			return 0;
+		}
+		//
+		// The rank of the sample we want, counting from 1
+		//
+		uint64_t rank = (uint64_t)(p / 100.0 * (double)this->count + 0.5);
+		if (rank < 1) {
+			rank = 1;
+		}
+		uint64_t seen = 0;
+		for (int bucket = 0; bucket < BUCKETS; bucket++) {
+			seen += this->counts[bucket];
+			if (seen >= rank) {
+				uint64_t limit = bucket_limit(bucket);
+				return limit < this->max ? limit : this->max;
+			}
+		}
+		return this->max;
+	}
+
+	/* Charges the time since the last switch to the current phase and makes phase the current one
+		Returns:
+			The phase that was current
+	 */
+	RestoreMetrics::Phase RestoreMetrics::switch_phase(Phase phase) {
+		Clock::time_point now = Clock::now();
+		if (this->current_phase != NO_PHASE) {
+			this->current_restore[this->current_phase] +=
+				(uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - this->phase_start).count();
+		}
+		Phase previous = this->current_phase;
+		this->current_phase = phase;
+		this->phase_start = now;
+		return previous;
+	}
+
+	void RestoreMetrics::begin_restore() {
+		for (int phase = 0; phase < PHASE_COUNT; phase++) {
+			this->current_restore[phase] = 0;
+		}
+		this->current_phase = NO_PHASE;
+		this->restore_start = Clock::now();
+	}
+
+	void RestoreMetrics::end_restore() {
+		this->current_restore[RESTORE_TOTAL] =
+			(uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - this->restore_start).count();
+		for (int phase = 0; phase < PHASE_COUNT; phase++) {
+			this->histograms[phase].record(this->current_restore[phase]);
+		}
+		this->restores++;
+
+		if (this->dump_interval != 0 && this->restores % this->dump_interval == 0) {
+			FILE* file = fopen(this->dump_path.c_str(), "a");
+			if (file == nullptr) {
+				printf("Couldn't open %s for the restore metrics\n", this->dump_path.c_str());
+				return;
+			}
+			this->dump(file);
+			fclose(file);
+		}
+	}
+
+	/* Appends everything recorded so far to a file as one line of JSON, so successive dumps can be charted
+		Args:
+			file - the file, open for writing
+	 */
+	void RestoreMetrics::dump(FILE* file) const {
+		uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - this->created).count();
+		fprintf(file, "{\"elapsed_ms\":%llu,\"restores\":%llu,\"pages_restored\":%llu,\"bytes_restored\":%llu,\"phases\":{",
+			(unsigned long long)elapsed,
+			(unsigned long long)this->restores,
+			(unsigned long long)this->pages_restored,
+			(unsigned long long)this->bytes_restored);
+		for (int phase = 0; phase < PHASE_COUNT; phase++) {
+			const LatencyHistogram& histogram = this->histograms[phase];
+			fprintf(file, "%s\"%s\":{\"mean_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu}",
+				phase == 0 ? "" : ",",
+				phase_name((Phase)phase),
+				(unsigned long long)histogram.get_mean(),
+				(unsigned long long)histogram.percentile(50),
+				(unsigned long long)histogram.percentile(99),
+				(unsigned long long)histogram.get_max());
+		}
+		fprintf(file, "}}\n");
+	}
+
+	const char* RestoreMetrics::phase_name(Phase phase) {
+		switch (phase) {
+		case PAGE_ENUMERATION:	return "page_enumeration";
+		case UNTRACKED_FREE:	return "untracked_free";
+		case PAGE_WRITE:		return "page_write";
+		case REPROTECT:			return "reprotect";
+		case THREAD_RESTORE:	return "thread_restore";
+		case THREAD_KILL:		return "thread_kill";
+		case VERIFY:			return "verify";
+		case RESTORE_TOTAL:		return "restore_total";
+		default:				return "none";
+		}
+	}
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include "platform/platform.h"
+
+namespace dedougger {
+	/**
+	 * LatencyHistogram - durations in nanoseconds, bucketed log-linearly so percentiles are within 1/16th of
+	 *	the real value whatever the magnitude, in a fixed amount of memory.
+	 *
+	 *	Methods:
+	 *		record(nanoseconds) - adds a sample
+	 *		percentile(p) - upper bound of the bucket the p-th percentile (0-100) falls in, capped at the maximum
+	 *		get_count()/get_max()/get_mean() - samples recorded, the largest one and their average
+	 */
+	class LatencyHistogram {
+		static const int SUB_BUCKET_BITS = 4;
+		static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+		static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+		uint64_t	counts[BUCKETS] = { 0 };
+		uint64_t	count = 0;
+		uint64_t	sum = 0;
+		uint64_t	max = 0;
+
+		static int bucket_of(uint64_t value);
+		static uint64_t bucket_limit(int bucket);
+	public:
+		void record(uint64_t nanoseconds);
+		uint64_t percentile(double p) const;
+		uint64_t get_count() const { return this->count; }
+		uint64_t get_max() const { return this->max; }
+		uint64_t get_mean() const { return this->count ? this->sum / this->count : 0; }
+	};
+
+	/**
+	 * RestoreMetrics - where the time of each restore goes, and how much it wrote.
+	 *
+	 *	The restorers mark the phase they're in with a PhaseTimer.  Timers nest and time is always charged to
+	 *	the innermost one, so each phase gets its own time and none is counted twice: the freeing of an
+	 *	allocation found while enumerating pages counts as UNTRACKED_FREE, not PAGE_ENUMERATION.  Whoever drives
+	 *	the restores brackets each with begin_restore()/end_restore(), which adds the restore's time in every
+	 *	phase (zero included) and its total to the phases' histograms.
+	 *
+	 *	Phases:
+	 *		PAGE_ENUMERATION - finding the pages to restore: address space walks, dirty bits, page compares
+	 *		UNTRACKED_FREE - freeing what the iteration allocated and putting back the regions it freed or reshaped
+	 *		PAGE_WRITE - writing saved pages back
+	 *		REPROTECT - hot page bookkeeping and re-arming change tracking on the written pages
+	 *		THREAD_RESTORE - putting the saved thread contexts back
+	 *		THREAD_KILL - killing the threads the iteration started
+	 *		VERIFY - checking restored pages against their backups, when PageRestorerEx verifies restores
+	 *		RESTORE_TOTAL - begin_restore() to end_restore()
+	 *
+	 *	Methods:
+	 *		begin_restore()/end_restore() - bracket one restore
+	 *		add_pages(pages, bytes) - counts pages written back
+	 *		get_histogram(phase)/get_restores()/get_pages_restored()/get_bytes_restored() - what's been recorded
+	 *		set_dump_file(path, interval) - end_restore() appends the metrics to path as a line of JSON every
+	 *			interval restores
+	 *		dump(file) - appends the metrics to an open file as a line of JSON
+	 *		phase_name(phase) - the phase's name in the JSON
+	 */
+	class RestoreMetrics {
+	public:
+		enum Phase {
+			PAGE_ENUMERATION,
+			UNTRACKED_FREE,
+			PAGE_WRITE,
+			REPROTECT,
+			THREAD_RESTORE,
+			THREAD_KILL,
+			VERIFY,
+			RESTORE_TOTAL,
+			PHASE_COUNT,
+			NO_PHASE = PHASE_COUNT
+		};
+
+		/* Charges the time until it goes out of scope to a phase.  A null metrics pointer makes it a no-op. */
+		class PhaseTimer {
+			RestoreMetrics*	metrics;
+			Phase			previous;
+		public:
+			PhaseTimer(RestoreMetrics* metrics, Phase phase) : metrics(metrics), previous(NO_PHASE) {
+				if (this->metrics != nullptr) {
+					this->previous = this->metrics->switch_phase(phase);
+				}
+			}
+			~PhaseTimer() {
+				if (this->metrics != nullptr) {
+					this->metrics->switch_phase(this->previous);
+				}
+			}
+			PhaseTimer(const PhaseTimer&) = delete;
+			PhaseTimer& operator=(const PhaseTimer&) = delete;
+		};
+
+	private:
+		typedef std::chrono::steady_clock Clock;
+
+		LatencyHistogram	histograms[PHASE_COUNT];
+		uint64_t			current_restore[PHASE_COUNT] = { 0 };	// nanoseconds in each phase so far
+		Phase				current_phase = NO_PHASE;
+		Clock::time_point	phase_start;
+		Clock::time_point	restore_start;
+		Clock::time_point	created = Clock::now();
+		uint64_t			restores = 0;
+		uint64_t			pages_restored = 0;
+		uint64_t			bytes_restored = 0;
+		std::string			dump_path;
+		uint64_t			dump_interval = 0;
+
+		Phase switch_phase(Phase phase);
+	public:
+		void begin_restore();
+		void end_restore();
+		void add_pages(uint64_t pages, uint64_t bytes) { this->pages_restored += pages; this->bytes_restored += bytes; }
+		const LatencyHistogram& get_histogram(Phase phase) const { return this->histograms[phase]; }
+		uint64_t get_restores() const { return this->restores; }
+		uint64_t get_pages_restored() const { return this->pages_restored; }
+		uint64_t get_bytes_restored() const { return this->bytes_restored; }
+		void set_dump_file(const std::string& path, uint64_t interval) { this->dump_path = path; this->dump_interval = interval; }
+		void dump(FILE* file) const;
+		static const char* phase_name(Phase phase);
+	};
+
+	typedef std::unique_ptr<RestoreMetrics> UP_RestoreMetrics;
+}
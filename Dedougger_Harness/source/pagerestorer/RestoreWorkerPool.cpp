@@ -0,0 +1,120 @@
+#include "RestoreWorkerPool.hpp"
+#include <algorithm>
+
+namespace dedougger {
+
+	/* Starts the pool
+		Args:
+			worker_count - threads writing pages, the thread calling restore() included.  At least 1.
+	 */
+	RestoreWorkerPool::RestoreWorkerPool(size_t worker_count) {
+		this->generation = 0;
+		this->busy_workers = 0;
+		this->stopping = false;
+		this->process = nullptr;
+		this->pages = nullptr;
+		for (size_t i = 0; i < (worker_count ? worker_count : 1); i++) {
+			this->workers.push_back(std::make_unique<Worker>());
+		}
+		//
+		// Worker 0 is whoever calls restore()
+		//
+		for (size_t i = 1; i < this->workers.size(); i++) {
+			Worker* worker = this->workers[i].get();
+			worker->thread = std::thread(&RestoreWorkerPool::worker_main, this, worker);
+		}
+	}
+
+	RestoreWorkerPool::~RestoreWorkerPool() {
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			this->stopping = true;
+		}
+		this->work_ready.notify_all();
+		for (size_t i = 1; i < this->workers.size(); i++) {
+			this->workers[i]->thread.join();
+		}
+	}
+
+	/* Writes every page in the list back into the target
+		Args:
+			process - handle of the target process
+			pages - the pages to restore, dirty and sorted by address
+	 */
+	void RestoreWorkerPool::restore(HANDLE process, std::vector<PageBackupEx*>& pages) {
+		size_t worker_count = this->workers.size();
+		size_t chunk_size = (pages.size() + worker_count - 1) / worker_count;
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			this->process = process;
+			this->pages = &pages;
+			this->failure = nullptr;
+			for (size_t i = 0; i < worker_count; i++) {
+				this->workers[i]->first = std::min(pages.size(), i * chunk_size);
+				this->workers[i]->last = std::min(pages.size(), (i + 1) * chunk_size);
+			}
+			this->busy_workers = worker_count - 1;
+			this->generation++;
+		}
+		this->work_ready.notify_all();
+
+		std::exception_ptr failure;
+		try {
+			this->restore_chunk(this->workers[0].get());
+		}
+		catch (...) {
+			failure = std::current_exception();
+		}
+
+		std::unique_lock<std::mutex> guard(this->lock);
+		this->work_done.wait(guard, [this] { return this->busy_workers == 0; });
+		if (!failure) {
+			failure = this->failure;
+		}
+		if (failure) {
+			std::rethrow_exception(failure);
+		}
+	}
+
+	uint64_t RestoreWorkerPool::get_write_calls() {
+		uint64_t write_calls = 0;
+		for (auto& worker : this->workers) {
+			write_calls += worker->batch.get_write_calls();
+		}
+		return write_calls;
+	}
+
+	void RestoreWorkerPool::worker_main(Worker* worker) {
+		uint64_t seen_generation = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> guard(this->lock);
+				this->work_ready.wait(guard, [&] { return this->stopping || this->generation != seen_generation; });
+				if (this->stopping) {
+					return;
+				}
+				seen_generation = this->generation;
+			}
+			try {
+				this->restore_chunk(worker);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> guard(this->lock);
+				this->failure = std::current_exception();
+			}
+			{
+				std::lock_guard<std::mutex> guard(this->lock);
+				this->busy_workers--;
+			}
+			this->work_done.notify_one();
+		}
+	}
+
+	void RestoreWorkerPool::restore_chunk(Worker* worker) {
+		std::vector<PageBackupEx*>& pages = *this->pages;
+		for (size_t i = worker->first; i < worker->last; i++) {
+			pages[i]->queue_restore(&worker->batch);
+		}
+		worker->batch.flush(this->process);
+	}
+}
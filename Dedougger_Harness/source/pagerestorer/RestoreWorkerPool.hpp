@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "platform/platform.h"
+#include "PageBackupEx.h"
+#include "PageWriteBatch.hpp"
+
+namespace dedougger {
+	/**
+	 * RestoreWorkerPool - writes a restore's dirty pages back with several threads at once.
+	 *
+	 *	The sorted page list is cut into one contiguous chunk per worker, and every worker queues its chunk
+	 *	into its own PageWriteBatch and flushes it, so each one still issues coalesced, vectored writes.  The
+	 *	calling thread takes the first chunk itself; the other workers are started once and wait between
+	 *	restores.  A write failure in any worker is rethrown from restore().
+	 *
+	 *	Methods:
+	 *		restore(process, pages) - queues and writes every page in the list, pages must be in address order
+	 *		get_worker_count() - threads writing, the calling thread included
+	 *		get_write_calls() - running total of write calls the workers made into the target
+	 */
+	class RestoreWorkerPool {
+		struct Worker {
+			std::thread		thread;
+			PageWriteBatch	batch;
+			size_t			first;
+			size_t			last;
+		};
+
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::mutex				lock;
+		std::condition_variable	work_ready;
+		std::condition_variable	work_done;
+		uint64_t				generation;
+		size_t					busy_workers;
+		bool					stopping;
+		HANDLE					process;
+		std::vector<PageBackupEx*>* pages;
+		std::exception_ptr		failure;
+
+		void worker_main(Worker* worker);
+		void restore_chunk(Worker* worker);
+	public:
+		RestoreWorkerPool(size_t worker_count);
+		~RestoreWorkerPool();
+		RestoreWorkerPool(const RestoreWorkerPool&) = delete;
+		RestoreWorkerPool& operator=(const RestoreWorkerPool&) = delete;
+
+		void restore(HANDLE process, std::vector<PageBackupEx*>& pages);
+		size_t get_worker_count() { return this->workers.size(); }
+		uint64_t get_write_calls();
+	};
+	typedef std::unique_ptr<RestoreWorkerPool> UP_RestoreWorkerPool;
+}
@@ -0,0 +1,121 @@
+#include "SnapshotArena.hpp"
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace dedougger {
+
+	SnapshotArena::SnapshotArena(SIZE_T max_bytes) {
+		SIZE_T max_pages = max_bytes / PageBackupEx::BACKUP_PAGE_SIZE;
+		this->page_count = 0;
+		this->reserve(&this->data, max_pages * PageBackupEx::BACKUP_PAGE_SIZE);
+		try {
+			this->reserve(&this->descriptors, max_pages * sizeof(PageBackupEx));
+		}
+		catch (...) {
+			this->release(&this->data);
+			throw;
+		}
+	}
+
+	SnapshotArena::~SnapshotArena() {
+		this->release(&this->data);
+		this->release(&this->descriptors);
+	}
+
+	/* Appends a page descriptor to the arena
+		Args:
+			address - address of the page in the target
+			region - the region the page belongs to
+			trackPageChanges - passed on to the PageBackupEx
+			storage - where the page's backup lives
+		Returns:
+			The new descriptor
+	 */
+	PageBackupEx* SnapshotArena::add_page(PVOID address, PageRegion* region, bool trackPageChanges, PVOID storage) {
+		BYTE* descriptor = this->allocate(&this->descriptors, sizeof(PageBackupEx));
+		this->page_count++;
+		return new (descriptor) PageBackupEx(address, region, storage, trackPageChanges);
+	}
+
+	/* Hands out storage for a run of pages that belong to descriptors allocated elsewhere
+		Args:
+			page_count - number of pages
+		Returns:
+			page_count * BACKUP_PAGE_SIZE bytes of contiguous, page aligned storage
+	 */
+	BYTE* SnapshotArena::allocate_storage(size_t page_count) {
+		return this->allocate(&this->data, page_count * PageBackupEx::BACKUP_PAGE_SIZE);
+	}
+
+	/* Frees everything allocated since mark was taken.  The memory stays committed for reuse.
+		Args:
+			mark - a mark taken with get_mark().  Marks taken after it are no longer valid.
+	 */
+	void SnapshotArena::release_to(const Mark& mark) {
+		this->page_count = mark.page_count;
+		this->data.used = mark.data_used;
+		this->descriptors.used = mark.descriptors_used;
+	}
+
+	void SnapshotArena::reserve(Mapping* mapping, SIZE_T size) {
+		//
+		// Round up to whole commit chunks so allocate never has to commit past the end
+		//
+		size = (size + COMMIT_CHUNK - 1) & ~(COMMIT_CHUNK - 1);
+#ifdef _WIN32
+		mapping->base = (BYTE*)VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+		if (mapping->base == nullptr) {
+			throw VirtualAllocFailedException();
+		}
+#else
+		void* base = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (base == MAP_FAILED) {
+			throw VirtualAllocFailedException();
+		}
+		mapping->base = (BYTE*)base;
+#endif
+		mapping->reserved = size;
+		mapping->committed = 0;
+		mapping->used = 0;
+	}
+
+	void SnapshotArena::release(Mapping* mapping) {
+		if (mapping->base == nullptr) {
+			return;
+		}
+#ifdef _WIN32
+		VirtualFree(mapping->base, 0, MEM_RELEASE);
+#else
+		munmap(mapping->base, mapping->reserved);
+#endif
+		mapping->base = nullptr;
+	}
+
+	BYTE* SnapshotArena::allocate(Mapping* mapping, SIZE_T size) {
+		if (mapping->used + size > mapping->reserved) {
+			throw SnapshotArenaExhaustedException();
+		}
+		if (mapping->used + size > mapping->committed) {
+			//
+			// Commit as many whole chunks as it takes, a run of pages can be bigger than one
+			//
+			BYTE* chunk = mapping->base + mapping->committed;
+			SIZE_T commit_size = (mapping->used + size - mapping->committed + COMMIT_CHUNK - 1) & ~(COMMIT_CHUNK - 1);
+#ifdef _WIN32
+			if (VirtualAlloc(chunk, commit_size, MEM_COMMIT, PAGE_READWRITE) == nullptr) {
+				throw VirtualAllocFailedException();
+			}
+#else
+			if (mprotect(chunk, commit_size, PROT_READ | PROT_WRITE) == -1) {
+				throw VirtualAllocFailedException();
+			}
+#endif
+			mapping->committed += commit_size;
+		}
+		BYTE* result = mapping->base + mapping->used;
+		mapping->used += size;
+		return result;
+	}
+}
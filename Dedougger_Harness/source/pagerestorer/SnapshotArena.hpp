@@ -0,0 +1,77 @@
+#pragma once
+#include <stdint.h>
+#include "platform/platform.h"
+#include "dexception.h"
+#include "PageBackupEx.h"
+
+namespace dedougger {
+	/**
+	 * SnapshotArena - storage for every page backup of a PageRestorerEx.
+	 *
+	 *	The PageBackupEx descriptors sit in one mapping as a dense array indexed by position, and the pages
+	 *	nested snapshots copy in push_state() back to back in a second, page aligned one.  Both are reserved
+	 *	up front and committed in chunks as they fill, so nothing ever moves: descriptors and page data can be
+	 *	pointed at for the lifetime of the arena, there's no per page heap allocation, and walking every page
+	 *	on a restore is a linear pass over the descriptor array.  The contents save_state() backs up are
+	 *	deduplicated by the PageStore instead, which carves its slots out of a Mapping of its own.
+	 *
+	 *	Allocation is strictly stack-like, which is what nested snapshots need: get_mark() before pushing a
+	 *	snapshot level and release_to(mark) when it's popped hands back everything the level took.
+	 *
+	 *	Methods:
+	 *		add_page(address, region, trackPageChanges, storage) - appends a descriptor for a page whose contents
+	 *			live in storage (the PageStore or a mapped SnapshotFile)
+	 *		allocate_storage(page_count) - contiguous storage for that many pages, without descriptors
+	 *		get_mark()/release_to(mark) - remembers the arena's fill level and frees back down to it
+	 *		size()/operator[](index)/begin()/end() - the descriptor array, in the order pages were added
+	 *		get_footprint() - bytes committed for page data and descriptors, for memory budgeting
+	 *		get_reserved() - address space held for the arena
+	 *
+	 *	The Mapping helpers - reserve(mapping, size), allocate(mapping, size), release(mapping) - are public for
+	 *	other stores that want the same reserve-once, commit-as-you-go memory.
+	 */
+	class SnapshotArena {
+	public:
+		struct Mark {
+			size_t	page_count;
+			SIZE_T	data_used;
+			SIZE_T	descriptors_used;
+		};
+		struct Mapping {
+			BYTE*	base;
+			SIZE_T	reserved;
+			SIZE_T	committed;
+			SIZE_T	used;
+		};
+
+		static void reserve(Mapping* mapping, SIZE_T size);
+		static void release(Mapping* mapping);
+		static BYTE* allocate(Mapping* mapping, SIZE_T size);
+	private:
+		Mapping data;
+		Mapping descriptors;
+		size_t	page_count;
+	public:
+		//
+		// 64 GiB of snapshot is plenty and costs nothing but address space until it's used
+		//
+		static const SIZE_T DEFAULT_RESERVE = sizeof(void*) == 8 ? (SIZE_T)64 << 30 : (SIZE_T)512 << 20;
+		static const SIZE_T COMMIT_CHUNK = 64 << 10;
+
+		SnapshotArena(SIZE_T max_bytes = DEFAULT_RESERVE);
+		~SnapshotArena();
+		SnapshotArena(const SnapshotArena&) = delete;
+		SnapshotArena& operator=(const SnapshotArena&) = delete;
+
+		PageBackupEx* add_page(PVOID address, PageRegion* region, bool trackPageChanges, PVOID storage);
+		BYTE* allocate_storage(size_t page_count);
+		Mark get_mark() { return { this->page_count, this->data.used, this->descriptors.used }; }
+		void release_to(const Mark& mark);
+		size_t size() { return this->page_count; }
+		PageBackupEx& operator[](size_t index) { return this->begin()[index]; }
+		PageBackupEx* begin() { return (PageBackupEx*)this->descriptors.base; }
+		PageBackupEx* end() { return this->begin() + this->page_count; }
+		SIZE_T get_footprint() { return this->data.committed + this->descriptors.committed; }
+		SIZE_T get_reserved() { return this->data.reserved + this->descriptors.reserved; }
+	};
+}
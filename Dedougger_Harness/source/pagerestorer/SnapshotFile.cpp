@@ -0,0 +1,226 @@
+#include "SnapshotFile.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "PageBackupEx.h"
+
+namespace dedougger {
+
+	static uint64_t align_up(uint64_t value, uint64_t alignment) {
+		return (value + alignment - 1) & ~(alignment - 1);
+	}
+
+	size_t SnapshotFileWriter::add_region(const MEMORY_BASIC_INFORMATION* mem_info) {
+		SnapshotFileRegion region = { 0 };
+		region.base					= (uint64_t)mem_info->BaseAddress;
+		region.size					= mem_info->RegionSize;
+		region.allocation_base		= (uint64_t)mem_info->AllocationBase;
+		region.allocation_protect	= mem_info->AllocationProtect;
+		region.protect				= mem_info->Protect;
+		region.state				= mem_info->State;
+		region.type					= mem_info->Type;
+		this->regions.push_back(region);
+		return this->regions.size() - 1;
+	}
+
+	void SnapshotFileWriter::add_page(LPCVOID address, size_t region, const void* contents) {
+		PendingPage page;
+		page.page.address = (uint64_t)address;
+		page.page.region = region;
+		page.contents = contents;
+		this->pages.push_back(page);
+	}
+
+	void SnapshotFileWriter::add_thread(DWORD thread_id, size_t start_address, size_t stack_base, const RegisterFile& registers) {
+		SnapshotFileThread thread = { 0 };
+		thread.thread_id = thread_id;
+		thread.start_address = start_address;
+		thread.stack_base = stack_base;
+		this->extended_states.emplace_back();
+		registers.GetExtendedState(&this->extended_states.back());
+		thread.xsave_size = this->extended_states.back().size();
+		this->threads.push_back(thread);
+		this->contexts.push_back(*registers.GetContext());
+	}
+
+	void SnapshotFileWriter::add_module(size_t base, const std::string& path) {
+		SnapshotFileModule module = { 0 };
+		module.base = base;
+		strncpy(module.path, path.c_str(), sizeof(module.path) - 1);
+		this->modules.push_back(module);
+	}
+
+	/* Writes everything added so far out as a snapshot file
+		Args:
+			path - the file to create or overwrite
+	 */
+	void SnapshotFileWriter::write(const char* path) {
+		const size_t page_size = PageBackupEx::BACKUP_PAGE_SIZE;
+		size_t xsave_area_size = 0;
+		for (auto& state : this->extended_states) {
+			xsave_area_size = std::max(xsave_area_size, state.size());
+		}
+		const size_t thread_size = snapshot_thread_record_size(sizeof(CONTEXT), xsave_area_size);
+		SnapshotFileHeader header = { 0 };
+		memcpy(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic));
+		header.version		= SNAPSHOT_FILE_VERSION;
+		header.context_size	= sizeof(CONTEXT);
+		header.page_size	= page_size;
+		header.region_count	= this->regions.size();
+		header.region_offset = align_up(sizeof(header), 16);
+		header.page_count	= this->pages.size();
+		header.page_offset	= align_up(header.region_offset + header.region_count * sizeof(SnapshotFileRegion), 16);
+		header.thread_count	= this->threads.size();
+		header.thread_offset = align_up(header.page_offset + header.page_count * sizeof(SnapshotFilePage), 16);
+		header.module_count	= this->modules.size();
+		header.module_offset = align_up(header.thread_offset + header.thread_count * thread_size, 16);
+		header.data_offset	= align_up(header.module_offset + header.module_count * sizeof(SnapshotFileModule), page_size);
+		header.xsave_area_size = xsave_area_size;
+
+		FILE* file = fopen(path, "wb");
+		if (file == nullptr) {
+			throw SnapshotFileWriteFailedException();
+		}
+		//
+		// Everything before the page contents is small, so build it in memory and write it in one go
+		//
+		std::vector<BYTE> tables((size_t)header.data_offset, 0);
+		memcpy(tables.data(), &header, sizeof(header));
+		memcpy(tables.data() + header.region_offset, this->regions.data(), this->regions.size() * sizeof(SnapshotFileRegion));
+		for (size_t i = 0; i < this->pages.size(); i++) {
+			memcpy(tables.data() + header.page_offset + i * sizeof(SnapshotFilePage), &this->pages[i].page, sizeof(SnapshotFilePage));
+		}
+		for (size_t i = 0; i < this->threads.size(); i++) {
+			BYTE* record = tables.data() + header.thread_offset + i * thread_size;
+			memcpy(record, &this->threads[i], sizeof(SnapshotFileThread));
+			memcpy(record + sizeof(SnapshotFileThread), &this->contexts[i], sizeof(CONTEXT));
+			memcpy(record + sizeof(SnapshotFileThread) + sizeof(CONTEXT), this->extended_states[i].data(), this->extended_states[i].size());
+		}
+		memcpy(tables.data() + header.module_offset, this->modules.data(), this->modules.size() * sizeof(SnapshotFileModule));
+
+		bool success = fwrite(tables.data(), 1, tables.size(), file) == tables.size();
+		for (size_t i = 0; success && i < this->pages.size(); i++) {
+			success = fwrite(this->pages[i].contents, 1, page_size, file) == page_size;
+		}
+		success = fclose(file) == 0 && success;
+		if (!success) {
+			throw SnapshotFileWriteFailedException();
+		}
+	}
+
+	SnapshotFile::SnapshotFile(const char* path) {
+		this->view = nullptr;
+		this->size = 0;
+#ifdef _WIN32
+		this->file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (this->file_handle == INVALID_HANDLE_VALUE) {
+			throw SnapshotFileInvalidException();
+		}
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(this->file_handle, &file_size);
+		this->size = (size_t)file_size.QuadPart;
+		this->mapping_handle = CreateFileMapping(this->file_handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if (this->mapping_handle != NULL) {
+			this->view = (BYTE*)MapViewOfFile(this->mapping_handle, FILE_MAP_COPY, 0, 0, 0);
+		}
+		if (this->view == nullptr) {
+			if (this->mapping_handle != NULL) {
+				CloseHandle(this->mapping_handle);
+			}
+			CloseHandle(this->file_handle);
+			throw SnapshotFileInvalidException();
+		}
+#else
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			throw SnapshotFileInvalidException();
+		}
+		struct stat file_stat;
+		if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+			this->size = (size_t)file_stat.st_size;
+			void* mapping = mmap(nullptr, this->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			this->view = mapping == MAP_FAILED ? nullptr : (BYTE*)mapping;
+		}
+		//
+		// The mapping keeps the file referenced on its own
+		//
+		::close(fd);
+		if (this->view == nullptr) {
+			throw SnapshotFileInvalidException();
+		}
+#endif
+		this->header = (const SnapshotFileHeader*)this->view;
+		try {
+			this->validate();
+		}
+		catch (...) {
+			this->close();
+			throw;
+		}
+	}
+
+	SnapshotFile::~SnapshotFile() {
+		this->close();
+	}
+
+	/* Unmaps the file, the destructor won't run for a constructor that throws
+	 */
+	void SnapshotFile::close() {
+		if (this->view == nullptr) {
+			return;
+		}
+#ifdef _WIN32
+		UnmapViewOfFile(this->view);
+		CloseHandle(this->mapping_handle);
+		CloseHandle(this->file_handle);
+#else
+		munmap(this->view, this->size);
+#endif
+		this->view = nullptr;
+	}
+
+	/* Makes sure the file is a snapshot this build can use and that every table lies inside it
+	 */
+	void SnapshotFile::validate() {
+		const SnapshotFileHeader* header = this->header;
+		if (this->size < sizeof(SnapshotFileHeader) ||
+			memcmp(header->magic, SNAPSHOT_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != SNAPSHOT_FILE_VERSION ||
+			header->context_size != sizeof(CONTEXT) ||
+			header->page_size != PageBackupEx::BACKUP_PAGE_SIZE) {
+			throw SnapshotFileInvalidException();
+		}
+		struct {
+			uint64_t offset;
+			uint64_t count;
+			uint64_t record_size;
+		} tables[] = {
+			{ header->region_offset, header->region_count, sizeof(SnapshotFileRegion) },
+			{ header->page_offset, header->page_count, sizeof(SnapshotFilePage) },
+			{ header->thread_offset, header->thread_count, snapshot_thread_record_size(header->context_size, header->xsave_area_size) },
+			{ header->module_offset, header->module_count, sizeof(SnapshotFileModule) },
+			{ header->data_offset, header->page_count, header->page_size },
+		};
+		for (auto& table : tables) {
+			if (table.offset > this->size || table.count > (this->size - table.offset) / table.record_size) {
+				throw SnapshotFileInvalidException();
+			}
+		}
+		for (size_t i = 0; i < header->page_count; i++) {
+			if (this->get_page(i)->region >= header->region_count) {
+				throw SnapshotFileInvalidException();
+			}
+		}
+		for (size_t i = 0; i < header->thread_count; i++) {
+			if (this->get_thread(i)->xsave_size > header->xsave_area_size) {
+				throw SnapshotFileInvalidException();
+			}
+		}
+	}
+}
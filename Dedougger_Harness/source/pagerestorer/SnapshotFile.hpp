@@ -0,0 +1,173 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "platform/platform.h"
+#include "dexception.h"
+#include "targetstate/RegisterFile.hpp"
+
+namespace dedougger {
+	//
+	// On-disk layout, version 3.  All fields are little-endian and naturally aligned, and every table is
+	// an array of one of these records:
+	//
+	//	SnapshotFileHeader
+	//	SnapshotFileRegion[region_count]	at region_offset
+	//	SnapshotFilePage[page_count]		at page_offset, in address order
+	//	SnapshotFileThread[thread_count]	at thread_offset, each followed by its CONTEXT and its XSAVE area
+	//										(standard layout, see RegisterFile) and padded to
+	//										snapshot_thread_record_size(context_size, xsave_area_size) bytes
+	//	SnapshotFileModule[module_count]	at module_offset
+	//	page contents						at data_offset, page aligned, BACKUP_PAGE_SIZE bytes per page
+	//
+	// The page contents are page aligned in the file so a mapped view can be restored from directly.
+	//
+	const char SNAPSHOT_FILE_MAGIC[8] = { 'D', 'D', 'G', 'S', 'N', 'A', 'P', 0 };
+	const uint32_t SNAPSHOT_FILE_VERSION = 3;
+
+	struct SnapshotFileHeader {
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	context_size;	// sizeof(CONTEXT) of the fuzzer that wrote it, checked on load
+		uint64_t	page_size;
+		uint64_t	region_count;
+		uint64_t	region_offset;
+		uint64_t	page_count;
+		uint64_t	page_offset;
+		uint64_t	thread_count;
+		uint64_t	thread_offset;
+		uint64_t	module_count;
+		uint64_t	module_offset;
+		uint64_t	data_offset;
+		uint64_t	xsave_area_size;	// room for an XSAVE area in every thread record, the largest one written
+	};
+
+	struct SnapshotFileRegion {
+		uint64_t	base;
+		uint64_t	size;
+		uint64_t	allocation_base;
+		uint32_t	allocation_protect;
+		uint32_t	protect;
+		uint32_t	state;
+		uint32_t	type;
+	};
+
+	struct SnapshotFilePage {
+		uint64_t	address;
+		uint64_t	region;			// index into the region table
+	};
+
+	//
+	// Thread IDs change from run to run, so a loaded snapshot finds its threads by where they started.  The
+	// stack base tells apart threads started at the same address.
+	//
+	struct SnapshotFileThread {
+		uint64_t	thread_id;
+		uint64_t	start_address;
+		uint64_t	stack_base;		// 0 if it wasn't known
+		uint64_t	xsave_size;		// how much of the record's XSAVE area is the thread's, 0 if none was captured
+	};
+
+	inline size_t snapshot_thread_record_size(size_t context_size, size_t xsave_area_size) {
+		return (sizeof(SnapshotFileThread) + context_size + xsave_area_size + 15) & ~(size_t)15;
+	}
+
+	struct SnapshotFileModule {
+		uint64_t	base;
+		char		path[512];
+	};
+
+	/**
+	 * SnapshotFileWriter - gathers a saved state and writes it out as a snapshot file.
+	 *
+	 *	The restorers add what they track (PageRestorerEx::write_snapshot, ThreadRestorerEx::write_snapshot)
+	 *	and the fuzzer adds the module list.  Page contents are only referenced until write() is called.
+	 *
+	 *	Methods:
+	 *		add_region(mem_info) - returns the region's index for add_page
+	 *		add_page(address, region, contents) - pages have to be added in address order
+	 *		add_thread(thread_id, start_address, stack_base, registers)/add_module(base, path)
+	 *		write(path) - writes the file, throws SnapshotFileWriteFailedException on failure
+	 */
+	class SnapshotFileWriter {
+		struct PendingPage {
+			SnapshotFilePage	page;
+			const void*			contents;
+		};
+
+		std::vector<SnapshotFileRegion>	regions;
+		std::vector<PendingPage>		pages;
+		std::vector<SnapshotFileThread>	threads;
+		std::vector<CONTEXT>			contexts;
+		std::vector<std::vector<uint8_t>>	extended_states;
+		std::vector<SnapshotFileModule>	modules;
+	public:
+		size_t add_region(const MEMORY_BASIC_INFORMATION* mem_info);
+		void add_page(LPCVOID address, size_t region, const void* contents);
+		void add_thread(DWORD thread_id, size_t start_address, size_t stack_base, const RegisterFile& registers);
+		void add_module(size_t base, const std::string& path);
+		void write(const char* path);
+	};
+
+	/**
+	 * SnapshotFile - a snapshot file mapped into the fuzzer.
+	 *
+	 *	The header is validated when the file is opened (SnapshotFileInvalidException otherwise), after which
+	 *	the tables and page contents are used straight out of the mapping.  The mapping lives as long as the
+	 *	object, so restorers loading from it keep a reference.  It's a private copy-on-write mapping: page
+	 *	backups point into it, and backing a page up again only copies that page, never touching the file.
+	 *
+	 *	Methods:
+	 *		get_header()
+	 *		get_region(index)/get_page(index)/get_module(index) - table entries, counts are in the header
+	 *		get_page_contents(index) - the page's saved bytes, inside the mapping
+	 *		get_thread_id(index)/get_thread_start_address(index)/get_thread_stack_base(index)/get_thread_context(index)
+	 *		get_thread_extended_state(index, size) - the thread's XSAVE area, nullptr if none was saved
+	 */
+	class SnapshotFile {
+		BYTE*	view;
+		size_t	size;
+#ifdef _WIN32
+		HANDLE	file_handle;
+		HANDLE	mapping_handle;
+#endif
+		const SnapshotFileHeader* header;
+
+		void validate();
+		void close();
+		const SnapshotFileThread* get_thread(size_t index) {
+			return (const SnapshotFileThread*)(this->view + this->header->thread_offset +
+				index * snapshot_thread_record_size(this->header->context_size, this->header->xsave_area_size));
+		}
+	public:
+		SnapshotFile(const char* path);
+		~SnapshotFile();
+		SnapshotFile(const SnapshotFile&) = delete;
+		SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+		const SnapshotFileHeader* get_header() { return this->header; }
+		const SnapshotFileRegion* get_region(size_t index) {
+			return (const SnapshotFileRegion*)(this->view + this->header->region_offset) + index;
+		}
+		const SnapshotFilePage* get_page(size_t index) {
+			return (const SnapshotFilePage*)(this->view + this->header->page_offset) + index;
+		}
+		const SnapshotFileModule* get_module(size_t index) {
+			return (const SnapshotFileModule*)(this->view + this->header->module_offset) + index;
+		}
+		const void* get_page_contents(size_t index) {
+			return this->view + this->header->data_offset + index * this->header->page_size;
+		}
+		DWORD get_thread_id(size_t index) { return (DWORD)this->get_thread(index)->thread_id; }
+		size_t get_thread_start_address(size_t index) { return (size_t)this->get_thread(index)->start_address; }
+		size_t get_thread_stack_base(size_t index) { return (size_t)this->get_thread(index)->stack_base; }
+		const CONTEXT* get_thread_context(size_t index) { return (const CONTEXT*)(this->get_thread(index) + 1); }
+		const void* get_thread_extended_state(size_t index, size_t* size) {
+			*size = (size_t)this->get_thread(index)->xsave_size;
+			return *size == 0 ? nullptr : (const BYTE*)(this->get_thread(index) + 1) + this->header->context_size;
+		}
+	};
+
+	typedef std::shared_ptr<SnapshotFile> SP_SnapshotFile;
+}
@@ -0,0 +1,201 @@
+#include "SnapshotScope.hpp"
+#include <algorithm>
+#include <stdio.h>
+#ifdef _WIN32
+#include <Psapi.h>
+#endif
+
+namespace dedougger {
+
+	namespace {
+		const size_t pageSize = 0x1000;
+		//
+		// PAGE_GUARD, PAGE_NOCACHE and PAGE_WRITECOMBINE modify a protection rather than being one
+		//
+		const DWORD PROTECTION_MODIFIERS = 0x700;
+	}
+
+	void SnapshotScope::add_range(std::vector<ScopeRange>& ranges, size_t start, size_t end) {
+		start &= ~(pageSize - 1);
+		end = (end + pageSize - 1) & ~(pageSize - 1);
+		if (start < end) {
+			ranges.push_back({ start, end });
+		}
+	}
+
+	bool SnapshotScope::is_restricted() const {
+		return !this->included_ranges.empty() || !this->excluded_ranges.empty() || !this->modules.empty() ||
+			this->types != 0 || this->required_protect != 0 || this->excluded_protect != 0;
+	}
+
+	/* Looks up the address ranges of the included and excluded modules
+		Args:
+			process - handle of the target process
+	 */
+	void SnapshotScope::resolve_modules(HANDLE process) {
+		this->included_modules.clear();
+		this->excluded_modules.clear();
+		if (this->modules.empty()) {
+			return;
+		}
+#ifdef _WIN32
+		HMODULE handles[1024];
+		DWORD bytes_needed = 0;
+		if (!EnumProcessModulesEx(process, handles, sizeof(handles), &bytes_needed, LIST_MODULES_ALL)) {
+			printf("Couldn't enumerate modules, module scope rules are ignored\n");
+			return;
+		}
+		DWORD module_count = std::min<DWORD>(bytes_needed / sizeof(HMODULE), sizeof(handles) / sizeof(HMODULE));
+		for (const ScopeModule& module : this->modules) {
+			bool found = false;
+			for (DWORD i = 0; i < module_count && !found; i++) {
+				char name[MAX_PATH];
+				MODULEINFO info;
+				if (!GetModuleBaseNameA(process, handles[i], name, sizeof(name)) || _stricmp(name, module.name.c_str()) != 0 ||
+					!GetModuleInformation(process, handles[i], &info, sizeof(info))) {
+					continue;
+				}
+				add_range(module.include ? this->included_modules : this->excluded_modules,
+					(size_t)info.lpBaseOfDll, (size_t)info.lpBaseOfDll + info.SizeOfImage);
+				found = true;
+			}
+			if (!found) {
+				printf("Scope module %s isn't loaded\n", module.name.c_str());
+			}
+		}
+#else
+		std::vector<ProcessMapsEntry> maps;
+		if (!ReadProcessMaps((pid_t)(intptr_t)process, &maps)) {
+			printf("Couldn't read the target's mappings, module scope rules are ignored\n");
+			return;
+		}
+		for (const ScopeModule& module : this->modules) {
+			size_t start = 0;
+			size_t end = 0;
+			size_t last = 0;
+			for (size_t i = 0; i < maps.size(); i++) {
+				size_t name_index = maps[i].path.find_last_of('/') + 1;
+				if (maps[i].path.compare(name_index, std::string::npos, module.name) != 0) {
+					continue;
+				}
+				if (end == 0) {
+					start = maps[i].start;
+				}
+				end = maps[i].end;
+				last = i;
+			}
+			if (end == 0) {
+				printf("Scope module %s isn't loaded\n", module.name.c_str());
+				continue;
+			}
+			if (last + 1 < maps.size() && maps[last + 1].start == end && maps[last + 1].path.empty()) {
+				end = maps[last + 1].end;
+			}
+			add_range(module.include ? this->included_modules : this->excluded_modules, start, end);
+		}
+#endif
+	}
+
+	bool SnapshotScope::passes_filters(const MEMORY_BASIC_INFORMATION* mem_info) const {
+		DWORD protect = mem_info->Protect & ~PROTECTION_MODIFIERS;
+		//
+		// Working set blocks don't say what type their page is, a type of 0 is let through
+		//
+		if (this->types != 0 && mem_info->Type != 0 && !(mem_info->Type & this->types)) {
+			return false;
+		}
+		if (this->required_protect != 0 && !(protect & this->required_protect)) {
+			return false;
+		}
+		if (this->excluded_protect != 0 && (protect & this->excluded_protect)) {
+			return false;
+		}
+		return true;
+	}
+
+	/* Cuts the parts of a mapping that are in scope out of it
+		Args:
+			mem_info - the mapping
+			pieces - receives a copy of mem_info for every part in scope, in address order, with BaseAddress and
+				RegionSize narrowed to the part.  Its previous contents are discarded.
+	 */
+	void SnapshotScope::select(const MEMORY_BASIC_INFORMATION* mem_info, std::vector<MEMORY_BASIC_INFORMATION>* pieces) const {
+		std::vector<ScopeRange> parts;
+		pieces->clear();
+		if (!this->passes_filters(mem_info)) {
+			return;
+		}
+		size_t start = (size_t)mem_info->BaseAddress;
+		size_t end = start + mem_info->RegionSize;
+
+		bool has_includes = !this->included_ranges.empty() ||
+			std::any_of(this->modules.begin(), this->modules.end(), [](const ScopeModule& module) { return module.include; });
+		if (!has_includes) {
+			parts.push_back({ start, end });
+		}
+		else {
+			for (const std::vector<ScopeRange>* ranges : { &this->included_ranges, &this->included_modules }) {
+				for (const ScopeRange& range : *ranges) {
+					if (range.start < end && range.end > start) {
+						parts.push_back({ std::max(start, range.start), std::min(end, range.end) });
+					}
+				}
+			}
+			//
+			// Included ranges can overlap each other
+			//
+			std::sort(parts.begin(), parts.end(), [](const ScopeRange& a, const ScopeRange& b) { return a.start < b.start; });
+			size_t merged = 0;
+			for (size_t i = 1; i < parts.size(); i++) {
+				if (parts[i].start <= parts[merged].end) {
+					parts[merged].end = std::max(parts[merged].end, parts[i].end);
+				}
+				else {
+					parts[++merged] = parts[i];
+				}
+			}
+			parts.resize(parts.empty() ? 0 : merged + 1);
+		}
+
+		for (const std::vector<ScopeRange>* ranges : { &this->excluded_ranges, &this->excluded_modules }) {
+			for (const ScopeRange& excluded : *ranges) {
+				for (size_t i = 0; i < parts.size(); i++) {
+					ScopeRange part = parts[i];
+					if (excluded.start >= part.end || excluded.end <= part.start) {
+						continue;
+					}
+					//
+					// Whatever is left of the part on either side of the excluded range
+					//
+					parts.erase(parts.begin() + i);
+					if (excluded.end < part.end) {
+						parts.insert(parts.begin() + i, { excluded.end, part.end });
+					}
+					if (excluded.start > part.start) {
+						parts.insert(parts.begin() + i, { part.start, excluded.start });
+						i++;
+					}
+					else {
+						i--;
+					}
+				}
+			}
+		}
+
+		for (const ScopeRange& part : parts) {
+			MEMORY_BASIC_INFORMATION piece = *mem_info;
+			piece.BaseAddress = (PVOID)part.start;
+			piece.RegionSize = part.end - part.start;
+			pieces->push_back(piece);
+		}
+	}
+
+	bool SnapshotScope::contains(const MEMORY_BASIC_INFORMATION* mem_info) const {
+		static std::vector<MEMORY_BASIC_INFORMATION> pieces;
+		if (!this->is_restricted()) {
+			return true;
+		}
+		this->select(mem_info, &pieces);
+		return !pieces.empty();
+	}
+}
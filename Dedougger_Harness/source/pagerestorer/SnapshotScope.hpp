@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "platform/platform.h"
+#include "dexception.h"
+
+namespace dedougger {
+	/**
+	 * SnapshotScope - which parts of the target's memory PageRestorerEx snapshots.
+	 *
+	 *	By default everything committed is in scope.  Each rule narrows it down:
+	 *		include_range/include_module - only memory inside one of the included ranges and modules is in
+	 *			scope, once there is at least one
+	 *		exclude_range/exclude_module - memory inside an excluded range or module never is
+	 *		set_types(types) - only mappings of these types (MEM_PRIVATE | MEM_IMAGE | MEM_MAPPED) are
+	 *		require_protection(mask) - only mappings with one of these protections are, e.g. the writable ones
+	 *		exclude_protection(mask) - mappings with one of these protections aren't, e.g. PAGE_EXECUTE_READ
+	 *
+	 *	Memory out of scope is neither saved nor restored, and restores leave it alone even if the iteration
+	 *	mapped it, so limiting a snapshot to heap, stacks and .data skips code, file mappings and driver
+	 *	buffers entirely.  Modules are named by file name and resolved to address ranges by resolve_modules(),
+	 *	which PageRestorerEx calls when the state is saved; on Linux a module's range takes in the anonymous
+	 *	mapping right after its last one, which is where its .bss lives.
+	 *
+	 *	Methods:
+	 *		select(mem_info, pieces) - the parts of a mapping in scope, each a page aligned copy of mem_info
+	 *		contains(mem_info) - whether any part of a mapping is in scope
+	 *		is_restricted() - false if no rule has been added
+	 */
+	class SnapshotScope {
+		struct ScopeRange {
+			size_t start;
+			size_t end;
+		};
+		struct ScopeModule {
+			std::string name;
+			bool		include;
+		};
+
+		std::vector<ScopeRange>		included_ranges;
+		std::vector<ScopeRange>		excluded_ranges;
+		std::vector<ScopeModule>	modules;
+		std::vector<ScopeRange>		included_modules;	// resolved by resolve_modules
+		std::vector<ScopeRange>		excluded_modules;
+		DWORD						types = 0;
+		DWORD						required_protect = 0;
+		DWORD						excluded_protect = 0;
+
+		static void add_range(std::vector<ScopeRange>& ranges, size_t start, size_t end);
+		bool passes_filters(const MEMORY_BASIC_INFORMATION* mem_info) const;
+	public:
+		void include_range(size_t start, size_t end) { add_range(this->included_ranges, start, end); }
+		void exclude_range(size_t start, size_t end) { add_range(this->excluded_ranges, start, end); }
+		void include_module(const std::string& name) { this->modules.push_back({ name, true }); }
+		void exclude_module(const std::string& name) { this->modules.push_back({ name, false }); }
+		void set_types(DWORD types) { this->types = types; }
+		void require_protection(DWORD mask) { this->required_protect = mask; }
+		void exclude_protection(DWORD mask) { this->excluded_protect = mask; }
+
+		void resolve_modules(HANDLE process);
+		void select(const MEMORY_BASIC_INFORMATION* mem_info, std::vector<MEMORY_BASIC_INFORMATION>* pieces) const;
+		bool contains(const MEMORY_BASIC_INFORMATION* mem_info) const;
+		bool is_restricted() const;
+	};
+}
@@ -0,0 +1,183 @@
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "UffdWriteTracker.hpp"
+#include "backend/LinuxDebugBackend.hpp"
+
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+
+namespace dedougger {
+
+	UffdWriteTracker::UffdWriteTracker(DWORD processId) {
+		LinuxDebugBackend* backend = LinuxDebugBackend::FromProcessHandle((HANDLE)(intptr_t)processId);
+		if (backend == nullptr) {
+			throw UserfaultfdFailedException();
+		}
+
+		//
+		// UFFD_USER_MODE_ONLY is out of the question even though it needs no privileges: the kernel's own writes
+		// into tracked pages (read() into a buffer, futex words etc.) would fail with EFAULT instead of being
+		// reported, changing what the target's syscalls return.  Without privileges (vm.unprivileged_userfaultfd
+		// is 0) the tracker can't be had and the caller has to pick another differential type.
+		//
+		long remoteFd = backend->RemoteSyscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+		if (remoteFd < 0) {
+			throw UserfaultfdFailedException();
+		}
+
+		int pidfd = (int)syscall(SYS_pidfd_open, (pid_t)processId, 0);
+		this->uffd = pidfd == -1 ? -1 : (int)syscall(SYS_pidfd_getfd, pidfd, (int)remoteFd, 0);
+		if (pidfd != -1) {
+			close(pidfd);
+		}
+		backend->RemoteSyscall(SYS_close, remoteFd);
+		if (this->uffd == -1) {
+			throw UserfaultfdFailedException();
+		}
+
+		//
+		// WP_UNPOPULATED (6.4+) keeps pages protected after they've been zapped (MADV_DONTNEED, swap), which
+		// we want when it's there.  The API handshake can only be done once per fd and fails outright on
+		// unknown features, so ask the kernel what it has first through a throwaway local userfaultfd.
+		//
+		struct uffdio_api api = { 0 };
+		api.api = UFFD_API;
+		api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+		int probe = (int)syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+		if (probe != -1) {
+			struct uffdio_api probeApi = { 0 };
+			probeApi.api = UFFD_API;
+			if (ioctl(probe, UFFDIO_API, &probeApi) == 0 && (probeApi.features & UFFD_FEATURE_WP_UNPOPULATED)) {
+				api.features |= UFFD_FEATURE_WP_UNPOPULATED;
+			}
+			close(probe);
+		}
+		if (ioctl(this->uffd, UFFDIO_API, &api) == -1) {
+			close(this->uffd);
+			throw UserfaultfdFailedException();
+		}
+
+		if (pipe2(this->stop_pipe, O_CLOEXEC) == -1) {
+			close(this->uffd);
+			throw UserfaultfdFailedException();
+		}
+		this->fault_count = 0;
+		this->fault_thread = std::thread(&UffdWriteTracker::handle_faults, this);
+	}
+
+	UffdWriteTracker::~UffdWriteTracker() {
+		char stop = 0;
+		if (write(this->stop_pipe[1], &stop, sizeof(stop)) == sizeof(stop)) {
+			this->fault_thread.join();
+		}
+		else {
+			this->fault_thread.detach();
+		}
+		close(this->stop_pipe[0]);
+		close(this->stop_pipe[1]);
+		//
+		// Closing the last reference unregisters everything and wakes any thread still blocked on us
+		//
+		close(this->uffd);
+	}
+
+	/* Registers a range for write-protect tracking and arms the protection
+		Args:
+			address - page aligned start of the range
+			size - size of the range in bytes, a multiple of the page size
+		Returns:
+			true if the range is now tracked, false if the kernel can't write-protect this kind of mapping
+	 */
+	bool UffdWriteTracker::track_range(size_t address, size_t size) {
+		struct uffdio_register reg = { 0 };
+		reg.range.start = address;
+		reg.range.len = size;
+		reg.mode = UFFDIO_REGISTER_MODE_WP;
+		if (ioctl(this->uffd, UFFDIO_REGISTER, &reg) == -1) {
+			return false;
+		}
+		if (!this->protect_range(address, size)) {
+			struct uffdio_range range = { address, size };
+			ioctl(this->uffd, UFFDIO_UNREGISTER, &range);
+			return false;
+		}
+		return true;
+	}
+
+	/* Moves the list of pages written since the last call into pages
+		Args:
+			pages - receives the page addresses, in fault order.  Its previous contents are discarded.
+	 */
+	void UffdWriteTracker::take_dirty_pages(std::vector<size_t>* pages) {
+		pages->clear();
+		std::lock_guard<std::mutex> guard(this->dirty_lock);
+		pages->swap(this->dirty_pages);
+	}
+
+	bool UffdWriteTracker::write_protect(size_t address, size_t size, bool protect) {
+		struct uffdio_writeprotect wp = { 0 };
+		wp.range.start = address;
+		wp.range.len = size;
+		//
+		// The target is stopped whenever we do this ourselves, there's nobody to wake
+		//
+		wp.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : UFFDIO_WRITEPROTECT_MODE_DONTWAKE;
+		return ioctl(this->uffd, UFFDIO_WRITEPROTECT, &wp) == 0;
+	}
+
+	void UffdWriteTracker::handle_faults() {
+		struct pollfd fds[2];
+		fds[0].fd = this->uffd;
+		fds[0].events = POLLIN;
+		fds[1].fd = this->stop_pipe[0];
+		fds[1].events = POLLIN;
+
+		while (true) {
+			if (poll(fds, 2, -1) == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			if (fds[1].revents) {
+				break;
+			}
+			if (fds[0].revents & (POLLERR | POLLHUP)) {
+				break;
+			}
+
+			struct uffd_msg msgs[64];
+			ssize_t bytesRead = read(this->uffd, msgs, sizeof(msgs));
+			if (bytesRead <= 0) {
+				continue;
+			}
+			for (size_t i = 0; i < bytesRead / sizeof(struct uffd_msg); i++) {
+				struct uffd_msg& msg = msgs[i];
+				if (msg.event != UFFD_EVENT_PAGEFAULT || !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+					continue;
+				}
+				size_t page = msg.arg.pagefault.address & ~(size_t)0xFFF;
+				{
+					std::lock_guard<std::mutex> guard(this->dirty_lock);
+					this->dirty_pages.push_back(page);
+				}
+				//
+				// Lifting the protection wakes the faulting thread and lets the write through
+				//
+				struct uffdio_writeprotect wp = { 0 };
+				wp.range.start = page;
+				wp.range.len = 0x1000;
+				wp.mode = 0;
+				ioctl(this->uffd, UFFDIO_WRITEPROTECT, &wp);
+				this->fault_count++;
+			}
+		}
+	}
+}
+#endif // __linux__
@@ -0,0 +1,58 @@
+#pragma once
+#ifdef __linux__
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "platform/platform.h"
+#include "dexception.h"
+
+namespace dedougger {
+	/**
+	 * UffdWriteTracker - records the pages a target writes to using userfaultfd write-protection.
+	 *
+	 *	The userfaultfd is created inside the target by injecting a userfaultfd() syscall (the target has to
+	 *	be stopped in a debug event when this object is constructed), then pulled into the fuzzer with
+	 *	pidfd_getfd and closed on the target's side, so the target never sees it.  Registered ranges are
+	 *	write-protected; the first write to a page blocks the writing thread in the kernel and queues a fault
+	 *	message that a fuzzer-side thread picks up.  That thread records the page and lifts the protection,
+	 *	which wakes the writer - no signal, no ptrace stop and no debugger round trip.
+	 *
+	 *	The kernel's own writes have to be tracked as well, so the userfaultfd can't be user mode only and needs
+	 *	CAP_SYS_PTRACE or vm.unprivileged_userfaultfd=1 in the target.  Construction throws
+	 *	UserfaultfdFailedException when the target isn't allowed one.
+	 *
+	 *	Only anonymous private memory can be write-protected this way.  track_range says whether a range was
+	 *	accepted so the caller can fall back to something else for file-backed mappings.
+	 *
+	 *	Methods:
+	 *		track_range(address, size) - registers and write-protects a range
+	 *		take_dirty_pages(pages) - hands over the addresses of the pages written since the last call
+	 *		unprotect_range(address, size)/protect_range(address, size) - lift and re-arm the protection
+	 *			around our own writes into the target
+	 *		get_fault_count() - number of write faults resolved by the fault thread
+	 */
+	class UffdWriteTracker {
+		int							uffd;			// our copy of the target's userfaultfd
+		int							stop_pipe[2];	// wakes the fault thread up when we shut down
+		std::thread					fault_thread;
+		std::mutex					dirty_lock;
+		std::vector<size_t>			dirty_pages;
+		std::atomic<uint64_t>		fault_count;
+
+		void handle_faults();
+		bool write_protect(size_t address, size_t size, bool protect);
+	public:
+		UffdWriteTracker(DWORD processId);
+		~UffdWriteTracker();
+		bool track_range(size_t address, size_t size);
+		void take_dirty_pages(std::vector<size_t>* pages);
+		bool protect_range(size_t address, size_t size) { return this->write_protect(address, size, true); }
+		bool unprotect_range(size_t address, size_t size) { return this->write_protect(address, size, false); }
+		uint64_t get_fault_count() { return this->fault_count; }
+	};
+
+	typedef std::unique_ptr<UffdWriteTracker> UP_UffdWriteTracker;
+}
+#endif // __linux__
@@ -1,44 +1,329 @@
 #include "ThreadBackupEx.hpp"
+#include <string.h>
+
 namespace dedougger {
-	ThreadBackupEx::ThreadBackupEx(DWORD remote_thread_id)	{
+#ifdef _WIN32
+	namespace {
+		//
+		// x64 TEB layout, as far as resurrect() needs it
+		//
+		const size_t TEB_STACK_BASE = 0x08;
+		const size_t TEB_SELF = 0x30;						// NtTib ends here, the fields before it are the thread's
+		const size_t TEB_THREAD_LOCAL_STORAGE_POINTER = 0x58;
+		const size_t TEB_LAST_ERROR_VALUE = 0x68;
+		const size_t TEB_DEALLOCATION_STACK = 0x1478;		// followed by TlsSlots[64]
+		const size_t TEB_TLS_LINKS = 0x1680;
+		const size_t TEB_GUARANTEED_STACK_BYTES = 0x1748;
+		const size_t TEB_TLS_EXPANSION_SLOTS = 0x1780;
+		const size_t TEB_FLS_DATA = 0x17C8;
+		const size_t TEB_ENVIRONMENT_SIZE = TEB_FLS_DATA + sizeof(size_t);
+
+		struct TebField {
+			size_t offset;
+			size_t size;
+		};
+
+		//
+		// What a resurrected thread takes over from the one it replaces.  Its own ClientId, Self, PEB pointer
+		// and TLS links stay.
+		//
+		const TebField RESURRECTED_TEB_FIELDS[] = {
+			{ 0, TEB_SELF },
+			{ TEB_THREAD_LOCAL_STORAGE_POINTER, sizeof(size_t) },
+			{ TEB_LAST_ERROR_VALUE, sizeof(DWORD) },
+			{ TEB_DEALLOCATION_STACK, TEB_TLS_LINKS - TEB_DEALLOCATION_STACK },
+			{ TEB_GUARANTEED_STACK_BYTES, sizeof(DWORD) },
+			{ TEB_TLS_EXPANSION_SLOTS, sizeof(size_t) },
+			{ TEB_FLS_DATA, sizeof(size_t) },
+		};
+
+		const ULONG THREAD_CREATE_FLAGS_CREATE_SUSPENDED = 0x1;
+		const ULONG THREAD_CREATE_FLAGS_SKIP_THREAD_ATTACH = 0x2;
+		const ULONG THREAD_BASIC_INFORMATION_CLASS = 0;
+		const ULONG THREAD_QUERY_SET_WIN32_START_ADDRESS_CLASS = 9;
+		const SIZE_T RESURRECTED_STACK_SIZE = 0x10000;
+
+		struct ThreadBasicInformation {
+			LONG		exitStatus;
+			PVOID		tebBaseAddress;
+			HANDLE		uniqueProcess;
+			HANDLE		uniqueThread;
+			ULONG_PTR	affinityMask;
+			LONG		priority;
+			LONG		basePriority;
+		};
+
+		typedef LONG(WINAPI *NtCreateThreadExFn)(PHANDLE threadHandle, ACCESS_MASK desiredAccess, PVOID objectAttributes,
+			HANDLE processHandle, PVOID startRoutine, PVOID argument, ULONG createFlags, SIZE_T zeroBits, SIZE_T stackSize,
+			SIZE_T maximumStackSize, PVOID attributeList);
+		typedef LONG(WINAPI *NtQueryInformationThreadFn)(HANDLE threadHandle, ULONG informationClass, PVOID information,
+			ULONG informationLength, PULONG returnLength);
+
+		FARPROC NtdllProc(const char* name) {
+			static HMODULE ntdll = GetModuleHandleA("ntdll.dll");
+			return ntdll == NULL ? nullptr : GetProcAddress(ntdll, name);
+		}
+
+		/* Finds a thread's TEB
+			Returns:
+				Its address, 0 if the thread couldn't be queried
+		 */
+		size_t QueryTeb(HANDLE thread) {
+			static NtQueryInformationThreadFn queryInformationThread = (NtQueryInformationThreadFn)NtdllProc("NtQueryInformationThread");
+			ThreadBasicInformation info = { 0 };
+			if (queryInformationThread == nullptr ||
+				queryInformationThread(thread, THREAD_BASIC_INFORMATION_CLASS, &info, sizeof(info), nullptr) < 0) {
+				return 0;
+			}
+			return (size_t)info.tebBaseAddress;
+		}
+
+		/* Finds where a thread started running, which stays the same from run to run where its ID doesn't
+			Returns:
+				The start address, 0 if the thread couldn't be queried
+		 */
+		size_t QueryStartAddress(HANDLE thread) {
+			static NtQueryInformationThreadFn queryInformationThread = (NtQueryInformationThreadFn)NtdllProc("NtQueryInformationThread");
+			PVOID start_address = nullptr;
+			if (queryInformationThread == nullptr ||
+				queryInformationThread(thread, THREAD_QUERY_SET_WIN32_START_ADDRESS_CLASS, &start_address, sizeof(start_address), nullptr) < 0) {
+				return 0;
+			}
+			return (size_t)start_address;
+		}
+	}
+#endif
+
+	ThreadBackupEx::ThreadBackupEx(DWORD remote_thread_id, HANDLE registered_handle)	{
 		this->thread_id = remote_thread_id;
 		//
-		// Maintain our thread handle in case one is killed during the iteration		
+		// Maintain our own copy of the thread handle in case the thread is killed during the iteration and the
+		// registry closes its one
 		//
-		this->thread_handle = OpenThread(THREAD_GET_CONTEXT | THREAD_SET_CONTEXT, false, this->thread_id);
+		if (registered_handle == NULL || !DuplicateHandle(GetCurrentProcess(), registered_handle, GetCurrentProcess(),
+			&this->thread_handle, 0, false, DUPLICATE_SAME_ACCESS)) {
+			this->thread_handle = NULL;
+		}
 		if (this->thread_handle == NULL) {
-			printf("ThreadBackup construction failed for thread ID %p", remote_thread_id);
+			printf("ThreadBackup construction failed for thread ID %x", remote_thread_id);
+		}
+#ifdef _WIN32
+		else {
+			this->teb = QueryTeb(this->thread_handle);
+			this->start_address = QueryStartAddress(this->thread_handle);
+		}
+#endif
+	}
+
+	ThreadBackupEx::~ThreadBackupEx() {
+		if (this->thread_handle != NULL) {
+			CloseHandle(this->thread_handle);
 		}
-		this->context.ContextFlags = CONTEXT_ALL;		
 	}
 
-	int ThreadBackupEx::backup() {		
-		bool result = GetThreadContext(this->thread_handle, &this->context);
+	int ThreadBackupEx::backup(HANDLE processHandle) {		
+		bool result = this->registers.Capture(this->thread_handle);
 		if (!result) {
-			printf("Backup failed for handle %d", this->thread_handle);
+			printf("Backup failed for handle %p", this->thread_handle);
 		}
 		else {
-			
+			this->backup_environment(processHandle);
+			this->exited = false;
+			this->sync_run_time();
 		}
 		return result;
 	}
 
+#ifdef _WIN32
+	/* Reads the part of the thread's TEB a resurrection needs.  A thread whose TEB can't be read can still be
+	 * restored while it lives, it just can't be brought back.
+		Returns:
+			true on success
+	 */
+	bool ThreadBackupEx::backup_environment(HANDLE processHandle) {
+		SIZE_T bytes_read = 0;
+		this->environment.resize(TEB_ENVIRONMENT_SIZE);
+		if (this->teb == 0 ||
+			!ReadProcessMemory(processHandle, (LPCVOID)this->teb, this->environment.data(), TEB_ENVIRONMENT_SIZE, &bytes_read) ||
+			bytes_read != TEB_ENVIRONMENT_SIZE) {
+			this->environment.clear();
+			return false;
+		}
+		return true;
+	}
+
+#else
+	/* Finds the stack the thread is on.  A resurrection needs more than that, which Linux doesn't have.
+		Returns:
+			true on success
+	 */
+	bool ThreadBackupEx::backup_environment(HANDLE processHandle) {
+		MEMORY_BASIC_INFORMATION stack_info = { 0 };
+		this->stack_start = 0;
+		this->stack_end = 0;
+		if (!VirtualQueryEx(processHandle, (LPCVOID)this->registers.GetContext()->Rsp, &stack_info, sizeof(stack_info)) ||
+			stack_info.State != MEM_COMMIT) {
+			return false;
+		}
+		this->stack_start = (size_t)stack_info.BaseAddress;
+		this->stack_end = this->stack_start + stack_info.RegionSize;
+		return true;
+	}
+#endif
+
 	int ThreadBackupEx::restore(HANDLE processHandle) {
-		bool result = SetThreadContext(this->thread_handle, &this->context);
+		if (this->exited) {
+			return this->resurrect(processHandle);
+		}
+		bool result = this->registers.Restore(this->thread_handle);
 		if (!result) {
 			//
-			// If the thread has been yeeted, we need to re-create it.
+			// The thread may have been yeeted without us seeing its exit event yet
 			//
-			DWORD newThreadId;
-			HANDLE newHandle;
-			newHandle = CreateRemoteThreadEx(processHandle, NULL,  NULL, (LPTHREAD_START_ROUTINE)this->context.Rip, NULL, NULL, NULL, &newThreadId);
-			this->thread_handle = newHandle;
-			this->thread_id = newThreadId;
-			result = SetThreadContext(newHandle, &this->context);
-			if (!result) {
+			DWORD exit_code = 0;
+			if (!GetExitCodeThread(this->thread_handle, &exit_code) || exit_code == STILL_ACTIVE) {
 				throw SetThreadContextFailedException();
 			}
+			return this->resurrect(processHandle);
 		}		
+		this->sync_run_time();
 		return result;
 	}
+
+#ifdef _WIN32
+	/* Brings back a thread that exited: creates a new one suspended, without DLL thread attach notifications
+	 * so the loader leaves its TLS alone, hands it the saved stack bounds and TLS of the old one and the saved
+	 * registers, and lets it go.  Until the debugger continues it doesn't run.
+	 *
+	 * The old stack has to be mapped again with its saved contents by now, which the page restorer does; the
+	 * stack the new thread was created with is freed since nothing will ever run on it.
+		Args:
+			processHandle - the target process
+		Returns:
+			Non-zero on success, throws ResurrectThreadFailedException otherwise
+	 */
+	int ThreadBackupEx::resurrect(HANDLE processHandle) {
+		static NtCreateThreadExFn createThreadEx = (NtCreateThreadExFn)NtdllProc("NtCreateThreadEx");
+		MEMORY_BASIC_INFORMATION stack_info = { 0 };
+		const CONTEXT* context = this->registers.GetContext();
+		if (createThreadEx == nullptr || this->environment.empty() ||
+			!VirtualQueryEx(processHandle, (LPCVOID)context->Rsp, &stack_info, sizeof(stack_info)) ||
+			stack_info.State != MEM_COMMIT) {
+			printf("Can't resurrect thread %x, its stack or TEB wasn't saved\n", this->thread_id);
+			throw ResurrectThreadFailedException();
+		}
+		HANDLE new_handle = NULL;
+		LONG status = createThreadEx(&new_handle, THREAD_ALL_ACCESS, nullptr, processHandle, (PVOID)context->Rip, nullptr,
+			THREAD_CREATE_FLAGS_CREATE_SUSPENDED | THREAD_CREATE_FLAGS_SKIP_THREAD_ATTACH, 0, RESURRECTED_STACK_SIZE,
+			RESURRECTED_STACK_SIZE, nullptr);
+		size_t new_teb = status < 0 ? 0 : QueryTeb(new_handle);
+		size_t own_stack = 0;
+		bool result = new_teb != 0 &&
+			ReadProcessMemory(processHandle, (LPCVOID)(new_teb + TEB_DEALLOCATION_STACK), &own_stack, sizeof(own_stack), nullptr);
+		for (size_t i = 0; result && i < sizeof(RESURRECTED_TEB_FIELDS) / sizeof(RESURRECTED_TEB_FIELDS[0]); i++) {
+			const TebField& field = RESURRECTED_TEB_FIELDS[i];
+			result = WriteProcessMemory(processHandle, (LPVOID)(new_teb + field.offset), this->environment.data() + field.offset,
+				field.size, nullptr) != 0;
+		}
+		result = result && this->registers.Restore(new_handle);
+		if (!result) {
+			if (new_handle != NULL) {
+				TerminateThread(new_handle, 0);
+				CloseHandle(new_handle);
+			}
+			printf("Resurrecting thread %x failed\n", this->thread_id);
+			throw ResurrectThreadFailedException();
+		}
+		VirtualFreeEx(processHandle, (LPVOID)own_stack, 0, MEM_RELEASE);
+		CloseHandle(this->thread_handle);
+		this->thread_handle = new_handle;
+		this->thread_id = GetThreadId(new_handle);
+		this->teb = new_teb;
+		this->exited = false;
+		ResumeThread(new_handle);
+		this->sync_run_time();
+		return 1;
+	}
+#else
+	int ThreadBackupEx::resurrect(HANDLE processHandle) {
+		printf("Can't resurrect thread %x, saved threads that exit can only be brought back on Windows\n", this->thread_id);
+		throw ResurrectThreadFailedException();
+	}
+#endif
+
+	/* The stack the thread had at the backup, from its deallocation stack (the bottom of the reservation) to
+	 * its stack base.  On Linux it's the mapping the stack pointer was in.
+		Returns:
+			false if the stack wasn't found
+	 */
+	bool ThreadBackupEx::get_stack(size_t* start, size_t* end) {
+#ifdef __linux__
+		*start = this->stack_start;
+		*end = this->stack_end;
+		return *start < *end;
+#else
+		if (this->environment.empty()) {
+			return false;
+		}
+		memcpy(start, this->environment.data() + TEB_DEALLOCATION_STACK, sizeof(*start));
+		memcpy(end, this->environment.data() + TEB_STACK_BASE, sizeof(*end));
+		return *start < *end;
+#endif
+	}
+
+	/* Remembers how long the thread has run so far, now that it has the saved registers
+	 */
+	void ThreadBackupEx::sync_run_time() {
+		this->in_sync = QueryThreadCycleTime(this->thread_handle, &this->run_time) != 0;
+	}
+
+	/* Whether the thread could have changed its registers since it last had the saved ones.  A thread that hasn't
+	 * been scheduled since can't have, so its cycle time is the cheapest test there is.
+		Returns:
+			false if the thread still has the saved registers for sure
+	 */
+	bool ThreadBackupEx::ran_since_sync() {
+		ULONG64 current = 0;
+		if (!this->in_sync || this->exited || !QueryThreadCycleTime(this->thread_handle, &current)) {
+			return true;
+		}
+		return current != this->run_time;
+	}
+
+	/* Reads the thread's registers as they are now, for live_registers_match()
+		Returns:
+			true on success
+	 */
+	bool ThreadBackupEx::read_live_registers() {
+		this->live_registers_read = this->live_registers.Capture(this->thread_handle);
+		return this->live_registers_read;
+	}
+
+	/* Whether the registers read_live_registers() read are the saved ones, by fingerprint
+	 */
+	bool ThreadBackupEx::live_registers_match() {
+		return this->live_registers_read && !this->exited && this->live_registers.GetFingerprint() == this->registers.GetFingerprint();
+	}
+
+	/* Keeps the current backup for the parent snapshot and backs the thread up again for a child snapshot
+		Returns:
+			Non-zero on success, zero on failure
+	 */
+	int ThreadBackupEx::push_context(HANDLE processHandle) {
+		this->parent_contexts.push_back(this->registers);
+		this->parent_environments.push_back(this->environment);
+		return this->backup(processHandle);
+	}
+
+	/* Goes back to the backup taken for the parent snapshot
+	 */
+	void ThreadBackupEx::pop_context() {
+		if (!this->parent_contexts.empty()) {
+			this->registers = this->parent_contexts.back();
+			this->parent_contexts.pop_back();
+			this->environment.swap(this->parent_environments.back());
+			this->parent_environments.pop_back();
+			this->in_sync = false;
+		}
+	}
 }
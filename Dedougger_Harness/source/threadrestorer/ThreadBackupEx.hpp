@@ -1,17 +1,78 @@
 #pragma once
-#include <Windows.h>
-#include <processthreadsapi.h>
 #include <stdio.h>
+#include <vector>
+#include "platform/platform.h"
 #include "dexception.h"
+#include "targetstate/RegisterFile.hpp"
 
 namespace dedougger {
+	/**
+	 * ThreadBackupEx - the saved registers of one thread of the target, one set per snapshot level.
+	 *
+	 *	Next to the registers every backup keeps the thread's TEB up to its FLS data: stack bounds, TLS slots
+	 *	and pointers, last error.  When the thread exits during an iteration restore() resurrects it - a new
+	 *	thread is created suspended and without DLL thread attach notifications, handed the old TEB fields so it
+	 *	runs on the original stack with the original TLS, and given the full saved register set.  The stack
+	 *	memory itself is the page restorer's, see ThreadRestorerEx::get_lost_stacks.
+	 *
+	 *	The backup keeps its own duplicate of the handle ThreadRegistry opened for the thread, since the registry
+	 *	closes its one when the thread exits.
+	 *
+	 *	On Linux there's no TEB.  The stack is the mapping the saved stack pointer is in, there's no start address
+	 *	to ask the kernel for, and a thread that exited can't be brought back (ResurrectThreadFailedException).
+	 *
+	 *	Methods:
+	 *		backup(process)/restore(process) - saves the thread and puts it back, resurrecting it if it exited
+	 *		push_context(process)/pop_context() - nested snapshots
+	 *		set_exited() - the thread exited, from its exit event
+	 *		get_stack(start, end) - the stack the thread had at the backup
+	 *		get_start_address() - where the thread was started, to tell it apart from the others across runs
+	 *		get_thread_id()/get_handle() - the thread, which is a new one after a resurrection
+	 */
 	class ThreadBackupEx {
 		DWORD thread_id;
 		HANDLE thread_handle;
-		CONTEXT context;
+		RegisterFile registers;	// general registers and the whole XSAVE area
+		std::vector<RegisterFile> parent_contexts;	// register files saved at shallower snapshot levels
+		std::vector<uint8_t> environment;	// the thread's TEB as of the backup, up to and including FlsData
+		std::vector<std::vector<uint8_t>> parent_environments;
+		size_t teb = 0;		// where the thread's TEB is now
+		size_t start_address = 0;	// where the thread was started, a resurrected one keeps the original's
+#ifdef __linux__
+		size_t stack_start = 0;		// the mapping the saved stack pointer was in
+		size_t stack_end = 0;
+#endif
+		bool exited = false;	// the thread exited since it last had the saved registers
+		RegisterFile live_registers;	// what read_live_registers() found on the thread
+		bool live_registers_read = false;
+		ULONG64 run_time = 0;	// the thread's cycle time when it last had the saved registers
+		bool in_sync = false;	// run_time is valid, the saved registers haven't been swapped out since
+		void sync_run_time();
+		bool backup_environment(HANDLE processHandle);
+		int resurrect(HANDLE processHandle);
 	public:
-		ThreadBackupEx(DWORD remote_thread_id);
+		ThreadBackupEx(DWORD remote_thread_id, HANDLE registered_handle);
+		~ThreadBackupEx();
+		ThreadBackupEx(const ThreadBackupEx&) = delete;
+		ThreadBackupEx& operator=(const ThreadBackupEx&) = delete;
 		int restore(HANDLE processHandle);
-		int backup();
+		int backup(HANDLE processHandle);
+		int push_context(HANDLE processHandle);
+		void pop_context();
+		size_t get_depth() { return this->parent_contexts.size(); }
+		DWORD get_thread_id() { return this->thread_id; }
+		HANDLE get_handle() { return this->thread_handle; }
+		void set_exited() { this->exited = true; }
+		bool has_exited() { return this->exited; }
+		bool get_stack(size_t* start, size_t* end);
+		size_t get_start_address() { return this->start_address; }
+		const CONTEXT* get_context() { return this->registers.GetContext(); }
+		void set_context(const CONTEXT* context) { this->registers.SetContext(context); this->in_sync = false; }
+		void set_extended_state(const void* state, size_t size) { this->registers.SetExtendedState(state, size); this->in_sync = false; }
+		const RegisterFile& get_registers() { return this->registers; }
+		bool ran_since_sync();
+		bool read_live_registers();
+		bool live_registers_match();
+		void mark_in_sync() { this->sync_run_time(); }
 	};
 }
\ No newline at end of file
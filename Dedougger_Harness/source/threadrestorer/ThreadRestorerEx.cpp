@@ -1,10 +1,25 @@
 #include "ThreadRestorerEx.hpp"
+#include <algorithm>
+#include <assert.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <stdlib.h>
+#endif
 
 
 namespace dedougger {
 
-	ThreadRestorerEx::ThreadRestorerEx(DWORD process_id) {
+	ThreadRestorerEx::ThreadRestorerEx(DWORD process_id, const ThreadRegistry* registry) {
 		this->process_id = process_id;
+		this->registry = registry;
+		this->metrics = nullptr;
+		this->skip_unchanged = true;
+		this->threads_skipped = 0;
+		this->new_thread_policy = NEW_THREADS_RUN;
+		this->last_killed = 0;
+		this->threads_killed = 0;
+		this->threads_frozen = 0;
+		this->threads_resurrected = 0;
 		this->processHandle = OpenProcess(PROCESS_ALL_ACCESS, false, process_id);
 
 		if (this->processHandle == INVALID_HANDLE_VALUE) {
@@ -22,6 +37,41 @@ namespace dedougger {
 		printf("Saving thread state\n");
 		int threads_saved = 0;
 		std::vector<DWORD> process_threads;
+		this->enumerate_threads(process_threads);
+		//
+		// Save the state of each thread belonging to the target process
+		//
+		for (int i = 0; i < process_threads.size(); i++) {			
+			if (this->save_thread(process_threads[i])) {
+				threads_saved++;
+			}
+		}
+		return threads_saved;
+	}
+
+	/* Lists the threads of the target process
+		Args:
+			process_threads - receives the thread IDs
+	 */
+	void ThreadRestorerEx::enumerate_threads(std::vector<DWORD>& process_threads) {
+		if (this->registry != nullptr) {
+			this->registry->GetThreadIds(&process_threads);
+			return;
+		}
+#ifdef __linux__
+		char task_path[64];
+		snprintf(task_path, sizeof(task_path), "/proc/%u/task", this->process_id);
+		DIR* tasks = opendir(task_path);
+		if (tasks != nullptr) {
+			struct dirent* entry;
+			while ((entry = readdir(tasks)) != nullptr) {
+				if (entry->d_name[0] != '.') {
+					process_threads.push_back((DWORD)strtoul(entry->d_name, nullptr, 10));
+				}
+			}
+			closedir(tasks);
+		}
+#else
 		HANDLE h = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
 		//
 		// Walk all threads on the system and add threads belonging to the target
@@ -37,16 +87,237 @@ namespace dedougger {
 					}
 				} while (Thread32Next(h, &thread_entry));
 			}
+			CloseHandle(h);
+		}
+#endif
+	}
+
+	/* Adds the registers restore_state() currently goes back to to a snapshot file
+		Args:
+			writer - the file being put together
+		Returns:
+			Number of threads added
+	 */
+	int ThreadRestorerEx::write_snapshot(SnapshotFileWriter* writer) {
+		for (auto it = this->threads.begin(); it != this->threads.end(); it++) {
+			size_t stack_start = 0;
+			size_t stack_base = 0;
+			it->second->get_stack(&stack_start, &stack_base);
+			writer->add_thread(it->second->get_thread_id(), it->second->get_start_address(), stack_base, it->second->get_registers());
+		}
+		return (int)this->threads.size();
+	}
+
+	/* Matches the threads of a snapshot file to the target's without touching the saved state or the target:
+	 * the live threads are backed up and given their saved counterpart's registers in a staging area that
+	 * load_snapshot() takes as the saved state.  Thread IDs are different in every run, so a saved thread is
+	 * matched to the live thread that started at the same address; threads that started at the same address are
+	 * paired up in order of their stack bases.  Live threads left over are killed once the snapshot is loaded.
+		Args:
+			file - the mapped snapshot
+		Returns:
+			Number of threads matched, throws SnapshotThreadMismatchException if a saved thread has no live
+			counterpart
+	 */
+	int ThreadRestorerEx::stage_snapshot(SP_SnapshotFile file) {
+		struct ThreadKey {
+			size_t start_address;
+			size_t stack_base;
+			size_t index;
+			bool operator<(const ThreadKey& other) const {
+				return start_address != other.start_address ? start_address < other.start_address : stack_base < other.stack_base;
+			}
+		};
+		std::vector<DWORD> process_threads;
+		std::vector<ThreadBackupEx*> backups;
+		std::vector<ThreadKey> live;
+		std::vector<ThreadKey> saved;
+		std::vector<bool> matched;
+		size_t thread_count = (size_t)file->get_header()->thread_count;
+		assert(this->threads.empty());
+		this->discard_snapshot();
+		this->enumerate_threads(process_threads);
+
+		for (size_t i = 0; i < process_threads.size(); i++) {
+			size_t stack_start = 0;
+			size_t stack_base = 0;
+			ThreadBackupEx* thread = this->create_backup(process_threads[i]);
+			thread->backup(this->processHandle);
+			thread->get_stack(&stack_start, &stack_base);
+			backups.push_back(thread);
+			live.push_back({ thread->get_start_address(), stack_base, i });
 		}
+		for (size_t i = 0; i < thread_count; i++) {
+			saved.push_back({ file->get_thread_start_address(i), file->get_thread_stack_base(i), i });
+		}
+		std::sort(live.begin(), live.end());
+		std::sort(saved.begin(), saved.end());
+
 		//
-		// Save the state of each thread belonging to the target process
+		// Both lists are in start address order, so each saved thread takes the next live one that started
+		// where it did
 		//
-		for (int i = 0; i < process_threads.size(); i++) {			
-			if (this->save_thread(process_threads[i])) {
-				threads_saved++;
+		matched.resize(process_threads.size());
+		size_t next_live = 0;
+		for (ThreadKey& key : saved) {
+			while (next_live < live.size() && live[next_live].start_address < key.start_address) {
+				next_live++;
 			}
+			if (next_live == live.size() || live[next_live].start_address != key.start_address) {
+				printf("Snapshot thread %x started at %p, which no thread of the target did\n",
+					file->get_thread_id(key.index), (void*)key.start_address);
+				for (ThreadBackupEx* thread : backups) {
+					delete thread;
+				}
+				throw SnapshotThreadMismatchException();
+			}
+			size_t xsave_size = 0;
+			const void* xsave = file->get_thread_extended_state(key.index, &xsave_size);
+			ThreadBackupEx* thread = backups[live[next_live].index];
+			thread->set_context(file->get_thread_context(key.index));
+			if (xsave != nullptr) {
+				thread->set_extended_state(xsave, xsave_size);
+			}
+			matched[live[next_live].index] = true;
+			next_live++;
 		}
-		return threads_saved;
+		for (size_t i = 0; i < process_threads.size(); i++) {
+			if (matched[i]) {
+				this->staged_threads[process_threads[i]] = backups[i];
+			}
+			else {
+				delete backups[i];
+				this->staged_leftovers.push_back(process_threads[i]);
+			}
+		}
+		return (int)this->staged_threads.size();
+	}
+
+	/* Takes the threads stage_snapshot() matched as the saved state instead of calling save_state(), puts their
+	 * saved registers on them and kills the live threads the snapshot didn't have
+		Returns:
+			Number of threads restored
+	 */
+	int ThreadRestorerEx::load_snapshot() {
+		this->threads.insert(this->staged_threads.begin(), this->staged_threads.end());
+		this->staged_threads.clear();
+		for (DWORD thread_id : this->staged_leftovers) {
+			HANDLE thread_handle = OpenThread(THREAD_TERMINATE | THREAD_SUSPEND_RESUME, false, thread_id);
+			if (thread_handle != NULL) {
+				this->add_thread_to_kill(thread_id, thread_handle);
+			}
+		}
+		this->staged_leftovers.clear();
+		return this->restore_state();
+	}
+
+	/* Drops whatever stage_snapshot() staged, for when the snapshot can't be loaded after all */
+	void ThreadRestorerEx::discard_snapshot() {
+		for (auto it = this->staged_threads.begin(); it != this->staged_threads.end(); it++) {
+			delete it->second;
+		}
+		this->staged_threads.clear();
+		this->staged_leftovers.clear();
+	}
+
+	/* Puts a thread created since the snapshot on the kill list, and freezes it under NEW_THREADS_FREEZE.  Called
+	 * from its creation event, before it has run any code.
+		Args:
+			threadId - the new thread
+			threadHandle - a handle to it with THREAD_TERMINATE and THREAD_SUSPEND_RESUME access, the restorer
+				closes it
+	 */
+	void ThreadRestorerEx::add_thread_to_kill(DWORD threadId, HANDLE threadHandle) {
+		if (this->original_ids.count(threadId)) {
+			//
+			// A thread we resurrected, not one the iteration started
+			//
+			CloseHandle(threadHandle);
+			return;
+		}
+		this->threads_to_kill[threadId] = threadHandle;
+		if (this->new_thread_policy == NEW_THREADS_FREEZE && SuspendThread(threadHandle) != (DWORD)-1) {
+			this->frozen_threads.insert(threadId);
+			this->threads_frozen++;
+		}
+	}
+
+	/* Takes a thread that exited on its own off the kill list
+		Args:
+			threadId - the thread
+	 */
+	void ThreadRestorerEx::remove_thread_from_kill(DWORD threadId) {
+		auto found = this->threads_to_kill.find(threadId);
+		if (found != this->threads_to_kill.end()) {
+			CloseHandle(found->second);
+			this->threads_to_kill.erase(found);
+		}
+		this->frozen_threads.erase(threadId);
+	}
+
+	/* Notes a thread's exit.  One created since the snapshot is taken off the kill list, a saved one is resurrected
+	 * by the next restore.
+		Args:
+			threadId - the thread's current ID
+	 */
+	void ThreadRestorerEx::thread_exited(DWORD threadId) {
+		this->remove_thread_from_kill(threadId);
+		auto tracked = this->threads.find(this->get_original_thread_id(threadId));
+		if (tracked != this->threads.end() && tracked->second->get_thread_id() == threadId) {
+			tracked->second->set_exited();
+		}
+	}
+
+	/* Lists the stacks of the saved threads that exited, so the page restorer can map them again with their saved
+	 * contents before restore_state() resurrects the threads on them
+		Args:
+			stacks - receives the start and end of each stack
+	 */
+	void ThreadRestorerEx::get_lost_stacks(std::vector<std::pair<size_t, size_t>>* stacks) {
+		for (auto it = this->threads.begin(); it != this->threads.end(); it++) {
+			size_t start = 0;
+			size_t end = 0;
+			if (it->second->has_exited() && it->second->get_stack(&start, &end)) {
+				stacks->push_back(std::make_pair(start, end));
+			}
+		}
+	}
+
+	DWORD ThreadRestorerEx::get_current_thread_id(DWORD originalId) {
+		auto tracked = this->threads.find(originalId);
+		return tracked == this->threads.end() ? originalId : tracked->second->get_thread_id();
+	}
+
+	DWORD ThreadRestorerEx::get_original_thread_id(DWORD threadId) {
+		auto original = this->original_ids.find(threadId);
+		return original == this->original_ids.end() ? threadId : original->second;
+	}
+
+	/* Moves the ID mapping and the kill handles of pushed levels over to a thread's replacement
+		Args:
+			original_id - the ID the thread was saved under
+			old_id - the ID of the thread that exited
+			thread - the backup, now on the new thread
+	 */
+	void ThreadRestorerEx::track_resurrection(DWORD original_id, DWORD old_id, ThreadBackupEx* thread) {
+		this->original_ids.erase(old_id);
+		if (thread->get_thread_id() != original_id) {
+			this->original_ids[thread->get_thread_id()] = original_id;
+		}
+		for (auto& level : this->levels) {
+			auto adopted = level.find(original_id);
+			if (adopted == level.end()) {
+				continue;
+			}
+			//
+			// A level that adopted the thread kills it when it's popped, which has to reach the new one
+			//
+			CloseHandle(adopted->second);
+			if (!DuplicateHandle(GetCurrentProcess(), thread->get_handle(), GetCurrentProcess(), &adopted->second, 0, false, DUPLICATE_SAME_ACCESS)) {
+				adopted->second = NULL;
+			}
+		}
+		this->threads_resurrected++;
 	}
 
 	/* Kills all threads not 'saved'/tracked by the ThreadRestorer in the target process
@@ -55,51 +326,179 @@ namespace dedougger {
 	 */
 	int ThreadRestorerEx::kill_threads() {
 		int killed_threads = 0;
-		for (int i = 0; i < this->threads_to_kill.size(); i++) {
-			HANDLE threadHandle = this->threads_to_kill[i];
-			TerminateThread(this->threads_to_kill[i], 0);
-			CloseHandle(threadHandle);
-			killed_threads++;
+		for (auto it = this->threads_to_kill.begin(); it != this->threads_to_kill.end(); it++) {
+			if (TerminateThread(it->second, 0)) {
+				killed_threads++;
+			}
+			CloseHandle(it->second);
 		}
 		this->threads_to_kill.clear();
+		this->frozen_threads.clear();
+		this->last_killed = killed_threads;
+		this->threads_killed += killed_threads;
 		return killed_threads;
 	}
 
 	/* Restores the state of all threads saved/tracked by the ThreadRestorer in the target process
 		Returns:
-			The number of threads restored
+			The number of threads written back, threads that still had the saved registers aren't counted
 	 */
 	int ThreadRestorerEx::restore_state() {
+		static std::vector<std::pair<DWORD, ThreadBackupEx*>> ran_threads;
 		int threads_restored = 0;		
-		this->kill_threads();
+		{
+			RestoreMetrics::PhaseTimer timer(this->metrics, RestoreMetrics::THREAD_KILL);
+			this->kill_threads();
+		}
 	
+		RestoreMetrics::PhaseTimer timer(this->metrics, RestoreMetrics::THREAD_RESTORE);
+		ran_threads.clear();
 		for (auto it = this->threads.begin(); it != this->threads.end(); it++) {
-			it->second->restore(this->processHandle);
+			if (!this->skip_unchanged || it->second->ran_since_sync()) {
+				ran_threads.push_back(*it);
+			}
+			else {
+				this->threads_skipped++;
+			}
+		}
+		//
+		// Read every thread that ran before writing any, so the reads go out back to back
+		//
+		if (this->skip_unchanged) {
+			for (auto& thread : ran_threads) {
+				if (!thread.second->has_exited()) {
+					thread.second->read_live_registers();
+				}
+			}
+		}
+		for (auto& thread : ran_threads) {
+			if (this->skip_unchanged && thread.second->live_registers_match()) {
+				thread.second->mark_in_sync();
+				this->threads_skipped++;
+				continue;
+			}
+			DWORD thread_id = thread.second->get_thread_id();
+			thread.second->restore(this->processHandle);
+			if (thread.second->get_thread_id() != thread_id) {
+				this->track_resurrection(thread.first, thread_id, thread.second);
+			}
 			threads_restored++;
 		}
 		
 		return threads_restored;
 	}
 
-	/* Saves the state of a single thread and tracks it
+	/* Saves the state of all tracked threads for a child snapshot, keeping the current one for the parent.
+	 * Threads started since the parent snapshot was taken are tracked from this level on.
+		Returns:
+			Number of threads saved
+	 */
+	int ThreadRestorerEx::push_state() {
+		int threads_saved = 0;
+		for (auto it = this->threads.begin(); it != this->threads.end(); it++) {
+			if (it->second->push_context(this->processHandle)) {
+				threads_saved++;
+			}
+		}
+		std::map<DWORD, HANDLE> adopted_threads;
+		adopted_threads.swap(this->threads_to_kill);
+		for (auto it = adopted_threads.begin(); it != adopted_threads.end(); it++) {
+			if (this->save_thread(it->first)) {
+				threads_saved++;
+			}
+			//
+			// The child snapshot has the thread running, so it can't stay frozen
+			//
+			if (this->frozen_threads.erase(it->first)) {
+				ResumeThread(it->second);
+			}
+		}
+		this->levels.push_back(adopted_threads);
+		return threads_saved;
+	}
+
+	/* Drops the deepest snapshot.  Threads go back to the parent's contexts on the next restore, and the
+	 * threads the snapshot adopted are killed.
+		Returns:
+			false if there's no snapshot above the one save_state() took
+	 */
+	bool ThreadRestorerEx::pop_state() {
+		if (this->levels.empty()) {
+			return false;
+		}
+		std::map<DWORD, HANDLE>& adopted_threads = this->levels.back();
+		for (auto it = adopted_threads.begin(); it != adopted_threads.end(); it++) {
+			DWORD thread_id = this->get_current_thread_id(it->first);
+			auto adopted = this->threads.find(it->first);
+			if (adopted != this->threads.end()) {
+				delete adopted->second;
+				this->threads.erase(adopted);
+			}
+			this->original_ids.erase(thread_id);
+			if (it->second != NULL) {
+				this->threads_to_kill[thread_id] = it->second;
+			}
+		}
+		for (auto it = this->threads.begin(); it != this->threads.end(); it++) {
+			it->second->pop_context();
+		}
+		this->levels.pop_back();
+		return true;
+	}
+
+	/* Pops snapshots until level is the deepest one and restores it
+		Args:
+			level - 0 for the snapshot save_state() took, 1 for the first push_state() and so on
+		Returns:
+			The number of threads restored
+	 */
+	int ThreadRestorerEx::restore_to_level(size_t level) {
+		while (this->levels.size() > level) {
+			this->pop_state();
+		}
+		return this->restore_state();
+	}
+
+	/* Creates the backup of a thread with the handle the registry opened for it.  A thread the registry doesn't
+	 * know, or a restorer without one, gets a handle opened just for the backup.
 		Args:
 			thread_id - ID of the target thread
+		Returns:
+			The backup, not saved yet
+	 */
+	ThreadBackupEx* ThreadRestorerEx::create_backup(DWORD thread_id) {
+		const RegisteredThread* registered = this->registry == nullptr ? nullptr : this->registry->Find(thread_id);
+		if (registered != nullptr) {
+			return new ThreadBackupEx(thread_id, registered->handle);
+		}
+		HANDLE thread_handle = OpenThread(THREAD_GET_CONTEXT | THREAD_SET_CONTEXT | THREAD_QUERY_INFORMATION, false, thread_id);
+		ThreadBackupEx* thread = new ThreadBackupEx(thread_id, thread_handle);
+		if (thread_handle != NULL) {
+			CloseHandle(thread_handle);
+		}
+		return thread;
+	}
+
+	/* Saves the state of a single thread and tracks it
+		Args:
+			thread_id - ID of the target thread, a resurrected one is tracked by the ID it was saved under
 		Returns:
 			Non-zero on success, zero on failure
 	 */
 	int ThreadRestorerEx::save_thread(DWORD thread_id) {
 		ThreadBackupEx* thread;
 		int result;
+		thread_id = this->get_original_thread_id(thread_id);
 
 		auto existingThread = this->threads.find(thread_id);
 		if (existingThread != this->threads.end()) {
 			thread= this->threads.at(thread_id);
 		}
 		else {
-			thread = new ThreadBackupEx(thread_id);
+			thread = this->create_backup(thread_id);
 			this->threads[thread_id] = thread;
 		}
-		result = thread->backup();
+		result = thread->backup(this->processHandle);
 		return result;
 	}
 
@@ -112,10 +511,15 @@ namespace dedougger {
 	int ThreadRestorerEx::restore_thread(DWORD thread_id) {
 		ThreadBackupEx* thread;
 		int result = 0;
+		thread_id = this->get_original_thread_id(thread_id);
 		auto existingThread = this->threads.find(thread_id);
 		if (existingThread != this->threads.end()) {
 			thread = this->threads.at(thread_id);
+			DWORD old_id = thread->get_thread_id();
 			thread->restore(this->processHandle);			
+			if (thread->get_thread_id() != old_id) {
+				this->track_resurrection(thread_id, old_id, thread);
+			}
 			result = 1;
 		}
 		else {
@@ -4,27 +4,132 @@
 #include <memory>
 #include <set>
 #include <vector>
-#include <Windows.h>
+#include "platform/platform.h"
+#ifdef _WIN32
 #include <TlHelp32.h>
+#endif
 #include "dexception.h"
+#include "targetstate/ThreadRegistry.hpp"
 #include "ThreadBackupEx.hpp"
+#include "../pagerestorer/SnapshotFile.hpp"
+#include "../pagerestorer/RestoreMetrics.hpp"
 
 namespace dedougger {
+	enum NewThreadPolicy {
+		NEW_THREADS_RUN,	// threads created after the snapshot run until the restore kills them
+		NEW_THREADS_FREEZE	// they're suspended as soon as they're created and killed at restore without having run
+	};
+
+	/**
+	 * ThreadRestorerEx - saves the context of every thread in the target and puts it back on restore, killing
+	 *	the threads created since.
+	 *
+	 *	Snapshots can be nested like PageRestorerEx's: push_state() saves the threads again for a child
+	 *	snapshot, keeping the parent's contexts, and adopts the threads started since the parent.  pop_state()
+	 *	goes back to the parent's contexts and hands the adopted threads back to the kill list.
+	 *
+	 *	Threads created after the snapshot are handed over with add_thread_to_kill and killed by the next restore.
+	 *	Under NEW_THREADS_FREEZE they're suspended right away, so per-connection workers and the like don't burn CPU
+	 *	or write memory for the rest of the iteration.  A nested snapshot taken while they're frozen adopts them, and
+	 *	they're resumed with it since they're part of its state from then on.
+	 *
+	 *	A saved thread that exits during an iteration is resurrected by the next restore on its original stack,
+	 *	with its TLS and registers (see ThreadBackupEx), under a new thread ID.  Threads stay tracked by the ID
+	 *	they were saved under; get_current_thread_id/get_original_thread_id map between the two, and the new
+	 *	thread's creation event doesn't put it on the kill list.  The exited thread's stack has to be mapped again
+	 *	before the restore, which is what get_lost_stacks hands to the page restorer.
+	 *
+	 *	Given the debugger's ThreadRegistry the target's threads are taken from it, otherwise every save walks a
+	 *	Toolhelp snapshot of all the threads on the machine (/proc/<pid>/task on Linux).
+	 *
+	 *	On Linux the thread calls go through the compat layer to the debug backend: a frozen thread is one the
+	 *	backend leaves at its clone stop when it resumes the rest, and killing a thread makes it run an exit
+	 *	syscall.  Both only work while the target is stopped in a debug event, which is where the fuzzer calls
+	 *	them from.
+	 *
+	 *	Most threads of a server sit blocked in a wait for the whole iteration, and writing their registers back
+	 *	would be wasted.  Unless set_skip_unchanged(false) is called, restore_state() leaves alone the threads whose
+	 *	cycle time hasn't moved since they last had the saved registers.  The registers of the rest are read in one
+	 *	pass and only threads whose register fingerprint differs from the saved one are written back.
+	 *
+	 *	Methods:
+	 *		save_state()/restore_state() - saves and restores the snapshot at the current level
+	 *		push_state()/pop_state()/restore_to_level(level) - nested snapshots, level 0 is save_state()'s
+	 *		add_thread_to_kill(id, handle)/remove_thread_from_kill(id) - threads created since the snapshot.  The
+	 *			restorer owns the handle from then on.
+	 *		thread_exited(id) - a thread exited, from its exit event.  Saved threads are resurrected by the next restore.
+	 *		get_lost_stacks(stacks) - appends the stacks of saved threads that exited, to map again before the pages
+	 *			are restored
+	 *		get_current_thread_id(id)/get_original_thread_id(id) - the thread a saved thread lives on as since its
+	 *			resurrection, and the other way around.  IDs of threads that weren't resurrected map to themselves.
+	 *		get_threads_resurrected() - threads brought back by restores so far
+	 *		set_new_thread_policy(policy) - what happens to threads created since the snapshot until they're killed
+	 *		get_last_killed() - threads the last restore_state() killed
+	 *		get_threads_killed()/get_threads_frozen() - threads killed by restores and frozen at creation so far
+	 *		write_snapshot(writer) - adds the saved contexts to a snapshot file
+	 *		stage_snapshot(file) - matches the threads in a snapshot file to the live ones by start address and stages
+	 *			their contexts, without touching the saved state or the target
+	 *		load_snapshot()/discard_snapshot() - takes the staged contexts as the saved state instead of save_state(),
+	 *			or drops them
+	 *		set_metrics(metrics) - times the thread kill and thread restore phases of restore_state() into metrics
+	 *		set_skip_unchanged(skip) - whether restore_state() skips the threads that still have the saved registers
+	 *		get_threads_skipped() - threads restore_state() found with the saved registers and didn't write back
+	 */
 	class ThreadRestorerEx {
 		std::map<DWORD, ThreadBackupEx*> threads;		
 		std::map<DWORD, HANDLE> threads_to_kill;
+		std::set<DWORD> frozen_threads;		// the threads to kill that NEW_THREADS_FREEZE suspended
+		std::map<DWORD, DWORD> original_ids;	// ID of each resurrected thread -> the ID it's tracked by in threads
+		std::map<DWORD, ThreadBackupEx*> staged_threads;	// live threads stage_snapshot() matched, with the snapshot's registers
+		std::vector<DWORD> staged_leftovers;	// live threads the staged snapshot doesn't have
+		//
+		// Threads adopted by each pushed level, with the handles needed to kill them once it's popped
+		//
+		std::vector<std::map<DWORD, HANDLE>> levels;
 		DWORD process_id;
 		HANDLE processHandle;
+		const ThreadRegistry* registry;
+		RestoreMetrics* metrics;
+		bool skip_unchanged;
+		uint64_t threads_skipped;
+		NewThreadPolicy new_thread_policy;
+		int last_killed;
+		uint64_t threads_killed;
+		uint64_t threads_frozen;
+		uint64_t threads_resurrected;
+		void track_resurrection(DWORD original_id, DWORD old_id, ThreadBackupEx* thread);
 		int kill_thread(DWORD thread_id);
+		ThreadBackupEx* create_backup(DWORD thread_id);
 		int save_thread(DWORD thread_id);
+		void enumerate_threads(std::vector<DWORD>& process_threads);
 		int restore_thread(DWORD thread_id);
 	public:
-		ThreadRestorerEx(DWORD process_id);
+		ThreadRestorerEx(DWORD process_id, const ThreadRegistry* registry = nullptr);
 		int restore_state();
 		int save_state();
-		void add_thread_to_kill(DWORD threadId, HANDLE threadHandle) { this->threads_to_kill[threadId] = threadHandle; }
-		void remove_thread_from_kill(DWORD threadId) { this->threads_to_kill.erase(threadId); }
+		void add_thread_to_kill(DWORD threadId, HANDLE threadHandle);
+		void remove_thread_from_kill(DWORD threadId);
+		void thread_exited(DWORD threadId);
+		void get_lost_stacks(std::vector<std::pair<size_t, size_t>>* stacks);
+		DWORD get_current_thread_id(DWORD originalId);
+		DWORD get_original_thread_id(DWORD threadId);
+		uint64_t get_threads_resurrected() { return this->threads_resurrected; }
 		int kill_threads();
+		int push_state();
+		bool pop_state();
+		int restore_to_level(size_t level);
+		size_t get_level() { return this->levels.size(); }
+		int write_snapshot(SnapshotFileWriter* writer);
+		int stage_snapshot(SP_SnapshotFile file);
+		int load_snapshot();
+		void discard_snapshot();
+		void set_metrics(RestoreMetrics* metrics) { this->metrics = metrics; }
+		void set_skip_unchanged(bool skip) { this->skip_unchanged = skip; }
+		uint64_t get_threads_skipped() { return this->threads_skipped; }
+		void set_new_thread_policy(NewThreadPolicy policy) { this->new_thread_policy = policy; }
+		int get_last_killed() { return this->last_killed; }
+		uint64_t get_threads_killed() { return this->threads_killed; }
+		uint64_t get_threads_frozen() { return this->threads_frozen; }
 	};
 
 	typedef std::unique_ptr<ThreadRestorerEx> UP_ThreadRestorerEx;